@@ -0,0 +1,1552 @@
+/*
+ *
+ * Copyright © 2023 Georgy E. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "modbus_rtu_base.h"
+#include "modbus_rtu_slave.h"
+#include "modbus_rtu_master.h"
+
+
+#if _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#define BENCH_CYCLES            (1)
+#else
+#define BENCH_CYCLES            (0)
+#endif
+
+
+#define BENCH_CRC_BUFFER_SIZE   (4096)
+#define BENCH_CRC_TOTAL_BYTES   (256UL * 1024 * 1024)
+
+#define BENCH_CRC_MIN_SIZE      (8)
+#define BENCH_CRC_MAX_SIZE      (64UL * 1024)
+#define BENCH_CRC_SIZE_BYTES    (64UL * 1024 * 1024)
+
+#define BENCH_SLAVE_ID          (0x01)
+#define BENCH_FRAME_REGISTERS   (MB_MIN(120, MODBUS_BENCH_REGISTERS))
+#define BENCH_FRAME_ROUNDS      (100000)
+#define BENCH_RESET_ROUNDS      (1000000)
+#define BENCH_SEGMENTS           (64)
+#define BENCH_SEGMENT_REGISTERS  (64)
+#define BENCH_SENSOR_SAMPLES    (16)
+#define BENCH_SENSOR_ROUNDS     (2000)
+#define BENCH_COILS_ADDR        (3)
+#define BENCH_COILS             (MB_MIN(1968, MODBUS_BENCH_REGISTERS - BENCH_COILS_ADDR))
+
+#define BENCH_INSTANCES_MAX     (16)
+#define BENCH_INSTANCE_ROUNDS   (200000)
+#define BENCH_INSTANCE_REGISTERS (16)
+#define BENCH_CYCLE_SETPOINTS   (4)
+#define BENCH_CYCLE_VALUES      (8)
+#define BENCH_BAUD_RATE         (9600)
+#define BENCH_FILE_RECORDS      (2000)
+#define BENCH_FILE_ROUNDS       (1000)
+#define BENCH_FLEET_SLAVES      (30)
+#define BENCH_FLEET_ROUNDS      (1000)
+#define BENCH_TURNAROUND_MS     (100)
+#define BENCH_UNITS             (16)
+#define BENCH_UNIT_REGISTERS    (8)
+#define BENCH_FOREIGN_PAIRS     (4)
+#define BENCH_FOREIGN_REGISTERS (16)
+#define BENCH_FOREIGN_ROUNDS    (200000)
+#define BENCH_PADDED_SILENCE_MS (10)
+#define BENCH_FRAMING_ROUNDS    (200000)
+#define BENCH_QUEUE_POLLS       (MODBUS_MASTER_QUEUE_SIZE - 1)
+#define BENCH_QUEUE_ROUNDS      (100000)
+#define BENCH_POLL_ENTRIES      (6)
+#define BENCH_POLL_SPAN_S       (600)
+#define BENCH_COALESCE_ENTRIES  (12)
+#define BENCH_COALESCE_REGISTERS (4)
+#define BENCH_COALESCE_GAP      (2)
+#define BENCH_COALESCE_PERIOD_MS (1000)
+#define BENCH_COMBINE_WRITES    (8)
+#define BENCH_COMBINE_ROUNDS    (100000)
+#define BENCH_PAGE_REGISTERS    (MB_MIN(125, MODBUS_BENCH_REGISTERS))
+
+
+typedef uint16_t (*crc_engine_t) (uint16_t, const uint8_t*, size_t);
+
+typedef struct _bench_t {
+    const char* name;
+    void        (*run)(void);
+} bench_t;
+
+/* One master looped back to its own slave, as on a separate serial line */
+typedef struct _bench_line_t {
+    modbus_master_t master;
+    modbus_slave_t  slave;
+    uint16_t        holding[BENCH_INSTANCE_REGISTERS];
+    uint32_t        packets;
+    uint32_t        bytes;
+} bench_line_t;
+
+/* A line that delivers each request after the previous response, as a UART driver does */
+typedef struct _bench_file_line_t {
+    modbus_master_t master;
+    modbus_slave_t  slave;
+    uint16_t        holding[BENCH_PAGE_REGISTERS];
+    uint16_t        records[BENCH_FILE_RECORDS];
+    uint8_t         pending[MODBUS_MASTER_MESSAGE_DATA_SIZE + 16];
+    uint32_t        pending_len;
+    uint32_t        frames;
+    uint32_t        bytes;
+    bool            complete;
+} bench_file_line_t;
+
+
+// Utils
+uint64_t bench_now_ns(void);
+uint64_t bench_now_cycles(void);
+void bench_fill_buffer(uint8_t* buffer, size_t len);
+uint16_t bench_make_frame(uint8_t* frame, const uint8_t* pdu, uint16_t pdu_len);
+
+// Slave
+void bench_slave_response_handler(uint8_t* data, uint32_t len);
+void bench_layout_response_handler(void* user_context, uint8_t* data, uint32_t len);
+void bench_count_response_handler(void* user_context, uint8_t* data, uint32_t len);
+void bench_sensor_read_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count);
+uint16_t bench_sensor_value(uint16_t register_id);
+
+uint8_t* bench_slave_tx_buffer_provider(uint32_t len);
+void bench_slave_tx_buffer_commit(uint8_t* data, uint32_t len);
+
+// Master
+void bench_master_request_sender(uint8_t* data, uint32_t len);
+void bench_master_response_handler(modbus_response_t* packet);
+
+// Instances
+void bench_line_init(bench_line_t* line);
+void* bench_line_run(void* line);
+void bench_line_request_sender(void* user_context, uint8_t* data, uint32_t len);
+void bench_line_response_handler(void* user_context, uint8_t* data, uint32_t len);
+void bench_line_packet_handler(void* user_context, modbus_response_t* packet);
+void bench_file_line_init(bench_file_line_t* line);
+void bench_file_line_pump(bench_file_line_t* line);
+void bench_file_line_request_sender(void* user_context, uint8_t* data, uint32_t len);
+void bench_file_line_response_handler(void* user_context, uint8_t* data, uint32_t len);
+void bench_file_line_packet_handler(void* user_context, modbus_response_t* packet);
+bool bench_file_read_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, uint8_t* data);
+bool bench_file_write_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, const uint8_t* data);
+void bench_file_complete_handler(void* user_context, modbus_error_response_t status, uint16_t records_done);
+void bench_print_bus(const char* name, double frames, double bytes, double wait_ms, double cpu_ns);
+uint32_t bench_clock(void* user_context);
+uint32_t bench_frame_us(uint32_t bytes);
+uint64_t bench_poll_list_run(bench_file_line_t* line);
+
+// Benchmarks
+void bench_crc_engines(void);
+void bench_crc_sizes(void);
+void bench_frame_end(void);
+void bench_frame_reset(void);
+void bench_coils(void);
+void bench_register_layout(void);
+void bench_segments(void);
+void bench_read_handler(void);
+void bench_dirty_ranges(void);
+void bench_snapshot(void);
+void bench_read_write(void);
+void bench_mask_write(void);
+void bench_file_records(void);
+void bench_broadcast(void);
+void bench_units(void);
+void bench_foreign_frames(void);
+void bench_framing(void);
+void bench_queue(void);
+void bench_poll_list(void);
+void bench_coalescing(void);
+void bench_write_combining(void);
+void bench_instances(void);
+void bench_receive_buffer(void);
+void bench_tx_buffer(void);
+double bench_crc_mbps(crc_engine_t engine, const uint8_t* buffer, size_t len, uint64_t total_bytes);
+
+
+volatile uint16_t bench_sink = 0;
+uint8_t bench_tx_buffer_data[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+uint16_t bench_sensors[BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS] = { 0 };
+uint32_t bench_clock_us = 0;
+
+
+int main(int argc, char** argv)
+{
+    const bench_t benches[] = {
+        { "crc_engines",    bench_crc_engines },
+        { "crc_sizes",      bench_crc_sizes },
+        { "frame_end",      bench_frame_end },
+        { "frame_reset",    bench_frame_reset },
+        { "coils",          bench_coils },
+        { "register_layout", bench_register_layout },
+        { "segments",       bench_segments },
+        { "read_handler",   bench_read_handler },
+        { "dirty_ranges",   bench_dirty_ranges },
+        { "snapshot",       bench_snapshot },
+        { "read_write",     bench_read_write },
+        { "mask_write",     bench_mask_write },
+        { "file_records",   bench_file_records },
+        { "broadcast",      bench_broadcast },
+        { "units",          bench_units },
+        { "foreign_frames", bench_foreign_frames },
+        { "framing",        bench_framing },
+        { "queue",          bench_queue },
+        { "poll_list",      bench_poll_list },
+        { "coalescing",     bench_coalescing },
+        { "write_combining", bench_write_combining },
+        { "receive_buffer", bench_receive_buffer },
+        { "tx_buffer",      bench_tx_buffer },
+        { "instances",      bench_instances },
+    };
+
+    modbus_slave_set_slave_id(BENCH_SLAVE_ID);
+    modbus_slave_set_response_data_handler(&bench_slave_response_handler);
+    modbus_master_set_request_data_sender(&bench_master_request_sender);
+    modbus_master_set_response_packet_handler(&bench_master_response_handler);
+
+    /* Optional argument runs only the benches whose name contains it */
+    const char* filter = argc > 1 ? argv[1] : NULL;
+
+    printf("modbus_settings.h: %u registers per type\n", MODBUS_BENCH_REGISTERS);
+    for (size_t i = 0; i < sizeof(benches) / sizeof(*benches); i++) {
+        if (filter == NULL || strstr(benches[i].name, filter) != NULL) {
+            benches[i].run();
+        }
+    }
+
+    return 0;
+}
+
+void bench_crc_engines(void)
+{
+    static uint8_t buffer[BENCH_CRC_BUFFER_SIZE] = { 0 };
+
+    const struct {
+        const char*  name;
+        crc_engine_t engine;
+    } engines[] = {
+        { "bitwise",    modbus_crc16_bitwise },
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_TABLE
+        { "table",      modbus_crc16_table },
+#endif
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_SLICING_4
+        { "slicing-4",  modbus_crc16_slicing_4 },
+#endif
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_SLICING_8
+        { "slicing-8",  modbus_crc16_slicing_8 },
+#endif
+    };
+
+    bench_fill_buffer(buffer, sizeof(buffer));
+
+    printf("\nCRC16 ENGINES (%u byte buffer):\n", (unsigned)sizeof(buffer));
+    for (size_t i = 0; i < sizeof(engines) / sizeof(*engines); i++) {
+        uint64_t total = BENCH_CRC_TOTAL_BYTES;
+        if (engines[i].engine == modbus_crc16_bitwise) {
+            total /= 8;
+        }
+        printf("  %-10s %10.1f MB/s\n", engines[i].name, bench_crc_mbps(engines[i].engine, buffer, sizeof(buffer), total));
+    }
+}
+
+void bench_crc_sizes(void)
+{
+    static uint8_t buffer[BENCH_CRC_MAX_SIZE] = { 0 };
+
+    bench_fill_buffer(buffer, sizeof(buffer));
+
+#if MODBUS_CRC16_HW
+    bool hw = modbus_crc16_hw_available();
+#else
+    bool hw = false;
+#endif
+
+    printf("\nCRC16 BUFFER SIZES (MB/s, hardware kernel %s):\n", hw ? "available" : "unavailable");
+    printf("  %8s %12s %12s %12s\n", "bytes", "portable", "clmul", "dispatch");
+    for (size_t len = BENCH_CRC_MIN_SIZE; len <= BENCH_CRC_MAX_SIZE; len *= 2) {
+        double portable = 0;
+        double clmul    = 0;
+        double dispatch = bench_crc_mbps(modbus_crc16_update, buffer, len, BENCH_CRC_SIZE_BYTES);
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_SLICING_8
+        portable = bench_crc_mbps(modbus_crc16_slicing_8, buffer, len, BENCH_CRC_SIZE_BYTES);
+#elif MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_TABLE
+        portable = bench_crc_mbps(modbus_crc16_table, buffer, len, BENCH_CRC_SIZE_BYTES);
+#else
+        portable = bench_crc_mbps(modbus_crc16_bitwise, buffer, len, BENCH_CRC_SIZE_BYTES / 8);
+#endif
+#if MODBUS_CRC16_HW
+        if (hw) {
+            clmul = bench_crc_mbps(modbus_crc16_clmul, buffer, len, BENCH_CRC_SIZE_BYTES);
+        }
+#endif
+        printf("  %8u %12.1f %12.1f %12.1f\n", (unsigned)len, portable, clmul, dispatch);
+    }
+}
+
+double bench_crc_mbps(crc_engine_t engine, const uint8_t* buffer, size_t len, uint64_t total_bytes)
+{
+    uint64_t rounds = total_bytes / len;
+
+    uint16_t crc   = MODBUS_CRC16_INIT;
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < rounds; i++) {
+        crc = engine(crc, buffer, len);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_sink = crc;
+
+    return (double)(rounds * len) / ((double)elapsed / 1e9) / (1024.0 * 1024.0);
+}
+
+void bench_frame_end(void)
+{
+    static uint8_t pdu[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+    static uint8_t request[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+    static uint8_t response[MODBUS_MASTER_RESPONSE_MESSAGE_SIZE] = { 0 };
+
+    /* Preset multiple registers request */
+    uint16_t pdu_len = 0;
+    pdu[pdu_len++] = BENCH_SLAVE_ID;
+    pdu[pdu_len++] = MODBUS_PRESET_MULTIPLE_REGISTERS;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS * 2;
+    bench_fill_buffer(pdu + pdu_len, BENCH_FRAME_REGISTERS * 2);
+    pdu_len += BENCH_FRAME_REGISTERS * 2;
+    uint16_t request_len = bench_make_frame(request, pdu, pdu_len);
+
+    /* Read holding registers response */
+    pdu_len = 0;
+    pdu[pdu_len++] = BENCH_SLAVE_ID;
+    pdu[pdu_len++] = MODBUS_READ_HOLDING_REGISTERS;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS * 2;
+    bench_fill_buffer(pdu + pdu_len, BENCH_FRAME_REGISTERS * 2);
+    pdu_len += BENCH_FRAME_REGISTERS * 2;
+    uint16_t response_len = bench_make_frame(response, pdu, pdu_len);
+
+    printf("\nEND OF FRAME PROCESSING (%u registers):\n", BENCH_FRAME_REGISTERS);
+
+    uint64_t elapsed = 0;
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        for (uint16_t j = 0; j < request_len - 1; j++) {
+            modbus_slave_recieve_data_byte(request[j]);
+        }
+        uint64_t start = bench_now_ns();
+        modbus_slave_recieve_data_byte(request[request_len - 1]);
+        elapsed += bench_now_ns() - start;
+    }
+    printf("  slave  %4u byte request  %8.1f ns\n", request_len, (double)elapsed / BENCH_FRAME_ROUNDS);
+
+    elapsed = 0;
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_master_read_holding_registers(BENCH_SLAVE_ID, 0, BENCH_FRAME_REGISTERS);
+        for (uint16_t j = 0; j < response_len - 1; j++) {
+            modbus_master_recieve_data_byte(response[j]);
+        }
+        uint64_t start = bench_now_ns();
+        modbus_master_recieve_data_byte(response[response_len - 1]);
+        elapsed += bench_now_ns() - start;
+    }
+    printf("  master %4u byte response %8.1f ns\n", response_len, (double)elapsed / BENCH_FRAME_ROUNDS);
+}
+
+void bench_frame_reset(void)
+{
+    uint8_t read_pdu[]     = { BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x01 };
+    uint8_t foreign_pdu[]  = { BENCH_SLAVE_ID + 1, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x01 };
+    uint8_t response_pdu[] = { BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x02, 0x12, 0x34 };
+
+    uint8_t read_request[sizeof(read_pdu) + 2]         = { 0 };
+    uint8_t foreign_request[sizeof(foreign_pdu) + 2]   = { 0 };
+    uint8_t read_response[sizeof(response_pdu) + 2]    = { 0 };
+
+    uint16_t read_len     = bench_make_frame(read_request, read_pdu, sizeof(read_pdu));
+    uint16_t foreign_len  = bench_make_frame(foreign_request, foreign_pdu, sizeof(foreign_pdu));
+    uint16_t response_len = bench_make_frame(read_response, response_pdu, sizeof(response_pdu));
+
+    printf("\nSMALL FRAMES (%u registers per type):\n", MODBUS_BENCH_REGISTERS);
+    printf("  %-22s %10s %10s\n", "", "ns", "cycles");
+
+    for (uint32_t n = 0; n < 5; n++) {
+        uint64_t start        = bench_now_ns();
+        uint64_t start_cycles = bench_now_cycles();
+        for (uint32_t i = 0; i < BENCH_RESET_ROUNDS; i++) {
+            switch (n) {
+            case 0:
+                modbus_slave_receive_buffer(read_request, read_len);
+                break;
+            case 1:
+                modbus_slave_receive_buffer(foreign_request, foreign_len);
+                modbus_slave_timeout();
+                break;
+            case 2:
+                modbus_slave_timeout();
+                break;
+            case 3:
+                modbus_master_read_holding_registers(BENCH_SLAVE_ID, 0, 1);
+                modbus_master_receive_buffer(read_response, response_len);
+                break;
+            default:
+                modbus_master_read_holding_registers(BENCH_SLAVE_ID, 0, 1);
+                modbus_master_timeout();
+                break;
+            }
+        }
+        uint64_t cycles  = bench_now_cycles() - start_cycles;
+        uint64_t elapsed = bench_now_ns() - start;
+
+        const char* names[] = { "slave read 1 register", "slave foreign frame", "slave timeout", "master read 1 register", "master timeout" };
+        printf("  %-22s %10.1f %10.1f\n", names[n], (double)elapsed / BENCH_RESET_ROUNDS, (double)cycles / BENCH_RESET_ROUNDS);
+    }
+}
+
+void bench_coils(void)
+{
+    static uint8_t pdu[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+    static uint8_t write_request[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+
+    uint8_t read_pdu[] = {
+        BENCH_SLAVE_ID, MODBUS_READ_COILS, 0x00, BENCH_COILS_ADDR, (uint8_t)(BENCH_COILS >> 8), (uint8_t)BENCH_COILS
+    };
+    uint8_t read_request[sizeof(read_pdu) + 2] = { 0 };
+    uint16_t read_len = bench_make_frame(read_request, read_pdu, sizeof(read_pdu));
+
+    uint16_t pdu_len = 0;
+    pdu[pdu_len++] = BENCH_SLAVE_ID;
+    pdu[pdu_len++] = MODBUS_FORCE_MULTIPLE_COILS;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = BENCH_COILS_ADDR;
+    pdu[pdu_len++] = (uint8_t)(BENCH_COILS >> 8);
+    pdu[pdu_len++] = (uint8_t)BENCH_COILS;
+    pdu[pdu_len++] = (uint8_t)MODBUS_COILS_BYTES(BENCH_COILS);
+    bench_fill_buffer(pdu + pdu_len, MODBUS_COILS_BYTES(BENCH_COILS));
+    pdu_len += MODBUS_COILS_BYTES(BENCH_COILS);
+    uint16_t write_len = bench_make_frame(write_request, pdu, pdu_len);
+
+    printf("\nCOILS (%u coils from address %u):\n", BENCH_COILS, BENCH_COILS_ADDR);
+
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_slave_receive_buffer(read_request, read_len);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    printf("  %-18s %8.1f ns\n", "read coils", (double)elapsed / BENCH_FRAME_ROUNDS);
+
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_slave_receive_buffer(write_request, write_len);
+    }
+    elapsed = bench_now_ns() - start;
+    printf("  %-18s %8.1f ns\n", "force coils", (double)elapsed / BENCH_FRAME_ROUNDS);
+}
+
+void bench_register_layout(void)
+{
+    static uint16_t holding[MODBUS_BENCH_REGISTERS];
+    static uint8_t pdu[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+    static uint8_t write_request[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+
+    uint8_t read_pdu[] = { BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, BENCH_FRAME_REGISTERS };
+    uint8_t read_request[sizeof(read_pdu) + 2] = { 0 };
+    uint16_t read_len = bench_make_frame(read_request, read_pdu, sizeof(read_pdu));
+
+    uint16_t pdu_len = 0;
+    pdu[pdu_len++] = BENCH_SLAVE_ID;
+    pdu[pdu_len++] = MODBUS_PRESET_MULTIPLE_REGISTERS;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS * 2;
+    bench_fill_buffer(pdu + pdu_len, BENCH_FRAME_REGISTERS * 2);
+    pdu_len += BENCH_FRAME_REGISTERS * 2;
+    uint16_t write_len = bench_make_frame(write_request, pdu, pdu_len);
+
+    printf("\nREGISTER LAYOUT (%u registers):\n", BENCH_FRAME_REGISTERS);
+    printf("  %-12s %12s %12s\n", "", "read ns", "write ns");
+
+    for (uint8_t wire_order = 0; wire_order < 2; wire_order++) {
+        modbus_slave_t slave;
+        modbus_slave_registers_t registers = { 0 };
+        registers.analog_output_holding_registers = holding;
+        registers.analog_output_holding_registers_count = MODBUS_BENCH_REGISTERS;
+        registers.registers_wire_order = wire_order;
+        modbus_slave_init(&slave, &registers, NULL);
+        modbus_slave_set_slave_id_r(&slave, BENCH_SLAVE_ID);
+        modbus_slave_set_response_data_handler_r(&slave, bench_layout_response_handler);
+
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+            modbus_slave_receive_buffer_r(&slave, read_request, read_len);
+        }
+        uint64_t read = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+            modbus_slave_receive_buffer_r(&slave, write_request, write_len);
+        }
+        uint64_t write = bench_now_ns() - start;
+
+        printf("  %-12s %12.1f %12.1f\n", wire_order ? "wire order" : "native", (double)read / BENCH_FRAME_ROUNDS, (double)write / BENCH_FRAME_ROUNDS);
+    }
+}
+
+void bench_segments(void)
+{
+    static uint16_t holding[BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS];
+    static modbus_slave_segment_t segments[BENCH_SEGMENTS];
+
+    /* Contiguous segments, a read in the middle of the map spans several of them */
+    for (uint16_t i = 0; i < BENCH_SEGMENTS; i++) {
+        segments[i].base    = (uint16_t)(i * BENCH_SEGMENT_REGISTERS);
+        segments[i].count   = BENCH_SEGMENT_REGISTERS;
+        segments[i].storage = holding + i * BENCH_SEGMENT_REGISTERS;
+    }
+
+    uint16_t addr = BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS / 2 - BENCH_FRAME_REGISTERS / 2;
+    uint8_t read_pdu[] = {
+        BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, (uint8_t)(addr >> 8), (uint8_t)addr, 0x00, BENCH_FRAME_REGISTERS
+    };
+    uint8_t read_request[sizeof(read_pdu) + 2] = { 0 };
+    uint16_t read_len = bench_make_frame(read_request, read_pdu, sizeof(read_pdu));
+
+    printf("\nSEGMENTED MAP (read %u registers at %u):\n", BENCH_FRAME_REGISTERS, addr);
+
+    for (uint8_t segmented = 0; segmented < 2; segmented++) {
+        modbus_slave_t slave;
+        modbus_slave_registers_t registers = { 0 };
+        registers.analog_output_holding_registers = holding;
+        registers.analog_output_holding_registers_count = BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS;
+        modbus_slave_init(&slave, &registers, NULL);
+        modbus_slave_set_slave_id_r(&slave, BENCH_SLAVE_ID);
+        modbus_slave_set_response_data_handler_r(&slave, bench_layout_response_handler);
+        if (segmented) {
+            modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, segments, BENCH_SEGMENTS);
+        }
+
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+            modbus_slave_receive_buffer_r(&slave, read_request, read_len);
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+
+        printf("  %-18s %8.1f ns\n", segmented ? "64 segments" : "dense", (double)elapsed / BENCH_FRAME_ROUNDS);
+    }
+}
+
+void bench_read_handler(void)
+{
+    const uint16_t sensors_count = BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS;
+    const modbus_slave_segment_t pushed[] = {
+        { .base = 0, .count = sensors_count, .storage = bench_sensors },
+    };
+    const modbus_slave_segment_t lazy[] = {
+        { .base = 0, .count = sensors_count, .storage = bench_sensors, .read_handler = bench_sensor_read_handler },
+    };
+
+    const uint8_t polls[] = { 2, BENCH_FRAME_REGISTERS };
+
+    printf("\nREAD HANDLER (%u computed registers, %u samples each):\n", sensors_count, BENCH_SENSOR_SAMPLES);
+
+    for (size_t p = 0; p < sizeof(polls); p++) {
+        uint8_t read_pdu[] = { BENCH_SLAVE_ID, MODBUS_READ_INPUT_REGISTERS, 0x01, 0x00, 0x00, polls[p] };
+        uint8_t read_request[sizeof(read_pdu) + 2] = { 0 };
+        uint16_t read_len = bench_make_frame(read_request, read_pdu, sizeof(read_pdu));
+
+        for (uint8_t on_read = 0; on_read < 2; on_read++) {
+            modbus_slave_t slave;
+            modbus_slave_init(&slave, NULL, NULL);
+            modbus_slave_set_slave_id_r(&slave, BENCH_SLAVE_ID);
+            modbus_slave_set_response_data_handler_r(&slave, bench_layout_response_handler);
+            modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, on_read ? lazy : pushed, 1);
+
+            uint64_t start = bench_now_ns();
+            for (uint32_t i = 0; i < BENCH_SENSOR_ROUNDS; i++) {
+                /* Without a read handler every value is refreshed before the poll */
+                for (uint16_t id = 0; !on_read && id < sensors_count; id++) {
+                    bench_sensors[id] = bench_sensor_value(id);
+                }
+                modbus_slave_receive_buffer_r(&slave, read_request, read_len);
+            }
+            uint64_t elapsed = bench_now_ns() - start;
+
+            printf("  poll %3u %-12s %10.1f ns\n", polls[p], on_read ? "read handler" : "push all", (double)elapsed / BENCH_SENSOR_ROUNDS);
+        }
+    }
+}
+
+void bench_dirty_ranges(void)
+{
+    static uint16_t holding[BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS];
+    static uint16_t shadow[BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS];
+    const uint16_t holding_count = BENCH_SEGMENTS * BENCH_SEGMENT_REGISTERS;
+
+    uint8_t write_pdu[] = { BENCH_SLAVE_ID, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x01, 0x00, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78 };
+    uint8_t write_request[sizeof(write_pdu) + 2] = { 0 };
+    uint16_t write_len = bench_make_frame(write_request, write_pdu, sizeof(write_pdu));
+
+    printf("\nDIRTY RANGES (write 2 of %u registers, then find the change):\n", holding_count);
+
+    for (uint8_t tracked = 0; tracked < 2; tracked++) {
+        modbus_slave_t slave;
+        modbus_slave_registers_t registers = { 0 };
+        registers.analog_output_holding_registers = holding;
+        registers.analog_output_holding_registers_count = holding_count;
+        modbus_slave_init(&slave, &registers, NULL);
+        modbus_slave_set_slave_id_r(&slave, BENCH_SLAVE_ID);
+        modbus_slave_set_response_data_handler_r(&slave, bench_layout_response_handler);
+        memset(holding, 0, sizeof(holding));
+        memset(shadow, 0, sizeof(shadow));
+
+        uint32_t changes = 0;
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_SENSOR_ROUNDS; i++) {
+            modbus_slave_receive_buffer_r(&slave, write_request, write_len);
+            if (tracked) {
+                modbus_slave_range_t ranges[MODBUS_SLAVE_DIRTY_RANGES];
+                uint8_t count = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES);
+                for (uint8_t r = 0; r < count; r++) {
+                    changes += ranges[r].count;
+                }
+                continue;
+            }
+            /* Without tracking the application compares the map with its last copy */
+            for (uint16_t id = 0; id < holding_count; id++) {
+                if (holding[id] != shadow[id]) {
+                    shadow[id] = holding[id];
+                    changes++;
+                }
+            }
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        bench_sink = (uint16_t)(bench_sink + changes);
+
+        printf("  %-18s %8.1f ns\n", tracked ? "consume ranges" : "rescan", (double)elapsed / BENCH_SENSOR_ROUNDS);
+    }
+}
+
+void bench_snapshot(void)
+{
+    static uint16_t front[BENCH_FRAME_REGISTERS];
+    static uint16_t back[BENCH_FRAME_REGISTERS];
+    modbus_slave_snapshot_t snapshot;
+    modbus_slave_snapshot_init(&snapshot, front, back, sizeof(front));
+
+    const modbus_slave_segment_t plain[] = {
+        { .base = 0, .count = BENCH_FRAME_REGISTERS, .storage = front },
+    };
+    const modbus_slave_segment_t published[] = {
+        { .base = 0, .count = BENCH_FRAME_REGISTERS, .snapshot = &snapshot },
+    };
+
+    uint8_t read_pdu[] = { BENCH_SLAVE_ID, MODBUS_READ_INPUT_REGISTERS, 0x00, 0x00, 0x00, BENCH_FRAME_REGISTERS };
+    uint8_t read_request[sizeof(read_pdu) + 2] = { 0 };
+    uint16_t read_len = bench_make_frame(read_request, read_pdu, sizeof(read_pdu));
+
+    printf("\nSNAPSHOT (%u input registers):\n", BENCH_FRAME_REGISTERS);
+
+    for (uint8_t snapshots = 0; snapshots < 2; snapshots++) {
+        modbus_slave_t slave;
+        modbus_slave_init(&slave, NULL, NULL);
+        modbus_slave_set_slave_id_r(&slave, BENCH_SLAVE_ID);
+        modbus_slave_set_response_data_handler_r(&slave, bench_layout_response_handler);
+        modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, snapshots ? published : plain, 1);
+
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+            modbus_slave_receive_buffer_r(&slave, read_request, read_len);
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+
+        printf("  %-18s %8.1f ns\n", snapshots ? "read snapshot" : "read plain", (double)elapsed / BENCH_FRAME_ROUNDS);
+    }
+
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        uint16_t* values = (uint16_t*)modbus_slave_snapshot_begin(&snapshot);
+        values[i % BENCH_FRAME_REGISTERS] = (uint16_t)i;
+        modbus_slave_snapshot_publish(&snapshot);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    printf("  %-18s %8.1f ns\n", "begin + publish", (double)elapsed / BENCH_FRAME_ROUNDS);
+}
+
+void bench_read_write(void)
+{
+    static bench_line_t line;
+    const uint16_t setpoints[BENCH_CYCLE_SETPOINTS] = { 0x0101, 0x0202, 0x0303, 0x0404 };
+
+    printf("\nCONTROL CYCLE (write %u + read %u registers, bus time at %u baud):\n", BENCH_CYCLE_SETPOINTS, BENCH_CYCLE_VALUES, BENCH_BAUD_RATE);
+    printf("  %-18s %8s %8s %10s %10s\n", "", "frames", "bytes", "bus ms", "cpu ns");
+
+    bench_line_init(&line);
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_master_preset_multiple_registers_r(&line.master, BENCH_SLAVE_ID, 0, setpoints, BENCH_CYCLE_SETPOINTS);
+        modbus_master_read_holding_registers_r(&line.master, BENCH_SLAVE_ID, BENCH_CYCLE_SETPOINTS, BENCH_CYCLE_VALUES);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    double bytes = (double)line.bytes / BENCH_FRAME_ROUNDS;
+    bench_print_bus("0x10 + 0x03", 4, bytes, 0, (double)elapsed / BENCH_FRAME_ROUNDS);
+
+    bench_line_init(&line);
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_master_read_write_multiple_registers_r(&line.master, BENCH_SLAVE_ID, BENCH_CYCLE_SETPOINTS, BENCH_CYCLE_VALUES, 0, setpoints, BENCH_CYCLE_SETPOINTS);
+    }
+    elapsed = bench_now_ns() - start;
+    bytes = (double)line.bytes / BENCH_FRAME_ROUNDS;
+    bench_print_bus("0x17", 2, bytes, 0, (double)elapsed / BENCH_FRAME_ROUNDS);
+}
+
+void bench_mask_write(void)
+{
+    static bench_line_t line;
+
+    printf("\nSET ONE BIT (bus time at %u baud):\n", BENCH_BAUD_RATE);
+    printf("  %-18s %8s %8s %10s %10s\n", "", "frames", "bytes", "bus ms", "cpu ns");
+
+    bench_line_init(&line);
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_master_read_holding_registers_r(&line.master, BENCH_SLAVE_ID, 0, 1);
+        modbus_master_preset_single_register_r(&line.master, BENCH_SLAVE_ID, 0, (uint16_t)(line.holding[0] | (1 << (i % 16))));
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    double bytes = (double)line.bytes / BENCH_FRAME_ROUNDS;
+    bench_print_bus("0x03 + 0x06", 4, bytes, 0, (double)elapsed / BENCH_FRAME_ROUNDS);
+
+    bench_line_init(&line);
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_master_mask_write_register_r(&line.master, BENCH_SLAVE_ID, 0, (uint16_t)~(1 << (i % 16)), (uint16_t)(1 << (i % 16)));
+    }
+    elapsed = bench_now_ns() - start;
+    bytes = (double)line.bytes / BENCH_FRAME_ROUNDS;
+    bench_print_bus("0x16", 2, bytes, 0, (double)elapsed / BENCH_FRAME_ROUNDS);
+}
+
+void bench_file_records(void)
+{
+    static bench_file_line_t line;
+    static uint16_t data[BENCH_FILE_RECORDS];
+
+    printf("\nBULK TRANSFER (%u records, bus time at %u baud):\n", BENCH_FILE_RECORDS, BENCH_BAUD_RATE);
+    printf("  %-18s %8s %8s %10s %10s\n", "", "frames", "bytes", "bus ms", "cpu ns");
+
+    /* Hand-rolled paging: select the page in a register, then read it through the register window */
+    bench_file_line_init(&line);
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FILE_ROUNDS; i++) {
+        for (uint16_t done = 0; done < BENCH_FILE_RECORDS; done = (uint16_t)(done + BENCH_PAGE_REGISTERS)) {
+            modbus_master_preset_single_register_r(&line.master, BENCH_SLAVE_ID, 0, (uint16_t)(done / BENCH_PAGE_REGISTERS));
+            bench_file_line_pump(&line);
+            modbus_master_read_holding_registers_r(&line.master, BENCH_SLAVE_ID, 0, (uint16_t)MB_MIN(BENCH_PAGE_REGISTERS, BENCH_FILE_RECORDS - done));
+            bench_file_line_pump(&line);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_print_bus("paged 0x06 + 0x03", (double)line.frames / BENCH_FILE_ROUNDS, (double)line.bytes / BENCH_FILE_ROUNDS, 0, (double)elapsed / BENCH_FILE_ROUNDS);
+
+    for (uint8_t write = 0; write < 2; write++) {
+        bench_file_line_init(&line);
+        start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_FILE_ROUNDS; i++) {
+            line.complete = false;
+            if (write) {
+                modbus_master_write_file_r(&line.master, BENCH_SLAVE_ID, 1, 0, data, BENCH_FILE_RECORDS, bench_file_complete_handler);
+            } else {
+                modbus_master_read_file_r(&line.master, BENCH_SLAVE_ID, 1, 0, data, BENCH_FILE_RECORDS, bench_file_complete_handler);
+            }
+            while (!line.complete && line.pending_len) {
+                bench_file_line_pump(&line);
+            }
+        }
+        elapsed = bench_now_ns() - start;
+        bench_print_bus(write ? "0x15 stream" : "0x14 stream", (double)line.frames / BENCH_FILE_ROUNDS, (double)line.bytes / BENCH_FILE_ROUNDS, 0, (double)elapsed / BENCH_FILE_ROUNDS);
+    }
+}
+
+void bench_broadcast(void)
+{
+    static bench_line_t line;
+    const uint16_t clock[2] = { 0x6520, 0x1A00 };
+
+    printf("\nFLEET WRITE (%u slaves, bus time at %u baud, %u ms turnaround):\n", BENCH_FLEET_SLAVES, BENCH_BAUD_RATE, BENCH_TURNAROUND_MS);
+    printf("  %-18s %8s %8s %10s %10s\n", "", "frames", "bytes", "bus ms", "cpu ns");
+
+    /* The line has one slave, the unicast frames are the same size for every address */
+    bench_line_init(&line);
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FLEET_ROUNDS; i++) {
+        for (uint8_t slave = 0; slave < BENCH_FLEET_SLAVES; slave++) {
+            modbus_master_preset_multiple_registers_r(&line.master, BENCH_SLAVE_ID, 0, clock, 2);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_print_bus("0x10 unicast", BENCH_FLEET_SLAVES * 2, (double)line.bytes / BENCH_FLEET_ROUNDS, 0, (double)elapsed / BENCH_FLEET_ROUNDS);
+
+    bench_line_init(&line);
+    modbus_master_set_turnaround_delay_r(&line.master, BENCH_TURNAROUND_MS);
+    uint16_t wait_ms = 0;
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FLEET_ROUNDS; i++) {
+        modbus_master_preset_multiple_registers_r(&line.master, MODBUS_BROADCAST_ID, 0, clock, 2);
+        wait_ms = modbus_master_get_wait_time_r(&line.master, 0);
+        modbus_master_timeout_r(&line.master);
+    }
+    elapsed = bench_now_ns() - start;
+    bench_print_bus("0x10 broadcast", 1, (double)line.bytes / BENCH_FLEET_ROUNDS, wait_ms, (double)elapsed / BENCH_FLEET_ROUNDS);
+}
+
+void bench_units(void)
+{
+    static modbus_slave_t units[BENCH_UNITS];
+    static modbus_slave_t* table[MODBUS_SLAVE_UNITS_COUNT];
+    static uint16_t holding[BENCH_UNITS][BENCH_UNIT_REGISTERS];
+    static uint8_t frames[BENCH_UNITS * 2][8];
+    modbus_slave_t port;
+
+    for (uint8_t i = 0; i < BENCH_UNITS; i++) {
+        modbus_slave_registers_t registers = { 0 };
+        registers.analog_output_holding_registers = holding[i];
+        registers.analog_output_holding_registers_count = BENCH_UNIT_REGISTERS;
+        modbus_slave_init(&units[i], &registers, NULL);
+        modbus_slave_set_slave_id_r(&units[i], (uint8_t)(BENCH_SLAVE_ID + i));
+        modbus_slave_set_response_data_handler_r(&units[i], bench_layout_response_handler);
+        table[BENCH_SLAVE_ID + i] = &units[i];
+    }
+    modbus_slave_init(&port, NULL, NULL);
+    modbus_slave_set_units_r(&port, table);
+
+    /* Every other frame is for a device behind another converter on the same line */
+    for (uint8_t i = 0; i < BENCH_UNITS * 2; i++) {
+        uint8_t slave_id = (uint8_t)((i % 2 ? 0x80 : BENCH_SLAVE_ID) + i / 2);
+        uint8_t pdu[] = { slave_id, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, BENCH_UNIT_REGISTERS };
+        bench_make_frame(frames[i], pdu, sizeof(pdu));
+    }
+
+    printf("\nUNITS (%u slave ids on one port, half of the frames for other ids):\n", BENCH_UNITS);
+
+    for (uint8_t dispatch = 0; dispatch < 2; dispatch++) {
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_INSTANCE_ROUNDS; i++) {
+            const uint8_t* frame = frames[i % (BENCH_UNITS * 2)];
+            for (uint8_t j = 0; j < sizeof(frames[0]); j++) {
+                if (dispatch) {
+                    modbus_slave_recieve_data_byte_r(&port, frame[j]);
+                    continue;
+                }
+                /* Without a unit table every instance parses every byte */
+                for (uint8_t k = 0; k < BENCH_UNITS; k++) {
+                    modbus_slave_recieve_data_byte_r(&units[k], frame[j]);
+                }
+            }
+            /* The silence after the frame */
+            if (dispatch) {
+                modbus_slave_timeout_r(&port);
+            } else {
+                for (uint8_t k = 0; k < BENCH_UNITS; k++) {
+                    modbus_slave_timeout_r(&units[k]);
+                }
+            }
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        printf("  %-18s %8.1f ns/frame\n", dispatch ? "unit table" : "instance per id", (double)elapsed / BENCH_INSTANCE_ROUNDS);
+    }
+}
+
+void bench_foreign_frames(void)
+{
+    static uint8_t frames[BENCH_FOREIGN_PAIRS * 2 + 2][5 + BENCH_FOREIGN_REGISTERS * 2];
+    uint16_t frames_len[BENCH_FOREIGN_PAIRS * 2 + 2] = { 0 };
+    uint16_t holding[BENCH_FOREIGN_REGISTERS] = { 0 };
+    uint32_t responses = 0;
+    uint32_t bytes = 0;
+    uint8_t  count = 0;
+
+    /* Polls of other slaves and their answers, with values that look like requests for this one */
+    for (uint8_t i = 0; i < BENCH_FOREIGN_PAIRS; i++) {
+        uint8_t request[] = { (uint8_t)(0x20 + i), MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, BENCH_FOREIGN_REGISTERS };
+        frames_len[count] = bench_make_frame(frames[count], request, sizeof(request));
+        count++;
+
+        uint8_t response[3 + BENCH_FOREIGN_REGISTERS * 2] = { (uint8_t)(0x20 + i), MODBUS_READ_HOLDING_REGISTERS, BENCH_FOREIGN_REGISTERS * 2 };
+        for (uint8_t j = 0; j < BENCH_FOREIGN_REGISTERS * 2; j++) {
+            response[3 + j] = (uint8_t)(j % 4 == 0 ? BENCH_SLAVE_ID : j);
+        }
+        frames_len[count] = bench_make_frame(frames[count], response, sizeof(response));
+        count++;
+    }
+    uint8_t silent[] = { 0x30, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x01, BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS };
+    frames_len[count] = bench_make_frame(frames[count], silent, sizeof(silent));
+    count++;
+    uint8_t own[] = { BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x08 };
+    frames_len[count] = bench_make_frame(frames[count], own, sizeof(own));
+    count++;
+    for (uint8_t i = 0; i < count; i++) {
+        bytes += frames_len[i];
+    }
+
+    printf("\nFOREIGN FRAMES (%u of %u frames for other slaves):\n", count - 1, count);
+
+    for (uint8_t buffered = 0; buffered < 2; buffered++) {
+        modbus_slave_t slave;
+        modbus_slave_registers_t registers = { 0 };
+        registers.analog_output_holding_registers = holding;
+        registers.analog_output_holding_registers_count = BENCH_FOREIGN_REGISTERS;
+        modbus_slave_init(&slave, &registers, &responses);
+        modbus_slave_set_slave_id_r(&slave, BENCH_SLAVE_ID);
+        modbus_slave_set_response_data_handler_r(&slave, bench_count_response_handler);
+        responses = 0;
+
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_FOREIGN_ROUNDS; i++) {
+            for (uint8_t j = 0; j < count; j++) {
+                if (buffered) {
+                    modbus_slave_receive_buffer_r(&slave, frames[j], frames_len[j]);
+                } else {
+                    for (uint16_t k = 0; k < frames_len[j]; k++) {
+                        modbus_slave_recieve_data_byte_r(&slave, frames[j][k]);
+                    }
+                }
+                /* The silence after the frame */
+                modbus_slave_timeout_r(&slave);
+            }
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+
+        printf("  %-18s %8.2f ns/byte %8.2f responses/round\n", buffered ? "receive_buffer" : "byte by byte",
+            (double)elapsed / ((double)BENCH_FOREIGN_ROUNDS * bytes), (double)responses / BENCH_FOREIGN_ROUNDS);
+    }
+}
+
+void bench_framing(void)
+{
+    uint16_t holding[BENCH_UNIT_REGISTERS] = { 0 };
+    uint32_t responses = 0;
+    uint8_t  request[8];
+    uint8_t  poll[] = { BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, BENCH_UNIT_REGISTERS };
+    uint16_t request_len = bench_make_frame(request, poll, sizeof(poll));
+    uint16_t response_len = 5 + BENCH_UNIT_REGISTERS * 2;
+
+    modbus_slave_t slave;
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = holding;
+    registers.analog_output_holding_registers_count = BENCH_UNIT_REGISTERS;
+    modbus_slave_init(&slave, &registers, &responses);
+    modbus_slave_set_slave_id_r(&slave, BENCH_SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, bench_count_response_handler);
+    modbus_slave_set_framing_r(&slave, BENCH_BAUD_RATE, MODBUS_RTU_DEFAULT_CHAR_BITS);
+    double t35_ms = slave.framer.t35_us / 1000.0;
+
+    printf("\nFRAME END (poll of %u slaves, bus time at %u baud, t3.5 %.2f ms):\n", BENCH_FLEET_SLAVES, BENCH_BAUD_RATE, t35_ms);
+    printf("  %-18s %8s %8s %10s %10s\n", "", "frames", "bytes", "bus ms", "cpu ns");
+
+    /* The application's timer ends every frame at its own tick instead of the t3.5 silence */
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAMING_ROUNDS; i++) {
+        for (uint16_t j = 0; j < request_len; j++) {
+            modbus_slave_recieve_data_byte_r(&slave, request[j]);
+        }
+        modbus_slave_timeout_r(&slave);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    double frames = BENCH_FLEET_SLAVES * 2;
+    double bytes = (double)BENCH_FLEET_SLAVES * (request_len + response_len);
+    bench_print_bus("padded timer", frames, bytes, frames * (BENCH_PADDED_SILENCE_MS - t35_ms),
+        (double)elapsed / BENCH_FRAMING_ROUNDS);
+
+    uint32_t now_us = 0;
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAMING_ROUNDS; i++) {
+        for (uint16_t j = 0; j < request_len; j++) {
+            modbus_slave_recieve_data_byte_at_r(&slave, request[j], now_us += slave.framer.char_us);
+        }
+        now_us += slave.framer.t35_us;
+        modbus_slave_poll_r(&slave, now_us);
+    }
+    elapsed = bench_now_ns() - start;
+    bench_print_bus("t3.5 framer", frames, bytes, 0, (double)elapsed / BENCH_FRAMING_ROUNDS);
+
+    if (responses != 2 * BENCH_FRAMING_ROUNDS) {
+        printf("  unexpected responses: %u\n", responses);
+    }
+}
+
+void bench_queue(void)
+{
+    static bench_file_line_t line;
+    const modbus_master_priority_t priorities[2][2] = {
+        { MODBUS_PRIORITY_NORMAL,  MODBUS_PRIORITY_NORMAL },
+        { MODBUS_PRIORITY_ROUTINE, MODBUS_PRIORITY_URGENT },
+    };
+    const char* names[2] = { "first come", "urgent write" };
+
+    printf("\nQUEUE (%u polls waiting, then one write, bus time at %u baud):\n", BENCH_QUEUE_POLLS, BENCH_BAUD_RATE);
+    printf("  %-18s %8s %10s %12s\n", "", "position", "write ms", "cpu ns/req");
+
+    for (uint8_t mode = 0; mode < 2; mode++) {
+        bench_file_line_init(&line);
+        uint32_t position = 0;
+        uint32_t bytes_before = 0;
+
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_QUEUE_ROUNDS; i++) {
+            uint32_t frames = line.frames;
+            uint32_t bytes = line.bytes;
+            modbus_master_read_holding_registers_r(&line.master, BENCH_SLAVE_ID, 0, BENCH_UNIT_REGISTERS);
+            for (uint8_t j = 0; j < BENCH_QUEUE_POLLS; j++) {
+                modbus_master_set_priority_r(&line.master, priorities[mode][0]);
+                modbus_master_read_holding_registers_r(&line.master, BENCH_SLAVE_ID, j, BENCH_UNIT_REGISTERS);
+            }
+            modbus_master_set_priority_r(&line.master, priorities[mode][1]);
+            modbus_master_preset_single_register_r(&line.master, BENCH_SLAVE_ID, 0, (uint16_t)i);
+
+            /* The line delivers each request after the previous response */
+            while (line.pending_len > 0) {
+                if (line.pending[1] == MODBUS_PRESET_SINGLE_REGISTER) {
+                    position = (line.frames - frames + 1) / 2;
+                    bytes_before = line.bytes - bytes - line.pending_len;
+                }
+                bench_file_line_pump(&line);
+            }
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+
+        double write_ms = (bytes_before + (position - 1) * 2 * 3.5) * 11 * 1000.0 / BENCH_BAUD_RATE;
+        printf("  %-18s %8u %10.2f %12.1f\n", names[mode], position, write_ms,
+            (double)elapsed / ((double)BENCH_QUEUE_ROUNDS * (BENCH_QUEUE_POLLS + 2)));
+    }
+}
+
+void bench_poll_list(void)
+{
+    static bench_file_line_t line;
+    static const uint32_t periods_ms[BENCH_POLL_ENTRIES] = { 200, 250, 500, 500, 1000, 1000 };
+    modbus_master_poll_t polls[BENCH_POLL_ENTRIES];
+    uint32_t poll_us = bench_frame_us(8) + bench_frame_us(5 + BENCH_UNIT_REGISTERS * 2);
+    const char* names[2] = { "periods x1", "periods x0.5" };
+
+    printf("\nPOLL LIST (%u periodic reads of %u registers, %u s of bus time at %u baud):\n",
+        BENCH_POLL_ENTRIES, BENCH_UNIT_REGISTERS, BENCH_POLL_SPAN_S, BENCH_BAUD_RATE);
+    printf("  %-18s %8s %8s %10s %10s %8s %10s\n", "", "demand", "busy", "jitter ms", "slowest", "missed", "cpu ns");
+
+    for (uint8_t load = 1; load <= 2; load++) {
+        bench_file_line_init(&line);
+        bench_clock_us = 0;
+        modbus_master_set_clock_r(&line.master, bench_clock);
+
+        double demand = 0;
+        for (uint8_t i = 0; i < BENCH_POLL_ENTRIES; i++) {
+            memset(&polls[i], 0, sizeof(polls[i]));
+            polls[i].slave_id  = BENCH_SLAVE_ID;
+            polls[i].command   = MODBUS_READ_HOLDING_REGISTERS;
+            polls[i].reg_addr  = i;
+            polls[i].reg_count = BENCH_UNIT_REGISTERS;
+            polls[i].period_us = periods_ms[i] * 1000 / load;
+            demand += (double)poll_us / polls[i].period_us;
+        }
+        modbus_master_set_poll_list_r(&line.master, polls, BENCH_POLL_ENTRIES);
+
+        uint64_t start = bench_now_ns();
+        uint64_t busy_us = bench_poll_list_run(&line);
+        uint64_t elapsed = bench_now_ns() - start;
+
+        uint32_t count = 0;
+        uint32_t missed = 0;
+        for (uint8_t i = 0; i < BENCH_POLL_ENTRIES; i++) {
+            count += polls[i].polls;
+            missed += polls[i].missed;
+        }
+        printf("  %-18s %7.1f%% %7.1f%% %10.2f %10.2f %8u %10.1f\n", names[load - 1], demand * 100,
+            (double)busy_us * 100 / bench_clock_us, polls[0].jitter_us_max / 1000.0,
+            polls[BENCH_POLL_ENTRIES - 1].jitter_us_max / 1000.0, missed, (double)elapsed / count);
+    }
+}
+
+void bench_coalescing(void)
+{
+    static bench_file_line_t line;
+    modbus_master_poll_t polls[BENCH_COALESCE_ENTRIES];
+    const uint16_t gaps[3] = { 0, 0, BENCH_COALESCE_GAP };
+    const char* names[3] = { "one per entry", "adjacent", "gap 2" };
+
+    printf("\nREAD COALESCING (%u reads of %u registers every %u ms, pairs %u registers apart, bus time at %u baud):\n",
+        BENCH_COALESCE_ENTRIES, BENCH_COALESCE_REGISTERS, BENCH_COALESCE_PERIOD_MS, BENCH_COALESCE_GAP, BENCH_BAUD_RATE);
+    printf("  %-18s %10s %8s %10s %10s\n", "", "requests/s", "bytes/s", "busy", "cpu ns");
+
+    for (uint8_t mode = 0; mode < 3; mode++) {
+        bench_file_line_init(&line);
+        bench_clock_us = 0;
+        modbus_master_set_clock_r(&line.master, bench_clock);
+        modbus_master_set_read_coalescing_r(&line.master, mode > 0, gaps[mode]);
+
+        /* Neighbouring pairs of ranges, the pairs separated by a small gap */
+        for (uint8_t i = 0; i < BENCH_COALESCE_ENTRIES; i++) {
+            memset(&polls[i], 0, sizeof(polls[i]));
+            polls[i].slave_id  = BENCH_SLAVE_ID;
+            polls[i].command   = MODBUS_READ_HOLDING_REGISTERS;
+            polls[i].reg_addr  = (uint16_t)(i * BENCH_COALESCE_REGISTERS + (i / 2) * BENCH_COALESCE_GAP);
+            polls[i].reg_count = BENCH_COALESCE_REGISTERS;
+            polls[i].period_us = BENCH_COALESCE_PERIOD_MS * 1000UL;
+        }
+        modbus_master_set_poll_list_r(&line.master, polls, BENCH_COALESCE_ENTRIES);
+
+        uint64_t start = bench_now_ns();
+        uint64_t busy_us = bench_poll_list_run(&line);
+        uint64_t elapsed = bench_now_ns() - start;
+
+        uint32_t count = 0;
+        for (uint8_t i = 0; i < BENCH_COALESCE_ENTRIES; i++) {
+            count += polls[i].polls;
+        }
+        printf("  %-18s %10.1f %8.0f %9.1f%% %10.1f\n", names[mode], line.frames / 2.0 / BENCH_POLL_SPAN_S,
+            (double)line.bytes / BENCH_POLL_SPAN_S, (double)busy_us * 100 / bench_clock_us, (double)elapsed / count);
+    }
+}
+
+void bench_write_combining(void)
+{
+    static bench_file_line_t line;
+    const char* names[2] = { "one per write", "combined" };
+
+    printf("\nWRITE COMBINING (%u single register writes to neighbouring addresses, bus time at %u baud):\n",
+        BENCH_COMBINE_WRITES, BENCH_BAUD_RATE);
+    printf("  %-18s %8s %8s %10s %10s\n", "", "frames", "bytes", "bus ms", "cpu ns");
+
+    for (uint8_t mode = 0; mode < 2; mode++) {
+        bench_file_line_init(&line);
+        modbus_master_set_write_combining_r(&line.master, mode > 0);
+
+        uint64_t start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_COMBINE_ROUNDS; i++) {
+            for (uint16_t j = 0; j < BENCH_COMBINE_WRITES; j++) {
+                modbus_master_preset_single_register_r(&line.master, BENCH_SLAVE_ID, j, (uint16_t)(i + j));
+            }
+            modbus_master_flush_writes_r(&line.master);
+            while (line.pending_len > 0) {
+                bench_file_line_pump(&line);
+            }
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+
+        bench_print_bus(names[mode], (double)line.frames / BENCH_COMBINE_ROUNDS, (double)line.bytes / BENCH_COMBINE_ROUNDS, 0,
+            (double)elapsed / ((double)BENCH_COMBINE_ROUNDS * BENCH_COMBINE_WRITES));
+        if (line.holding[BENCH_COMBINE_WRITES - 1] != (uint16_t)(BENCH_COMBINE_ROUNDS - 1 + BENCH_COMBINE_WRITES - 1)) {
+            printf("  unexpected register value: %u\n", line.holding[BENCH_COMBINE_WRITES - 1]);
+        }
+    }
+}
+
+void bench_receive_buffer(void)
+{
+    static uint8_t pdu[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+    static uint8_t request[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
+    static uint8_t response[MODBUS_MASTER_RESPONSE_MESSAGE_SIZE] = { 0 };
+
+    uint16_t pdu_len = 0;
+    pdu[pdu_len++] = BENCH_SLAVE_ID;
+    pdu[pdu_len++] = MODBUS_PRESET_MULTIPLE_REGISTERS;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = 0x00;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS * 2;
+    bench_fill_buffer(pdu + pdu_len, BENCH_FRAME_REGISTERS * 2);
+    pdu_len += BENCH_FRAME_REGISTERS * 2;
+    uint16_t request_len = bench_make_frame(request, pdu, pdu_len);
+
+    pdu_len = 0;
+    pdu[pdu_len++] = BENCH_SLAVE_ID;
+    pdu[pdu_len++] = MODBUS_READ_HOLDING_REGISTERS;
+    pdu[pdu_len++] = BENCH_FRAME_REGISTERS * 2;
+    bench_fill_buffer(pdu + pdu_len, BENCH_FRAME_REGISTERS * 2);
+    pdu_len += BENCH_FRAME_REGISTERS * 2;
+    uint16_t response_len = bench_make_frame(response, pdu, pdu_len);
+
+    printf("\nRECEIVE PATH (MB/s, %u registers):\n", BENCH_FRAME_REGISTERS);
+    printf("  %8s %12s %12s\n", "", "per byte", "buffer");
+
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        for (uint16_t j = 0; j < request_len; j++) {
+            modbus_slave_recieve_data_byte(request[j]);
+        }
+    }
+    uint64_t per_byte = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_slave_receive_buffer(request, request_len);
+    }
+    uint64_t buffer = bench_now_ns() - start;
+
+    double total = (double)request_len * BENCH_FRAME_ROUNDS / (1024.0 * 1024.0);
+    printf("  %8s %12.1f %12.1f\n", "slave", total / ((double)per_byte / 1e9), total / ((double)buffer / 1e9));
+
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_master_read_holding_registers(BENCH_SLAVE_ID, 0, BENCH_FRAME_REGISTERS);
+        for (uint16_t j = 0; j < response_len; j++) {
+            modbus_master_recieve_data_byte(response[j]);
+        }
+    }
+    per_byte = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_master_read_holding_registers(BENCH_SLAVE_ID, 0, BENCH_FRAME_REGISTERS);
+        modbus_master_receive_buffer(response, response_len);
+    }
+    buffer = bench_now_ns() - start;
+
+    total = (double)response_len * BENCH_FRAME_ROUNDS / (1024.0 * 1024.0);
+    printf("  %8s %12.1f %12.1f\n", "master", total / ((double)per_byte / 1e9), total / ((double)buffer / 1e9));
+}
+
+void bench_tx_buffer(void)
+{
+    uint8_t pdu[] = { BENCH_SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, BENCH_FRAME_REGISTERS };
+    uint8_t request[sizeof(pdu) + 2] = { 0 };
+    uint16_t request_len = bench_make_frame(request, pdu, sizeof(pdu));
+
+    printf("\nREAD RESPONSE SERIALIZATION (%u registers):\n", BENCH_FRAME_REGISTERS);
+
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_slave_receive_buffer(request, request_len);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    printf("  %-18s %8.1f ns\n", "response handler", (double)elapsed / BENCH_FRAME_ROUNDS);
+
+    modbus_slave_set_tx_buffer_handlers(&bench_slave_tx_buffer_provider, &bench_slave_tx_buffer_commit);
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_FRAME_ROUNDS; i++) {
+        modbus_slave_receive_buffer(request, request_len);
+    }
+    elapsed = bench_now_ns() - start;
+    modbus_slave_set_tx_buffer_handlers(NULL, NULL);
+    printf("  %-18s %8.1f ns\n", "tx buffer", (double)elapsed / BENCH_FRAME_ROUNDS);
+}
+
+void bench_instances(void)
+{
+    static bench_line_t lines[BENCH_INSTANCES_MAX];
+
+    printf("\nINDEPENDENT INSTANCES (%u x read %u registers per line):\n", BENCH_INSTANCE_ROUNDS, BENCH_INSTANCE_REGISTERS);
+    printf("  %8s %16s %16s\n", "lines", "transactions/s", "per line");
+    for (uint32_t count = 1; count <= BENCH_INSTANCES_MAX; count *= 2) {
+        for (uint32_t i = 0; i < count; i++) {
+            bench_line_init(&lines[i]);
+        }
+
+        uint64_t start = bench_now_ns();
+#if _WIN32
+        for (uint32_t i = 0; i < count; i++) {
+            bench_line_run(&lines[i]);
+        }
+#else
+        pthread_t threads[BENCH_INSTANCES_MAX];
+        for (uint32_t i = 0; i < count; i++) {
+            pthread_create(&threads[i], NULL, bench_line_run, &lines[i]);
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            pthread_join(threads[i], NULL);
+        }
+#endif
+        uint64_t elapsed = bench_now_ns() - start;
+
+        uint64_t packets = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            packets += lines[i].packets;
+        }
+        double rate = (double)packets / ((double)elapsed / 1e9);
+        printf("  %8u %16.0f %16.0f\n", count, rate, rate / count);
+    }
+}
+
+void bench_line_init(bench_line_t* line)
+{
+    memset(line, 0, sizeof(*line));
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = line->holding;
+    registers.analog_output_holding_registers_count = BENCH_INSTANCE_REGISTERS;
+    modbus_slave_init(&line->slave, &registers, line);
+    modbus_slave_set_slave_id_r(&line->slave, BENCH_SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&line->slave, bench_line_response_handler);
+
+    modbus_master_init(&line->master, line);
+    modbus_master_set_request_data_sender_r(&line->master, bench_line_request_sender);
+    modbus_master_set_response_packet_handler_r(&line->master, bench_line_packet_handler);
+}
+
+void* bench_line_run(void* line)
+{
+    bench_line_t* bench_line = (bench_line_t*)line;
+    for (uint32_t i = 0; i < BENCH_INSTANCE_ROUNDS; i++) {
+        modbus_master_read_holding_registers_r(&bench_line->master, BENCH_SLAVE_ID, 0, BENCH_INSTANCE_REGISTERS);
+    }
+    return NULL;
+}
+
+void bench_line_request_sender(void* user_context, uint8_t* data, uint32_t len)
+{
+    bench_line_t* line = (bench_line_t*)user_context;
+    line->bytes += len;
+    for (uint32_t i = 0; i < len; i++) {
+        modbus_slave_recieve_data_byte_r(&line->slave, data[i]);
+    }
+}
+
+void bench_line_response_handler(void* user_context, uint8_t* data, uint32_t len)
+{
+    bench_line_t* line = (bench_line_t*)user_context;
+    line->bytes += len;
+    for (uint32_t i = 0; i < len; i++) {
+        modbus_master_recieve_data_byte_r(&line->master, data[i]);
+    }
+}
+
+void bench_line_packet_handler(void* user_context, modbus_response_t* packet)
+{
+    bench_line_t* line = (bench_line_t*)user_context;
+    line->packets += packet->status == MODBUS_NO_ERROR;
+}
+
+void bench_file_line_init(bench_file_line_t* line)
+{
+    memset(line, 0, sizeof(*line));
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = line->holding;
+    registers.analog_output_holding_registers_count = BENCH_PAGE_REGISTERS;
+    modbus_slave_init(&line->slave, &registers, line);
+    modbus_slave_set_slave_id_r(&line->slave, BENCH_SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&line->slave, bench_file_line_response_handler);
+    modbus_slave_set_file_record_handlers_r(&line->slave, bench_file_read_handler, bench_file_write_handler);
+
+    modbus_master_init(&line->master, line);
+    modbus_master_set_request_data_sender_r(&line->master, bench_file_line_request_sender);
+    modbus_master_set_response_packet_handler_r(&line->master, bench_file_line_packet_handler);
+}
+
+void bench_file_line_pump(bench_file_line_t* line)
+{
+    uint8_t request[sizeof(line->pending)];
+    uint32_t len = line->pending_len;
+    memcpy(request, line->pending, len);
+    line->pending_len = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        modbus_slave_recieve_data_byte_r(&line->slave, request[i]);
+    }
+}
+
+void bench_file_line_request_sender(void* user_context, uint8_t* data, uint32_t len)
+{
+    bench_file_line_t* line = (bench_file_line_t*)user_context;
+    line->frames++;
+    line->bytes += len;
+    memcpy(line->pending, data, len);
+    line->pending_len = len;
+}
+
+void bench_file_line_response_handler(void* user_context, uint8_t* data, uint32_t len)
+{
+    bench_file_line_t* line = (bench_file_line_t*)user_context;
+    line->frames++;
+    line->bytes += len;
+    for (uint32_t i = 0; i < len; i++) {
+        modbus_master_recieve_data_byte_r(&line->master, data[i]);
+    }
+}
+
+void bench_file_line_packet_handler(void* user_context, modbus_response_t* packet)
+{
+    (void)user_context;
+    bench_sink ^= packet->response[0];
+}
+
+bool bench_file_read_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, uint8_t* data)
+{
+    bench_file_line_t* line = (bench_file_line_t*)user_context;
+    (void)file_number;
+    if (record_number + count > BENCH_FILE_RECORDS) {
+        return false;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        data[i * 2] = (uint8_t)(line->records[record_number + i] >> 8);
+        data[i * 2 + 1] = (uint8_t)line->records[record_number + i];
+    }
+    return true;
+}
+
+bool bench_file_write_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, const uint8_t* data)
+{
+    bench_file_line_t* line = (bench_file_line_t*)user_context;
+    (void)file_number;
+    if (record_number + count > BENCH_FILE_RECORDS) {
+        return false;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        line->records[record_number + i] = (uint16_t)((data[i * 2] << 8) | data[i * 2 + 1]);
+    }
+    return true;
+}
+
+void bench_file_complete_handler(void* user_context, modbus_error_response_t status, uint16_t records_done)
+{
+    bench_file_line_t* line = (bench_file_line_t*)user_context;
+    line->complete = true;
+    bench_sink = (uint16_t)(bench_sink + status + records_done);
+}
+
+void bench_print_bus(const char* name, double frames, double bytes, double wait_ms, double cpu_ns)
+{
+    /* 11 bits per character and a 3.5 character gap after every frame */
+    printf("  %-18s %8.0f %8.0f %10.2f %10.1f\n", name, frames, bytes,
+        (bytes + frames * 3.5) * 11 * 1000.0 / BENCH_BAUD_RATE + wait_ms, cpu_ns);
+}
+
+uint32_t bench_clock(void* user_context)
+{
+    (void)user_context;
+    return bench_clock_us;
+}
+
+uint64_t bench_poll_list_run(bench_file_line_t* line)
+{
+    /* The simulated clock jumps to the next release when the line is idle and runs with the bytes otherwise */
+    uint64_t busy_us = 0;
+    while (bench_clock_us < BENCH_POLL_SPAN_S * 1000000UL) {
+        uint32_t release_us = modbus_master_run_poll_list_r(&line->master);
+        if (line->pending_len == 0) {
+            bench_clock_us = release_us;
+            continue;
+        }
+        while (line->pending_len > 0 && bench_clock_us < BENCH_POLL_SPAN_S * 1000000UL) {
+            uint32_t transaction_us = bench_frame_us(line->pending_len) + bench_frame_us(5 + line->pending[5] * 2);
+            bench_clock_us += transaction_us;
+            busy_us += transaction_us;
+            bench_file_line_pump(line);
+        }
+    }
+    return busy_us;
+}
+
+uint32_t bench_frame_us(uint32_t bytes)
+{
+    /* 11 bits per character and a 3.5 character gap, as in bench_print_bus() */
+    return (uint32_t)((bytes * 2 + 7) * 11 * 1000000ULL / (2 * BENCH_BAUD_RATE));
+}
+
+void bench_slave_response_handler(uint8_t* data, uint32_t len)
+{
+    bench_sink ^= data[len - 1];
+}
+
+void bench_layout_response_handler(void* user_context, uint8_t* data, uint32_t len)
+{
+    (void)user_context;
+    bench_sink ^= data[len - 1];
+}
+
+void bench_count_response_handler(void* user_context, uint8_t* data, uint32_t len)
+{
+    bench_sink ^= data[len - 1];
+    (*(uint32_t*)user_context)++;
+}
+
+uint8_t* bench_slave_tx_buffer_provider(uint32_t len)
+{
+    return len <= sizeof(bench_tx_buffer_data) ? bench_tx_buffer_data : NULL;
+}
+
+void bench_sensor_read_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count)
+{
+    (void)user_context;
+    (void)register_type;
+    for (uint16_t i = 0; i < count; i++) {
+        bench_sensors[register_id + i] = bench_sensor_value((uint16_t)(register_id + i));
+    }
+}
+
+uint16_t bench_sensor_value(uint16_t register_id)
+{
+    /* Stands in for ADC averaging */
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < BENCH_SENSOR_SAMPLES; i++) {
+        sum += (uint32_t)((register_id * 31u + i * 17u + bench_sink) & 0x0FFF);
+    }
+    return (uint16_t)(sum / BENCH_SENSOR_SAMPLES);
+}
+
+void bench_slave_tx_buffer_commit(uint8_t* data, uint32_t len)
+{
+    bench_sink ^= data[len - 1];
+}
+
+void bench_master_request_sender(uint8_t* data, uint32_t len)
+{
+    bench_sink ^= data[len - 1];
+}
+
+void bench_master_response_handler(modbus_response_t* packet)
+{
+    bench_sink ^= packet->status;
+}
+
+uint64_t bench_now_ns(void)
+{
+#if _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t bench_now_cycles(void)
+{
+#if BENCH_CYCLES
+    return (uint64_t)__rdtsc();
+#else
+    return 0;
+#endif
+}
+
+void bench_fill_buffer(uint8_t* buffer, size_t len)
+{
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+uint16_t bench_make_frame(uint8_t* frame, const uint8_t* pdu, uint16_t pdu_len)
+{
+    memcpy(frame, pdu, pdu_len);
+    uint16_t crc = modbus_crc16(frame, pdu_len);
+    frame[pdu_len++] = (uint8_t)(crc);
+    frame[pdu_len++] = (uint8_t)(crc >> 8);
+    return pdu_len;
+}
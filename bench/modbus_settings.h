@@ -0,0 +1,28 @@
+/* Copyright © 2023 Georgy E. All rights reserved. */
+
+#ifndef _MODBUS_SETTINGS_BENCH_H_
+#define _MODBUS_SETTINGS_BENCH_H_
+
+/*************************** MODBUS REGISTER SETTINGS BEGIN ***************************/
+
+/* Register count of every type, CMake builds additional benches with other counts */
+#ifndef MODBUS_BENCH_REGISTERS
+#   define MODBUS_BENCH_REGISTERS                       (125)
+#endif
+
+/* Slave registers count */
+#define MODBUS_SLAVE_INPUT_COILS_COUNT                  (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+#define MODBUS_SLAVE_OUTPUT_COILS_COUNT                 (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+#define MODBUS_SLAVE_INPUT_REGISTERS_COUNT              (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+#define MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT     (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+
+/* Expected registers count (master) */
+#define MODBUS_MASTER_INPUT_COILS_COUNT                 (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+#define MODBUS_MASTER_OUTPUT_COILS_COUNT                (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+#define MODBUS_MASTER_INPUT_REGISTERS_COUNT             (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+#define MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT    (MODBUS_BENCH_REGISTERS)   // MODBUS default: 9999
+
+
+/**************************** MODBUS REGISTER SETTINGS END ****************************/
+
+#endif
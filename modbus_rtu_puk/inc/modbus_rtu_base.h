@@ -10,6 +10,8 @@ extern "C" {
 
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #include "modbus_settings.h"
 
@@ -17,9 +19,77 @@ extern "C" {
 #define SPECIAL_DATA_REGISTERS_COUNT_IDX                ((uint8_t)0)
 #define SPECIAL_DATA_VALUE_SIZE                         ((uint8_t)2)
 #define SPECIAL_DATA_META_COUNT                         ((uint8_t)3)
+/* Read/write multiple registers: read count, write address, write count and byte count */
+#define SPECIAL_DATA_WRITE_ADDR_IDX                     ((uint8_t)2)
+#define SPECIAL_DATA_WRITE_COUNT_IDX                    ((uint8_t)4)
+#define SPECIAL_DATA_READ_WRITE_META_COUNT              ((uint8_t)7)
+/* Mask write register: AND mask and OR mask */
+#define SPECIAL_DATA_OR_MASK_IDX                        ((uint8_t)2)
+#define SPECIAL_DATA_MASK_WRITE_COUNT                   ((uint8_t)4)
+/* File records: byte count, then sub-requests of reference type, file number, record number and record length */
+#define SPECIAL_DATA_FILE_META_COUNT                    ((uint8_t)1)
+#define SPECIAL_DATA_FILE_SUB_REQUEST_SIZE              ((uint8_t)7)
+#define SPECIAL_DATA_FILE_RECORD_NUMBER_IDX             ((uint8_t)3)
+#define SPECIAL_DATA_FILE_RECORD_LENGTH_IDX             ((uint8_t)5)
+
+#define MODBUS_FILE_REFERENCE_TYPE                      ((uint8_t)0x06)
+#define MODBUS_FILE_READ_BYTES_MAX                      ((uint8_t)0xF5)
+#define MODBUS_FILE_WRITE_BYTES_MAX                     ((uint8_t)0xFB)
 
 #define MODBUS_ERROR_COMMAND_CODE                       ((uint8_t)0x80)
 
+#define MODBUS_BROADCAST_ID                             ((uint8_t)0x00)
+
+#define MODBUS_CRC16_INIT                               ((uint16_t)0xFFFF)
+
+/* RTU silent intervals: 1.5 and 3.5 characters, fixed above 19200 baud */
+#define MODBUS_RTU_DEFAULT_BAUD_RATE                    ((uint32_t)19200)
+#define MODBUS_RTU_DEFAULT_CHAR_BITS                    ((uint8_t)11)
+#define MODBUS_RTU_FIXED_INTERVALS_BAUD_RATE            ((uint32_t)19200)
+#define MODBUS_RTU_FIXED_T15_US                         ((uint32_t)750)
+#define MODBUS_RTU_FIXED_T35_US                         ((uint32_t)1750)
+
+/* Microseconds of half_chars / 2 characters, rounded up */
+#define MODBUS_RTU_HALF_CHARS_US(baud_rate, char_bits, half_chars) \
+    ((uint32_t)(((uint32_t)(half_chars) * (char_bits) * 1000000UL + 2UL * (baud_rate) - 1) / (2UL * (baud_rate))))
+#define MODBUS_RTU_T15_US(baud_rate, char_bits) \
+    ((baud_rate) > MODBUS_RTU_FIXED_INTERVALS_BAUD_RATE ? MODBUS_RTU_FIXED_T15_US : MODBUS_RTU_HALF_CHARS_US(baud_rate, char_bits, 3))
+#define MODBUS_RTU_T35_US(baud_rate, char_bits) \
+    ((baud_rate) > MODBUS_RTU_FIXED_INTERVALS_BAUD_RATE ? MODBUS_RTU_FIXED_T35_US : MODBUS_RTU_HALF_CHARS_US(baud_rate, char_bits, 7))
+#define MODBUS_RTU_FRAMER_INIT(baud_rate, char_bits) { \
+    .char_us = MODBUS_RTU_HALF_CHARS_US(baud_rate, char_bits, 2), \
+    .t15_us  = MODBUS_RTU_T15_US(baud_rate, char_bits), \
+    .t35_us  = MODBUS_RTU_T35_US(baud_rate, char_bits), \
+    .last_us = 0, .open = false, .broken = false }
+
+#define MODBUS_CRC16_ENGINE_BITWISE                     (0)
+#define MODBUS_CRC16_ENGINE_TABLE                       (1)
+#define MODBUS_CRC16_ENGINE_SLICING_4                   (2)
+#define MODBUS_CRC16_ENGINE_SLICING_8                   (3)
+
+#ifndef MODBUS_CRC16_ENGINE
+#   if defined(SDCC) || defined(__SDCC)
+#       define MODBUS_CRC16_ENGINE                      MODBUS_CRC16_ENGINE_BITWISE
+#   else
+#       define MODBUS_CRC16_ENGINE                      MODBUS_CRC16_ENGINE_SLICING_8
+#   endif
+#endif
+
+/* Carry-less multiply kernel (PCLMULQDQ), selected at runtime, x86-64 only until other kernels are tested */
+#ifndef MODBUS_CRC16_HW
+#   if !defined(SDCC) && !defined(__SDCC) && defined(__GNUC__) && defined(__x86_64__)
+#       define MODBUS_CRC16_HW                          (1)
+#   else
+#       define MODBUS_CRC16_HW                          (0)
+#   endif
+#endif
+#if MODBUS_CRC16_HW && !defined(__x86_64__)
+#   error "MODBUS_CRC16_HW is only available on x86-64"
+#endif
+#ifndef MODBUS_CRC16_HW_MIN_LEN
+#   define MODBUS_CRC16_HW_MIN_LEN                      (128)
+#endif
+
 
 typedef enum _modbus_command_t {
     MODBUS_READ_COILS                = (uint8_t)0x01,
@@ -29,7 +99,11 @@ typedef enum _modbus_command_t {
     MODBUS_FORCE_SINGLE_COIL         = (uint8_t)0x05,
     MODBUS_PRESET_SINGLE_REGISTER    = (uint8_t)0x06,
     MODBUS_FORCE_MULTIPLE_COILS      = (uint8_t)0x0F,
-    MODBUS_PRESET_MULTIPLE_REGISTERS = (uint8_t)0x10
+    MODBUS_PRESET_MULTIPLE_REGISTERS = (uint8_t)0x10,
+    MODBUS_READ_FILE_RECORD          = (uint8_t)0x14,
+    MODBUS_WRITE_FILE_RECORD         = (uint8_t)0x15,
+    MODBUS_MASK_WRITE_REGISTER       = (uint8_t)0x16,
+    MODBUS_READ_WRITE_MULTIPLE_REGISTERS = (uint8_t)0x17
 } modbus_command_t;
 
 
@@ -61,12 +135,35 @@ typedef enum _modbus_error_types_t {
 #   define MB_MAX(var1, var2)       ((var1 > var2) ? (var1) : (var2))
 #endif
 
+/* Coils are packed LSB first, 8 per byte, in the Modbus wire order */
+#define MODBUS_COILS_BYTES(count)   (((count) + 7) / 8)
+
 #define MODBUS_SLAVE_MESSAGE_DATA_SIZE  ((sizeof(uint16_t) * MB_MAX(MB_MAX(MODBUS_SLAVE_INPUT_COILS_COUNT, MODBUS_SLAVE_OUTPUT_COILS_COUNT), MB_MAX(MODBUS_SLAVE_INPUT_REGISTERS_COUNT, MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT))) + 1)
 #ifdef MODBUS_MASTER_MAX_RESPONSE_SIZE
 #   define MODBUS_MASTER_MESSAGE_DATA_SIZE MODBUS_MASTER_MAX_RESPONSE_SIZE
 #else
 #   define MODBUS_MASTER_MESSAGE_DATA_SIZE ((sizeof(uint16_t) * MB_MAX(MB_MAX(MODBUS_MASTER_INPUT_COILS_COUNT, MODBUS_MASTER_OUTPUT_COILS_COUNT), MB_MAX(MODBUS_MASTER_INPUT_REGISTERS_COUNT, MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT))) + 1)
 #endif
+/* What the receiver does with bytes after the silence measured before them */
+typedef enum _modbus_rtu_frame_event_t {
+    MODBUS_RTU_FRAME_BYTES     = (uint8_t)0x00,
+    MODBUS_RTU_FRAME_END_BYTES = (uint8_t)0x01,
+    MODBUS_RTU_FRAME_DISCARD   = (uint8_t)0x02
+} modbus_rtu_frame_event_t;
+
+
+/* Frame boundaries from byte timestamps: a t3.5 silence ends a frame, a t1.5 silence inside it breaks the frame */
+typedef struct _modbus_rtu_framer_t {
+    uint32_t char_us;
+    uint32_t t15_us;
+    uint32_t t35_us;
+    /* Reception time of the last byte */
+    uint32_t last_us;
+    bool     open;
+    bool     broken;
+} modbus_rtu_framer_t;
+
+
 typedef struct _modbus_request_message_t {
     uint8_t  id;
     uint8_t  command;
@@ -88,6 +185,33 @@ typedef struct _modbus_response_message_t {
 #define MODBUS_MASTER_RESPONSE_MESSAGE_SIZE  ((uint16_t)(MB_MAX(sizeof(struct _modbus_response_message_t), sizeof(struct _modbus_request_message_t)) + MODBUS_MASTER_MESSAGE_DATA_SIZE))
 
 uint16_t modbus_crc16(const uint8_t* data, uint16_t len);
+uint16_t modbus_crc16_update(uint16_t crc, const uint8_t* data, size_t len);
+uint16_t modbus_crc16_byte(uint16_t crc, uint8_t byte);
+
+uint16_t modbus_crc16_bitwise(uint16_t crc, const uint8_t* data, size_t len);
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_TABLE
+uint16_t modbus_crc16_table(uint16_t crc, const uint8_t* data, size_t len);
+#endif
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_SLICING_4
+uint16_t modbus_crc16_slicing_4(uint16_t crc, const uint8_t* data, size_t len);
+#endif
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_SLICING_8
+uint16_t modbus_crc16_slicing_8(uint16_t crc, const uint8_t* data, size_t len);
+#endif
+/* char_bits counts start, data, parity and stop bits: 11 for 8E1 and 8N2, 10 for 8N1 */
+void modbus_rtu_framer_init(modbus_rtu_framer_t* framer, uint32_t baud_rate, uint8_t char_bits);
+/* count bytes received back to back, the last one at now_us: END_BYTES ends the open frame before them, DISCARD drops them */
+modbus_rtu_frame_event_t modbus_rtu_framer_bytes(modbus_rtu_framer_t* framer, uint32_t now_us, size_t count);
+/* True once when the open frame ended, now_us is at least the deadline */
+bool     modbus_rtu_framer_poll(modbus_rtu_framer_t* framer, uint32_t now_us);
+/* The time a timer can be armed for to close the open frame at the t3.5 silence */
+uint32_t modbus_rtu_framer_get_deadline(const modbus_rtu_framer_t* framer);
+void modbus_bits_copy(uint8_t* dst, uint32_t dst_bit, const uint8_t* src, uint32_t src_bit, uint32_t count);
+
+#if MODBUS_CRC16_HW
+bool     modbus_crc16_hw_available(void);
+uint16_t modbus_crc16_clmul(uint16_t crc, const uint8_t* data, size_t len);
+#endif
 
 
 #ifdef __cplusplus
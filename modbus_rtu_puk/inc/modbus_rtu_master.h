@@ -11,19 +11,51 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "modbus_rtu_base.h"
 
 
+/* The largest request the master builds: a read/write multiple registers request with a full data buffer */
+#define MODBUS_MASTER_REQUEST_MESSAGE_SIZE     (4 + SPECIAL_DATA_READ_WRITE_META_COUNT + MODBUS_MASTER_MESSAGE_DATA_SIZE + 2)
+
+/* Requests waiting for the line while one is in flight, and the largest frame one of them can hold */
+#ifndef MODBUS_MASTER_QUEUE_SIZE
+#   if defined(SDCC) || defined(__SDCC)
+#       define MODBUS_MASTER_QUEUE_SIZE        (2)
+#   else
+#       define MODBUS_MASTER_QUEUE_SIZE        (8)
+#   endif
+#endif
+#ifndef MODBUS_MASTER_QUEUE_FRAME_SIZE
+#   define MODBUS_MASTER_QUEUE_FRAME_SIZE      MODBUS_MASTER_REQUEST_MESSAGE_SIZE
+#endif
+
+/* The most a single read or write request may carry */
+#define MODBUS_READ_REGISTERS_MAX              (125)
+#define MODBUS_READ_COILS_MAX                  (2000)
+#define MODBUS_WRITE_REGISTERS_MAX             (123)
+#define MODBUS_WRITE_COILS_MAX                 (1968)
+
+
 typedef enum _modbus_error_response_t {
 	MODBUS_NO_ERROR       = (uint8_t)0x00,
 	MODBUS_ERROR_COMMAND  = (uint8_t)0x01,
 	MODBUS_ERROR_REG_ADDR = (uint8_t)0x02,
 	MODBUS_ERROR_DATA     = (uint8_t)0x03,
-	MODBUS_ERROR_CRC      = (uint8_t)0x04
+	MODBUS_ERROR_CRC      = (uint8_t)0x04,
+	MODBUS_ERROR_TIMEOUT  = (uint8_t)0x05
 } modbus_error_response_t;
 
 
+/* Queued requests are sent in this order, first come first served within a priority */
+typedef enum _modbus_master_priority_t {
+	MODBUS_PRIORITY_URGENT  = (uint8_t)0x00,
+	MODBUS_PRIORITY_NORMAL  = (uint8_t)0x01,
+	MODBUS_PRIORITY_ROUTINE = (uint8_t)0x02
+} modbus_master_priority_t;
+
+
 typedef struct _modbus_response_t {
 	modbus_error_response_t status;
 	uint8_t slave_id;
@@ -32,27 +64,134 @@ typedef struct _modbus_response_t {
 } modbus_response_t;
 
 
+/* A file read or written as a sequence of maximum-size requests */
+typedef struct _modbus_master_file_transfer_t {
+	void (*complete_handler) (void*, modbus_error_response_t, uint16_t);
+	uint16_t* destination;
+	const uint16_t* source;
+	uint16_t file_number;
+	uint16_t record_number;
+	uint16_t records_count;
+	uint16_t records_done;
+	uint16_t chunk_records;
+	modbus_error_response_t status;
+	uint8_t slave_id;
+	bool answered;
+} modbus_master_file_transfer_t;
+
+
+/* A held write waits for a flush, combined_command is the single write a combined frame was built from */
+typedef struct _modbus_master_transaction_t {
+	uint8_t  frame[MODBUS_MASTER_QUEUE_FRAME_SIZE];
+	uint16_t len;
+	modbus_master_priority_t priority;
+	uint32_t queued_us;
+	bool     held;
+	uint8_t  combined_command;
+} modbus_master_transaction_t;
+
+
+/* Wait times are measured with the clock of modbus_master_set_clock_r(), zero without one */
+typedef struct _modbus_master_queue_stats_t {
+	uint8_t  depth;
+	uint8_t  depth_max;
+	uint32_t queued;
+	uint32_t dispatched;
+	uint32_t dropped;
+	uint32_t combined;
+	uint32_t wait_us_total;
+	uint32_t wait_us_max;
+} modbus_master_queue_stats_t;
+
+
+/* Free transactions have a zero length, order lists the waiting ones */
+typedef struct _modbus_master_queue_t {
+	modbus_master_transaction_t transactions[MODBUS_MASTER_QUEUE_SIZE];
+	uint8_t order[MODBUS_MASTER_QUEUE_SIZE];
+	uint8_t count;
+	modbus_master_queue_stats_t stats;
+} modbus_master_queue_t;
+
+
+/* A periodic read of the poll list, released every period_us and due by its next release.
+   The scheduler fields are reset by modbus_master_set_poll_list_r(), jitter is the delay from release to send,
+   coalesced marks the entries of a merged read in flight */
+typedef struct _modbus_master_poll_t {
+	uint8_t  slave_id;
+	modbus_command_t command;
+	uint16_t reg_addr;
+	uint16_t reg_count;
+	uint32_t period_us;
+
+	uint32_t release_us;
+	uint32_t polls;
+	uint32_t errors;
+	uint32_t missed;
+	uint32_t jitter_us_total;
+	uint32_t jitter_us_max;
+	bool     coalesced;
+} modbus_master_poll_t;
+
+
 typedef struct _modbus_master_state_t {
-	void (*request_data_sender) (uint8_t*, uint32_t);
-	void (*response_byte_handler) (uint8_t);
-	void (*response_packet_handler) (modbus_response_t*);
-	void (*internal_error_handler) (void);
+	void* user_context;
+	void (*request_data_sender) (void*, uint8_t*, uint32_t);
+	void (*response_byte_handler) (struct _modbus_master_state_t*, uint8_t);
+	void (*response_packet_handler) (void*, modbus_response_t*);
+	void (*internal_error_handler) (void*);
+	uint32_t (*clock_us) (void*);
 	uint8_t data_counter;
+	uint16_t turnaround_delay;
+	/* Frame boundaries of the timestamped receive functions */
+	modbus_rtu_framer_t framer;
+	modbus_master_priority_t next_priority;
+	modbus_master_queue_t queue;
+	bool combine_writes;
+	/* Copy of the combined frame in flight, its length is zero otherwise */
+	modbus_master_transaction_t combined;
+	modbus_master_poll_t* polls;
+	uint8_t polls_count;
+	bool coalesce_reads;
+	uint16_t coalesce_gap;
+	/* The poll being sent and the one in flight, NULL for other requests */
+	modbus_master_poll_t* poll_pending;
+	modbus_master_poll_t* poll_active;
+	modbus_master_file_transfer_t file_transfer;
 	modbus_request_message_t data_req;
 	modbus_response_message_t data_resp;
 
 	uint16_t response_bytes_len;
+	uint16_t response_crc;
 	uint8_t special_data[MODBUS_MASTER_MESSAGE_DATA_SIZE];
 	uint8_t response_bytes[MODBUS_MASTER_RESPONSE_MESSAGE_SIZE];
 } modbus_master_state_t;
 
+typedef modbus_master_state_t modbus_master_t;
+
 
 void modbus_master_set_request_data_sender(void (*request_data_sender) (uint8_t*, uint32_t));
 void modbus_master_set_internal_error_handler(void (*response_error_handler) (void));
 void modbus_master_set_response_packet_handler(void (*response_packet_handler) (modbus_response_t*));
 
 void modbus_master_recieve_data_byte(uint8_t byte);
+size_t modbus_master_receive_buffer(const uint8_t* data, size_t len);
 void modbus_master_timeout(void);
+void modbus_master_set_turnaround_delay(uint16_t delay);
+uint16_t modbus_master_get_wait_time(uint16_t response_timeout);
+void modbus_master_set_framing(uint32_t baud_rate, uint8_t char_bits);
+void modbus_master_recieve_data_byte_at(uint8_t byte, uint32_t now_us);
+void modbus_master_receive_buffer_at(const uint8_t* data, size_t len, uint32_t now_us);
+void modbus_master_poll(uint32_t now_us);
+void modbus_master_set_priority(modbus_master_priority_t priority);
+void modbus_master_set_clock(uint32_t (*clock_us) (void));
+void modbus_master_get_queue_stats(modbus_master_queue_stats_t* stats);
+void modbus_master_reset_queue_stats(void);
+bool modbus_master_set_poll_list(modbus_master_poll_t* polls, uint8_t polls_count);
+uint32_t modbus_master_run_poll_list(void);
+const modbus_master_poll_t* modbus_master_get_active_poll(void);
+void modbus_master_set_read_coalescing(bool enabled, uint16_t gap);
+void modbus_master_set_write_combining(bool enabled);
+void modbus_master_flush_writes(void);
 
 void modbus_master_read_coils(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count);
 void modbus_master_read_input_status(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count);
@@ -62,6 +201,74 @@ void modbus_master_force_single_coil(uint8_t slave_id, uint16_t reg_addr, uint16
 void modbus_master_preset_single_register(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_val);
 void modbus_master_force_multiple_coils(uint8_t slave_id, uint16_t reg_addr, const bool* data, uint16_t reg_count);
 void modbus_master_preset_multiple_registers(uint8_t slave_id, uint16_t reg_addr, const uint16_t* data, uint16_t reg_count);
+void modbus_master_mask_write_register(uint8_t slave_id, uint16_t reg_addr, uint16_t and_mask, uint16_t or_mask);
+void modbus_master_read_file_record(uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t record_count);
+void modbus_master_write_file_record(uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count);
+void modbus_master_read_file(uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t* data, uint16_t record_count, void (*complete_handler) (modbus_error_response_t, uint16_t));
+void modbus_master_write_file(uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count, void (*complete_handler) (modbus_error_response_t, uint16_t));
+void modbus_master_read_write_multiple_registers(uint8_t slave_id, uint16_t read_addr, uint16_t read_count, uint16_t write_addr, const uint16_t* data, uint16_t write_count);
+
+/* Re-entrant API: independent instances may be driven from separate threads */
+void modbus_master_init(modbus_master_t* master, void* user_context);
+void modbus_master_set_request_data_sender_r(modbus_master_t* master, void (*request_data_sender) (void*, uint8_t*, uint32_t));
+void modbus_master_set_internal_error_handler_r(modbus_master_t* master, void (*response_error_handler) (void*));
+void modbus_master_set_response_packet_handler_r(modbus_master_t* master, void (*response_packet_handler) (void*, modbus_response_t*));
+
+void modbus_master_recieve_data_byte_r(modbus_master_t* master, uint8_t byte);
+size_t modbus_master_receive_buffer_r(modbus_master_t* master, const uint8_t* data, size_t len);
+void modbus_master_timeout_r(modbus_master_t* master);
+/* Writes to MODBUS_BROADCAST_ID get no response: the timer is armed with the turnaround delay instead of the response timeout,
+   and modbus_master_timeout_r() then passes a MODBUS_NO_ERROR packet from slave 0 to the response packet handler */
+void modbus_master_set_turnaround_delay_r(modbus_master_t* master, uint16_t delay);
+/* The time to arm the timer with after a request: the turnaround delay after a broadcast, response_timeout otherwise */
+uint16_t modbus_master_get_wait_time_r(modbus_master_t* master, uint16_t response_timeout);
+/* Framing from a monotonic microsecond clock, 19200 baud 8E1 by default: a response cut short by a t3.5 silence
+   or broken by a t1.5 silence ends like modbus_master_timeout_r(), the response timeout is still the application's */
+void modbus_master_set_framing_r(modbus_master_t* master, uint32_t baud_rate, uint8_t char_bits);
+void modbus_master_recieve_data_byte_at_r(modbus_master_t* master, uint8_t byte, uint32_t now_us);
+/* The bytes arrived back to back, the last one at now_us, all of them are consumed */
+void modbus_master_receive_buffer_at_r(modbus_master_t* master, const uint8_t* data, size_t len, uint32_t now_us);
+void modbus_master_poll_r(modbus_master_t* master, uint32_t now_us);
+/* A request made while another one is in flight waits in the queue and is sent after its response or timeout.
+   The priority applies to the next request only, NORMAL otherwise, a full queue refuses the request
+   unless it can drop a less urgent one, both call the internal error handler */
+void modbus_master_set_priority_r(modbus_master_t* master, modbus_master_priority_t priority);
+/* Monotonic microseconds for the wait time statistics */
+void modbus_master_set_clock_r(modbus_master_t* master, uint32_t (*clock_us) (void*));
+void modbus_master_get_queue_stats_r(modbus_master_t* master, modbus_master_queue_stats_t* stats);
+void modbus_master_reset_queue_stats_r(modbus_master_t* master);
+/* Periodic reads sent earliest deadline first whenever the line is idle and the queue is empty, after each response
+   or timeout and from modbus_master_run_poll_list_r(). The clock must be set, the entries stay the caller's */
+bool modbus_master_set_poll_list_r(modbus_master_t* master, modbus_master_poll_t* polls, uint8_t polls_count);
+/* Sends the most urgent due poll if the line is idle, returns the earliest release to arm a timer with */
+uint32_t modbus_master_run_poll_list_r(modbus_master_t* master);
+/* The poll entry of the response being handled, NULL for other requests */
+const modbus_master_poll_t* modbus_master_get_active_poll_r(modbus_master_t* master);
+/* Due polls of one slave and function whose ranges overlap or lie at most gap registers apart are read with one request,
+   up to MODBUS_READ_REGISTERS_MAX registers or MODBUS_READ_COILS_MAX coils and the master's register counts.
+   The response packet handler still gets a packet per entry, with modbus_master_get_active_poll_r() pointing at it */
+void modbus_master_set_read_coalescing_r(modbus_master_t* master, bool enabled, uint16_t gap);
+/* Single writes are held in the queue until modbus_master_flush_writes_r() or any other request, which goes after them.
+   A write continuing the held one before it on the same slave joins its frame as FC 0x10 or 0x0F,
+   and the response packet handler still gets the response of each single write, in order */
+void modbus_master_set_write_combining_r(modbus_master_t* master, bool enabled);
+void modbus_master_flush_writes_r(modbus_master_t* master);
+
+void modbus_master_read_coils_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count);
+void modbus_master_read_input_status_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count);
+void modbus_master_read_holding_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count);
+void modbus_master_read_input_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count);
+void modbus_master_force_single_coil_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_val);
+void modbus_master_preset_single_register_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_val);
+void modbus_master_force_multiple_coils_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, const bool* data, uint16_t reg_count);
+void modbus_master_preset_multiple_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, const uint16_t* data, uint16_t reg_count);
+void modbus_master_mask_write_register_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t and_mask, uint16_t or_mask);
+void modbus_master_read_file_record_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t record_count);
+void modbus_master_write_file_record_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count);
+/* Streams record_count records, the next request is sent from the response path, complete_handler gets the status and the records done */
+void modbus_master_read_file_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t* data, uint16_t record_count, void (*complete_handler) (void*, modbus_error_response_t, uint16_t));
+void modbus_master_write_file_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count, void (*complete_handler) (void*, modbus_error_response_t, uint16_t));
+void modbus_master_read_write_multiple_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t read_addr, uint16_t read_count, uint16_t write_addr, const uint16_t* data, uint16_t write_count);
 
 
 #ifdef __cplusplus
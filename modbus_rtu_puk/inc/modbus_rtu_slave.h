@@ -11,35 +11,174 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "modbus_rtu_base.h"
 
 
+#define MODBUS_SLAVE_REGISTER_TYPES (4)
+/* Entries of a unit table, one per slave id */
+#define MODBUS_SLAVE_UNITS_COUNT    (256)
+
+/* Coalesced ranges written by masters, kept until consumed */
+#ifndef MODBUS_SLAVE_DIRTY_RANGES
+#   define MODBUS_SLAVE_DIRTY_RANGES (8)
+#endif
+
+
+/* Bumped once per publication, one byte is a single store on 8-bit targets */
+#if defined(SDCC) || defined(__SDCC)
+typedef uint8_t  modbus_slave_sequence_t;
+#else
+typedef uint32_t modbus_slave_sequence_t;
+#endif
+
+
+/* Two copies of a segment storage, buffers[sequence & 1] is the published one */
+typedef struct _modbus_slave_snapshot_t {
+    void*     buffers[2];
+    uint16_t  size;
+    volatile modbus_slave_sequence_t sequence;
+} modbus_slave_snapshot_t;
+
+
+/* A run of addresses from base, storage[0] holds the register at base (packed bits for coils) */
+typedef struct _modbus_slave_segment_t {
+    uint16_t  base;
+    uint16_t  count;
+    void*     storage;
+    /* Optional, called before a read request copies registers [register_id, register_id + count) of this segment */
+    void (*read_handler) (void*, register_type_t, uint16_t, uint16_t);
+    /* Optional, replaces storage with the published buffer of a snapshot, the segment is read-only then */
+    modbus_slave_snapshot_t* snapshot;
+} modbus_slave_segment_t;
+
+
+typedef struct _modbus_slave_range_t {
+    register_type_t register_type;
+    uint16_t        register_id;
+    uint16_t        count;
+} modbus_slave_range_t;
+
+
+typedef struct _modbus_slave_registers_t {
+    /* Coils are packed bits, MODBUS_COILS_BYTES(count) bytes */
+    uint8_t*  discrete_output_coils;
+    uint16_t  discrete_output_coils_count;
+    uint8_t*  discrete_input_coils;
+    uint16_t  discrete_input_coils_count;
+    uint16_t* analog_input_registers;
+    uint16_t  analog_input_registers_count;
+    uint16_t* analog_output_holding_registers;
+    uint16_t  analog_output_holding_registers_count;
+    /* Analog registers hold big-endian (wire order) bytes, reads and writes are plain copies */
+    bool      registers_wire_order;
+} modbus_slave_registers_t;
+
+
 typedef struct _modbus_slave_state_t {
     uint8_t slave_id;
-    void (*response_data_handler) (uint8_t*, uint32_t);
-    void (*request_byte_handler) (uint8_t);
-    void (*internal_error_handler) (void);
+    void* user_context;
+    void (*response_data_handler) (void*, uint8_t*, uint32_t);
+    void (*request_byte_handler) (struct _modbus_slave_state_t*, uint8_t);
+    void (*internal_error_handler) (void*);
+    uint8_t* (*tx_buffer_provider) (void*, uint32_t);
+    void (*tx_buffer_commit) (void*, uint8_t*, uint32_t);
+    void (*write_handler) (void*, register_type_t, uint16_t, uint16_t);
+    bool (*file_read_handler) (void*, uint16_t, uint16_t, uint16_t, uint8_t*);
+    bool (*file_write_handler) (void*, uint16_t, uint16_t, uint16_t, const uint8_t*);
+    /* A port with a unit table passes each frame to the slave of its id instead of serving it */
+    struct _modbus_slave_state_t* const* units;
+    struct _modbus_slave_state_t* unit;
+    bool unit_broadcast;
+    /* Bytes left to the nearer possible end of a frame for another slave, and from there to the other one */
+    uint16_t skip_bytes;
+    uint16_t skip_next;
+    /* Frame boundaries of the timestamped receive functions */
+    modbus_rtu_framer_t framer;
+    modbus_slave_registers_t registers;
+    const modbus_slave_segment_t* segments[MODBUS_SLAVE_REGISTER_TYPES];
+    uint16_t segments_count[MODBUS_SLAVE_REGISTER_TYPES];
+    modbus_slave_segment_t dense_segments[MODBUS_SLAVE_REGISTER_TYPES];
+    /* Writes fill dirty_ranges[dirty_active], the consumer drains the other list, then switches */
+    modbus_slave_range_t dirty_ranges[2][MODBUS_SLAVE_DIRTY_RANGES];
+    uint8_t dirty_ranges_count[2];
+    volatile uint8_t dirty_active;
+    /* Odd while a write updates the active list, and the odd value seen by the last switch */
+    volatile modbus_slave_sequence_t dirty_sequence;
+    modbus_slave_sequence_t dirty_switch_sequence;
     modbus_request_message_t data_req;
     uint8_t data_handler_counter;
     modbus_response_message_t data_resp;
     bool is_error_response;
     
     uint16_t req_data_bytes_idx;
+    uint16_t req_crc;
     uint8_t special_data[MODBUS_SLAVE_MESSAGE_DATA_SIZE];
     uint8_t req_data_bytes[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE];
 } modbus_slave_state_t;
 
+typedef modbus_slave_state_t modbus_slave_t;
+
 
 void modbus_slave_set_response_data_handler(void (*response_data_handler) (uint8_t*, uint32_t));
 void modbus_slave_set_internal_error_handler(void (*request_error_handler) (void));
+void modbus_slave_set_tx_buffer_handlers(uint8_t* (*tx_buffer_provider) (uint32_t), void (*tx_buffer_commit) (uint8_t*, uint32_t));
+void modbus_slave_set_write_handler(void (*write_handler) (register_type_t, uint16_t, uint16_t));
+void modbus_slave_set_file_record_handlers(bool (*file_read_handler) (uint16_t, uint16_t, uint16_t, uint8_t*), bool (*file_write_handler) (uint16_t, uint16_t, uint16_t, const uint8_t*));
+void modbus_slave_set_units(modbus_slave_t* const* units);
 void modbus_slave_recieve_data_byte(uint8_t byte);
+size_t modbus_slave_receive_buffer(const uint8_t* data, size_t len);
 void modbus_slave_set_slave_id(uint8_t new_slave_id);
 void modbus_slave_timeout(void);
+void modbus_slave_set_framing(uint32_t baud_rate, uint8_t char_bits);
+void modbus_slave_recieve_data_byte_at(uint8_t byte, uint32_t now_us);
+void modbus_slave_receive_buffer_at(const uint8_t* data, size_t len, uint32_t now_us);
+void modbus_slave_poll(uint32_t now_us);
 void modbus_slave_clear_data(void);
 
 uint16_t modbus_slave_get_register_value(register_type_t register_type, uint16_t register_id);
 void     modbus_slave_set_register_value(register_type_t register_type, uint16_t register_id, uint16_t value);
+bool     modbus_slave_get_coils(register_type_t register_type, uint16_t start_id, uint16_t count, uint8_t* bits);
+bool     modbus_slave_set_coils(register_type_t register_type, uint16_t start_id, uint16_t count, const uint8_t* bits);
+bool     modbus_slave_set_segments(register_type_t register_type, const modbus_slave_segment_t* segments, uint16_t segments_count);
+uint8_t  modbus_slave_consume_dirty_ranges(modbus_slave_range_t* ranges, uint8_t max_count);
+
+/* Lock-free publication of a segment, one writer per snapshot */
+void     modbus_slave_snapshot_init(modbus_slave_snapshot_t* snapshot, void* front, void* back, uint16_t size);
+void*    modbus_slave_snapshot_begin(modbus_slave_snapshot_t* snapshot);
+void     modbus_slave_snapshot_publish(modbus_slave_snapshot_t* snapshot);
+
+/* Re-entrant API: every instance owns its state, register storage is provided by the caller */
+void modbus_slave_init(modbus_slave_t* slave, const modbus_slave_registers_t* registers, void* user_context);
+void modbus_slave_set_response_data_handler_r(modbus_slave_t* slave, void (*response_data_handler) (void*, uint8_t*, uint32_t));
+void modbus_slave_set_internal_error_handler_r(modbus_slave_t* slave, void (*request_error_handler) (void*));
+void modbus_slave_set_tx_buffer_handlers_r(modbus_slave_t* slave, uint8_t* (*tx_buffer_provider) (void*, uint32_t), void (*tx_buffer_commit) (void*, uint8_t*, uint32_t));
+void modbus_slave_set_write_handler_r(modbus_slave_t* slave, void (*write_handler) (void*, register_type_t, uint16_t, uint16_t));
+/* Record store of function 0x14/0x15: count records of a file from record_number, big-endian in data, false for a missing file or record */
+void modbus_slave_set_file_record_handlers_r(modbus_slave_t* slave, bool (*file_read_handler) (void*, uint16_t, uint16_t, uint16_t, uint8_t*), bool (*file_write_handler) (void*, uint16_t, uint16_t, uint16_t, const uint8_t*));
+/* units[slave_id] is the instance answering for slave_id or NULL, a unit is listed once, the table can be const */
+void modbus_slave_set_units_r(modbus_slave_t* slave, modbus_slave_t* const* units);
+void modbus_slave_recieve_data_byte_r(modbus_slave_t* slave, uint8_t byte);
+size_t modbus_slave_receive_buffer_r(modbus_slave_t* slave, const uint8_t* data, size_t len);
+void modbus_slave_set_slave_id_r(modbus_slave_t* slave, uint8_t new_slave_id);
+void modbus_slave_timeout_r(modbus_slave_t* slave);
+/* Framing from a monotonic microsecond clock instead of modbus_slave_timeout_r(), 19200 baud 8E1 by default */
+void modbus_slave_set_framing_r(modbus_slave_t* slave, uint32_t baud_rate, uint8_t char_bits);
+void modbus_slave_recieve_data_byte_at_r(modbus_slave_t* slave, uint8_t byte, uint32_t now_us);
+/* The bytes arrived back to back, the last one at now_us, all of them are consumed */
+void modbus_slave_receive_buffer_at_r(modbus_slave_t* slave, const uint8_t* data, size_t len, uint32_t now_us);
+/* Ends the frame once the line was silent for t3.5, called from a timer or the idle loop */
+void modbus_slave_poll_r(modbus_slave_t* slave, uint32_t now_us);
+void modbus_slave_clear_data_r(modbus_slave_t* slave);
+
+uint16_t modbus_slave_get_register_value_r(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id);
+void     modbus_slave_set_register_value_r(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t value);
+bool     modbus_slave_get_coils_r(modbus_slave_t* slave, register_type_t register_type, uint16_t start_id, uint16_t count, uint8_t* bits);
+bool     modbus_slave_set_coils_r(modbus_slave_t* slave, register_type_t register_type, uint16_t start_id, uint16_t count, const uint8_t* bits);
+bool     modbus_slave_set_segments_r(modbus_slave_t* slave, register_type_t register_type, const modbus_slave_segment_t* segments, uint16_t segments_count);
+/* Lock-free against the receive calls, one consumer per slave */
+uint8_t  modbus_slave_consume_dirty_ranges_r(modbus_slave_t* slave, modbus_slave_range_t* ranges, uint8_t max_count);
 
 
 #ifdef __cplusplus
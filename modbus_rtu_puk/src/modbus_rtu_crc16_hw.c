@@ -0,0 +1,127 @@
+/* Copyright © 2023 Georgy E. All rights reserved. */
+
+#include "modbus_rtu_base.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#if MODBUS_CRC16_HW
+
+#   include <cpuid.h>
+#   include <immintrin.h>
+
+
+/*
+ * Folding constants: x^(n-1) mod 0x8005, bit-reflected into the top 16 bits of a
+ * 64-bit lane. The extra x^-1 absorbs the one bit shift of a reflected carry-less
+ * multiplication. Folding keeps a 128-bit remainder that is congruent to the data
+ * consumed so far, the last 16 bytes and the tail are finished by the table engine.
+ */
+#define MB_CRC16_K_576 ((uint64_t)0xC450000000000000ULL)
+#define MB_CRC16_K_512 ((uint64_t)0x8101000000000000ULL)
+#define MB_CRC16_K_448 ((uint64_t)0xAAA4000000000000ULL)
+#define MB_CRC16_K_384 ((uint64_t)0xAC91000000000000ULL)
+#define MB_CRC16_K_320 ((uint64_t)0xC991000000000000ULL)
+#define MB_CRC16_K_256 ((uint64_t)0x5001000000000000ULL)
+#define MB_CRC16_K_192 ((uint64_t)0xCCD0000000000000ULL)
+#define MB_CRC16_K_128 ((uint64_t)0xC100000000000000ULL)
+
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_TABLE
+#   define MB_CRC16_HW_TAIL     modbus_crc16_table
+#else
+#   define MB_CRC16_HW_TAIL     modbus_crc16_bitwise
+#endif
+
+#define MB_CRC16_HW_UNKNOWN     (0)
+#define MB_CRC16_HW_PRESENT     (1)
+#define MB_CRC16_HW_ABSENT      (2)
+
+
+static int _mb_crc16_hw_state = MB_CRC16_HW_UNKNOWN;
+
+
+static bool _mb_crc16_hw_detect(void);
+
+
+bool modbus_crc16_hw_available(void)
+{
+	int state = __atomic_load_n(&_mb_crc16_hw_state, __ATOMIC_RELAXED);
+	if (state == MB_CRC16_HW_UNKNOWN) {
+		state = _mb_crc16_hw_detect() ? MB_CRC16_HW_PRESENT : MB_CRC16_HW_ABSENT;
+		__atomic_store_n(&_mb_crc16_hw_state, state, __ATOMIC_RELAXED);
+	}
+	return state == MB_CRC16_HW_PRESENT;
+}
+
+
+static bool _mb_crc16_hw_detect(void)
+{
+	unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+	return (ecx & bit_PCLMUL) != 0;
+}
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i _mb_crc16_fold(__m128i acc, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x00), _mm_clmulepi64_si128(acc, k, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+uint16_t modbus_crc16_clmul(uint16_t crc, const uint8_t* data, size_t len)
+{
+	if (len < 16) {
+		return MB_CRC16_HW_TAIL(crc, data, len);
+	}
+
+	const __m128i k128 = _mm_set_epi64x((long long)MB_CRC16_K_128, (long long)MB_CRC16_K_192);
+
+	__m128i acc = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data), _mm_cvtsi32_si128(crc));
+
+	if (len >= 64) {
+		const __m128i k512 = _mm_set_epi64x((long long)MB_CRC16_K_512, (long long)MB_CRC16_K_576);
+		const __m128i k384 = _mm_set_epi64x((long long)MB_CRC16_K_384, (long long)MB_CRC16_K_448);
+		const __m128i k256 = _mm_set_epi64x((long long)MB_CRC16_K_256, (long long)MB_CRC16_K_320);
+
+		__m128i acc1 = _mm_loadu_si128((const __m128i*)(data + 16));
+		__m128i acc2 = _mm_loadu_si128((const __m128i*)(data + 32));
+		__m128i acc3 = _mm_loadu_si128((const __m128i*)(data + 48));
+		data += 64;
+		len  -= 64;
+
+		while (len >= 64) {
+			acc  = _mm_xor_si128(_mb_crc16_fold(acc,  k512), _mm_loadu_si128((const __m128i*)data));
+			acc1 = _mm_xor_si128(_mb_crc16_fold(acc1, k512), _mm_loadu_si128((const __m128i*)(data + 16)));
+			acc2 = _mm_xor_si128(_mb_crc16_fold(acc2, k512), _mm_loadu_si128((const __m128i*)(data + 32)));
+			acc3 = _mm_xor_si128(_mb_crc16_fold(acc3, k512), _mm_loadu_si128((const __m128i*)(data + 48)));
+			data += 64;
+			len  -= 64;
+		}
+
+		acc = _mm_xor_si128(
+			_mm_xor_si128(_mb_crc16_fold(acc, k384), _mb_crc16_fold(acc1, k256)),
+			_mm_xor_si128(_mb_crc16_fold(acc2, k128), acc3)
+		);
+	} else {
+		data += 16;
+		len  -= 16;
+	}
+
+	while (len >= 16) {
+		acc = _mm_xor_si128(_mb_crc16_fold(acc, k128), _mm_loadu_si128((const __m128i*)data));
+		data += 16;
+		len  -= 16;
+	}
+
+	uint8_t remainder[16];
+	_mm_storeu_si128((__m128i*)remainder, acc);
+
+	crc = MB_CRC16_HW_TAIL(0, remainder, sizeof(remainder));
+	return MB_CRC16_HW_TAIL(crc, data, len);
+}
+
+#endif
@@ -11,51 +11,117 @@
 #include "modbus_rtu_base.h"
 
 
-void _mb_ms_send_simple_message(uint8_t slave_id, uint8_t command, uint16_t reg_addr, uint16_t spec_data);
-
-void _mb_ms_do_internal_error(void);
-void _mb_ms_reset_data(void);
-
-void _mb_ms_fsm_response_slave_id(uint8_t byte);
-void _mb_ms_fsm_response_command(uint8_t byte);
-void _mb_ms_fsm_response_data_len(uint8_t byte);
-void _mb_ms_fsm_response_register_addr(uint8_t byte);
-void _mb_ms_fsm_response_special_data(uint8_t byte);
-void _mb_ms_fsm_response_error(uint8_t byte);
-void _mb_ms_fsm_response_crc(uint8_t byte);
-
-void _mb_ms_response_proccess(void);
-
-uint16_t _mb_ms_get_response_bytes_count(void);
-uint16_t _mb_ms_get_registers_count(register_type_t register_type);
-
-bool _mb_ms_is_read_command(void);
-bool _mb_ms_is_write_single_reg_command(void);
-bool _mb_ms_is_write_multiple_reg_command(void);
-bool _mb_ms_is_read_discrete_reg_command(void);
-bool _mb_ms_is_read_analog_reg_command(void);
-bool _mb_ms_is_recieved_needed_slave_id(void);
-bool _mb_ms_check_response_command(void);
-bool _mb_ms_check_response_crc(void);
-
-void _mb_ms_make_read_discrete_packet(modbus_response_t* packet);
-void _mb_ms_make_read_analog_packet(modbus_response_t* packet);
-void _mb_ms_make_write_packet(modbus_response_t* packet);
-
-register_type_t _mb_ms_get_request_register_type();
-
+void _mb_ms_send_simple_message(modbus_master_t* master, uint8_t slave_id, uint8_t command, uint16_t reg_addr, uint16_t spec_data);
+void _mb_ms_send_request(modbus_master_t* master, uint8_t* request, uint32_t len);
+void _mb_ms_transmit(modbus_master_t* master, uint8_t* request, uint32_t len);
+void _mb_ms_queue_push(modbus_master_t* master, const uint8_t* request, uint32_t len, modbus_master_priority_t priority, bool held);
+void _mb_ms_queue_dispatch(modbus_master_t* master);
+bool _mb_ms_queue_combine(modbus_master_t* master, const uint8_t* request, modbus_master_priority_t priority);
+void _mb_ms_queue_seal(modbus_master_t* master);
+void _mb_ms_combined_fan_out(modbus_master_t* master, modbus_response_t* packet);
+uint16_t _mb_ms_get_combined_value(const modbus_master_transaction_t* transaction, uint16_t idx);
+void _mb_ms_poll_list_dispatch(modbus_master_t* master);
+void _mb_ms_poll_release(modbus_master_poll_t* poll, uint32_t now_us);
+uint16_t _mb_ms_poll_coalesce(modbus_master_t* master, modbus_master_poll_t* next, uint32_t now_us, uint16_t* reg_addr);
+uint16_t _mb_ms_get_read_limit(modbus_master_t* master, uint8_t command);
+void _mb_ms_poll_count_error(modbus_master_t* master);
+void _mb_ms_poll_fan_out(modbus_master_t* master, modbus_response_t* packet);
+void _mb_ms_dispatch_next(modbus_master_t* master);
+void _mb_ms_send_file_request(modbus_master_t* master, uint8_t slave_id, uint8_t command, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count);
+uint16_t _mb_ms_get_file_records_max(modbus_master_t* master, uint8_t command);
+
+void _mb_ms_file_transfer_start(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t* destination, const uint16_t* source, uint16_t record_count, void (*complete_handler) (void*, modbus_error_response_t, uint16_t));
+void _mb_ms_file_transfer_send(modbus_master_t* master);
+void _mb_ms_file_transfer_response(modbus_master_t* master, modbus_response_t* packet);
+void _mb_ms_file_transfer_continue(modbus_master_t* master);
+void _mb_ms_file_transfer_finish(modbus_master_t* master, modbus_error_response_t status);
+
+void _mb_ms_do_internal_error(modbus_master_t* master);
+void _mb_ms_reject_request(modbus_master_t* master);
+void _mb_ms_reset_data(modbus_master_t* master);
+
+void _mb_ms_fsm_response_slave_id(modbus_master_t* master, uint8_t byte);
+void _mb_ms_fsm_response_command(modbus_master_t* master, uint8_t byte);
+void _mb_ms_fsm_response_data_len(modbus_master_t* master, uint8_t byte);
+void _mb_ms_fsm_response_register_addr(modbus_master_t* master, uint8_t byte);
+void _mb_ms_fsm_response_special_data(modbus_master_t* master, uint8_t byte);
+void _mb_ms_fsm_response_error(modbus_master_t* master, uint8_t byte);
+void _mb_ms_fsm_response_crc(modbus_master_t* master, uint8_t byte);
+
+void _mb_ms_response_proccess(modbus_master_t* master);
+
+bool _mb_ms_framer_accept(modbus_master_t* master, uint32_t now_us, size_t count);
+void _mb_ms_frame_end(modbus_master_t* master);
+
+size_t _mb_ms_get_payload_span(modbus_master_t* master, size_t len);
+void _mb_ms_receive_payload(modbus_master_t* master, const uint8_t* data, size_t len);
+
+uint16_t _mb_ms_get_response_bytes_count(modbus_master_t* master);
+uint16_t _mb_ms_get_registers_count(modbus_master_t* master, register_type_t register_type);
+
+bool _mb_ms_is_read_command(modbus_master_t* master);
+bool _mb_ms_is_write_single_reg_command(modbus_master_t* master);
+bool _mb_ms_is_write_multiple_reg_command(modbus_master_t* master);
+bool _mb_ms_is_mask_write_command(modbus_master_t* master);
+bool _mb_ms_is_file_command(modbus_master_t* master);
+bool _mb_ms_is_read_discrete_reg_command(modbus_master_t* master);
+bool _mb_ms_is_read_analog_reg_command(modbus_master_t* master);
+bool _mb_ms_is_recieved_needed_slave_id(modbus_master_t* master);
+bool _mb_ms_is_broadcast_pending(modbus_master_t* master);
+bool _mb_ms_check_request_slave_id(uint8_t slave_id, uint8_t command);
+bool _mb_ms_is_busy(modbus_master_t* master);
+bool _mb_ms_is_combinable_write(const uint8_t* request);
+bool _mb_ms_check_response_command(modbus_master_t* master);
+bool _mb_ms_check_response_crc(modbus_master_t* master);
+
+void _mb_ms_make_read_discrete_packet(modbus_master_t* master, modbus_response_t* packet);
+void _mb_ms_make_read_analog_packet(modbus_master_t* master, modbus_response_t* packet);
+void _mb_ms_make_write_packet(modbus_master_t* master, modbus_response_t* packet);
+void _mb_ms_make_file_packet(modbus_master_t* master, modbus_response_t* packet);
+
+register_type_t _mb_ms_get_request_register_type(modbus_master_t* master);
+
+
+void _mb_ms_legacy_request_data_sender(void* user_context, uint8_t* data, uint32_t len);
+void _mb_ms_legacy_response_packet_handler(void* user_context, modbus_response_t* packet);
+void _mb_ms_legacy_internal_error_handler(void* user_context);
+void _mb_ms_legacy_file_complete_handler(void* user_context, modbus_error_response_t status, uint16_t records_done);
+uint32_t _mb_ms_legacy_clock(void* user_context);
+
+
+void (*mb_master_legacy_request_data_sender) (uint8_t*, uint32_t) = NULL;
+void (*mb_master_legacy_response_packet_handler) (modbus_response_t*) = NULL;
+void (*mb_master_legacy_internal_error_handler) (void) = NULL;
+void (*mb_master_legacy_file_complete_handler) (modbus_error_response_t, uint16_t) = NULL;
+uint32_t (*mb_master_legacy_clock) (void) = NULL;
 
 modbus_master_state_t mb_master_state = {
+	.user_context = NULL,
 	.data_counter = 0,
+	.turnaround_delay = 0,
+	.framer = MODBUS_RTU_FRAMER_INIT(MODBUS_RTU_DEFAULT_BAUD_RATE, MODBUS_RTU_DEFAULT_CHAR_BITS),
+	.next_priority = MODBUS_PRIORITY_NORMAL,
+	.queue = { .count = 0 },
+	.combine_writes = false,
+	.combined = { .len = 0 },
+	.polls = NULL,
+	.polls_count = 0,
+	.coalesce_reads = false,
+	.coalesce_gap = 0,
+	.poll_pending = NULL,
+	.poll_active = NULL,
+	.file_transfer = {0},
 	.request_data_sender = NULL,
 	.response_packet_handler = NULL,
 	.internal_error_handler = NULL,
+	.clock_us = NULL,
 	.response_byte_handler = _mb_ms_fsm_response_slave_id,
 	.data_req = {0},
 	.data_resp = {0},
 	.special_data = {0},
 
 	.response_bytes_len = 0,
+	.response_crc = MODBUS_CRC16_INIT,
 	.response_bytes = {0}
 };
 
@@ -63,491 +129,1599 @@ modbus_master_state_t mb_master_state = {
 void modbus_master_set_request_data_sender(void (*request_data_sender) (uint8_t*, uint32_t))
 {
 	if (request_data_sender != NULL) {
-		mb_master_state.request_data_sender = request_data_sender;
+		mb_master_legacy_request_data_sender = request_data_sender;
+		modbus_master_set_request_data_sender_r(&mb_master_state, _mb_ms_legacy_request_data_sender);
 	}
 }
 
 void modbus_master_set_internal_error_handler(void (*response_error_handler) (void))
 {
 	if (response_error_handler != NULL) {
-		mb_master_state.internal_error_handler = response_error_handler;
+		mb_master_legacy_internal_error_handler = response_error_handler;
+		modbus_master_set_internal_error_handler_r(&mb_master_state, _mb_ms_legacy_internal_error_handler);
 	}
 }
 
 void modbus_master_set_response_packet_handler(void (*response_packet_handler) (modbus_response_t*))
 {
 	if (response_packet_handler == NULL) {
-		_mb_ms_do_internal_error();
+		modbus_master_set_response_packet_handler_r(&mb_master_state, NULL);
 		return;
 	}
 
-	mb_master_state.response_packet_handler = response_packet_handler;
+	mb_master_legacy_response_packet_handler = response_packet_handler;
+	modbus_master_set_response_packet_handler_r(&mb_master_state, _mb_ms_legacy_response_packet_handler);
 }
 
 void modbus_master_recieve_data_byte(uint8_t byte)
 {
-	if (mb_master_state.response_bytes_len > sizeof(mb_master_state.response_bytes)) {
-		_mb_ms_do_internal_error();
-		_mb_ms_reset_data();
-	}
-
-	mb_master_state.response_bytes[mb_master_state.response_bytes_len++] = byte;
+	modbus_master_recieve_data_byte_r(&mb_master_state, byte);
+}
 
-	if (mb_master_state.response_byte_handler != NULL) {
-		mb_master_state.data_counter++;
-		mb_master_state.response_byte_handler(byte);
-	}
-	else {
-		_mb_ms_do_internal_error();
-		_mb_ms_reset_data();
-	}
+size_t modbus_master_receive_buffer(const uint8_t* data, size_t len)
+{
+	return modbus_master_receive_buffer_r(&mb_master_state, data, len);
 }
 
 void modbus_master_timeout(void)
 {
-	_mb_ms_do_internal_error();
-	_mb_ms_reset_data();
+	modbus_master_timeout_r(&mb_master_state);
+}
+
+void modbus_master_set_turnaround_delay(uint16_t delay)
+{
+	modbus_master_set_turnaround_delay_r(&mb_master_state, delay);
+}
+
+uint16_t modbus_master_get_wait_time(uint16_t response_timeout)
+{
+	return modbus_master_get_wait_time_r(&mb_master_state, response_timeout);
+}
+
+void modbus_master_set_framing(uint32_t baud_rate, uint8_t char_bits)
+{
+	modbus_master_set_framing_r(&mb_master_state, baud_rate, char_bits);
+}
+
+void modbus_master_recieve_data_byte_at(uint8_t byte, uint32_t now_us)
+{
+	modbus_master_recieve_data_byte_at_r(&mb_master_state, byte, now_us);
+}
+
+void modbus_master_receive_buffer_at(const uint8_t* data, size_t len, uint32_t now_us)
+{
+	modbus_master_receive_buffer_at_r(&mb_master_state, data, len, now_us);
+}
+
+void modbus_master_poll(uint32_t now_us)
+{
+	modbus_master_poll_r(&mb_master_state, now_us);
+}
+
+void modbus_master_set_priority(modbus_master_priority_t priority)
+{
+	modbus_master_set_priority_r(&mb_master_state, priority);
+}
+
+void modbus_master_set_clock(uint32_t (*clock_us) (void))
+{
+	mb_master_legacy_clock = clock_us;
+	modbus_master_set_clock_r(&mb_master_state, clock_us != NULL ? _mb_ms_legacy_clock : NULL);
+}
+
+void modbus_master_get_queue_stats(modbus_master_queue_stats_t* stats)
+{
+	modbus_master_get_queue_stats_r(&mb_master_state, stats);
+}
+
+void modbus_master_reset_queue_stats(void)
+{
+	modbus_master_reset_queue_stats_r(&mb_master_state);
+}
+
+bool modbus_master_set_poll_list(modbus_master_poll_t* polls, uint8_t polls_count)
+{
+	return modbus_master_set_poll_list_r(&mb_master_state, polls, polls_count);
+}
+
+uint32_t modbus_master_run_poll_list(void)
+{
+	return modbus_master_run_poll_list_r(&mb_master_state);
+}
+
+const modbus_master_poll_t* modbus_master_get_active_poll(void)
+{
+	return modbus_master_get_active_poll_r(&mb_master_state);
+}
+
+void modbus_master_set_read_coalescing(bool enabled, uint16_t gap)
+{
+	modbus_master_set_read_coalescing_r(&mb_master_state, enabled, gap);
+}
+
+void modbus_master_set_write_combining(bool enabled)
+{
+	modbus_master_set_write_combining_r(&mb_master_state, enabled);
+}
+
+void modbus_master_flush_writes(void)
+{
+	modbus_master_flush_writes_r(&mb_master_state);
 }
 
 void modbus_master_read_coils(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
 {
-	_mb_ms_send_simple_message(slave_id, MODBUS_READ_COILS, reg_addr, reg_count);
+	modbus_master_read_coils_r(&mb_master_state, slave_id, reg_addr, reg_count);
 }
 
 void modbus_master_read_input_status(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
 {
-	_mb_ms_send_simple_message(slave_id, MODBUS_READ_INPUT_STATUS, reg_addr, reg_count);
+	modbus_master_read_input_status_r(&mb_master_state, slave_id, reg_addr, reg_count);
 }
 
 void modbus_master_read_holding_registers(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
 {
-	_mb_ms_send_simple_message(slave_id, MODBUS_READ_HOLDING_REGISTERS, reg_addr, reg_count);
+	modbus_master_read_holding_registers_r(&mb_master_state, slave_id, reg_addr, reg_count);
 }
 
 void modbus_master_read_input_registers(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
 {
-	_mb_ms_send_simple_message(slave_id, MODBUS_READ_INPUT_REGISTERS, reg_addr, reg_count);
+	modbus_master_read_input_registers_r(&mb_master_state, slave_id, reg_addr, reg_count);
 }
 
 void modbus_master_force_single_coil(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_val)
 {
-	_mb_ms_send_simple_message(slave_id, MODBUS_FORCE_SINGLE_COIL, reg_addr, reg_val);
+	modbus_master_force_single_coil_r(&mb_master_state, slave_id, reg_addr, reg_val);
 }
 
 void modbus_master_preset_single_register(uint8_t slave_id, uint16_t reg_addr, uint16_t reg_val)
 {
-	_mb_ms_send_simple_message(slave_id, MODBUS_PRESET_SINGLE_REGISTER, reg_addr, reg_val);
+	modbus_master_preset_single_register_r(&mb_master_state, slave_id, reg_addr, reg_val);
 }
 
 void modbus_master_force_multiple_coils(uint8_t slave_id, uint16_t reg_addr, const bool* data, uint16_t reg_count)
+{
+	modbus_master_force_multiple_coils_r(&mb_master_state, slave_id, reg_addr, data, reg_count);
+}
+
+void modbus_master_preset_multiple_registers(uint8_t slave_id, uint16_t reg_addr, const uint16_t* data, uint16_t reg_count)
+{
+	modbus_master_preset_multiple_registers_r(&mb_master_state, slave_id, reg_addr, data, reg_count);
+}
+
+void modbus_master_mask_write_register(uint8_t slave_id, uint16_t reg_addr, uint16_t and_mask, uint16_t or_mask)
+{
+	modbus_master_mask_write_register_r(&mb_master_state, slave_id, reg_addr, and_mask, or_mask);
+}
+
+void modbus_master_read_file_record(uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t record_count)
+{
+	modbus_master_read_file_record_r(&mb_master_state, slave_id, file_number, record_number, record_count);
+}
+
+void modbus_master_write_file_record(uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count)
+{
+	modbus_master_write_file_record_r(&mb_master_state, slave_id, file_number, record_number, data, record_count);
+}
+
+void modbus_master_read_file(uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t* data, uint16_t record_count, void (*complete_handler) (modbus_error_response_t, uint16_t))
+{
+	mb_master_legacy_file_complete_handler = complete_handler;
+	modbus_master_read_file_r(&mb_master_state, slave_id, file_number, record_number, data, record_count, complete_handler != NULL ? _mb_ms_legacy_file_complete_handler : NULL);
+}
+
+void modbus_master_write_file(uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count, void (*complete_handler) (modbus_error_response_t, uint16_t))
+{
+	mb_master_legacy_file_complete_handler = complete_handler;
+	modbus_master_write_file_r(&mb_master_state, slave_id, file_number, record_number, data, record_count, complete_handler != NULL ? _mb_ms_legacy_file_complete_handler : NULL);
+}
+
+void modbus_master_read_write_multiple_registers(uint8_t slave_id, uint16_t read_addr, uint16_t read_count, uint16_t write_addr, const uint16_t* data, uint16_t write_count)
+{
+	modbus_master_read_write_multiple_registers_r(&mb_master_state, slave_id, read_addr, read_count, write_addr, data, write_count);
+}
+
+void modbus_master_init(modbus_master_t* master, void* user_context)
+{
+	memset((uint8_t*)master, 0, sizeof(*master));
+	modbus_rtu_framer_init(&master->framer, MODBUS_RTU_DEFAULT_BAUD_RATE, MODBUS_RTU_DEFAULT_CHAR_BITS);
+	master->next_priority = MODBUS_PRIORITY_NORMAL;
+	master->user_context = user_context;
+	_mb_ms_reset_data(master);
+}
+
+void modbus_master_set_request_data_sender_r(modbus_master_t* master, void (*request_data_sender) (void*, uint8_t*, uint32_t))
+{
+	if (request_data_sender != NULL) {
+		master->request_data_sender = request_data_sender;
+	}
+}
+
+void modbus_master_set_internal_error_handler_r(modbus_master_t* master, void (*response_error_handler) (void*))
+{
+	if (response_error_handler != NULL) {
+		master->internal_error_handler = response_error_handler;
+	}
+}
+
+void modbus_master_set_response_packet_handler_r(modbus_master_t* master, void (*response_packet_handler) (void*, modbus_response_t*))
+{
+	if (response_packet_handler == NULL) {
+		_mb_ms_do_internal_error(master);
+		return;
+	}
+
+	master->response_packet_handler = response_packet_handler;
+}
+
+void modbus_master_recieve_data_byte_r(modbus_master_t* master, uint8_t byte)
+{
+	if (master->response_bytes_len >= sizeof(master->response_bytes)) {
+		_mb_ms_do_internal_error(master);
+		_mb_ms_reset_data(master);
+	}
+
+	master->response_bytes[master->response_bytes_len++] = byte;
+	master->response_crc = modbus_crc16_byte(master->response_crc, byte);
+
+	if (master->response_byte_handler != NULL) {
+		master->data_counter++;
+		master->response_byte_handler(master, byte);
+	}
+	else {
+		_mb_ms_do_internal_error(master);
+		_mb_ms_reset_data(master);
+	}
+}
+
+size_t modbus_master_receive_buffer_r(modbus_master_t* master, const uint8_t* data, size_t len)
+{
+	size_t counter = 0;
+	while (counter < len) {
+		size_t span = _mb_ms_get_payload_span(master, len - counter);
+		if (span > 0) {
+			_mb_ms_receive_payload(master, data + counter, span);
+			counter += span;
+			continue;
+		}
+
+		bool in_frame = master->response_byte_handler != _mb_ms_fsm_response_slave_id;
+		modbus_master_recieve_data_byte_r(master, data[counter++]);
+		if (in_frame && master->response_byte_handler == _mb_ms_fsm_response_slave_id) {
+			break;
+		}
+	}
+	return counter;
+}
+
+void modbus_master_timeout_r(modbus_master_t* master)
+{
+	/* No response comes to a broadcast, the end of the turnaround delay completes it */
+	if (_mb_ms_is_broadcast_pending(master)) {
+		modbus_response_t mb_resp_packet = {
+			.status = MODBUS_NO_ERROR,
+			.slave_id = MODBUS_BROADCAST_ID,
+			.command = master->data_req.command,
+			.response = {0}
+		};
+		_mb_ms_reset_data(master);
+		if (master->response_packet_handler != NULL) {
+			master->response_packet_handler(master->user_context, &mb_resp_packet);
+		}
+		_mb_ms_dispatch_next(master);
+		return;
+	}
+
+	_mb_ms_poll_count_error(master);
+	_mb_ms_do_internal_error(master);
+	_mb_ms_reset_data(master);
+	if (master->file_transfer.complete_handler != NULL) {
+		_mb_ms_file_transfer_finish(master, MODBUS_ERROR_TIMEOUT);
+	}
+	_mb_ms_dispatch_next(master);
+}
+
+void modbus_master_set_turnaround_delay_r(modbus_master_t* master, uint16_t delay)
+{
+	master->turnaround_delay = delay;
+}
+
+uint16_t modbus_master_get_wait_time_r(modbus_master_t* master, uint16_t response_timeout)
+{
+	return _mb_ms_is_broadcast_pending(master) ? master->turnaround_delay : response_timeout;
+}
+
+void modbus_master_set_framing_r(modbus_master_t* master, uint32_t baud_rate, uint8_t char_bits)
+{
+	modbus_rtu_framer_init(&master->framer, baud_rate, char_bits);
+}
+
+void modbus_master_recieve_data_byte_at_r(modbus_master_t* master, uint8_t byte, uint32_t now_us)
+{
+	if (_mb_ms_framer_accept(master, now_us, 1)) {
+		modbus_master_recieve_data_byte_r(master, byte);
+	}
+}
+
+void modbus_master_receive_buffer_at_r(modbus_master_t* master, const uint8_t* data, size_t len, uint32_t now_us)
+{
+	if (len == 0 || !_mb_ms_framer_accept(master, now_us, len)) {
+		return;
+	}
+	size_t counter = 0;
+	while (counter < len) {
+		counter += modbus_master_receive_buffer_r(master, data + counter, len - counter);
+	}
+}
+
+void modbus_master_poll_r(modbus_master_t* master, uint32_t now_us)
+{
+	if (modbus_rtu_framer_poll(&master->framer, now_us)) {
+		_mb_ms_frame_end(master);
+	}
+}
+
+void modbus_master_set_priority_r(modbus_master_t* master, modbus_master_priority_t priority)
+{
+	master->next_priority = priority;
+}
+
+void modbus_master_set_clock_r(modbus_master_t* master, uint32_t (*clock_us) (void*))
+{
+	master->clock_us = clock_us;
+}
+
+void modbus_master_get_queue_stats_r(modbus_master_t* master, modbus_master_queue_stats_t* stats)
+{
+	*stats = master->queue.stats;
+	stats->depth = master->queue.count;
+}
+
+void modbus_master_reset_queue_stats_r(modbus_master_t* master)
+{
+	memset((uint8_t*)&master->queue.stats, 0, sizeof(master->queue.stats));
+}
+
+bool modbus_master_set_poll_list_r(modbus_master_t* master, modbus_master_poll_t* polls, uint8_t polls_count)
+{
+	if (polls == NULL) {
+		polls_count = 0;
+	}
+	if (polls_count > 0 && master->clock_us == NULL) {
+		return false;
+	}
+	for (uint8_t i = 0; i < polls_count; i++) {
+		modbus_command_t command = polls[i].command;
+		bool is_read = command == MODBUS_READ_COILS || command == MODBUS_READ_INPUT_STATUS
+			|| command == MODBUS_READ_HOLDING_REGISTERS || command == MODBUS_READ_INPUT_REGISTERS;
+		if (!is_read || polls[i].slave_id == MODBUS_BROADCAST_ID || polls[i].period_us == 0) {
+			return false;
+		}
+	}
+
+	/* Every entry is released at once, the first deadlines follow the periods */
+	uint32_t now_us = polls_count > 0 ? master->clock_us(master->user_context) : 0;
+	for (uint8_t i = 0; i < polls_count; i++) {
+		polls[i].release_us      = now_us;
+		polls[i].polls           = 0;
+		polls[i].errors          = 0;
+		polls[i].missed          = 0;
+		polls[i].jitter_us_total = 0;
+		polls[i].jitter_us_max   = 0;
+		polls[i].coalesced       = false;
+	}
+	/* A poll in flight no longer belongs to a list */
+	master->polls       = polls_count > 0 ? polls : NULL;
+	master->polls_count = polls_count;
+	master->poll_active = NULL;
+	return true;
+}
+
+uint32_t modbus_master_run_poll_list_r(modbus_master_t* master)
+{
+	if (master->polls_count == 0 || master->clock_us == NULL) {
+		return master->clock_us != NULL ? master->clock_us(master->user_context) : 0;
+	}
+
+	_mb_ms_poll_list_dispatch(master);
+
+	uint32_t release_us = master->polls[0].release_us;
+	for (uint8_t i = 1; i < master->polls_count; i++) {
+		if ((int32_t)(master->polls[i].release_us - release_us) < 0) {
+			release_us = master->polls[i].release_us;
+		}
+	}
+	return release_us;
+}
+
+const modbus_master_poll_t* modbus_master_get_active_poll_r(modbus_master_t* master)
+{
+	return master->poll_active;
+}
+
+void modbus_master_set_read_coalescing_r(modbus_master_t* master, bool enabled, uint16_t gap)
+{
+	master->coalesce_reads = enabled;
+	master->coalesce_gap   = gap;
+}
+
+void modbus_master_set_write_combining_r(modbus_master_t* master, bool enabled)
+{
+	master->combine_writes = enabled;
+	if (!enabled) {
+		modbus_master_flush_writes_r(master);
+	}
+}
+
+void modbus_master_flush_writes_r(modbus_master_t* master)
+{
+	_mb_ms_queue_seal(master);
+	_mb_ms_dispatch_next(master);
+}
+
+void modbus_master_read_coils_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
+{
+	_mb_ms_send_simple_message(master, slave_id, MODBUS_READ_COILS, reg_addr, reg_count);
+}
+
+void modbus_master_read_input_status_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
+{
+	_mb_ms_send_simple_message(master, slave_id, MODBUS_READ_INPUT_STATUS, reg_addr, reg_count);
+}
+
+void modbus_master_read_holding_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
+{
+	_mb_ms_send_simple_message(master, slave_id, MODBUS_READ_HOLDING_REGISTERS, reg_addr, reg_count);
+}
+
+void modbus_master_read_input_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_count)
+{
+	_mb_ms_send_simple_message(master, slave_id, MODBUS_READ_INPUT_REGISTERS, reg_addr, reg_count);
+}
+
+void modbus_master_force_single_coil_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_val)
+{
+	_mb_ms_send_simple_message(master, slave_id, MODBUS_FORCE_SINGLE_COIL, reg_addr, reg_val);
+}
+
+void modbus_master_preset_single_register_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t reg_val)
+{
+	_mb_ms_send_simple_message(master, slave_id, MODBUS_PRESET_SINGLE_REGISTER, reg_addr, reg_val);
+}
+
+void modbus_master_force_multiple_coils_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, const bool* data, uint16_t reg_count)
 {
 	if (reg_count == 0 || data == NULL) {
-		_mb_ms_do_internal_error();
+		_mb_ms_reject_request(master);
 		return;
 	}
 
-	uint8_t request[MODBUS_MASTER_MESSAGE_DATA_SIZE] = { 0 };
+	if (reg_count > sizeof(master->special_data)) {
+		_mb_ms_reject_request(master);
+		return;
+	}
+
+	uint8_t request[4 + SPECIAL_DATA_META_COUNT + MODBUS_MASTER_MESSAGE_DATA_SIZE + 2];
 	uint32_t counter = 0;
 
-	mb_master_state.data_req.id = slave_id;
 	request[counter++] = slave_id;
-
-	mb_master_state.data_req.command = MODBUS_FORCE_MULTIPLE_COILS;
 	request[counter++] = MODBUS_FORCE_MULTIPLE_COILS;
-
-	mb_master_state.data_req.register_addr = reg_addr;
 	request[counter++] = (uint8_t)(reg_addr >> 8);
 	request[counter++] = (uint8_t)(reg_addr);
 
-	if (reg_count > sizeof(mb_master_state.special_data)) {
-		_mb_ms_do_internal_error();
-		return;
-	}
-
-	uint8_t spec_data_counter = 0;
-	mb_master_state.special_data[spec_data_counter++] = (uint8_t)(reg_count >> 8);
-	mb_master_state.special_data[spec_data_counter++] = (uint8_t)(reg_count);
 	request[counter++] = (uint8_t)(reg_count >> 8);
 	request[counter++] = (uint8_t)(reg_count);
 
 	uint8_t bytes_count = (uint8_t)((reg_count / 8) + (reg_count % 8 > 0 ? 1 : 0));
-	mb_master_state.special_data[spec_data_counter++] = (uint8_t)(bytes_count);
 	request[counter++] = (uint8_t)(bytes_count);
 
-	for (uint8_t i = 0; i < reg_count; i++) {
-		uint8_t tmp_data = (uint8_t)((data[i] ? 1 : 0) << (i % 8));
+	memset(request + counter, 0, bytes_count);
+	for (uint16_t i = 0; i < reg_count; i++) {
+		request[counter + i / 8] |= (uint8_t)((data[i] ? 1 : 0) << (i % 8));
+	}
+	counter += bytes_count;
+
+	_mb_ms_send_request(master, request, counter);
+}
 
-		mb_master_state.special_data[spec_data_counter + i / 8] |= tmp_data;
-		request[counter + i / 8] |= tmp_data;
+void modbus_master_preset_multiple_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, const uint16_t* data, uint16_t reg_count)
+{
+	if (reg_count == 0 || data == NULL) {
+		_mb_ms_reject_request(master);
+		return;
+	}
+
+	if (reg_count * sizeof(uint16_t) > sizeof(master->special_data)) {
+		_mb_ms_reject_request(master);
+		return;
 	}
-	uint8_t count = (uint8_t)(reg_count / 8 + (reg_count % 8 ? 1 : 0));
-	counter += count;
-	spec_data_counter += count;
 
-	uint16_t crc = modbus_crc16(request, (uint16_t)counter);
-	mb_master_state.data_req.crc = crc;
-	request[counter++] = (uint8_t)(crc);
-	request[counter++] = (uint8_t)(crc >> 8);
+	uint8_t request[4 + SPECIAL_DATA_META_COUNT + MODBUS_MASTER_MESSAGE_DATA_SIZE + 2];
+	uint32_t counter = 0;
+
+	request[counter++] = slave_id;
+	request[counter++] = MODBUS_PRESET_MULTIPLE_REGISTERS;
+	request[counter++] = (uint8_t)(reg_addr >> 8);
+	request[counter++] = (uint8_t)(reg_addr);
+
+	request[counter++] = (uint8_t)(reg_count >> 8);
+	request[counter++] = (uint8_t)(reg_count);
+	request[counter++] = (uint8_t)(reg_count * sizeof(uint16_t));
 
-	if (mb_master_state.request_data_sender == NULL) {
-		_mb_ms_do_internal_error();
+	for (uint16_t i = 0; i < reg_count; i++) {
+		request[counter++] = (uint8_t)(data[i] >> 8);
+		request[counter++] = (uint8_t)(data[i]);
+	}
+
+	_mb_ms_send_request(master, request, counter);
+}
+
+void modbus_master_mask_write_register_r(modbus_master_t* master, uint8_t slave_id, uint16_t reg_addr, uint16_t and_mask, uint16_t or_mask)
+{
+	uint8_t request[4 + SPECIAL_DATA_MASK_WRITE_COUNT + 2];
+	uint32_t counter = 0;
+
+	request[counter++] = slave_id;
+	request[counter++] = MODBUS_MASK_WRITE_REGISTER;
+	request[counter++] = (uint8_t)(reg_addr >> 8);
+	request[counter++] = (uint8_t)(reg_addr);
+
+	request[counter++] = (uint8_t)(and_mask >> 8);
+	request[counter++] = (uint8_t)(and_mask);
+	request[counter++] = (uint8_t)(or_mask >> 8);
+	request[counter++] = (uint8_t)(or_mask);
+
+	_mb_ms_send_request(master, request, counter);
+}
+
+void modbus_master_read_file_record_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t record_count)
+{
+	_mb_ms_send_file_request(master, slave_id, MODBUS_READ_FILE_RECORD, file_number, record_number, NULL, record_count);
+}
+
+void modbus_master_write_file_record_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count)
+{
+	_mb_ms_send_file_request(master, slave_id, MODBUS_WRITE_FILE_RECORD, file_number, record_number, data, record_count);
+}
+
+void modbus_master_read_file_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t* data, uint16_t record_count, void (*complete_handler) (void*, modbus_error_response_t, uint16_t))
+{
+	/* A stream continues from the responses, a broadcast has none, and it starts on an idle line */
+	if (slave_id == MODBUS_BROADCAST_ID || record_count == 0 || data == NULL || complete_handler == NULL || _mb_ms_get_file_records_max(master, MODBUS_READ_FILE_RECORD) == 0
+		|| _mb_ms_is_busy(master) || master->file_transfer.complete_handler != NULL) {
+		_mb_ms_reject_request(master);
 		return;
 	}
+	_mb_ms_file_transfer_start(master, slave_id, file_number, record_number, data, NULL, record_count, complete_handler);
+}
 
-	mb_master_state.request_data_sender(request, counter);
+void modbus_master_write_file_r(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count, void (*complete_handler) (void*, modbus_error_response_t, uint16_t))
+{
+	/* A stream continues from the responses, a broadcast has none, and it starts on an idle line */
+	if (slave_id == MODBUS_BROADCAST_ID || record_count == 0 || data == NULL || complete_handler == NULL || _mb_ms_get_file_records_max(master, MODBUS_WRITE_FILE_RECORD) == 0
+		|| _mb_ms_is_busy(master) || master->file_transfer.complete_handler != NULL) {
+		_mb_ms_reject_request(master);
+		return;
+	}
+	_mb_ms_file_transfer_start(master, slave_id, file_number, record_number, NULL, data, record_count, complete_handler);
 }
 
-void modbus_master_preset_multiple_registers(uint8_t slave_id, uint16_t reg_addr, const uint16_t* data, uint16_t reg_count)
+void modbus_master_read_write_multiple_registers_r(modbus_master_t* master, uint8_t slave_id, uint16_t read_addr, uint16_t read_count, uint16_t write_addr, const uint16_t* data, uint16_t write_count)
 {
-	if (reg_count == 0 || data == NULL) {
-		_mb_ms_do_internal_error();
+	if (read_count == 0 || write_count == 0 || data == NULL) {
+		_mb_ms_reject_request(master);
 		return;
 	}
 
-	uint8_t request[MODBUS_MASTER_MESSAGE_DATA_SIZE] = { 0 };
+	/* The written values and the read back response have to fit the data buffer */
+	if (1 + write_count * sizeof(uint16_t) > sizeof(master->special_data) || 1 + read_count * sizeof(uint16_t) > sizeof(master->special_data)) {
+		_mb_ms_reject_request(master);
+		return;
+	}
+
+	uint8_t request[4 + SPECIAL_DATA_READ_WRITE_META_COUNT + MODBUS_MASTER_MESSAGE_DATA_SIZE + 2];
 	uint32_t counter = 0;
 
-	mb_master_state.data_req.id = slave_id;
 	request[counter++] = slave_id;
+	request[counter++] = MODBUS_READ_WRITE_MULTIPLE_REGISTERS;
+	request[counter++] = (uint8_t)(read_addr >> 8);
+	request[counter++] = (uint8_t)(read_addr);
+
+	request[counter++] = (uint8_t)(read_count >> 8);
+	request[counter++] = (uint8_t)(read_count);
+	request[counter++] = (uint8_t)(write_addr >> 8);
+	request[counter++] = (uint8_t)(write_addr);
+	request[counter++] = (uint8_t)(write_count >> 8);
+	request[counter++] = (uint8_t)(write_count);
+	request[counter++] = (uint8_t)(write_count * sizeof(uint16_t));
+
+	for (uint16_t i = 0; i < write_count; i++) {
+		request[counter++] = (uint8_t)(data[i] >> 8);
+		request[counter++] = (uint8_t)(data[i]);
+	}
 
-	mb_master_state.data_req.command = MODBUS_PRESET_MULTIPLE_REGISTERS;
-	request[counter++] = MODBUS_PRESET_MULTIPLE_REGISTERS;
-
-	mb_master_state.data_req.register_addr = reg_addr;
-	request[counter++] = (uint8_t)(reg_addr >> 8);
-	request[counter++] = (uint8_t)(reg_addr);
+	_mb_ms_send_request(master, request, counter);
+}
 
-	if (reg_count * sizeof(uint16_t) > sizeof(mb_master_state.special_data)) {
-		_mb_ms_do_internal_error();
+void _mb_ms_send_file_request(modbus_master_t* master, uint8_t slave_id, uint8_t command, uint16_t file_number, uint16_t record_number, const uint16_t* data, uint16_t record_count)
+{
+	bool write = command == MODBUS_WRITE_FILE_RECORD;
+	if (record_count == 0 || record_count > _mb_ms_get_file_records_max(master, command) || (write && data == NULL)) {
+		_mb_ms_reject_request(master);
 		return;
 	}
 
-	uint8_t spec_data_counter = 0;
-	mb_master_state.special_data[spec_data_counter++] = (uint8_t)(reg_count >> 8);
-	mb_master_state.special_data[spec_data_counter++] = (uint8_t)(reg_count);
-	request[counter++] = (uint8_t)(reg_count >> 8);
-	request[counter++] = (uint8_t)(reg_count);
+	uint8_t request[3 + SPECIAL_DATA_FILE_SUB_REQUEST_SIZE + MODBUS_MASTER_MESSAGE_DATA_SIZE + 2];
+	uint32_t counter = 0;
 
-	uint8_t bytes_count = (uint8_t)(reg_count * sizeof(uint16_t));
-	mb_master_state.special_data[spec_data_counter++] = (uint8_t)(bytes_count);
-	request[counter++] = (uint8_t)(bytes_count);
+	request[counter++] = slave_id;
+	/* One sub-request, the byte count follows the command instead of a register address */
+	request[counter++] = command;
 
-	for (uint8_t i = 0; i < reg_count; i++) {
-		mb_master_state.special_data[spec_data_counter++] = (uint8_t)(data[i] >> 8);
-		mb_master_state.special_data[spec_data_counter++] = (uint8_t)(data[i]);
+	request[counter++] = (uint8_t)(SPECIAL_DATA_FILE_SUB_REQUEST_SIZE + (write ? record_count * sizeof(uint16_t) : 0));
+	request[counter++] = MODBUS_FILE_REFERENCE_TYPE;
+	request[counter++] = (uint8_t)(file_number >> 8);
+	request[counter++] = (uint8_t)(file_number);
+	request[counter++] = (uint8_t)(record_number >> 8);
+	request[counter++] = (uint8_t)(record_number);
+	request[counter++] = (uint8_t)(record_count >> 8);
+	request[counter++] = (uint8_t)(record_count);
+
+	for (uint16_t i = 0; write && i < record_count; i++) {
 		request[counter++] = (uint8_t)(data[i] >> 8);
 		request[counter++] = (uint8_t)(data[i]);
 	}
 
-	uint16_t crc = modbus_crc16(request, (uint16_t)counter);
-	mb_master_state.data_req.crc = crc;
-	request[counter++] = (uint8_t)(crc);
-	request[counter++] = (uint8_t)(crc >> 8);
+	_mb_ms_send_request(master, request, counter);
+}
 
-	if (mb_master_state.request_data_sender == NULL) {
-		_mb_ms_do_internal_error();
+uint16_t _mb_ms_get_file_records_max(modbus_master_t* master, uint8_t command)
+{
+	/*
+	 * A read response holds the sub-response length and reference type, a write response echoes the sub-request.
+	 * A slave with the same buffer size also keeps the byte count in front, the largest request it accepts is sent.
+	 */
+	size_t size = sizeof(master->special_data);
+	size_t meta = SPECIAL_DATA_FILE_META_COUNT + (command == MODBUS_READ_FILE_RECORD ? 2 : SPECIAL_DATA_FILE_SUB_REQUEST_SIZE);
+	size_t max  = command == MODBUS_READ_FILE_RECORD ? MODBUS_FILE_READ_BYTES_MAX : MODBUS_FILE_WRITE_BYTES_MAX;
+	if (size <= meta) {
+		return 0;
+	}
+	return (uint16_t)MB_MIN((size - meta) / 2, (max + SPECIAL_DATA_FILE_META_COUNT - meta) / 2);
+}
+
+void _mb_ms_file_transfer_start(modbus_master_t* master, uint8_t slave_id, uint16_t file_number, uint16_t record_number, uint16_t* destination, const uint16_t* source, uint16_t record_count, void (*complete_handler) (void*, modbus_error_response_t, uint16_t))
+{
+	modbus_master_file_transfer_t* transfer = &master->file_transfer;
+	memset((uint8_t*)transfer, 0, sizeof(*transfer));
+	transfer->complete_handler = complete_handler;
+	transfer->destination      = destination;
+	transfer->source           = source;
+	transfer->file_number      = file_number;
+	transfer->record_number    = record_number;
+	transfer->records_count    = record_count;
+	transfer->slave_id         = slave_id;
+	_mb_ms_file_transfer_send(master);
+}
+
+void _mb_ms_file_transfer_send(modbus_master_t* master)
+{
+	modbus_master_file_transfer_t* transfer = &master->file_transfer;
+	uint8_t command = transfer->source != NULL ? MODBUS_WRITE_FILE_RECORD : MODBUS_READ_FILE_RECORD;
+
+	transfer->chunk_records = (uint16_t)MB_MIN((uint16_t)(transfer->records_count - transfer->records_done), _mb_ms_get_file_records_max(master, command));
+	_mb_ms_send_file_request(
+		master,
+		transfer->slave_id,
+		command,
+		transfer->file_number,
+		(uint16_t)(transfer->record_number + transfer->records_done),
+		transfer->source != NULL ? transfer->source + transfer->records_done : NULL,
+		transfer->chunk_records
+	);
+}
+
+void _mb_ms_file_transfer_response(modbus_master_t* master, modbus_response_t* packet)
+{
+	modbus_master_file_transfer_t* transfer = &master->file_transfer;
+	transfer->answered = true;
+	transfer->status   = packet->status;
+	if (transfer->status == MODBUS_NO_ERROR && master->data_resp.command != master->data_req.command) {
+		transfer->status = MODBUS_ERROR_COMMAND;
+	}
+	if (transfer->status != MODBUS_NO_ERROR) {
 		return;
 	}
 
-	mb_master_state.request_data_sender(request, counter);
+	if (transfer->destination != NULL) {
+		if (master->data_resp.data_len != 2 + transfer->chunk_records * 2) {
+			transfer->status = MODBUS_ERROR_DATA;
+			return;
+		}
+		for (uint16_t i = 0; i < transfer->chunk_records; i++) {
+			transfer->destination[transfer->records_done + i] = packet->response[i];
+		}
+	}
+	transfer->records_done = (uint16_t)(transfer->records_done + transfer->chunk_records);
 }
 
-void _mb_ms_send_simple_message(uint8_t slave_id, uint8_t command, uint16_t reg_addr, uint16_t spec_data)
+void _mb_ms_file_transfer_continue(modbus_master_t* master)
 {
-	uint8_t request[MODBUS_MASTER_MESSAGE_DATA_SIZE] = { 0 };
+	modbus_master_file_transfer_t* transfer = &master->file_transfer;
+	if (transfer->complete_handler == NULL || !transfer->answered) {
+		return;
+	}
+
+	transfer->answered = false;
+	if (transfer->status != MODBUS_NO_ERROR || transfer->records_done == transfer->records_count) {
+		_mb_ms_file_transfer_finish(master, transfer->status);
+		return;
+	}
+	_mb_ms_file_transfer_send(master);
+}
+
+void _mb_ms_file_transfer_finish(modbus_master_t* master, modbus_error_response_t status)
+{
+	/* Cleared first, the handler may start the next transfer */
+	void (*complete_handler) (void*, modbus_error_response_t, uint16_t) = master->file_transfer.complete_handler;
+	master->file_transfer.complete_handler = NULL;
+	complete_handler(master->user_context, status, master->file_transfer.records_done);
+}
+
+void _mb_ms_send_simple_message(modbus_master_t* master, uint8_t slave_id, uint8_t command, uint16_t reg_addr, uint16_t spec_data)
+{
+	uint8_t request[4 + SPECIAL_DATA_VALUE_SIZE + 2];
 	uint32_t counter = 0;
 
-	mb_master_state.data_req.id = slave_id;
 	request[counter++] = slave_id;
-
-	mb_master_state.data_req.command = command;
 	request[counter++] = command;
-
-	mb_master_state.data_req.register_addr = reg_addr;
 	request[counter++] = (uint8_t)(reg_addr >> 8);
 	request[counter++] = (uint8_t)(reg_addr);
-
-	mb_master_state.special_data[0] = (uint8_t)(spec_data >> 8);
-	mb_master_state.special_data[1] = (uint8_t)(spec_data);
 	request[counter++] = (uint8_t)(spec_data >> 8);
 	request[counter++] = (uint8_t)(spec_data);
 
-	uint16_t crc = modbus_crc16(request, (uint16_t)counter);
-	mb_master_state.data_req.crc = crc;
-	request[counter++] = (uint8_t)(crc);
-	request[counter++] = (uint8_t)(crc >> 8);
+	_mb_ms_send_request(master, request, counter);
+}
+
+void _mb_ms_send_request(modbus_master_t* master, uint8_t* request, uint32_t len)
+{
+	modbus_master_priority_t priority = master->next_priority;
+	master->next_priority = MODBUS_PRIORITY_NORMAL;
+
+	if (master->request_data_sender == NULL || !_mb_ms_check_request_slave_id(request[0], request[1])) {
+		_mb_ms_reject_request(master);
+		return;
+	}
+
+	uint16_t crc = modbus_crc16(request, (uint16_t)len);
+	request[len++] = (uint8_t)(crc);
+	request[len++] = (uint8_t)(crc >> 8);
+
+	/* A file transfer owns the line from its start on an idle one, its chunks are never queued behind other requests */
+	if (master->file_transfer.complete_handler != NULL && !_mb_ms_is_busy(master)) {
+		_mb_ms_transmit(master, request, len);
+		return;
+	}
+
+	/* Single writes are held for a flush, one continuing the held write before it joins its frame */
+	if (master->combine_writes && _mb_ms_is_combinable_write(request)) {
+		if (!_mb_ms_queue_combine(master, request, priority)) {
+			_mb_ms_queue_push(master, request, len, priority, true);
+		}
+		return;
+	}
 
-	if (mb_master_state.request_data_sender == NULL) {
-		_mb_ms_do_internal_error();
+	/* The request in flight keeps the line, held writes were made earlier and are flushed ahead of this one */
+	if (_mb_ms_is_busy(master) || master->queue.count > 0) {
+		_mb_ms_queue_seal(master);
+		_mb_ms_queue_push(master, request, len, priority, false);
+		_mb_ms_queue_dispatch(master);
 		return;
 	}
+	_mb_ms_transmit(master, request, len);
+}
+
+void _mb_ms_transmit(modbus_master_t* master, uint8_t* request, uint32_t len)
+{
+	master->data_req.id      = request[0];
+	master->data_req.command = request[1];
+	if (!_mb_ms_is_file_command(master)) {
+		master->data_req.register_addr = (uint16_t)((request[2] << 8) | request[3]);
+	}
+	master->data_req.crc = (uint16_t)(request[len - 2] | (request[len - 1] << 8));
+	master->poll_active  = master->poll_pending;
 
-	mb_master_state.request_data_sender(request, counter);
+	master->request_data_sender(master->user_context, request, len);
 }
 
+void _mb_ms_queue_push(modbus_master_t* master, const uint8_t* request, uint32_t len, modbus_master_priority_t priority, bool held)
+{
+	modbus_master_queue_t* queue = &master->queue;
+	if (len > sizeof(queue->transactions[0].frame)) {
+		queue->stats.dropped++;
+		_mb_ms_reject_request(master);
+		return;
+	}
+
+	/* The slot of a frame being sent stays taken until its sender returns, a response handler may push meanwhile */
+	uint8_t slot = 0;
+	while (slot < MODBUS_MASTER_QUEUE_SIZE && queue->transactions[slot].len != 0) {
+		slot++;
+	}
+
+	/* A full queue gives the place of its newest least urgent request to a more urgent one */
+	if (slot == MODBUS_MASTER_QUEUE_SIZE) {
+		queue->stats.dropped++;
+		if (queue->count == 0 || queue->transactions[queue->order[queue->count - 1]].priority <= priority) {
+			_mb_ms_reject_request(master);
+			return;
+		}
+		queue->count--;
+		slot = queue->order[queue->count];
+		queue->transactions[slot].len = 0;
+		_mb_ms_reject_request(master);
+	}
+	modbus_master_transaction_t* transaction = &queue->transactions[slot];
+	memcpy(transaction->frame, request, len);
+	transaction->len       = (uint16_t)len;
+	transaction->priority  = priority;
+	transaction->queued_us = master->clock_us != NULL ? master->clock_us(master->user_context) : 0;
+	transaction->held      = held;
+	transaction->combined_command = 0;
+
+	/* Ordered by priority, first come first served within one */
+	uint8_t position = queue->count;
+	while (position > 0 && queue->transactions[queue->order[position - 1]].priority > priority) {
+		queue->order[position] = queue->order[position - 1];
+		position--;
+	}
+	queue->order[position] = slot;
+	queue->count++;
+
+	queue->stats.queued++;
+	queue->stats.depth_max = MB_MAX(queue->stats.depth_max, queue->count);
+}
 
-void _mb_ms_response_proccess(void)
+void _mb_ms_queue_dispatch(modbus_master_t* master)
 {
-	if (!_mb_ms_is_recieved_needed_slave_id()) {
-		_mb_ms_reset_data();
+	modbus_master_queue_t* queue = &master->queue;
+	if (queue->count == 0 || _mb_ms_is_busy(master) || master->file_transfer.complete_handler != NULL) {
+		return;
+	}
+
+	/* Held writes wait for the flush and nothing overtakes them */
+	uint8_t slot = queue->order[0];
+	if (queue->transactions[slot].held) {
 		return;
 	}
-	if (mb_master_state.response_packet_handler == NULL) {
-		_mb_ms_do_internal_error();
+	queue->count--;
+	memmove(queue->order, queue->order + 1, queue->count);
+
+	modbus_master_transaction_t* transaction = &queue->transactions[slot];
+	if (master->clock_us != NULL) {
+		uint32_t wait_us = master->clock_us(master->user_context) - transaction->queued_us;
+		queue->stats.wait_us_total += wait_us;
+		queue->stats.wait_us_max    = MB_MAX(queue->stats.wait_us_max, wait_us);
+	}
+	queue->stats.dispatched++;
+
+	if (transaction->combined_command != 0) {
+		master->combined = *transaction;
+	}
+
+	/* The slot stays taken while the frame is sent, a request queued by a response handler meanwhile takes another one */
+	_mb_ms_transmit(master, transaction->frame, transaction->len);
+	transaction->len = 0;
+}
+
+bool _mb_ms_queue_combine(modbus_master_t* master, const uint8_t* request, modbus_master_priority_t priority)
+{
+	/* Only the request this one would be queued right after can take it, the order stays as it was */
+	modbus_master_queue_t* queue = &master->queue;
+	uint8_t position = queue->count;
+	while (position > 0 && queue->transactions[queue->order[position - 1]].priority > priority) {
+		position--;
+	}
+	if (position == 0) {
+		return false;
+	}
+
+	modbus_master_transaction_t* transaction = &queue->transactions[queue->order[position - 1]];
+	uint8_t command = request[1];
+	if (!transaction->held || transaction->frame[0] != request[0]
+		|| (transaction->frame[1] != command && transaction->combined_command != command)) {
+		return false;
+	}
+
+	bool coils = command == MODBUS_FORCE_SINGLE_COIL;
+	uint16_t first    = (uint16_t)((transaction->frame[2] << 8) | transaction->frame[3]);
+	uint16_t count    = transaction->combined_command != 0 ? (uint16_t)((transaction->frame[4] << 8) | transaction->frame[5]) : 1;
+	uint16_t reg_addr = (uint16_t)((request[2] << 8) | request[3]);
+	bool prepend = (uint32_t)reg_addr + 1 == first;
+	if (!prepend && (uint32_t)first + count != reg_addr) {
+		return false;
+	}
+
+	/* The combined frame must fit a queue slot, the protocol and what the master sends itself */
+	int32_t limit = coils
+		? MB_MIN(MB_MIN(((int32_t)MODBUS_MASTER_QUEUE_FRAME_SIZE - 9) * 8, (int32_t)sizeof(master->special_data)), MODBUS_WRITE_COILS_MAX)
+		: MB_MIN(MB_MIN(((int32_t)MODBUS_MASTER_QUEUE_FRAME_SIZE - 9) / 2, (int32_t)(sizeof(master->special_data) / 2)), MODBUS_WRITE_REGISTERS_MAX);
+	if ((int32_t)count >= limit) {
+		return false;
+	}
+
+	uint8_t frame[MODBUS_MASTER_QUEUE_FRAME_SIZE];
+	uint16_t len = 0;
+	uint16_t combined_first = prepend ? reg_addr : first;
+	uint16_t combined_count = (uint16_t)(count + 1);
+	uint16_t bytes_count    = coils ? (uint16_t)MODBUS_COILS_BYTES(combined_count) : (uint16_t)(combined_count * 2);
+
+	frame[len++] = request[0];
+	frame[len++] = coils ? MODBUS_FORCE_MULTIPLE_COILS : MODBUS_PRESET_MULTIPLE_REGISTERS;
+	frame[len++] = (uint8_t)(combined_first >> 8);
+	frame[len++] = (uint8_t)(combined_first);
+	frame[len++] = (uint8_t)(combined_count >> 8);
+	frame[len++] = (uint8_t)(combined_count);
+	frame[len++] = (uint8_t)(bytes_count);
+
+	memset(frame + len, 0, bytes_count);
+	for (uint16_t i = 0; i < combined_count; i++) {
+		bool is_new = prepend ? i == 0 : i == count;
+		uint16_t value = is_new
+			? (uint16_t)((request[4] << 8) | request[5])
+			: _mb_ms_get_combined_value(transaction, (uint16_t)(prepend ? i - 1 : i));
+		if (coils) {
+			frame[len + i / 8] |= (uint8_t)((value != 0 ? 1 : 0) << (i % 8));
+		} else {
+			frame[len + i * 2]     = (uint8_t)(value >> 8);
+			frame[len + i * 2 + 1] = (uint8_t)(value);
+		}
+	}
+	len = (uint16_t)(len + bytes_count);
+
+	uint16_t crc = modbus_crc16(frame, len);
+	frame[len++] = (uint8_t)(crc);
+	frame[len++] = (uint8_t)(crc >> 8);
+
+	memcpy(transaction->frame, frame, len);
+	transaction->len = len;
+	transaction->combined_command = command;
+	queue->stats.combined++;
+	return true;
+}
+
+void _mb_ms_queue_seal(modbus_master_t* master)
+{
+	for (uint8_t i = 0; i < master->queue.count; i++) {
+		master->queue.transactions[master->queue.order[i]].held = false;
+	}
+}
+
+uint16_t _mb_ms_get_combined_value(const modbus_master_transaction_t* transaction, uint16_t idx)
+{
+	/* The value a single write of the frame was made with, coils as 0xFF00 or 0x0000 */
+	if (transaction->combined_command == 0) {
+		return (uint16_t)((transaction->frame[4] << 8) | transaction->frame[5]);
+	}
+	if (transaction->combined_command == MODBUS_FORCE_SINGLE_COIL) {
+		return (transaction->frame[7 + idx / 8] & (1 << (idx % 8))) ? 0xFF00 : 0x0000;
+	}
+	return (uint16_t)((transaction->frame[7 + idx * 2] << 8) | transaction->frame[8 + idx * 2]);
+}
+
+void _mb_ms_combined_fan_out(modbus_master_t* master, modbus_response_t* packet)
+{
+	/* Each single write gets the response its own request would have had, in address order */
+	modbus_master_transaction_t* combined = &master->combined;
+	uint16_t count = (uint16_t)((combined->frame[4] << 8) | combined->frame[5]);
+	modbus_response_t single = {
+		.status = packet->status,
+		.slave_id = packet->slave_id,
+		.command = (modbus_command_t)combined->combined_command,
+		.response = {0}
+	};
+	for (uint16_t i = 0; i < count; i++) {
+		single.response[0] = _mb_ms_get_combined_value(combined, i);
+		master->response_packet_handler(master->user_context, &single);
+	}
+}
+
+void _mb_ms_poll_list_dispatch(modbus_master_t* master)
+{
+	if (master->polls_count == 0 || master->clock_us == NULL || master->queue.count > 0
+		|| _mb_ms_is_busy(master) || master->file_transfer.complete_handler != NULL) {
+		return;
+	}
+
+	uint32_t now_us = master->clock_us(master->user_context);
+	modbus_master_poll_t* next = NULL;
+	for (uint8_t i = 0; i < master->polls_count; i++) {
+		modbus_master_poll_t* poll = &master->polls[i];
+		poll->coalesced = false;
+		if ((int32_t)(now_us - poll->release_us) < 0) {
+			continue;
+		}
+		/* Earliest deadline first, the deadline of a released poll is its next release */
+		if (next == NULL || (int32_t)((poll->release_us + poll->period_us) - (next->release_us + next->period_us)) < 0) {
+			next = poll;
+		}
+	}
+	if (next == NULL) {
+		return;
+	}
+
+	uint16_t reg_addr  = next->reg_addr;
+	uint16_t reg_count = next->reg_count;
+	if (master->coalesce_reads) {
+		reg_count = _mb_ms_poll_coalesce(master, next, now_us, &reg_addr);
+	}
+	for (uint8_t i = 0; i < master->polls_count; i++) {
+		if (master->polls[i].coalesced && &master->polls[i] != next) {
+			_mb_ms_poll_release(&master->polls[i], now_us);
+		}
+	}
+	_mb_ms_poll_release(next, now_us);
+
+	/* The line is idle, the poll is sent at once and leaves the priority of the application's next request alone */
+	modbus_master_priority_t priority = master->next_priority;
+	master->poll_pending = next;
+	_mb_ms_send_simple_message(master, next->slave_id, next->command, reg_addr, reg_count);
+	master->poll_pending = NULL;
+	master->next_priority = priority;
+}
+
+void _mb_ms_poll_release(modbus_master_poll_t* poll, uint32_t now_us)
+{
+	uint32_t late_us = now_us - poll->release_us;
+	poll->jitter_us_total += late_us;
+	poll->jitter_us_max    = MB_MAX(poll->jitter_us_max, late_us);
+	/* Sent past its deadline, the releases it slept through are missed and not caught up with */
+	uint32_t periods = late_us / poll->period_us;
+	poll->missed     += periods;
+	poll->release_us += (periods + 1) * poll->period_us;
+	poll->polls++;
+}
+
+uint16_t _mb_ms_poll_coalesce(modbus_master_t* master, modbus_master_poll_t* next, uint32_t now_us, uint16_t* reg_addr)
+{
+	uint32_t limit = _mb_ms_get_read_limit(master, next->command);
+	uint32_t first = next->reg_addr;
+	uint32_t last  = first + next->reg_count;
+
+	/* Grown until no released entry fits, one that bridges a gap may bring in another */
+	bool grown = true;
+	while (grown) {
+		grown = false;
+		for (uint8_t i = 0; i < master->polls_count; i++) {
+			modbus_master_poll_t* poll = &master->polls[i];
+			if (poll == next || poll->coalesced || poll->slave_id != next->slave_id || poll->command != next->command
+				|| (int32_t)(now_us - poll->release_us) < 0) {
+				continue;
+			}
+			uint32_t poll_first = poll->reg_addr;
+			uint32_t poll_last  = poll_first + poll->reg_count;
+			if (poll_first > last + master->coalesce_gap || first > poll_last + master->coalesce_gap
+				|| MB_MAX(last, poll_last) - MB_MIN(first, poll_first) > limit) {
+				continue;
+			}
+			first = MB_MIN(first, poll_first);
+			last  = MB_MAX(last, poll_last);
+			poll->coalesced = true;
+			next->coalesced = true;
+			grown = true;
+		}
+	}
+
+	*reg_addr = (uint16_t)first;
+	return (uint16_t)(last - first);
+}
+
+uint16_t _mb_ms_get_read_limit(modbus_master_t* master, uint8_t command)
+{
+	/* A response must fit the master's register count and buffers as well as the protocol */
+	if (command == MODBUS_READ_COILS || command == MODBUS_READ_INPUT_STATUS) {
+		register_type_t register_type = command == MODBUS_READ_COILS ? MODBUS_REGISTER_DISCRETE_OUTPUT_COILS : MODBUS_REGISTER_DISCRETE_INPUT_COILS;
+		uint32_t coils = MB_MIN((uint32_t)_mb_ms_get_registers_count(master, register_type) * sizeof(uint16_t), sizeof(master->special_data)) * 8;
+		return (uint16_t)MB_MIN(coils, MODBUS_READ_COILS_MAX);
+	}
+	register_type_t register_type = command == MODBUS_READ_INPUT_REGISTERS ? MODBUS_REGISTER_ANALOG_INPUT_REGISTERS : MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS;
+	uint32_t registers = MB_MIN((uint32_t)_mb_ms_get_registers_count(master, register_type), sizeof(master->special_data) / sizeof(uint16_t));
+	return (uint16_t)MB_MIN(registers, MODBUS_READ_REGISTERS_MAX);
+}
+
+void _mb_ms_poll_count_error(modbus_master_t* master)
+{
+	if (master->poll_active == NULL) {
+		return;
+	}
+	if (!master->poll_active->coalesced) {
+		master->poll_active->errors++;
+		return;
+	}
+	for (uint8_t i = 0; i < master->polls_count; i++) {
+		if (master->polls[i].coalesced) {
+			master->polls[i].errors++;
+		}
+	}
+}
+
+void _mb_ms_poll_fan_out(modbus_master_t* master, modbus_response_t* packet)
+{
+	/* Every entry of the merged read gets its own slice, the values start at the request's address */
+	modbus_master_poll_t* lead = master->poll_active;
+	bool discrete = _mb_ms_is_read_discrete_reg_command(master);
+	modbus_response_t slice = {
+		.status = packet->status,
+		.slave_id = packet->slave_id,
+		.command = packet->command,
+		.response = {0}
+	};
+
+	for (uint8_t i = 0; i < master->polls_count; i++) {
+		modbus_master_poll_t* poll = &master->polls[i];
+		if (!poll->coalesced) {
+			continue;
+		}
+		uint16_t offset = (uint16_t)(poll->reg_addr - master->data_req.register_addr);
+		if (packet->status == MODBUS_NO_ERROR && discrete) {
+			memset((uint8_t*)slice.response, 0, MODBUS_COILS_BYTES(poll->reg_count) * sizeof(*slice.response));
+			for (uint16_t j = 0; j < poll->reg_count; j++) {
+				uint16_t bit = (uint16_t)(offset + j);
+				if (packet->response[bit >> 3] & (1 << (bit & 7))) {
+					slice.response[j >> 3] |= (uint16_t)(1 << (j & 7));
+				}
+			}
+		} else if (packet->status == MODBUS_NO_ERROR) {
+			memcpy((uint8_t*)slice.response, (uint8_t*)(packet->response + offset), poll->reg_count * sizeof(*slice.response));
+		}
+		master->poll_active = poll;
+		master->response_packet_handler(master->user_context, &slice);
+	}
+	master->poll_active = lead;
+}
+
+void _mb_ms_dispatch_next(modbus_master_t* master)
+{
+	/* Requests of the application go before the periodic ones */
+	_mb_ms_queue_dispatch(master);
+	_mb_ms_poll_list_dispatch(master);
+}
+
+
+void _mb_ms_response_proccess(modbus_master_t* master)
+{
+	if (!_mb_ms_is_recieved_needed_slave_id(master)) {
+		_mb_ms_reset_data(master);
+		return;
+	}
+	if (master->response_packet_handler == NULL && master->file_transfer.complete_handler == NULL) {
+		_mb_ms_do_internal_error(master);
 		return;
 	}
 
 	modbus_response_t mb_resp_packet = {
 		.status = MODBUS_NO_ERROR,
-		.slave_id = mb_master_state.data_resp.id,
-		.command = mb_master_state.data_resp.command,
+		.slave_id = master->data_resp.id,
+		.command = master->data_resp.command,
 		.response = {0}
 	};
 
 	/* CHECK ERRORS BEGIN */
-	if (!_mb_ms_check_response_command()) {
-		mb_master_state.data_resp.command ^= MODBUS_ERROR_COMMAND_CODE;
+	if (!_mb_ms_check_response_command(master)) {
+		master->data_resp.command ^= MODBUS_ERROR_COMMAND_CODE;
 		mb_resp_packet.status = MODBUS_ERROR_DATA;
 	}
 
-	if (!_mb_ms_check_response_command()) {
+	if (!_mb_ms_check_response_command(master)) {
 		mb_resp_packet.status = MODBUS_ERROR_COMMAND;
 		goto do_response_packet_handler;
 	}
 
-	if (!_mb_ms_check_response_crc()) {
+	if (!_mb_ms_check_response_crc(master)) {
 		mb_resp_packet.status = MODBUS_ERROR_CRC;
 		goto do_response_packet_handler;
 	}
 	/* CHECK ERRORS END */
 
 	/* MAKE PACKET DATA BEGIN */
-	if (_mb_ms_is_read_discrete_reg_command()) {
-		_mb_ms_make_read_discrete_packet(&mb_resp_packet);
+	if (_mb_ms_is_read_discrete_reg_command(master)) {
+		_mb_ms_make_read_discrete_packet(master, &mb_resp_packet);
+	}
+	if (_mb_ms_is_read_analog_reg_command(master)) {
+		_mb_ms_make_read_analog_packet(master, &mb_resp_packet);
 	}
-	if (_mb_ms_is_read_analog_reg_command()) {
-		_mb_ms_make_read_analog_packet(&mb_resp_packet);
+	if (_mb_ms_is_write_single_reg_command(master) || _mb_ms_is_write_multiple_reg_command(master) || _mb_ms_is_mask_write_command(master)) {
+		_mb_ms_make_write_packet(master, &mb_resp_packet);
 	}
-	if (_mb_ms_is_write_single_reg_command() || _mb_ms_is_write_multiple_reg_command()) {
-		_mb_ms_make_write_packet(&mb_resp_packet);
+	if (_mb_ms_is_file_command(master)) {
+		_mb_ms_make_file_packet(master, &mb_resp_packet);
 	}
 	/* MAKE PACKET DATA END */
 
 do_response_packet_handler:
-	mb_master_state.response_packet_handler(&mb_resp_packet);
-	_mb_ms_reset_data();
+	if (mb_resp_packet.status != MODBUS_NO_ERROR) {
+		_mb_ms_poll_count_error(master);
+	}
+	/* Responses of a file transfer are consumed by it, the next request is sent once the state is reset */
+	if (master->file_transfer.complete_handler != NULL && _mb_ms_is_file_command(master)) {
+		_mb_ms_file_transfer_response(master, &mb_resp_packet);
+	} else if (master->combined.len != 0 && master->response_packet_handler != NULL) {
+		_mb_ms_combined_fan_out(master, &mb_resp_packet);
+	} else if (master->poll_active != NULL && master->poll_active->coalesced && master->response_packet_handler != NULL) {
+		_mb_ms_poll_fan_out(master, &mb_resp_packet);
+	} else if (master->response_packet_handler != NULL) {
+		master->response_packet_handler(master->user_context, &mb_resp_packet);
+	}
+	_mb_ms_reset_data(master);
 }
 
-void _mb_ms_reset_data(void)
+size_t _mb_ms_get_payload_span(modbus_master_t* master, size_t len)
 {
-	memset((uint8_t*)&mb_master_state.data_req, 0, sizeof(mb_master_state.data_req));
-	memset((uint8_t*)&mb_master_state.data_resp, 0, sizeof(mb_master_state.data_resp));
-	memset((uint8_t*)&mb_master_state.special_data, 0, sizeof(mb_master_state.special_data));
-	memset((uint8_t*)&mb_master_state.response_bytes, 0, sizeof(mb_master_state.response_bytes));
+	if (master->response_byte_handler != _mb_ms_fsm_response_special_data || !_mb_ms_is_recieved_needed_slave_id(master)) {
+		return 0;
+	}
+	/* The first data byte has passed the response size check, the rest is plain data */
+	if (master->data_counter == 0) {
+		return 0;
+	}
+
+	if (_mb_ms_get_response_bytes_count(master) <= master->data_counter) {
+		return 0;
+	}
 
-	mb_master_state.response_byte_handler = _mb_ms_fsm_response_slave_id;
-	mb_master_state.data_counter          = 0;
-	mb_master_state.response_bytes_len    = 0;
+	size_t span = (size_t)_mb_ms_get_response_bytes_count(master) - master->data_counter;
+	span = MB_MIN(span, len);
+	span = MB_MIN(span, sizeof(master->special_data) - master->data_counter);
+	span = MB_MIN(span, sizeof(master->response_bytes) - master->response_bytes_len);
+	span = MB_MIN(span, (size_t)(UINT8_MAX - master->data_counter));
+	return span;
 }
 
-void _mb_ms_do_internal_error(void)
+void _mb_ms_receive_payload(modbus_master_t* master, const uint8_t* data, size_t len)
 {
-	if (mb_master_state.internal_error_handler != NULL) {
-		mb_master_state.internal_error_handler();
+	memcpy(master->special_data + master->data_counter, data, len);
+	memcpy(master->response_bytes + master->response_bytes_len, data, len);
+	master->response_bytes_len += (uint16_t)len;
+	master->response_crc        = modbus_crc16_update(master->response_crc, data, len);
+	master->data_counter       += (uint8_t)len;
+
+	if (master->data_counter == _mb_ms_get_response_bytes_count(master)) {
+		master->data_counter = 0;
+		master->response_byte_handler = _mb_ms_fsm_response_crc;
 	}
-	_mb_ms_reset_data();
 }
 
-void _mb_ms_make_read_discrete_packet(modbus_response_t* packet)
+void _mb_ms_reset_data(modbus_master_t* master)
 {
-	for (uint16_t i = 0; i < mb_master_state.data_resp.data_len; i++) {
-		packet->response[i] = mb_master_state.special_data[i];
+	/* Only the header is reset, buffers are valid up to their tracked length */
+	memset((uint8_t*)&master->data_req, 0, sizeof(master->data_req));
+	memset((uint8_t*)&master->data_resp, 0, sizeof(master->data_resp));
+
+	master->response_byte_handler = _mb_ms_fsm_response_slave_id;
+	master->data_counter          = 0;
+	master->response_bytes_len    = 0;
+	master->response_crc          = MODBUS_CRC16_INIT;
+	master->poll_active           = NULL;
+	master->combined.len          = 0;
+}
+
+bool _mb_ms_framer_accept(modbus_master_t* master, uint32_t now_us, size_t count)
+{
+	modbus_rtu_frame_event_t event = modbus_rtu_framer_bytes(&master->framer, now_us, count);
+	if (event != MODBUS_RTU_FRAME_BYTES) {
+		_mb_ms_frame_end(master);
 	}
+	return event != MODBUS_RTU_FRAME_DISCARD;
 }
 
-void _mb_ms_make_read_analog_packet(modbus_response_t* packet)
+void _mb_ms_frame_end(modbus_master_t* master)
 {
-	for (uint16_t i = 0; i < mb_master_state.data_resp.data_len; i += 2) {
-		packet->response[i / 2] = (mb_master_state.special_data[i] << 8) | (mb_master_state.special_data[i + 1]);
+	/* A complete response was already processed, the rest of one is a failed transaction */
+	if (master->response_bytes_len > 0) {
+		modbus_master_timeout_r(master);
 	}
 }
 
-void _mb_ms_make_write_packet(modbus_response_t* packet)
+void _mb_ms_do_internal_error(modbus_master_t* master)
 {
-	packet->response[0] = (mb_master_state.special_data[0] << 8) | (mb_master_state.special_data[1]);
+	if (master->internal_error_handler != NULL) {
+		master->internal_error_handler(master->user_context);
+	}
+	_mb_ms_reset_data(master);
 }
 
-void _mb_ms_fsm_response_slave_id(uint8_t byte)
+void _mb_ms_reject_request(modbus_master_t* master)
 {
-	mb_master_state.data_resp.id = byte;
-	mb_master_state.data_counter = 0;
-	mb_master_state.response_byte_handler = _mb_ms_fsm_response_command;
+	/* A request that can't be sent leaves the one in flight alone */
+	if (!_mb_ms_is_busy(master)) {
+		_mb_ms_do_internal_error(master);
+	} else if (master->internal_error_handler != NULL) {
+		master->internal_error_handler(master->user_context);
+	}
 }
 
-void _mb_ms_fsm_response_command(uint8_t byte)
+void _mb_ms_make_read_discrete_packet(modbus_master_t* master, modbus_response_t* packet)
 {
-	mb_master_state.data_resp.command = byte;
-	mb_master_state.data_counter = 0;
-	if (_mb_ms_is_read_command()) {
-		mb_master_state.response_byte_handler = _mb_ms_fsm_response_data_len;
-	} else if (_mb_ms_is_write_single_reg_command() || _mb_ms_is_write_multiple_reg_command()) {
-		mb_master_state.response_byte_handler = _mb_ms_fsm_response_register_addr;
+	for (uint16_t i = 0; i < master->data_resp.data_len; i++) {
+		packet->response[i] = master->special_data[i];
+	}
+}
+
+void _mb_ms_make_read_analog_packet(modbus_master_t* master, modbus_response_t* packet)
+{
+	for (uint16_t i = 0; i < master->data_resp.data_len; i += 2) {
+		packet->response[i / 2] = (master->special_data[i] << 8) | (master->special_data[i + 1]);
+	}
+}
+
+void _mb_ms_make_write_packet(modbus_master_t* master, modbus_response_t* packet)
+{
+	packet->response[0] = (master->special_data[0] << 8) | (master->special_data[1]);
+	/* AND mask and OR mask of a mask write */
+	if (_mb_ms_is_mask_write_command(master)) {
+		packet->response[1] = (master->special_data[2] << 8) | (master->special_data[3]);
+	}
+}
+
+void _mb_ms_make_file_packet(modbus_master_t* master, modbus_response_t* packet)
+{
+	if (master->data_resp.command == MODBUS_WRITE_FILE_RECORD) {
+		/* File number, record number and record length of the echoed sub-request */
+		if (master->data_resp.data_len < SPECIAL_DATA_FILE_SUB_REQUEST_SIZE || master->special_data[0] != MODBUS_FILE_REFERENCE_TYPE) {
+			packet->status = MODBUS_ERROR_DATA;
+			return;
+		}
+		for (uint16_t i = 0; i < 3; i++) {
+			packet->response[i] = (master->special_data[1 + i * 2] << 8) | (master->special_data[2 + i * 2]);
+		}
+		return;
+	}
+
+	/* One sub-response: its length, the reference type and the records */
+	if (master->data_resp.data_len < 2 || master->special_data[0] != master->data_resp.data_len - 1 || master->special_data[1] != MODBUS_FILE_REFERENCE_TYPE) {
+		packet->status = MODBUS_ERROR_DATA;
+		return;
+	}
+	for (uint16_t i = 2; i + 1 < master->data_resp.data_len; i += 2) {
+		packet->response[(i - 2) / 2] = (master->special_data[i] << 8) | (master->special_data[i + 1]);
+	}
+}
+
+void _mb_ms_fsm_response_slave_id(modbus_master_t* master, uint8_t byte)
+{
+	master->data_resp.id = byte;
+	master->data_counter = 0;
+	master->response_byte_handler = _mb_ms_fsm_response_command;
+}
+
+void _mb_ms_fsm_response_command(modbus_master_t* master, uint8_t byte)
+{
+	master->data_resp.command = byte;
+	master->data_counter = 0;
+	if (_mb_ms_is_read_command(master) || _mb_ms_is_file_command(master)) {
+		master->response_byte_handler = _mb_ms_fsm_response_data_len;
+	} else if (_mb_ms_is_write_single_reg_command(master) || _mb_ms_is_write_multiple_reg_command(master) || _mb_ms_is_mask_write_command(master)) {
+		master->response_byte_handler = _mb_ms_fsm_response_register_addr;
 	} else {
-		mb_master_state.response_byte_handler = _mb_ms_fsm_response_error;
+		master->response_byte_handler = _mb_ms_fsm_response_error;
 	}
 }
 
-void _mb_ms_fsm_response_data_len(uint8_t byte)
+void _mb_ms_fsm_response_data_len(modbus_master_t* master, uint8_t byte)
 {
-	mb_master_state.data_resp.data_len = byte;
+	master->data_resp.data_len = byte;
 
-	mb_master_state.data_counter = 0;
-	mb_master_state.response_byte_handler = _mb_ms_fsm_response_special_data;
+	master->data_counter = 0;
+	master->response_byte_handler = _mb_ms_fsm_response_special_data;
 }
 
-void _mb_ms_fsm_response_register_addr(uint8_t byte)
+void _mb_ms_fsm_response_register_addr(modbus_master_t* master, uint8_t byte)
 {
-	mb_master_state.data_resp.register_addr <<= 8;
-	mb_master_state.data_resp.register_addr |= byte;
-	if (mb_master_state.data_counter == sizeof(mb_master_state.data_resp.register_addr)) {
-		mb_master_state.data_counter = 0;
-		mb_master_state.response_byte_handler = _mb_ms_fsm_response_special_data;
+	master->data_resp.register_addr <<= 8;
+	master->data_resp.register_addr |= byte;
+	if (master->data_counter == sizeof(master->data_resp.register_addr)) {
+		master->data_counter = 0;
+		master->response_byte_handler = _mb_ms_fsm_response_special_data;
 	}
-	if (mb_master_state.data_resp.register_addr >= _mb_ms_get_registers_count(_mb_ms_get_request_register_type())) {
-		_mb_ms_reset_data();
+	if (master->data_resp.register_addr >= _mb_ms_get_registers_count(master, _mb_ms_get_request_register_type(master))) {
+		_mb_ms_reset_data(master);
 	}
 }
 
-void _mb_ms_fsm_response_special_data(uint8_t byte)
+void _mb_ms_fsm_response_special_data(modbus_master_t* master, uint8_t byte)
 {
-	if (!_mb_ms_is_recieved_needed_slave_id()) {
+	if (!_mb_ms_is_recieved_needed_slave_id(master)) {
 		goto do_count_special_data;
 	}
 
 
-	if (_mb_ms_get_response_bytes_count() > _mb_ms_get_registers_count(_mb_ms_get_request_register_type()) * sizeof(uint16_t)) {
-		_mb_ms_do_internal_error();
-		_mb_ms_reset_data();
+	if (!_mb_ms_is_file_command(master) && _mb_ms_get_response_bytes_count(master) > _mb_ms_get_registers_count(master, _mb_ms_get_request_register_type(master)) * sizeof(uint16_t)) {
+		_mb_ms_do_internal_error(master);
+		_mb_ms_reset_data(master);
 		return;
 	}
 
-	if (mb_master_state.data_counter > sizeof(mb_master_state.special_data)) {
-		_mb_ms_do_internal_error();
-		_mb_ms_reset_data();
+	if (master->data_counter > sizeof(master->special_data)) {
+		_mb_ms_do_internal_error(master);
+		_mb_ms_reset_data(master);
 		return;
 	}
 
-	mb_master_state.special_data[mb_master_state.data_counter - 1] = byte;
+	master->special_data[master->data_counter - 1] = byte;
 
 
 do_count_special_data:
-	if (mb_master_state.data_counter == _mb_ms_get_response_bytes_count()) {
-		mb_master_state.data_counter = 0;
-		mb_master_state.response_byte_handler = _mb_ms_fsm_response_crc;
+	if (master->data_counter == _mb_ms_get_response_bytes_count(master)) {
+		master->data_counter = 0;
+		master->response_byte_handler = _mb_ms_fsm_response_crc;
 	}
 }
 
-void _mb_ms_fsm_response_error(uint8_t byte)
+void _mb_ms_fsm_response_error(modbus_master_t* master, uint8_t byte)
 {
-	mb_master_state.special_data[0] = byte;
-	mb_master_state.data_counter = 0;
-	mb_master_state.response_byte_handler = _mb_ms_fsm_response_crc;
+	master->special_data[0] = byte;
+	master->data_counter = 0;
+	master->response_byte_handler = _mb_ms_fsm_response_crc;
 }
 
-void _mb_ms_fsm_response_crc(uint8_t byte)
+void _mb_ms_fsm_response_crc(modbus_master_t* master, uint8_t byte)
 {
-	mb_master_state.data_resp.crc >>= 8;
-	mb_master_state.data_resp.crc |= (byte << 8);
+	master->data_resp.crc >>= 8;
+	master->data_resp.crc |= (byte << 8);
 
-	if (mb_master_state.data_counter < sizeof(mb_master_state.data_resp.crc)) {
+	if (master->data_counter < sizeof(master->data_resp.crc)) {
 		return;
 	}
 
-	if (!_mb_ms_is_recieved_needed_slave_id()) {
-		mb_master_state.data_counter = 0;
-		mb_master_state.response_byte_handler = _mb_ms_fsm_response_slave_id;
+	if (!_mb_ms_is_recieved_needed_slave_id(master)) {
+		master->data_counter = 0;
+		master->response_byte_handler = _mb_ms_fsm_response_slave_id;
 		goto do_reset_data;
 	}
 
-	_mb_ms_response_proccess();
+	_mb_ms_response_proccess(master);
 
 do_reset_data:
-	_mb_ms_reset_data();
+	_mb_ms_reset_data(master);
+	_mb_ms_file_transfer_continue(master);
+	_mb_ms_dispatch_next(master);
 }
 
-uint16_t _mb_ms_get_response_bytes_count(void)
+uint16_t _mb_ms_get_response_bytes_count(modbus_master_t* master)
 {
+	if (_mb_ms_is_file_command(master)) {
+		return master->data_resp.data_len;
+	}
+#if MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT
+	if (_mb_ms_is_mask_write_command(master)) {
+		return SPECIAL_DATA_MASK_WRITE_COUNT;
+	}
+#endif
 #if MODBUS_MASTER_OUTPUT_COILS_COUNT || MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT
-	if (!_mb_ms_is_read_command()) {
+	if (!_mb_ms_is_read_command(master)) {
 		return 2;
 	}
 #endif
 #if MODBUS_MASTER_OUTPUT_COILS_COUNT || MODBUS_MASTER_INPUT_COILS_COUNT || MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT || MODBUS_MASTER_INPUT_REGISTERS_COUNT
-	if (_mb_ms_is_read_command()) {
-		return mb_master_state.data_resp.data_len;
+	if (_mb_ms_is_read_command(master)) {
+		return master->data_resp.data_len;
 	}
 #endif
 	return 0;
 }
 
-bool _mb_ms_is_read_command(void)
+bool _mb_ms_is_read_command(modbus_master_t* master)
+{
+	return master->data_resp.command == MODBUS_READ_COILS || master->data_resp.command == MODBUS_READ_HOLDING_REGISTERS || master->data_resp.command == MODBUS_READ_INPUT_REGISTERS || master->data_resp.command == MODBUS_READ_INPUT_STATUS || master->data_resp.command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS;
+}
+
+bool _mb_ms_is_write_single_reg_command(modbus_master_t* master)
+{
+	return master->data_resp.command == MODBUS_FORCE_SINGLE_COIL || master->data_resp.command == MODBUS_PRESET_SINGLE_REGISTER;
+}
+
+bool _mb_ms_is_write_multiple_reg_command(modbus_master_t* master)
+{
+	return master->data_resp.command == MODBUS_FORCE_MULTIPLE_COILS || master->data_resp.command == MODBUS_PRESET_MULTIPLE_REGISTERS;
+}
+
+bool _mb_ms_is_mask_write_command(modbus_master_t* master)
 {
-	return mb_master_state.data_resp.command == MODBUS_READ_COILS || mb_master_state.data_resp.command == MODBUS_READ_HOLDING_REGISTERS || mb_master_state.data_resp.command == MODBUS_READ_INPUT_REGISTERS || mb_master_state.data_resp.command == MODBUS_READ_INPUT_STATUS;
+	return master->data_resp.command == MODBUS_MASK_WRITE_REGISTER;
 }
 
-bool _mb_ms_is_write_single_reg_command(void)
+bool _mb_ms_is_file_command(modbus_master_t* master)
 {
-	return mb_master_state.data_resp.command == MODBUS_FORCE_SINGLE_COIL || mb_master_state.data_resp.command == MODBUS_PRESET_SINGLE_REGISTER;
+	return master->data_resp.command == MODBUS_READ_FILE_RECORD || master->data_resp.command == MODBUS_WRITE_FILE_RECORD;
 }
 
-bool _mb_ms_is_write_multiple_reg_command(void)
+bool _mb_ms_is_read_discrete_reg_command(modbus_master_t* master)
 {
-	return mb_master_state.data_resp.command == MODBUS_FORCE_MULTIPLE_COILS || mb_master_state.data_resp.command == MODBUS_PRESET_MULTIPLE_REGISTERS;
+	return master->data_resp.command == MODBUS_READ_COILS || master->data_resp.command == MODBUS_READ_INPUT_STATUS;
 }
 
-bool _mb_ms_is_read_discrete_reg_command(void)
+bool _mb_ms_is_read_analog_reg_command(modbus_master_t* master)
 {
-	return mb_master_state.data_resp.command == MODBUS_READ_COILS || mb_master_state.data_resp.command == MODBUS_READ_INPUT_STATUS;
+	/* A read/write response carries the read registers only */
+	return master->data_resp.command == MODBUS_READ_HOLDING_REGISTERS || master->data_resp.command == MODBUS_READ_INPUT_REGISTERS || master->data_resp.command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS;
 }
 
-bool _mb_ms_is_read_analog_reg_command(void)
+bool _mb_ms_is_recieved_needed_slave_id(modbus_master_t* master)
 {
-	return mb_master_state.data_resp.command == MODBUS_READ_HOLDING_REGISTERS || mb_master_state.data_resp.command == MODBUS_READ_INPUT_REGISTERS;
+	return master->data_req.id == master->data_resp.id;
 }
 
-bool _mb_ms_is_recieved_needed_slave_id(void)
+bool _mb_ms_is_broadcast_pending(modbus_master_t* master)
 {
-	return mb_master_state.data_req.id == mb_master_state.data_resp.id;
+	return master->data_req.id == MODBUS_BROADCAST_ID && master->data_req.command != 0;
 }
 
-bool _mb_ms_check_response_crc(void) {
-	return mb_master_state.data_resp.crc == modbus_crc16(mb_master_state.response_bytes, (uint16_t)(mb_master_state.response_bytes_len - sizeof(uint16_t)));
+bool _mb_ms_check_request_slave_id(uint8_t slave_id, uint8_t command)
+{
+	if (slave_id != MODBUS_BROADCAST_ID) {
+		return true;
+	}
+	/* Only writes can be broadcast, a read would have no response to carry the values */
+	return false
+		|| command == MODBUS_FORCE_SINGLE_COIL
+		|| command == MODBUS_PRESET_SINGLE_REGISTER
+		|| command == MODBUS_FORCE_MULTIPLE_COILS
+		|| command == MODBUS_PRESET_MULTIPLE_REGISTERS
+		|| command == MODBUS_MASK_WRITE_REGISTER
+		|| command == MODBUS_WRITE_FILE_RECORD;
+}
+
+bool _mb_ms_is_combinable_write(const uint8_t* request)
+{
+	if (request[0] == MODBUS_BROADCAST_ID) {
+		return false;
+	}
+	/* A coil value other than on or off is left to the slave to refuse on its own */
+	uint16_t value = (uint16_t)((request[4] << 8) | request[5]);
+	return request[1] == MODBUS_PRESET_SINGLE_REGISTER
+		|| (request[1] == MODBUS_FORCE_SINGLE_COIL && (value == 0xFF00 || value == 0x0000));
+}
+
+bool _mb_ms_is_busy(modbus_master_t* master)
+{
+	/* A request is in flight from its transmission until its response, timeout or turnaround delay */
+	return master->data_req.command != 0;
+}
+
+bool _mb_ms_check_response_crc(modbus_master_t* master) {
+	/* CRC over the frame including its own CRC bytes is zero */
+	return master->response_crc == 0;
 }
 
-bool _mb_ms_check_response_command(void)
+bool _mb_ms_check_response_command(modbus_master_t* master)
 {
 	return false
+		|| master->data_resp.command == MODBUS_READ_FILE_RECORD
+		|| master->data_resp.command == MODBUS_WRITE_FILE_RECORD
 #if MODBUS_MASTER_OUTPUT_COILS_COUNT
-		|| mb_master_state.data_resp.command == MODBUS_READ_COILS
-		|| mb_master_state.data_resp.command == MODBUS_FORCE_SINGLE_COIL
-		|| mb_master_state.data_resp.command == MODBUS_FORCE_MULTIPLE_COILS
+		|| master->data_resp.command == MODBUS_READ_COILS
+		|| master->data_resp.command == MODBUS_FORCE_SINGLE_COIL
+		|| master->data_resp.command == MODBUS_FORCE_MULTIPLE_COILS
 #endif
 #if MODBUS_MASTER_INPUT_COILS_COUNT
-		|| mb_master_state.data_resp.command == MODBUS_READ_INPUT_STATUS
+		|| master->data_resp.command == MODBUS_READ_INPUT_STATUS
 #endif
 #if MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT
-		|| mb_master_state.data_resp.command == MODBUS_READ_HOLDING_REGISTERS
-		|| mb_master_state.data_resp.command == MODBUS_PRESET_SINGLE_REGISTER
-		|| mb_master_state.data_resp.command == MODBUS_PRESET_MULTIPLE_REGISTERS
+		|| master->data_resp.command == MODBUS_READ_HOLDING_REGISTERS
+		|| master->data_resp.command == MODBUS_PRESET_SINGLE_REGISTER
+		|| master->data_resp.command == MODBUS_PRESET_MULTIPLE_REGISTERS
+		|| master->data_resp.command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS
+		|| master->data_resp.command == MODBUS_MASK_WRITE_REGISTER
 #endif
 #if MODBUS_MASTER_INPUT_REGISTERS_COUNT
-		|| mb_master_state.data_resp.command == MODBUS_READ_INPUT_REGISTERS
+		|| master->data_resp.command == MODBUS_READ_INPUT_REGISTERS
 #endif
 		;
 }
 
-uint16_t _mb_ms_get_registers_count(register_type_t register_type)
+uint16_t _mb_ms_get_registers_count(modbus_master_t* master, register_type_t register_type)
 {
+	(void)master;
 	(void)register_type;
 #if MODBUS_MASTER_INPUT_COILS_COUNT
 	if (register_type == MODBUS_REGISTER_DISCRETE_INPUT_COILS) {
@@ -572,12 +1746,12 @@ uint16_t _mb_ms_get_registers_count(register_type_t register_type)
 	return 0;
 }
 
-register_type_t _mb_ms_get_request_register_type()
+register_type_t _mb_ms_get_request_register_type(modbus_master_t* master)
 {
 
 	register_type_t  register_type = 0;
 #if MODBUS_MASTER_INPUT_COILS_COUNT | MODBUS_MASTER_OUTPUT_COILS_COUNT | MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT | MODBUS_MASTER_INPUT_REGISTERS_COUNT
-	modbus_command_t command       = mb_master_state.data_req.command;
+	modbus_command_t command       = master->data_req.command;
 #endif
 #if MODBUS_MASTER_INPUT_COILS_COUNT
 	if (command == MODBUS_READ_INPUT_STATUS) {
@@ -590,7 +1764,7 @@ register_type_t _mb_ms_get_request_register_type()
 	}
 #endif
 #if MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT
-	if (command == MODBUS_PRESET_MULTIPLE_REGISTERS || command == MODBUS_PRESET_SINGLE_REGISTER || command == MODBUS_READ_HOLDING_REGISTERS) {
+	if (command == MODBUS_PRESET_MULTIPLE_REGISTERS || command == MODBUS_PRESET_SINGLE_REGISTER || command == MODBUS_READ_HOLDING_REGISTERS || command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS || command == MODBUS_MASK_WRITE_REGISTER) {
 		register_type = MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS;
 	}
 #endif
@@ -601,3 +1775,41 @@ register_type_t _mb_ms_get_request_register_type()
 #endif
 	return register_type;
 }
+
+void _mb_ms_legacy_request_data_sender(void* user_context, uint8_t* data, uint32_t len)
+{
+	(void)user_context;
+	if (mb_master_legacy_request_data_sender != NULL) {
+		mb_master_legacy_request_data_sender(data, len);
+	}
+}
+
+void _mb_ms_legacy_response_packet_handler(void* user_context, modbus_response_t* packet)
+{
+	(void)user_context;
+	if (mb_master_legacy_response_packet_handler != NULL) {
+		mb_master_legacy_response_packet_handler(packet);
+	}
+}
+
+void _mb_ms_legacy_internal_error_handler(void* user_context)
+{
+	(void)user_context;
+	if (mb_master_legacy_internal_error_handler != NULL) {
+		mb_master_legacy_internal_error_handler();
+	}
+}
+
+void _mb_ms_legacy_file_complete_handler(void* user_context, modbus_error_response_t status, uint16_t records_done)
+{
+	(void)user_context;
+	if (mb_master_legacy_file_complete_handler != NULL) {
+		mb_master_legacy_file_complete_handler(status, records_done);
+	}
+}
+
+uint32_t _mb_ms_legacy_clock(void* user_context)
+{
+	(void)user_context;
+	return mb_master_legacy_clock != NULL ? mb_master_legacy_clock() : 0;
+}
@@ -11,11 +11,41 @@
 #include "modbus_rtu_base.h"
 
 
+#ifndef MODBUS_SLAVE_REGISTERS_WIRE_ORDER
+#   define MODBUS_SLAVE_REGISTERS_WIRE_ORDER (false)
+#endif
+
+/* A full list merges two ranges of the same type, which needs more slots than register types */
+#if MODBUS_SLAVE_DIRTY_RANGES <= MODBUS_SLAVE_REGISTER_TYPES
+#   error "MODBUS_SLAVE_DIRTY_RANGES must be greater than MODBUS_SLAVE_REGISTER_TYPES"
+#endif
+
+/* Single core targets read snapshots from an interrupt, a volatile byte access is enough there */
+#if defined(__GNUC__) && !defined(SDCC) && !defined(__SDCC)
+#   define MB_SL_SEQUENCE_LOAD(sequence)          __atomic_load_n((sequence), __ATOMIC_ACQUIRE)
+#   define MB_SL_SEQUENCE_STORE(sequence, value)  __atomic_store_n((sequence), (value), __ATOMIC_RELEASE)
+#   define MB_SL_SEQUENCE_FENCE()                 __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#   define MB_SL_SEQUENCE_BARRIER()               __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#   define MB_SL_SEQUENCE_LOAD(sequence)          (*(sequence))
+#   define MB_SL_SEQUENCE_STORE(sequence, value)  (*(sequence) = (value))
+#   define MB_SL_SEQUENCE_FENCE()
+#   define MB_SL_SEQUENCE_BARRIER()
+#endif
+
+/* Frames of functions without a known layout can't be skipped */
+#define MB_SL_FRAME_LEN_UNKNOWN ((uint16_t)0xFFFF)
+/* Longest RTU frame, a longer size read from a header is wrong */
+#define MB_SL_FRAME_LEN_MAX     (256)
+/* A request is answered early from its header, the read/write one is the longest */
+#define MB_SL_EARLY_HEADER_SIZE (16)
+
+
 #if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-bool mb_discrete_output_coils[MODBUS_SLAVE_OUTPUT_COILS_COUNT] = { 0 };
+uint8_t mb_discrete_output_coils[MODBUS_COILS_BYTES(MODBUS_SLAVE_OUTPUT_COILS_COUNT)] = { 0 };
 #endif
 #if MODBUS_SLAVE_INPUT_COILS_COUNT
-bool mb_discrete_input_coils[MODBUS_SLAVE_INPUT_COILS_COUNT] = { 0 };
+uint8_t mb_discrete_input_coils[MODBUS_COILS_BYTES(MODBUS_SLAVE_INPUT_COILS_COUNT)] = { 0 };
 #endif
 #if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
 uint16_t mb_analog_input_registers[MODBUS_SLAVE_INPUT_REGISTERS_COUNT] = { 0 };
@@ -25,51 +55,163 @@ uint16_t mb_analog_output_holding_registers[MODBUS_SLAVE_OUTPUT_HOLDING_REGISTER
 #endif
 
 
-void _mb_sl_do_internal_error(void);
-
-void _mb_sl_fsm_request_slave_id(uint8_t byte);
-void _mb_sl_fsm_request_command(uint8_t byte);
-void _mb_sl_fsm_request_register_addr(uint8_t byte);
-void _mb_sl_fsm_request_special_data(uint8_t byte);
-void _mb_sl_fsm_request_crc(uint8_t byte);
-
-void _mb_sl_request_proccess(void);
-void _mb_sl_write_single_register(void);
-void _mb_sl_write_multiple_registers(void);
-void _mb_sl_make_error_response(modbus_error_types_t error_type);
-void _mb_sl_send_response(void);
-
-bool _mb_sl_is_read_command(void);
-bool _mb_sl_is_write_single_reg_command(void);
-bool _mb_sl_is_write_multiple_reg_command(void);
-bool _mb_sl_is_recieved_own_slave_id(void);
-bool _mb_sl_check_available_request_command(void);
-bool _mb_sl_check_request_register_addr(void);
-bool _mb_sl_check_request_registers_count(void);
-uint16_t _mb_sl_get_special_data_first_value(void);
-uint16_t _mb_sl_get_needed_registers_count(void);
-uint16_t _mb_sl_get_registers_count(register_type_t register_type);
-
-
-void _mb_sl_make_read_response(void);
-void _mb_sl_make_write_single_response(void);
-void _mb_sl_make_write_multiple_response(void);
-
-register_type_t _mb_sl_get_request_register_type();
-
+void _mb_sl_do_internal_error(modbus_slave_t* slave);
+
+void _mb_sl_fsm_request_slave_id(modbus_slave_t* slave, uint8_t byte);
+void _mb_sl_fsm_request_command(modbus_slave_t* slave, uint8_t byte);
+void _mb_sl_fsm_request_register_addr(modbus_slave_t* slave, uint8_t byte);
+void _mb_sl_fsm_request_special_data(modbus_slave_t* slave, uint8_t byte);
+void _mb_sl_fsm_request_crc(modbus_slave_t* slave, uint8_t byte);
+void _mb_sl_fsm_foreign_frame(modbus_slave_t* slave, uint8_t byte);
+uint16_t _mb_sl_get_foreign_frame_len(const uint8_t* frame, uint16_t received, bool response);
+void _mb_sl_skip_foreign_bytes(modbus_slave_t* slave, const uint8_t* data, uint16_t len);
+bool _mb_sl_is_receiving_request(modbus_slave_t* slave);
+
+void _mb_sl_request_proccess(modbus_slave_t* slave);
+void _mb_sl_request_proccess_early(modbus_slave_t* slave);
+void _mb_sl_write_single_register(modbus_slave_t* slave);
+void _mb_sl_write_multiple_registers(modbus_slave_t* slave);
+void _mb_sl_mask_write_register(modbus_slave_t* slave);
+bool _mb_sl_write_file_records(modbus_slave_t* slave);
+void _mb_sl_notify_written_registers(modbus_slave_t* slave);
+void _mb_sl_add_dirty_range(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count);
+void _mb_sl_merge_closest_dirty_ranges(modbus_slave_t* slave, uint8_t list);
+void _mb_sl_remove_dirty_range(modbus_slave_t* slave, uint8_t list, uint8_t idx);
+void _mb_sl_make_error_response(modbus_slave_t* slave, modbus_error_types_t error_type);
+void _mb_sl_send_response(modbus_slave_t* slave);
+
+bool _mb_sl_is_read_command(modbus_slave_t* slave);
+bool _mb_sl_is_write_single_reg_command(modbus_slave_t* slave);
+bool _mb_sl_is_write_multiple_reg_command(modbus_slave_t* slave);
+bool _mb_sl_is_read_write_command(modbus_slave_t* slave);
+bool _mb_sl_is_mask_write_command(modbus_slave_t* slave);
+bool _mb_sl_is_file_command(modbus_slave_t* slave);
+bool _mb_sl_is_recieved_own_slave_id(modbus_slave_t* slave);
+bool _mb_sl_is_broadcast_request(modbus_slave_t* slave);
+bool _mb_sl_check_available_request_command(modbus_slave_t* slave);
+bool _mb_sl_check_request_register_addr(modbus_slave_t* slave);
+bool _mb_sl_check_request_write_register_addr(modbus_slave_t* slave);
+bool _mb_sl_check_request_writable(modbus_slave_t* slave);
+bool _mb_sl_check_request_registers_count(modbus_slave_t* slave);
+bool _mb_sl_check_file_byte_count(modbus_slave_t* slave);
+bool _mb_sl_check_file_request(modbus_slave_t* slave);
+uint16_t _mb_sl_get_file_response_len(modbus_slave_t* slave);
+uint16_t _mb_sl_get_special_data_first_value(modbus_slave_t* slave);
+uint16_t _mb_sl_get_special_data_value(modbus_slave_t* slave, uint8_t idx);
+uint8_t _mb_sl_get_special_data_meta_count(modbus_slave_t* slave);
+uint16_t _mb_sl_get_needed_registers_count(modbus_slave_t* slave);
+uint16_t _mb_sl_get_write_register_addr(modbus_slave_t* slave);
+uint16_t _mb_sl_get_write_registers_count(modbus_slave_t* slave);
+uint16_t _mb_sl_get_segments(modbus_slave_t* slave, register_type_t register_type, const modbus_slave_segment_t** segments);
+const modbus_slave_segment_t* _mb_sl_find_segment(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id);
+bool _mb_sl_check_registers_range(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count);
+bool _mb_sl_check_registers_writable(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count);
+void _mb_sl_copy_registers(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count, uint8_t* data, bool to_storage, bool from_request);
+void _mb_sl_copy_chunk(modbus_slave_t* slave, bool coils, void* storage, uint16_t offset, uint8_t* data, uint16_t done, uint16_t chunk, bool to_storage);
+void* _mb_sl_get_segment_storage(const modbus_slave_segment_t* segment, modbus_slave_sequence_t* sequence);
+bool _mb_sl_is_coils(register_type_t register_type);
+bool _mb_sl_get_coil(const uint8_t* coils, uint16_t coil_id);
+void _mb_sl_set_coil(uint8_t* coils, uint16_t coil_id, bool value);
+uint16_t _mb_sl_get_register(modbus_slave_t* slave, const uint16_t* registers, uint16_t register_id);
+void _mb_sl_set_register(modbus_slave_t* slave, uint16_t* registers, uint16_t register_id, uint16_t value);
+
+
+bool _mb_sl_dispatch_byte(modbus_slave_t* slave, uint8_t byte);
+void _mb_sl_dispatch_broadcast_byte(modbus_slave_t* slave, uint8_t byte, bool frame_start);
+void _mb_sl_dispatch_reset(modbus_slave_t* slave);
+bool _mb_sl_is_dispatching(modbus_slave_t* slave);
+
+bool _mb_sl_framer_accept(modbus_slave_t* slave, uint32_t now_us, size_t count);
+
+size_t _mb_sl_get_payload_span(modbus_slave_t* slave, size_t len);
+void _mb_sl_receive_payload(modbus_slave_t* slave, const uint8_t* data, size_t len);
+
+uint16_t _mb_sl_get_response_data_len(modbus_slave_t* slave);
+uint16_t _mb_sl_make_read_response(modbus_slave_t* slave, uint8_t* data);
+uint16_t _mb_sl_make_write_single_response(modbus_slave_t* slave, uint8_t* data);
+uint16_t _mb_sl_make_write_multiple_response(modbus_slave_t* slave, uint8_t* data);
+uint16_t _mb_sl_make_mask_write_response(modbus_slave_t* slave, uint8_t* data);
+uint16_t _mb_sl_make_read_file_response(modbus_slave_t* slave, uint8_t* data);
+uint16_t _mb_sl_make_write_file_response(modbus_slave_t* slave, uint8_t* data);
+
+register_type_t _mb_sl_get_request_register_type(modbus_slave_t* slave);
+
+void _mb_sl_legacy_response_data_handler(void* user_context, uint8_t* data, uint32_t len);
+void _mb_sl_legacy_internal_error_handler(void* user_context);
+uint8_t* _mb_sl_legacy_tx_buffer_provider(void* user_context, uint32_t len);
+void _mb_sl_legacy_tx_buffer_commit(void* user_context, uint8_t* data, uint32_t len);
+void _mb_sl_legacy_write_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count);
+bool _mb_sl_legacy_file_read_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, uint8_t* data);
+bool _mb_sl_legacy_file_write_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, const uint8_t* data);
+
+
+void (*mb_slave_legacy_response_data_handler) (uint8_t*, uint32_t) = NULL;
+void (*mb_slave_legacy_internal_error_handler) (void) = NULL;
+uint8_t* (*mb_slave_legacy_tx_buffer_provider) (uint32_t) = NULL;
+void (*mb_slave_legacy_tx_buffer_commit) (uint8_t*, uint32_t) = NULL;
+void (*mb_slave_legacy_write_handler) (register_type_t, uint16_t, uint16_t) = NULL;
+bool (*mb_slave_legacy_file_read_handler) (uint16_t, uint16_t, uint16_t, uint8_t*) = NULL;
+bool (*mb_slave_legacy_file_write_handler) (uint16_t, uint16_t, uint16_t, const uint8_t*) = NULL;
 
 modbus_slave_state_t mb_slave_state = {
-    .slave_id = 0x00, 
+    .slave_id = 0x00,
+    .user_context = NULL,
     .response_data_handler = NULL,
     .internal_error_handler = NULL,
+    .tx_buffer_provider = NULL,
+    .tx_buffer_commit = NULL,
     .request_byte_handler = _mb_sl_fsm_request_slave_id,
+    .registers = {
+        .registers_wire_order = MODBUS_SLAVE_REGISTERS_WIRE_ORDER,
+#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
+        .discrete_output_coils = mb_discrete_output_coils,
+        .discrete_output_coils_count = MODBUS_SLAVE_OUTPUT_COILS_COUNT,
+#endif
+#if MODBUS_SLAVE_INPUT_COILS_COUNT
+        .discrete_input_coils = mb_discrete_input_coils,
+        .discrete_input_coils_count = MODBUS_SLAVE_INPUT_COILS_COUNT,
+#endif
+#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
+        .analog_input_registers = mb_analog_input_registers,
+        .analog_input_registers_count = MODBUS_SLAVE_INPUT_REGISTERS_COUNT,
+#endif
+#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
+        .analog_output_holding_registers = mb_analog_output_holding_registers,
+        .analog_output_holding_registers_count = MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT,
+#endif
+    },
+    .dense_segments = {
+#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
+        { 0, MODBUS_SLAVE_OUTPUT_COILS_COUNT, mb_discrete_output_coils, NULL, NULL },
+#else
+        { 0, 0, NULL, NULL, NULL },
+#endif
+#if MODBUS_SLAVE_INPUT_COILS_COUNT
+        { 0, MODBUS_SLAVE_INPUT_COILS_COUNT, mb_discrete_input_coils, NULL, NULL },
+#else
+        { 0, 0, NULL, NULL, NULL },
+#endif
+#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
+        { 0, MODBUS_SLAVE_INPUT_REGISTERS_COUNT, mb_analog_input_registers, NULL, NULL },
+#else
+        { 0, 0, NULL, NULL, NULL },
+#endif
+#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
+        { 0, MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT, mb_analog_output_holding_registers, NULL, NULL },
+#else
+        { 0, 0, NULL, NULL, NULL },
+#endif
+    },
     .data_req = {0},
     .data_resp = {0},
 	.special_data = {0},
     .data_handler_counter = 0,
     .is_error_response = false,
 
+    .framer = MODBUS_RTU_FRAMER_INIT(MODBUS_RTU_DEFAULT_BAUD_RATE, MODBUS_RTU_DEFAULT_CHAR_BITS),
+
     .req_data_bytes_idx = 0,
+    .req_crc = MODBUS_CRC16_INIT,
     .req_data_bytes = {0}
 };
 
@@ -77,624 +219,1712 @@ modbus_slave_state_t mb_slave_state = {
 void modbus_slave_set_response_data_handler(void (*response_data_handler) (uint8_t*, uint32_t))
 {
     if (response_data_handler != NULL) {
-        mb_slave_state.response_data_handler = response_data_handler;
+        mb_slave_legacy_response_data_handler = response_data_handler;
+        modbus_slave_set_response_data_handler_r(&mb_slave_state, _mb_sl_legacy_response_data_handler);
     }
 }
 
 void modbus_slave_set_internal_error_handler(void (*request_error_handler) (void))
 {
-
     if (request_error_handler != NULL) {
-        mb_slave_state.internal_error_handler = request_error_handler;
+        mb_slave_legacy_internal_error_handler = request_error_handler;
+        modbus_slave_set_internal_error_handler_r(&mb_slave_state, _mb_sl_legacy_internal_error_handler);
     }
 }
 
+void modbus_slave_set_tx_buffer_handlers(uint8_t* (*tx_buffer_provider) (uint32_t), void (*tx_buffer_commit) (uint8_t*, uint32_t))
+{
+    mb_slave_legacy_tx_buffer_provider = tx_buffer_provider;
+    mb_slave_legacy_tx_buffer_commit   = tx_buffer_commit;
+    modbus_slave_set_tx_buffer_handlers_r(
+        &mb_slave_state,
+        tx_buffer_provider != NULL ? _mb_sl_legacy_tx_buffer_provider : NULL,
+        tx_buffer_commit != NULL ? _mb_sl_legacy_tx_buffer_commit : NULL
+    );
+}
+
+void modbus_slave_set_write_handler(void (*write_handler) (register_type_t, uint16_t, uint16_t))
+{
+    mb_slave_legacy_write_handler = write_handler;
+    modbus_slave_set_write_handler_r(&mb_slave_state, write_handler != NULL ? _mb_sl_legacy_write_handler : NULL);
+}
+
+void modbus_slave_set_file_record_handlers(bool (*file_read_handler) (uint16_t, uint16_t, uint16_t, uint8_t*), bool (*file_write_handler) (uint16_t, uint16_t, uint16_t, const uint8_t*))
+{
+    mb_slave_legacy_file_read_handler  = file_read_handler;
+    mb_slave_legacy_file_write_handler = file_write_handler;
+    modbus_slave_set_file_record_handlers_r(
+        &mb_slave_state,
+        file_read_handler != NULL ? _mb_sl_legacy_file_read_handler : NULL,
+        file_write_handler != NULL ? _mb_sl_legacy_file_write_handler : NULL
+    );
+}
+
+void modbus_slave_set_units(modbus_slave_t* const* units)
+{
+    modbus_slave_set_units_r(&mb_slave_state, units);
+}
+
 void modbus_slave_recieve_data_byte(uint8_t byte)
 {
-    if (mb_slave_state.request_byte_handler != NULL) {
-        mb_slave_state.req_data_bytes[mb_slave_state.req_data_bytes_idx++] = byte;
+    modbus_slave_recieve_data_byte_r(&mb_slave_state, byte);
+}
 
-        mb_slave_state.data_handler_counter++;
-        mb_slave_state.request_byte_handler(byte);
-    } else {
-        _mb_sl_do_internal_error();
-        modbus_slave_clear_data();
-    }
-    if (mb_slave_state.req_data_bytes_idx >= sizeof(mb_slave_state.req_data_bytes)) {
-    	mb_slave_state.req_data_bytes_idx = 0;
-        modbus_slave_clear_data();
-    }
+size_t modbus_slave_receive_buffer(const uint8_t* data, size_t len)
+{
+    return modbus_slave_receive_buffer_r(&mb_slave_state, data, len);
 }
 
 void modbus_slave_set_slave_id(uint8_t new_slave_id)
 {
-    mb_slave_state.slave_id = new_slave_id;
-    modbus_slave_clear_data();
+    modbus_slave_set_slave_id_r(&mb_slave_state, new_slave_id);
 }
 
 void modbus_slave_timeout(void)
 {
-    modbus_slave_clear_data();
+    modbus_slave_timeout_r(&mb_slave_state);
+}
+
+void modbus_slave_set_framing(uint32_t baud_rate, uint8_t char_bits)
+{
+    modbus_slave_set_framing_r(&mb_slave_state, baud_rate, char_bits);
+}
+
+void modbus_slave_recieve_data_byte_at(uint8_t byte, uint32_t now_us)
+{
+    modbus_slave_recieve_data_byte_at_r(&mb_slave_state, byte, now_us);
+}
+
+void modbus_slave_receive_buffer_at(const uint8_t* data, size_t len, uint32_t now_us)
+{
+    modbus_slave_receive_buffer_at_r(&mb_slave_state, data, len, now_us);
+}
+
+void modbus_slave_poll(uint32_t now_us)
+{
+    modbus_slave_poll_r(&mb_slave_state, now_us);
+}
+
+void modbus_slave_clear_data(void)
+{
+    modbus_slave_clear_data_r(&mb_slave_state);
 }
 
 uint16_t modbus_slave_get_register_value(register_type_t register_type, uint16_t register_id)
 {
-    if (register_id >= _mb_sl_get_registers_count(register_type)) {
-        _mb_sl_make_error_response(MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
-        _mb_sl_send_response();
-        modbus_slave_clear_data();
+    return modbus_slave_get_register_value_r(&mb_slave_state, register_type, register_id);
+}
+
+void modbus_slave_set_register_value(register_type_t register_type, uint16_t register_id, uint16_t value)
+{
+    modbus_slave_set_register_value_r(&mb_slave_state, register_type, register_id, value);
+}
+
+bool modbus_slave_get_coils(register_type_t register_type, uint16_t start_id, uint16_t count, uint8_t* bits)
+{
+    return modbus_slave_get_coils_r(&mb_slave_state, register_type, start_id, count, bits);
+}
+
+bool modbus_slave_set_coils(register_type_t register_type, uint16_t start_id, uint16_t count, const uint8_t* bits)
+{
+    return modbus_slave_set_coils_r(&mb_slave_state, register_type, start_id, count, bits);
+}
+
+bool modbus_slave_set_segments(register_type_t register_type, const modbus_slave_segment_t* segments, uint16_t segments_count)
+{
+    return modbus_slave_set_segments_r(&mb_slave_state, register_type, segments, segments_count);
+}
+
+uint8_t modbus_slave_consume_dirty_ranges(modbus_slave_range_t* ranges, uint8_t max_count)
+{
+    return modbus_slave_consume_dirty_ranges_r(&mb_slave_state, ranges, max_count);
+}
+
+void modbus_slave_init(modbus_slave_t* slave, const modbus_slave_registers_t* registers, void* user_context)
+{
+    memset((uint8_t*)slave, 0, sizeof(*slave));
+    if (registers != NULL) {
+        slave->registers = *registers;
+    }
+
+    const modbus_slave_segment_t dense_segments[MODBUS_SLAVE_REGISTER_TYPES] = {
+        { 0, slave->registers.discrete_output_coils_count,           slave->registers.discrete_output_coils, NULL, NULL },
+        { 0, slave->registers.discrete_input_coils_count,            slave->registers.discrete_input_coils, NULL, NULL },
+        { 0, slave->registers.analog_input_registers_count,          slave->registers.analog_input_registers, NULL, NULL },
+        { 0, slave->registers.analog_output_holding_registers_count, slave->registers.analog_output_holding_registers, NULL, NULL },
+    };
+    memcpy(slave->dense_segments, dense_segments, sizeof(dense_segments));
+    modbus_rtu_framer_init(&slave->framer, MODBUS_RTU_DEFAULT_BAUD_RATE, MODBUS_RTU_DEFAULT_CHAR_BITS);
+    slave->user_context = user_context;
+    modbus_slave_clear_data_r(slave);
+}
+
+void modbus_slave_set_response_data_handler_r(modbus_slave_t* slave, void (*response_data_handler) (void*, uint8_t*, uint32_t))
+{
+    if (response_data_handler != NULL) {
+        slave->response_data_handler = response_data_handler;
+    }
+}
+
+void modbus_slave_set_internal_error_handler_r(modbus_slave_t* slave, void (*request_error_handler) (void*))
+{
+    if (request_error_handler != NULL) {
+        slave->internal_error_handler = request_error_handler;
+    }
+}
+
+void modbus_slave_set_tx_buffer_handlers_r(modbus_slave_t* slave, uint8_t* (*tx_buffer_provider) (void*, uint32_t), void (*tx_buffer_commit) (void*, uint8_t*, uint32_t))
+{
+    slave->tx_buffer_provider = tx_buffer_provider;
+    slave->tx_buffer_commit   = tx_buffer_commit;
+}
+
+void modbus_slave_set_write_handler_r(modbus_slave_t* slave, void (*write_handler) (void*, register_type_t, uint16_t, uint16_t))
+{
+    slave->write_handler = write_handler;
+}
+
+void modbus_slave_set_file_record_handlers_r(modbus_slave_t* slave, bool (*file_read_handler) (void*, uint16_t, uint16_t, uint16_t, uint8_t*), bool (*file_write_handler) (void*, uint16_t, uint16_t, uint16_t, const uint8_t*))
+{
+    slave->file_read_handler  = file_read_handler;
+    slave->file_write_handler = file_write_handler;
+}
+
+void modbus_slave_set_units_r(modbus_slave_t* slave, modbus_slave_t* const* units)
+{
+    _mb_sl_dispatch_reset(slave);
+    slave->units = units;
+}
+
+void modbus_slave_recieve_data_byte_r(modbus_slave_t* slave, uint8_t byte)
+{
+    /* The rest of a frame for another slave only goes through the CRC */
+    if (slave->skip_bytes > 0) {
+        _mb_sl_skip_foreign_bytes(slave, &byte, 1);
+        return;
+    }
+    if (slave->units != NULL && _mb_sl_dispatch_byte(slave, byte)) {
+        return;
+    }
+    if (slave->request_byte_handler != NULL) {
+        slave->req_data_bytes[slave->req_data_bytes_idx++] = byte;
+        slave->req_crc = modbus_crc16_byte(slave->req_crc, byte);
+
+        slave->data_handler_counter++;
+        slave->request_byte_handler(slave, byte);
+    } else {
+        _mb_sl_do_internal_error(slave);
+        modbus_slave_clear_data_r(slave);
+    }
+    if (slave->req_data_bytes_idx >= sizeof(slave->req_data_bytes)) {
+    	slave->req_data_bytes_idx = 0;
+        modbus_slave_clear_data_r(slave);
+    }
+}
+
+size_t modbus_slave_receive_buffer_r(modbus_slave_t* slave, const uint8_t* data, size_t len)
+{
+    size_t counter = 0;
+    bool in_request = false;
+    while (counter < len) {
+        /* The rest of a frame for another slave, or of a request answered early, is skipped in one step */
+        size_t span = MB_MIN((size_t)slave->skip_bytes, len - counter);
+        if (span > 0) {
+            _mb_sl_skip_foreign_bytes(slave, data + counter, (uint16_t)span);
+            counter += span;
+        } else {
+            in_request = in_request || _mb_sl_is_receiving_request(slave);
+            if (slave->unit != NULL) {
+                /* The unit takes the payload in bulk and stops at the end of its frame */
+                counter += modbus_slave_receive_buffer_r(slave->unit, data + counter, len - counter);
+                if (slave->unit->request_byte_handler == _mb_sl_fsm_request_slave_id) {
+                    slave->unit = NULL;
+                }
+            } else if ((span = _mb_sl_get_payload_span(slave, len - counter)) > 0) {
+                _mb_sl_receive_payload(slave, data + counter, span);
+                counter += span;
+            } else {
+                modbus_slave_recieve_data_byte_r(slave, data[counter++]);
+            }
+        }
+        if (in_request && !_mb_sl_is_receiving_request(slave) && slave->request_byte_handler == _mb_sl_fsm_request_slave_id) {
+            break;
+        }
+    }
+    return counter;
+}
+
+void modbus_slave_set_slave_id_r(modbus_slave_t* slave, uint8_t new_slave_id)
+{
+    slave->slave_id = new_slave_id;
+    modbus_slave_clear_data_r(slave);
+}
+
+void modbus_slave_timeout_r(modbus_slave_t* slave)
+{
+    _mb_sl_dispatch_reset(slave);
+    modbus_slave_clear_data_r(slave);
+}
+
+void modbus_slave_set_framing_r(modbus_slave_t* slave, uint32_t baud_rate, uint8_t char_bits)
+{
+    modbus_rtu_framer_init(&slave->framer, baud_rate, char_bits);
+    modbus_slave_timeout_r(slave);
+}
+
+void modbus_slave_recieve_data_byte_at_r(modbus_slave_t* slave, uint8_t byte, uint32_t now_us)
+{
+    if (_mb_sl_framer_accept(slave, now_us, 1)) {
+        modbus_slave_recieve_data_byte_r(slave, byte);
+    }
+}
+
+void modbus_slave_receive_buffer_at_r(modbus_slave_t* slave, const uint8_t* data, size_t len, uint32_t now_us)
+{
+    if (len == 0 || !_mb_sl_framer_accept(slave, now_us, len)) {
+        return;
+    }
+    size_t counter = 0;
+    while (counter < len) {
+        counter += modbus_slave_receive_buffer_r(slave, data + counter, len - counter);
+    }
+}
+
+void modbus_slave_poll_r(modbus_slave_t* slave, uint32_t now_us)
+{
+    if (modbus_rtu_framer_poll(&slave->framer, now_us)) {
+        modbus_slave_timeout_r(slave);
+    }
+}
+
+uint16_t modbus_slave_get_register_value_r(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id)
+{
+    const modbus_slave_segment_t* segment = _mb_sl_find_segment(slave, register_type, register_id);
+    if (segment == NULL) {
+        _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
+        _mb_sl_send_response(slave);
+        modbus_slave_clear_data_r(slave);
         return 0;
     }
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-    if (register_type == MODBUS_REGISTER_DISCRETE_OUTPUT_COILS) {
-        return mb_discrete_output_coils[register_id];
+    modbus_slave_sequence_t sequence = 0;
+    if (_mb_sl_is_coils(register_type)) {
+        return _mb_sl_get_coil((const uint8_t*)_mb_sl_get_segment_storage(segment, &sequence), (uint16_t)(register_id - segment->base));
     }
-#endif
-#if MODBUS_SLAVE_INPUT_COILS_COUNT
-    if (register_type == MODBUS_REGISTER_DISCRETE_INPUT_COILS) {
-        return mb_discrete_input_coils[register_id];
+    return _mb_sl_get_register(slave, (const uint16_t*)_mb_sl_get_segment_storage(segment, &sequence), (uint16_t)(register_id - segment->base));
+}
+
+void modbus_slave_set_register_value_r(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t value)
+{
+    const modbus_slave_segment_t* segment = _mb_sl_find_segment(slave, register_type, register_id);
+    if (segment == NULL) {
+        _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
+        _mb_sl_send_response(slave);
+        modbus_slave_clear_data_r(slave);
+        return;
     }
-#endif
-#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
-    if (register_type == MODBUS_REGISTER_ANALOG_INPUT_REGISTERS) {
-        return mb_analog_input_registers[register_id];
+    /* A snapshot is only written through modbus_slave_snapshot_begin(), a publication would drop the value */
+    if (segment->snapshot != NULL) {
+        return;
     }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (register_type == MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS) {
-        return mb_analog_output_holding_registers[register_id];
+    modbus_slave_sequence_t sequence = 0;
+    if (_mb_sl_is_coils(register_type)) {
+        _mb_sl_set_coil((uint8_t*)_mb_sl_get_segment_storage(segment, &sequence), (uint16_t)(register_id - segment->base), value > 0);
+    } else {
+        _mb_sl_set_register(slave, (uint16_t*)_mb_sl_get_segment_storage(segment, &sequence), (uint16_t)(register_id - segment->base), value);
     }
-#endif
-    return 0;
 }
 
-void modbus_slave_set_register_value(register_type_t register_type, uint16_t register_id, uint16_t value)
+bool modbus_slave_get_coils_r(modbus_slave_t* slave, register_type_t register_type, uint16_t start_id, uint16_t count, uint8_t* bits)
+{
+    if (!_mb_sl_is_coils(register_type) || bits == NULL || !_mb_sl_check_registers_range(slave, register_type, start_id, count)) {
+        return false;
+    }
+    _mb_sl_copy_registers(slave, register_type, start_id, count, bits, false, false);
+    return true;
+}
+
+bool modbus_slave_set_coils_r(modbus_slave_t* slave, register_type_t register_type, uint16_t start_id, uint16_t count, const uint8_t* bits)
 {
-    if (register_id >= _mb_sl_get_registers_count(register_type)) {
-        _mb_sl_make_error_response(MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
-        _mb_sl_send_response();
-        modbus_slave_clear_data();
+    if (!_mb_sl_is_coils(register_type) || bits == NULL || !_mb_sl_check_registers_writable(slave, register_type, start_id, count)) {
+        return false;
+    }
+    _mb_sl_copy_registers(slave, register_type, start_id, count, (uint8_t*)bits, true, false);
+    return true;
+}
+
+bool modbus_slave_set_segments_r(modbus_slave_t* slave, register_type_t register_type, const modbus_slave_segment_t* segments, uint16_t segments_count)
+{
+    if (register_type < MODBUS_REGISTER_DISCRETE_OUTPUT_COILS || register_type > MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS) {
+        return false;
+    }
+    if (segments == NULL) {
+        segments_count = 0;
+    }
+    for (uint16_t i = 0; i < segments_count; i++) {
+        if ((segments[i].storage == NULL && segments[i].snapshot == NULL) || segments[i].count == 0 || (uint32_t)segments[i].base + segments[i].count > 0x10000UL) {
+            return false;
+        }
+        /* Sorted and not overlapping, the lookup is a binary search */
+        if (i > 0 && (uint32_t)segments[i - 1].base + segments[i - 1].count > segments[i].base) {
+            return false;
+        }
+    }
+
+    uint8_t idx = (uint8_t)(register_type - MODBUS_REGISTER_DISCRETE_OUTPUT_COILS);
+    slave->segments[idx]       = segments_count > 0 ? segments : NULL;
+    slave->segments_count[idx] = segments_count;
+    return true;
+}
+
+uint8_t modbus_slave_consume_dirty_ranges_r(modbus_slave_t* slave, modbus_slave_range_t* ranges, uint8_t max_count)
+{
+    if (ranges == NULL) {
+        return 0;
+    }
+
+    /* A write that read the active index before the last switch may still update the list taken over */
+    if ((slave->dirty_switch_sequence & 1) != 0) {
+        if (MB_SL_SEQUENCE_LOAD(&slave->dirty_sequence) == slave->dirty_switch_sequence) {
+            return 0;
+        }
+        slave->dirty_switch_sequence = 0;
+    }
+
+    /* Only the consumer switches lists, the writes never touch the drained one */
+    uint8_t list = (uint8_t)(slave->dirty_active ^ 1);
+    if (slave->dirty_ranges_count[list] == 0) {
+        MB_SL_SEQUENCE_STORE(&slave->dirty_active, list);
+        MB_SL_SEQUENCE_BARRIER();
+        slave->dirty_switch_sequence = MB_SL_SEQUENCE_LOAD(&slave->dirty_sequence);
+        if ((slave->dirty_switch_sequence & 1) != 0) {
+            return 0;
+        }
+        list ^= 1;
+    }
+
+    /* The oldest ranges are handed out first, the rest stays for the next call */
+    modbus_slave_range_t* dirty_ranges = slave->dirty_ranges[list];
+    uint8_t count = (uint8_t)MB_MIN(max_count, slave->dirty_ranges_count[list]);
+    memcpy(ranges, dirty_ranges, count * sizeof(*ranges));
+    slave->dirty_ranges_count[list] = (uint8_t)(slave->dirty_ranges_count[list] - count);
+    memmove(dirty_ranges, dirty_ranges + count, slave->dirty_ranges_count[list] * sizeof(*ranges));
+    return count;
+}
+
+void modbus_slave_snapshot_init(modbus_slave_snapshot_t* snapshot, void* front, void* back, uint16_t size)
+{
+    snapshot->buffers[0] = front;
+    snapshot->buffers[1] = back;
+    snapshot->size       = size;
+    snapshot->sequence   = 0;
+}
+
+void* modbus_slave_snapshot_begin(modbus_slave_snapshot_t* snapshot)
+{
+    /* The back buffer starts as a copy of the published one, so a partial update keeps the rest */
+    modbus_slave_sequence_t sequence = MB_SL_SEQUENCE_LOAD(&snapshot->sequence);
+    void* back = snapshot->buffers[(sequence + 1) & 1];
+    memcpy(back, snapshot->buffers[sequence & 1], snapshot->size);
+    return back;
+}
+
+void modbus_slave_snapshot_publish(modbus_slave_snapshot_t* snapshot)
+{
+    /* Readers switch to the new buffer, a reader still copying the old one sees the change and repeats */
+    MB_SL_SEQUENCE_STORE(&snapshot->sequence, (modbus_slave_sequence_t)(snapshot->sequence + 1));
+}
+
+void _mb_sl_request_proccess(modbus_slave_t* slave)
+{
+    if (!_mb_sl_is_recieved_own_slave_id(slave)) {
+        modbus_slave_clear_data_r(slave);
         return;
     }
-    (void)value;
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-    if (register_type == MODBUS_REGISTER_DISCRETE_OUTPUT_COILS) {
-        mb_discrete_output_coils[register_id] = value > 0;
+
+    /* Only writes can be broadcast, nothing is read without a response to carry it */
+    if (_mb_sl_is_broadcast_request(slave) && (_mb_sl_is_read_command(slave) || _mb_sl_is_read_write_command(slave) || slave->data_req.command == MODBUS_READ_FILE_RECORD)) {
+        modbus_slave_clear_data_r(slave);
+        return;
     }
-#endif
-#if MODBUS_SLAVE_INPUT_COILS_COUNT
-    if (register_type == MODBUS_REGISTER_DISCRETE_INPUT_COILS) {
-        mb_discrete_input_coils[register_id] = value > 0;
+
+    /* A broadcast write is applied silently, it needs no way to send */
+    if (!_mb_sl_is_broadcast_request(slave) && slave->response_data_handler == NULL && slave->tx_buffer_commit == NULL) {
+        _mb_sl_do_internal_error(slave);
+        return;
     }
-#endif
-#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
-    if (register_type == MODBUS_REGISTER_ANALOG_INPUT_REGISTERS) {
-        mb_analog_input_registers[register_id] = value;
+
+    slave->data_resp.id = slave->data_req.id;
+
+    /* CHECK ERRORS BEGIN */
+    if (!_mb_sl_check_available_request_command(slave)) {
+        _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_FUNCTION);
+        goto do_send;
     }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (register_type == MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS) {
-        mb_analog_output_holding_registers[register_id] = value;
+
+    if (!_mb_sl_check_request_register_addr(slave) || !_mb_sl_check_request_write_register_addr(slave)) {
+        _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
+        goto do_send;
     }
-#endif
+
+    if (!_mb_sl_check_request_registers_count(slave)) {
+        _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_DATA_VALUE);
+        goto do_send;
+    }
+    if (slave->is_error_response) {
+        goto do_reset;
+    }
+
+    if (!_mb_sl_check_request_writable(slave)) {
+        _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
+        goto do_send;
+    }
+    /* CHECK ERRORS END */
+
+    slave->data_resp.command = slave->data_req.command;
+
+    /* WRITE REGISTERS BEGIN */
+    if (_mb_sl_is_write_single_reg_command(slave)) {
+        _mb_sl_write_single_register(slave);
+    }
+
+    /* A read/write request reads the registers after they are written */
+    if (_mb_sl_is_write_multiple_reg_command(slave) || _mb_sl_is_read_write_command(slave)) {
+        _mb_sl_write_multiple_registers(slave);
+    }
+
+    if (_mb_sl_is_mask_write_command(slave)) {
+        _mb_sl_mask_write_register(slave);
+    }
+
+    if (slave->data_req.command == MODBUS_WRITE_FILE_RECORD && !_mb_sl_write_file_records(slave)) {
+        _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
+        goto do_send;
+    }
+
+    if (_mb_sl_is_write_single_reg_command(slave) || _mb_sl_is_write_multiple_reg_command(slave) || _mb_sl_is_read_write_command(slave) || _mb_sl_is_mask_write_command(slave)) {
+        _mb_sl_notify_written_registers(slave);
+    }
+    /* WRITE REGISTERS END */
+
+    goto do_send;
+
+do_send:
+    /* Broadcast writes are applied without a response, errors included */
+    if (!_mb_sl_is_broadcast_request(slave)) {
+        _mb_sl_send_response(slave);
+    }
+
+    goto do_reset;
+
+do_reset:
+    modbus_slave_clear_data_r(slave);
+}
+
+void _mb_sl_request_proccess_early(modbus_slave_t* slave)
+{
+    /* The response may be serialized over the received bytes, the header is needed to size the rest */
+    uint8_t  header[MB_SL_EARLY_HEADER_SIZE];
+    uint16_t received = slave->req_data_bytes_idx;
+    uint16_t crc      = slave->req_crc;
+    if (received > sizeof(header)) {
+        _mb_sl_request_proccess(slave);
+        return;
+    }
+    memcpy(header, slave->req_data_bytes, received);
+
+    _mb_sl_request_proccess(slave);
+
+    /* The rest of the answered frame is skipped like a foreign one, so none of its bytes is taken for a slave id */
+    memcpy(slave->req_data_bytes, header, received);
+    slave->req_data_bytes_idx   = received;
+    slave->req_crc              = crc;
+    slave->request_byte_handler = _mb_sl_fsm_foreign_frame;
+    _mb_sl_fsm_foreign_frame(slave, header[received - 1]);
+}
+
+void _mb_sl_make_error_response(modbus_slave_t* slave, modbus_error_types_t error_type)
+{
+    slave->is_error_response = true;
+    slave->data_resp.command = slave->data_req.command | MODBUS_ERROR_COMMAND_CODE;
+    slave->special_data[0] = error_type;
+}
+
+void _mb_sl_send_response(modbus_slave_t* slave)
+{
+    if (slave->response_data_handler == NULL && slave->tx_buffer_commit == NULL) {
+        _mb_sl_do_internal_error(slave);
+        return;
+    }
+
+    /* The request bytes are not needed anymore, the response is serialized over them */
+    uint8_t* data = slave->req_data_bytes;
+    uint16_t len  = (uint16_t)(2 + _mb_sl_get_response_data_len(slave) + sizeof(uint16_t));
+    if (slave->tx_buffer_provider != NULL) {
+        data = slave->tx_buffer_provider(slave->user_context, len);
+    }
+    if (data == NULL) {
+        _mb_sl_do_internal_error(slave);
+        return;
+    }
+
+    uint16_t counter = 0;
+    data[counter++] = slave->data_resp.id;
+    data[counter++] = slave->data_resp.command;
+    if (slave->is_error_response) {
+        data[counter++] = slave->special_data[0];
+    } else if (_mb_sl_is_read_command(slave) || _mb_sl_is_read_write_command(slave)) {
+        counter += _mb_sl_make_read_response(slave, data + counter);
+    } else if (_mb_sl_is_write_single_reg_command(slave)) {
+        counter += _mb_sl_make_write_single_response(slave, data + counter);
+    } else if (_mb_sl_is_write_multiple_reg_command(slave)) {
+        counter += _mb_sl_make_write_multiple_response(slave, data + counter);
+    } else if (_mb_sl_is_mask_write_command(slave)) {
+        counter += _mb_sl_make_mask_write_response(slave, data + counter);
+    } else if (slave->data_req.command == MODBUS_READ_FILE_RECORD) {
+        uint16_t file_len = _mb_sl_make_read_file_response(slave, data + counter);
+        if (file_len == 0) {
+            /* A missing file or record is known only when the store is asked for it */
+            _mb_sl_make_error_response(slave, MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
+            data[counter - 1] = slave->data_resp.command;
+            data[counter++]   = slave->special_data[0];
+        }
+        counter += file_len;
+    } else if (slave->data_req.command == MODBUS_WRITE_FILE_RECORD) {
+        counter += _mb_sl_make_write_file_response(slave, data + counter);
+    }
+    uint16_t crc = modbus_crc16(data, counter);
+    data[counter++] = (uint8_t)(crc & 0xFF);
+    data[counter++] = (uint8_t)(crc >> 8);
+
+    if (slave->tx_buffer_commit != NULL) {
+        slave->tx_buffer_commit(slave->user_context, data, counter);
+    } else {
+        slave->response_data_handler(slave->user_context, data, counter);
+    }
+}
+
+void _mb_sl_write_single_register(modbus_slave_t* slave)
+{
+    if (slave->data_req.command == MODBUS_FORCE_SINGLE_COIL) {
+        modbus_slave_set_register_value_r(slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, slave->data_req.register_addr, _mb_sl_get_special_data_first_value(slave) > 0);
+    }
+    if (slave->data_req.command == MODBUS_PRESET_SINGLE_REGISTER) {
+        modbus_slave_set_register_value_r(slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, slave->data_req.register_addr, _mb_sl_get_special_data_first_value(slave));
+    }
+}
+
+void _mb_sl_write_multiple_registers(modbus_slave_t* slave)
+{
+    /* The range is checked before, it may span contiguous segments */
+    _mb_sl_copy_registers(
+        slave,
+        _mb_sl_get_request_register_type(slave),
+        _mb_sl_get_write_register_addr(slave),
+        _mb_sl_get_write_registers_count(slave),
+        slave->special_data + _mb_sl_get_special_data_meta_count(slave),
+        true,
+        true
+    );
+}
+
+void _mb_sl_mask_write_register(modbus_slave_t* slave)
+{
+    /* Read, modify and write without returning to the caller, no other request is handled in between */
+    uint16_t and_mask = _mb_sl_get_special_data_first_value(slave);
+    uint16_t or_mask  = _mb_sl_get_special_data_value(slave, SPECIAL_DATA_OR_MASK_IDX);
+    uint16_t value    = modbus_slave_get_register_value_r(slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, slave->data_req.register_addr);
+
+    value = (uint16_t)((value & and_mask) | (or_mask & (uint16_t)~and_mask));
+    modbus_slave_set_register_value_r(slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, slave->data_req.register_addr, value);
+}
+
+bool _mb_sl_write_file_records(modbus_slave_t* slave)
+{
+    /* The sub-requests are checked before, each one is followed by its records */
+    uint16_t idx = SPECIAL_DATA_FILE_META_COUNT;
+    uint16_t end = (uint16_t)(SPECIAL_DATA_FILE_META_COUNT + slave->special_data[0]);
+    while (idx < end) {
+        uint16_t file_number   = _mb_sl_get_special_data_value(slave, (uint8_t)(idx + 1));
+        uint16_t record_number = _mb_sl_get_special_data_value(slave, (uint8_t)(idx + SPECIAL_DATA_FILE_RECORD_NUMBER_IDX));
+        uint16_t count         = _mb_sl_get_special_data_value(slave, (uint8_t)(idx + SPECIAL_DATA_FILE_RECORD_LENGTH_IDX));
+        idx += SPECIAL_DATA_FILE_SUB_REQUEST_SIZE;
+        if (!slave->file_write_handler(slave->user_context, file_number, record_number, count, slave->special_data + idx)) {
+            return false;
+        }
+        idx += count * 2;
+    }
+    return true;
+}
+
+void _mb_sl_notify_written_registers(modbus_slave_t* slave)
+{
+    register_type_t register_type = _mb_sl_get_request_register_type(slave);
+    uint16_t register_id = _mb_sl_get_write_register_addr(slave);
+    uint16_t count = _mb_sl_get_write_registers_count(slave);
+
+    _mb_sl_add_dirty_range(slave, register_type, register_id, count);
+    if (slave->write_handler != NULL) {
+        slave->write_handler(slave->user_context, register_type, register_id, count);
+    }
+}
+
+void _mb_sl_add_dirty_range(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count)
+{
+    uint32_t start = register_id;
+    uint32_t end   = (uint32_t)register_id + count;
+
+    /* The odd sequence tells a consumer switching lists meanwhile that this write may use the old one */
+    modbus_slave_sequence_t sequence = slave->dirty_sequence;
+    MB_SL_SEQUENCE_STORE(&slave->dirty_sequence, (modbus_slave_sequence_t)(sequence + 1));
+    MB_SL_SEQUENCE_BARRIER();
+    uint8_t list = MB_SL_SEQUENCE_LOAD(&slave->dirty_active);
+
+    /* Absorb every range of the same type that overlaps or touches the new one, again after a merge widened one */
+    bool full = false;
+    do {
+        uint8_t i = 0;
+        while (i < slave->dirty_ranges_count[list]) {
+            modbus_slave_range_t* range = &slave->dirty_ranges[list][i];
+            uint32_t range_end = (uint32_t)range->register_id + range->count;
+            if (range->register_type == register_type && range->register_id <= end && start <= range_end) {
+                start = MB_MIN(start, range->register_id);
+                end   = MB_MAX(end, range_end);
+                _mb_sl_remove_dirty_range(slave, list, i);
+                continue;
+            }
+            i++;
+        }
+
+        full = slave->dirty_ranges_count[list] >= MODBUS_SLAVE_DIRTY_RANGES;
+        if (full) {
+            _mb_sl_merge_closest_dirty_ranges(slave, list);
+        }
+    } while (full);
+
+    modbus_slave_range_t* range = &slave->dirty_ranges[list][slave->dirty_ranges_count[list]++];
+    range->register_type = register_type;
+    range->register_id   = (uint16_t)start;
+    range->count         = (uint16_t)(end - start);
+    MB_SL_SEQUENCE_STORE(&slave->dirty_sequence, (modbus_slave_sequence_t)(sequence + 2));
+}
+
+void _mb_sl_merge_closest_dirty_ranges(modbus_slave_t* slave, uint8_t list)
+{
+    /* More ranges than register types, so two of them have the same type */
+    uint8_t  first  = 0;
+    uint8_t  second = 0;
+    uint32_t gap    = 0xFFFFFFFFUL;
+    for (uint8_t i = 0; i < slave->dirty_ranges_count[list]; i++) {
+        for (uint8_t j = (uint8_t)(i + 1); j < slave->dirty_ranges_count[list]; j++) {
+            const modbus_slave_range_t* a = &slave->dirty_ranges[list][i];
+            const modbus_slave_range_t* b = &slave->dirty_ranges[list][j];
+            if (a->register_type != b->register_type) {
+                continue;
+            }
+            uint32_t a_end = (uint32_t)a->register_id + a->count;
+            uint32_t b_end = (uint32_t)b->register_id + b->count;
+            uint32_t distance = a->register_id < b->register_id ? b->register_id - a_end : a->register_id - b_end;
+            if (distance < gap) {
+                gap    = distance;
+                first  = i;
+                second = j;
+            }
+        }
+    }
+
+    /* The merged range also covers the gap, it is reported as written */
+    modbus_slave_range_t* a = &slave->dirty_ranges[list][first];
+    const modbus_slave_range_t* b = &slave->dirty_ranges[list][second];
+    uint32_t start = MB_MIN(a->register_id, b->register_id);
+    uint32_t end   = MB_MAX((uint32_t)a->register_id + a->count, (uint32_t)b->register_id + b->count);
+    a->register_id = (uint16_t)start;
+    a->count       = (uint16_t)(end - start);
+    _mb_sl_remove_dirty_range(slave, list, second);
+}
+
+void _mb_sl_remove_dirty_range(modbus_slave_t* slave, uint8_t list, uint8_t idx)
+{
+    /* Keeps the order, consumers get the oldest writes first */
+    slave->dirty_ranges_count[list]--;
+    memmove(
+        slave->dirty_ranges[list] + idx,
+        slave->dirty_ranges[list] + idx + 1,
+        (size_t)(slave->dirty_ranges_count[list] - idx) * sizeof(*slave->dirty_ranges[list])
+    );
+}
+
+void modbus_slave_clear_data_r(modbus_slave_t* slave)
+{
+    /* Only the header is reset, buffers are valid up to their tracked length */
+    memset((uint8_t*)&slave->data_req, 0, sizeof(slave->data_req));
+    memset((uint8_t*)&slave->data_resp, 0, sizeof(slave->data_resp));
+    slave->req_data_bytes_idx = 0;
+    slave->req_crc            = MODBUS_CRC16_INIT;
+
+    slave->is_error_response    = false;
+    slave->data_handler_counter = 0;
+    slave->skip_bytes           = 0;
+    slave->skip_next            = 0;
+    slave->request_byte_handler = _mb_sl_fsm_request_slave_id;
+}
+
+bool _mb_sl_framer_accept(modbus_slave_t* slave, uint32_t now_us, size_t count)
+{
+    modbus_rtu_frame_event_t event = modbus_rtu_framer_bytes(&slave->framer, now_us, count);
+    /* A t3.5 silence ended the last frame, a t1.5 silence inside a frame drops it up to the next t3.5 silence */
+    if (event != MODBUS_RTU_FRAME_BYTES) {
+        modbus_slave_timeout_r(slave);
+    }
+    return event != MODBUS_RTU_FRAME_DISCARD;
+}
+
+void _mb_sl_do_internal_error(modbus_slave_t* slave)
+{
+    if (slave->internal_error_handler != NULL) {
+        slave->internal_error_handler(slave->user_context);
+    }
+    modbus_slave_clear_data_r(slave);
+}
+
+uint16_t _mb_sl_get_response_data_len(modbus_slave_t* slave)
+{
+    if (slave->is_error_response) {
+        return 1;
+    }
+    if (slave->data_req.command == MODBUS_READ_HOLDING_REGISTERS || slave->data_req.command == MODBUS_READ_INPUT_REGISTERS || _mb_sl_is_read_write_command(slave)) {
+        return 1 + _mb_sl_get_special_data_first_value(slave) * 2;
+    }
+    if (_mb_sl_is_read_command(slave)) {
+        return 1 + MODBUS_COILS_BYTES(_mb_sl_get_special_data_first_value(slave));
+    }
+    if (_mb_sl_is_write_single_reg_command(slave) || _mb_sl_is_write_multiple_reg_command(slave)) {
+        return 4;
+    }
+    if (_mb_sl_is_mask_write_command(slave)) {
+        return 2 + SPECIAL_DATA_MASK_WRITE_COUNT;
+    }
+    if (_mb_sl_is_file_command(slave)) {
+        return 1 + _mb_sl_get_file_response_len(slave);
+    }
+    return 0;
+}
+
+uint16_t _mb_sl_make_read_response(modbus_slave_t* slave, uint8_t* data)
+{
+    uint16_t resp_data_len = (uint16_t)(_mb_sl_get_response_data_len(slave) - 1);
+
+    uint8_t* payload = data + 1;
+    data[0] = (uint8_t)resp_data_len;
+
+    /* Unused bits of the last coils byte are sent as zeros */
+    payload[resp_data_len - 1] = 0;
+    _mb_sl_copy_registers(
+        slave,
+        _mb_sl_get_request_register_type(slave),
+        slave->data_req.register_addr,
+        _mb_sl_get_special_data_first_value(slave),
+        payload,
+        false,
+        true
+    );
+
+    return (uint16_t)(1 + resp_data_len);
+}
+
+uint16_t _mb_sl_make_write_single_response(modbus_slave_t* slave, uint8_t* data)
+{
+    uint16_t counter = 0;
+
+    uint16_t reg_addr = slave->data_req.register_addr;
+
+    data[counter++] = (uint8_t)(reg_addr >> 8);
+    data[counter++] = (uint8_t)(reg_addr);
+
+    if (slave->data_req.command == MODBUS_FORCE_SINGLE_COIL) {
+        data[counter++] = 0x00;
+        data[counter++] = (uint8_t)modbus_slave_get_register_value_r(slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, reg_addr);
+    }
+    if (slave->data_req.command == MODBUS_PRESET_SINGLE_REGISTER) {
+        uint16_t value = modbus_slave_get_register_value_r(slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, reg_addr);
+        data[counter++] = (uint8_t)(value >> 8);
+        data[counter++] = (uint8_t)(value);
+    }
+
+    return counter;
 }
 
-void _mb_sl_request_proccess(void)
+uint16_t _mb_sl_make_write_multiple_response(modbus_slave_t* slave, uint8_t* data)
 {
-    if (!_mb_sl_is_recieved_own_slave_id()) {
-        modbus_slave_clear_data();
+    uint16_t counter = 0;
+
+    uint16_t written_count = _mb_sl_get_special_data_first_value(slave);
+
+    uint16_t reg_addr = slave->data_req.register_addr;
+
+    data[counter++] = (uint8_t)(reg_addr >> 8);
+    data[counter++] = (uint8_t)(reg_addr);
+    data[counter++] = (uint8_t)(written_count >> 8);
+    data[counter++] = (uint8_t)(written_count);
+
+    return counter;
+}
+
+uint16_t _mb_sl_make_mask_write_response(modbus_slave_t* slave, uint8_t* data)
+{
+    uint16_t counter = 0;
+
+    uint16_t reg_addr = slave->data_req.register_addr;
+
+    /* The response echoes the request */
+    data[counter++] = (uint8_t)(reg_addr >> 8);
+    data[counter++] = (uint8_t)(reg_addr);
+    memcpy(data + counter, slave->special_data, SPECIAL_DATA_MASK_WRITE_COUNT);
+    counter += SPECIAL_DATA_MASK_WRITE_COUNT;
+
+    return counter;
+}
+
+uint16_t _mb_sl_make_read_file_response(modbus_slave_t* slave, uint8_t* data)
+{
+    uint16_t counter = 0;
+    data[counter++] = (uint8_t)_mb_sl_get_file_response_len(slave);
+
+    uint16_t idx = SPECIAL_DATA_FILE_META_COUNT;
+    uint16_t end = (uint16_t)(SPECIAL_DATA_FILE_META_COUNT + slave->special_data[0]);
+    while (idx < end) {
+        uint16_t file_number   = _mb_sl_get_special_data_value(slave, (uint8_t)(idx + 1));
+        uint16_t record_number = _mb_sl_get_special_data_value(slave, (uint8_t)(idx + SPECIAL_DATA_FILE_RECORD_NUMBER_IDX));
+        uint16_t count         = _mb_sl_get_special_data_value(slave, (uint8_t)(idx + SPECIAL_DATA_FILE_RECORD_LENGTH_IDX));
+        idx += SPECIAL_DATA_FILE_SUB_REQUEST_SIZE;
+
+        data[counter++] = (uint8_t)(1 + count * 2);
+        data[counter++] = MODBUS_FILE_REFERENCE_TYPE;
+        if (!slave->file_read_handler(slave->user_context, file_number, record_number, count, data + counter)) {
+            return 0;
+        }
+        counter += count * 2;
+    }
+
+    return counter;
+}
+
+uint16_t _mb_sl_make_write_file_response(modbus_slave_t* slave, uint8_t* data)
+{
+    /* The response echoes the request */
+    uint16_t counter = (uint16_t)(SPECIAL_DATA_FILE_META_COUNT + slave->special_data[0]);
+    memcpy(data, slave->special_data, counter);
+    return counter;
+}
+
+void _mb_sl_fsm_request_slave_id(modbus_slave_t* slave, uint8_t byte)
+{
+    slave->data_req.id = byte;
+    slave->data_handler_counter = 0;
+    if (!_mb_sl_is_recieved_own_slave_id(slave)) {
+        /* Sized from its header and skipped, so its bytes are never taken for a slave id */
+        slave->request_byte_handler = _mb_sl_fsm_foreign_frame;
+        return;
+    }
+    slave->request_byte_handler = _mb_sl_fsm_request_command;
+}
+
+void _mb_sl_fsm_request_command(modbus_slave_t* slave, uint8_t byte)
+{
+    slave->data_req.command = byte;
+    slave->data_handler_counter = 0;
+    slave->request_byte_handler = _mb_sl_fsm_request_register_addr;
+    /* File requests have no register address, the byte count follows the command */
+    if (_mb_sl_is_file_command(slave)) {
+        slave->request_byte_handler = _mb_sl_fsm_request_special_data;
+    }
+
+    if (!_mb_sl_is_recieved_own_slave_id(slave)) {
         return;
     }
 
-    if (mb_slave_state.response_data_handler == NULL) {
-        _mb_sl_do_internal_error();
-        return;
+    if (!_mb_sl_check_available_request_command(slave)) {
+        _mb_sl_request_proccess_early(slave);
+    }
+}
+
+void _mb_sl_fsm_request_register_addr(modbus_slave_t* slave, uint8_t byte)
+{
+    slave->data_req.register_addr <<= 8;
+    slave->data_req.register_addr |= byte;
+    if (slave->data_handler_counter == sizeof(slave->data_req.register_addr)) {
+        slave->data_handler_counter = 0;
+        slave->request_byte_handler = _mb_sl_fsm_request_special_data;
+    }
+
+    if (!_mb_sl_is_recieved_own_slave_id(slave)) {
+        return;
+    }
+
+    if (slave->request_byte_handler == _mb_sl_fsm_request_register_addr) {
+        return;
+    }
+
+    if (!_mb_sl_check_request_register_addr(slave)) {
+        _mb_sl_request_proccess_early(slave);
+    }
+}
+
+void _mb_sl_fsm_request_special_data(modbus_slave_t* slave, uint8_t byte)
+{
+    uint16_t needed_count_bytes = 0;
+    uint16_t needed_count       = 0;
+    uint16_t cur_count          = slave->data_handler_counter;
+
+    if (slave->data_handler_counter <= sizeof(slave->special_data)) {
+        slave->special_data[slave->data_handler_counter - 1] = byte;
+    }
+
+    if (_mb_sl_is_read_command(slave) || _mb_sl_is_write_single_reg_command(slave)) {
+        needed_count_bytes = SPECIAL_DATA_VALUE_SIZE;
+        needed_count       = SPECIAL_DATA_VALUE_SIZE;
+    }
+
+    if (_mb_sl_is_write_multiple_reg_command(slave) || _mb_sl_is_read_write_command(slave)) {
+        uint8_t meta_count = _mb_sl_get_special_data_meta_count(slave);
+        /* special_data is not cleared between frames, the byte count is valid after the meta bytes only */
+        if (cur_count >= meta_count) {
+            needed_count_bytes = meta_count + slave->special_data[meta_count - 1];
+        }
+        needed_count       = meta_count;
     }
 
-    mb_slave_state.data_resp.id = mb_slave_state.data_req.id;
-
-    /* CHECK ERRORS BEGIN */
-    if (!_mb_sl_check_available_request_command()) {
-        _mb_sl_make_error_response(MODBUS_ERROR_ILLEGAL_FUNCTION);
-        goto do_send;
+    if (_mb_sl_is_mask_write_command(slave)) {
+        needed_count_bytes = SPECIAL_DATA_MASK_WRITE_COUNT;
+        needed_count       = SPECIAL_DATA_MASK_WRITE_COUNT;
     }
 
-    if (!_mb_sl_check_request_register_addr()) {
-        _mb_sl_make_error_response(MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
-        goto do_send;
+    if (_mb_sl_is_file_command(slave)) {
+        if (cur_count >= SPECIAL_DATA_FILE_META_COUNT) {
+            needed_count_bytes = SPECIAL_DATA_FILE_META_COUNT + slave->special_data[0];
+        }
+        /* Sub-requests are checked once complete, only the byte count is checked here */
+        needed_count       = needed_count_bytes;
     }
 
-    if (!_mb_sl_check_request_registers_count()) {
-        _mb_sl_make_error_response(MODBUS_ERROR_ILLEGAL_DATA_VALUE);
-        goto do_send;
+    if (slave->data_handler_counter == needed_count_bytes) {
+        slave->data_handler_counter = 0;
+        slave->request_byte_handler = _mb_sl_fsm_request_crc;
     }
-    if (mb_slave_state.is_error_response) {
-        goto do_reset;
-    }
-    /* CHECK ERRORS END */
 
-    mb_slave_state.data_resp.command = mb_slave_state.data_req.command;
+    if (!_mb_sl_is_recieved_own_slave_id(slave)) {
+        return;
+    }
 
-    /* WRITE REGISTERS BEGIN */
-    if (_mb_sl_is_write_single_reg_command()) {
-        _mb_sl_write_single_register();
+    if (_mb_sl_is_file_command(slave) && cur_count == SPECIAL_DATA_FILE_META_COUNT && !_mb_sl_check_file_byte_count(slave)) {
+        _mb_sl_request_proccess_early(slave);
+        return;
     }
 
-    if (_mb_sl_is_write_multiple_reg_command()) {
-        _mb_sl_write_multiple_registers();
+    if (cur_count <= needed_count) {
+        return;
     }
-    /* WRITE REGISTERS END */
 
-    /* MAKE RESPONSE DATA BEGIN */
-    if (_mb_sl_is_read_command()) {
-        _mb_sl_make_read_response();
+    if (!_mb_sl_check_request_registers_count(slave)) {
+        _mb_sl_request_proccess_early(slave);
     }
-    if (_mb_sl_is_write_single_reg_command()) {
-        _mb_sl_make_write_single_response();
+}
+
+void _mb_sl_fsm_request_crc(modbus_slave_t* slave, uint8_t byte)
+{
+    slave->data_req.crc >>= 8;
+    slave->data_req.crc |= (byte << 8);
+
+    if (slave->data_handler_counter < sizeof(slave->data_req.crc)) {
+        return;
     }
-    if (_mb_sl_is_write_multiple_reg_command()) {
-        _mb_sl_make_write_multiple_response();
+
+    if (!_mb_sl_is_recieved_own_slave_id(slave)) {
+        slave->data_handler_counter = 0;
+        slave->request_byte_handler = _mb_sl_fsm_request_slave_id;
+        goto do_reset_data;
     }
-    /* MAKE RESPONSE DATA END */
 
-    goto do_send;
+    /* CRC over the frame including its own CRC bytes is zero */
+    if (slave->req_crc != 0) {
+        slave->is_error_response = true;
+    }
 
-do_send:
-    _mb_sl_send_response();
+    _mb_sl_request_proccess(slave);
 
-    goto do_reset;
+    goto do_reset_data;
 
-do_reset:
-    modbus_slave_clear_data();
+do_reset_data:
+    modbus_slave_clear_data_r(slave);
 }
 
-void _mb_sl_make_error_response(modbus_error_types_t error_type)
+bool _mb_sl_dispatch_byte(modbus_slave_t* slave, uint8_t byte)
 {
-    mb_slave_state.is_error_response = true;
-    mb_slave_state.data_resp.command = mb_slave_state.data_req.command | MODBUS_ERROR_COMMAND_CODE;
-    mb_slave_state.special_data[0] = error_type;
-}
+    bool frame_start = !_mb_sl_is_dispatching(slave);
+    if (frame_start) {
+        /* The port's own state machine sizes frames for other ids so they can be skipped */
+        if (slave->request_byte_handler != _mb_sl_fsm_request_slave_id) {
+            return false;
+        }
+        /* The only lookup of a frame */
+        slave->unit_broadcast = byte == MODBUS_BROADCAST_ID;
+        slave->unit           = slave->unit_broadcast ? NULL : slave->units[byte];
+    }
 
-void _mb_sl_send_response(void)
-{
-    if (mb_slave_state.response_data_handler == NULL) {
-        _mb_sl_do_internal_error();
-        return;
+    if (slave->unit_broadcast) {
+        _mb_sl_dispatch_broadcast_byte(slave, byte, frame_start);
+        return true;
+    }
+    if (slave->unit == NULL) {
+        return false;
     }
 
-    uint8_t data[MODBUS_SLAVE_RESPONSE_MESSAGE_SIZE] = { 0 };
-    uint16_t counter = 0;
-    data[counter++] = mb_slave_state.data_resp.id;
-    data[counter++] = mb_slave_state.data_resp.command;
-    if (mb_slave_state.is_error_response) {
-        data[counter++] = mb_slave_state.special_data[0];
-    } else {
-        memcpy(data + counter, mb_slave_state.special_data, mb_slave_state.data_resp.data_len);
-        counter += mb_slave_state.data_resp.data_len;
+    modbus_slave_recieve_data_byte_r(slave->unit, byte);
+    if (slave->unit->request_byte_handler == _mb_sl_fsm_request_slave_id) {
+        slave->unit = NULL;
     }
-    uint16_t crc = modbus_crc16(data, counter);
-    data[counter++] = (uint8_t)(crc & 0xFF);
-    data[counter++] = (uint8_t)(crc >> 8);
+    return true;
+}
 
-    mb_slave_state.response_data_handler(data, counter);
+void _mb_sl_dispatch_broadcast_byte(modbus_slave_t* slave, uint8_t byte, bool frame_start)
+{
+    bool in_frame = false;
+    for (uint16_t id = 1; id < MODBUS_SLAVE_UNITS_COUNT; id++) {
+        modbus_slave_t* unit = slave->units[id];
+        /* A unit that has finished or dropped the frame waits for the next one */
+        if (unit == NULL || (!frame_start && unit->request_byte_handler == _mb_sl_fsm_request_slave_id)) {
+            continue;
+        }
+        modbus_slave_recieve_data_byte_r(unit, byte);
+        in_frame = in_frame || unit->request_byte_handler != _mb_sl_fsm_request_slave_id;
+    }
+    slave->unit_broadcast = in_frame;
 }
 
-void _mb_sl_write_single_register(void)
+void _mb_sl_dispatch_reset(modbus_slave_t* slave)
 {
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-    if (mb_slave_state.data_req.command == MODBUS_FORCE_SINGLE_COIL) {
-        mb_discrete_output_coils[mb_slave_state.data_req.register_addr] = _mb_sl_get_special_data_first_value() > 0;
+    if (slave->unit != NULL) {
+        modbus_slave_clear_data_r(slave->unit);
     }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (mb_slave_state.data_req.command == MODBUS_PRESET_SINGLE_REGISTER) {
-        mb_analog_output_holding_registers[mb_slave_state.data_req.register_addr] = _mb_sl_get_special_data_first_value();
+    for (uint16_t id = 1; slave->unit_broadcast && id < MODBUS_SLAVE_UNITS_COUNT; id++) {
+        if (slave->units[id] != NULL) {
+            modbus_slave_clear_data_r(slave->units[id]);
+        }
     }
-#endif
+    slave->unit           = NULL;
+    slave->unit_broadcast = false;
 }
 
-void _mb_sl_write_multiple_registers(void)
+bool _mb_sl_is_dispatching(modbus_slave_t* slave)
 {
-    uint16_t count = _mb_sl_get_special_data_first_value();
+    return slave->unit != NULL || slave->unit_broadcast;
+}
 
-    if (mb_slave_state.data_req.register_addr >= _mb_sl_get_registers_count(_mb_sl_get_request_register_type())) {
-        _mb_sl_make_error_response(MODBUS_ERROR_ILLEGAL_DATA_ADDRESS);
+void _mb_sl_fsm_foreign_frame(modbus_slave_t* slave, uint8_t byte)
+{
+    (void)byte;
+    const uint8_t* frame = slave->req_data_bytes;
+    uint16_t received = slave->req_data_bytes_idx;
+    /* A retry or a unit that doesn't answer makes the direction a guess, the CRC tells where the frame ends */
+    uint16_t request_len  = _mb_sl_get_foreign_frame_len(frame, received, false);
+    uint16_t response_len = _mb_sl_get_foreign_frame_len(frame, received, true);
+    if ((request_len == received || response_len == received) && slave->req_crc == 0) {
+        modbus_slave_clear_data_r(slave);
         return;
     }
-    
-    if (SPECIAL_DATA_META_COUNT + count - 1 > _mb_sl_get_registers_count(_mb_sl_get_request_register_type())) {
-        count = _mb_sl_get_registers_count(_mb_sl_get_request_register_type()) - SPECIAL_DATA_META_COUNT;
+    if (request_len == 0 || response_len == 0) {
+        return;
     }
 
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-    if (mb_slave_state.data_req.command == MODBUS_FORCE_MULTIPLE_COILS) {
-        for (uint8_t i = 0; i < count; i++) {
-            bool value = ((mb_slave_state.special_data[SPECIAL_DATA_META_COUNT] >> i) & 0x01);
-            mb_discrete_output_coils[mb_slave_state.data_req.register_addr + i] = value > 0;
-        }
+    if (request_len <= received || request_len > MB_SL_FRAME_LEN_MAX) {
+        request_len = MB_SL_FRAME_LEN_UNKNOWN;
     }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (mb_slave_state.data_req.command == MODBUS_PRESET_MULTIPLE_REGISTERS) {
-        for (uint8_t i = 0; i < count * 2; i += 2) {
-            uint16_t value = (uint16_t)mb_slave_state.special_data[SPECIAL_DATA_META_COUNT + i] << 8 |
-                (uint16_t)mb_slave_state.special_data[SPECIAL_DATA_META_COUNT + i + 1];
-            mb_analog_output_holding_registers[mb_slave_state.data_req.register_addr + i / 2] = value;
-        }
+    if (response_len <= received || response_len > MB_SL_FRAME_LEN_MAX) {
+        response_len = MB_SL_FRAME_LEN_UNKNOWN;
     }
-#endif
+    uint16_t first_len = MB_MIN(request_len, response_len);
+    uint16_t last_len  = MB_MAX(request_len, response_len);
+    if (first_len == MB_SL_FRAME_LEN_UNKNOWN) {
+        /* Resynchronized byte by byte as a slave id, or by the silence after the frame */
+        modbus_slave_clear_data_r(slave);
+        return;
+    }
+    slave->skip_bytes = (uint16_t)(first_len - received);
+    slave->skip_next  = last_len != MB_SL_FRAME_LEN_UNKNOWN ? (uint16_t)(last_len - first_len) : 0;
 }
 
-void modbus_slave_clear_data(void)
+void _mb_sl_skip_foreign_bytes(modbus_slave_t* slave, const uint8_t* data, uint16_t len)
 {
-    memset((uint8_t*)&mb_slave_state.data_req, 0, sizeof(mb_slave_state.data_req));
-    memset((uint8_t*)&mb_slave_state.data_resp, 0, sizeof(mb_slave_state.data_resp));
-    memset((uint8_t*)&mb_slave_state.special_data, 0, sizeof(mb_slave_state.special_data));
-    memset(mb_slave_state.req_data_bytes, 0, sizeof(mb_slave_state.req_data_bytes));
-    mb_slave_state.req_data_bytes_idx = 0;
-
-    mb_slave_state.is_error_response    = false;
-    mb_slave_state.data_handler_counter = 0;
-    mb_slave_state.request_byte_handler = _mb_sl_fsm_request_slave_id;
+    slave->req_crc    = modbus_crc16_update(slave->req_crc, data, len);
+    slave->skip_bytes = (uint16_t)(slave->skip_bytes - len);
+    if (slave->skip_bytes > 0) {
+        return;
+    }
+    /* Past the last possible end without a valid CRC the stream is resynchronized byte by byte */
+    if (slave->req_crc != 0 && slave->skip_next > 0) {
+        slave->skip_bytes = slave->skip_next;
+        slave->skip_next  = 0;
+        return;
+    }
+    modbus_slave_clear_data_r(slave);
 }
 
-void _mb_sl_do_internal_error(void)
+uint16_t _mb_sl_get_foreign_frame_len(const uint8_t* frame, uint16_t received, bool response)
 {
-    if (mb_slave_state.internal_error_handler != NULL) {
-        mb_slave_state.internal_error_handler();
+    uint8_t  command   = frame[1];
+    uint16_t base_len  = 0;
+    uint8_t  count_idx = 0;
+
+    if (command & MODBUS_ERROR_COMMAND_CODE) {
+        base_len = response ? 5 : 0;
+    } else if (command >= MODBUS_READ_COILS && command <= MODBUS_READ_INPUT_REGISTERS) {
+        base_len  = response ? 5 : 8;
+        count_idx = response ? 2 : 0;
+    } else if (command == MODBUS_FORCE_SINGLE_COIL || command == MODBUS_PRESET_SINGLE_REGISTER) {
+        base_len = 8;
+    } else if (command == MODBUS_FORCE_MULTIPLE_COILS || command == MODBUS_PRESET_MULTIPLE_REGISTERS) {
+        base_len  = response ? 8 : 9;
+        count_idx = response ? 0 : 6;
+    } else if (command == MODBUS_MASK_WRITE_REGISTER) {
+        base_len = 10;
+    } else if (command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS) {
+        base_len  = response ? 5 : 13;
+        count_idx = response ? 2 : 10;
+    } else if (command == MODBUS_READ_FILE_RECORD || command == MODBUS_WRITE_FILE_RECORD) {
+        base_len  = 5;
+        count_idx = 2;
+    }
+
+    if (base_len == 0) {
+        return MB_SL_FRAME_LEN_UNKNOWN;
+    }
+    /* The byte count hasn't been received yet */
+    if (count_idx >= received) {
+        return 0;
     }
-    modbus_slave_clear_data();
+    return (uint16_t)(base_len + (count_idx > 0 ? frame[count_idx] : 0));
 }
 
-void _mb_sl_make_read_response(void)
+bool _mb_sl_is_receiving_request(modbus_slave_t* slave)
 {
-    uint8_t command       = mb_slave_state.data_req.command;
-    uint16_t req_data_len = _mb_sl_get_special_data_first_value();
-
-    uint16_t counter      = 0;
-
-    memset(mb_slave_state.special_data, 0, sizeof(mb_slave_state.special_data));
-    while (counter < req_data_len) {
-        uint16_t cur_idx = mb_slave_state.data_req.register_addr + counter;
-        (void)cur_idx;
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-        if (command == MODBUS_READ_COILS) {
-            mb_slave_state.special_data[1 + (counter / 8)] |= (mb_discrete_output_coils[cur_idx] << (cur_idx % 8));
-        }
-#endif
-#if MODBUS_SLAVE_INPUT_COILS_COUNT
-        if (command == MODBUS_READ_INPUT_STATUS) {
-            mb_slave_state.special_data[1 + (counter / 8)] |= (mb_discrete_input_coils[cur_idx] << (cur_idx % 8));
-        }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-        if (command == MODBUS_READ_HOLDING_REGISTERS) {
-            mb_slave_state.special_data[1 + counter * 2] = mb_analog_output_holding_registers[cur_idx] >> 8;
-            mb_slave_state.special_data[1 + counter * 2 + 1] = mb_analog_output_holding_registers[cur_idx];
-        }
-#endif
-#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
-        if (command == MODBUS_READ_INPUT_REGISTERS) {
-            mb_slave_state.special_data[1 + counter * 2] = (uint8_t)(mb_analog_input_registers[cur_idx] >> 8);
-            mb_slave_state.special_data[1 + counter * 2 + 1] = (uint8_t)(mb_analog_input_registers[cur_idx]);
-        }
-#endif
-        counter++;
-    }
+    return _mb_sl_is_dispatching(slave)
+        || (slave->request_byte_handler != _mb_sl_fsm_request_slave_id && slave->request_byte_handler != _mb_sl_fsm_foreign_frame);
+}
 
-    uint16_t resp_data_len = 0;
-    if (command == MODBUS_READ_HOLDING_REGISTERS || command == MODBUS_READ_INPUT_REGISTERS) {
-        resp_data_len = counter * 2;
+size_t _mb_sl_get_payload_span(modbus_slave_t* slave, size_t len)
+{
+    if (slave->request_byte_handler != _mb_sl_fsm_request_special_data || (!_mb_sl_is_write_multiple_reg_command(slave) && !_mb_sl_is_read_write_command(slave) && !_mb_sl_is_file_command(slave))) {
+        return 0;
     }
-    else {
-        resp_data_len = counter;
+    /* The first payload byte has passed the registers count check, the rest is plain data */
+    uint8_t meta_count = _mb_sl_get_special_data_meta_count(slave);
+    if (slave->data_handler_counter <= meta_count) {
+        return 0;
     }
-    mb_slave_state.data_resp.data_len = (uint8_t)(1 + resp_data_len);
-    mb_slave_state.special_data[0]    = (uint8_t)resp_data_len;
+
+    size_t span = (size_t)(meta_count + slave->special_data[meta_count - 1]) - slave->data_handler_counter;
+    span = MB_MIN(span, len);
+    span = MB_MIN(span, sizeof(slave->req_data_bytes) - slave->req_data_bytes_idx - 1);
+    span = MB_MIN(span, (size_t)(UINT8_MAX - slave->data_handler_counter));
+    return span;
 }
 
-void _mb_sl_make_write_single_response(void)
+void _mb_sl_receive_payload(modbus_slave_t* slave, const uint8_t* data, size_t len)
 {
-    uint8_t counter = 0;
-
-    uint16_t reg_addr = mb_slave_state.data_req.register_addr;
-
-    mb_slave_state.special_data[counter++] = (uint8_t)(reg_addr >> 8);
-    mb_slave_state.special_data[counter++] = (uint8_t)(reg_addr);
+    memcpy(slave->special_data + slave->data_handler_counter, data, len);
+    memcpy(slave->req_data_bytes + slave->req_data_bytes_idx, data, len);
+    slave->req_data_bytes_idx   += (uint16_t)len;
+    slave->req_crc               = modbus_crc16_update(slave->req_crc, data, len);
+    slave->data_handler_counter += (uint8_t)len;
 
-    memset(mb_slave_state.special_data, 0, sizeof(mb_slave_state.special_data));
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-    if (mb_slave_state.data_req.command == MODBUS_FORCE_SINGLE_COIL) {
-        mb_slave_state.special_data[counter++] = mb_discrete_output_coils[reg_addr] >> 8;
-        mb_slave_state.special_data[counter++] = mb_discrete_output_coils[reg_addr];
-    }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (mb_slave_state.data_req.command == MODBUS_PRESET_SINGLE_REGISTER) {
-        mb_slave_state.special_data[counter++] = mb_analog_output_holding_registers[reg_addr] >> 8;
-        mb_slave_state.special_data[counter++] = mb_analog_output_holding_registers[reg_addr];
+    uint8_t meta_count = _mb_sl_get_special_data_meta_count(slave);
+    if (slave->data_handler_counter == meta_count + slave->special_data[meta_count - 1]) {
+        slave->data_handler_counter = 0;
+        slave->request_byte_handler = _mb_sl_fsm_request_crc;
     }
-#endif
+}
 
-    mb_slave_state.data_resp.data_len = counter;
+bool _mb_sl_is_read_command(modbus_slave_t* slave)
+{
+    return slave->data_req.command == MODBUS_READ_COILS || slave->data_req.command == MODBUS_READ_HOLDING_REGISTERS || slave->data_req.command == MODBUS_READ_INPUT_REGISTERS || slave->data_req.command == MODBUS_READ_INPUT_STATUS;
 }
 
-void _mb_sl_make_write_multiple_response(void)
+bool _mb_sl_is_write_single_reg_command(modbus_slave_t* slave)
 {
-    uint8_t counter = 0;
+    return slave->data_req.command == MODBUS_FORCE_SINGLE_COIL || slave->data_req.command == MODBUS_PRESET_SINGLE_REGISTER;
+}
 
-    uint16_t written_count = _mb_sl_get_special_data_first_value();
+bool _mb_sl_is_write_multiple_reg_command(modbus_slave_t* slave)
+{
+    return slave->data_req.command == MODBUS_FORCE_MULTIPLE_COILS || slave->data_req.command == MODBUS_PRESET_MULTIPLE_REGISTERS;
+}
 
-    uint16_t reg_addr = mb_slave_state.data_req.register_addr;
+bool _mb_sl_is_read_write_command(modbus_slave_t* slave)
+{
+    return slave->data_req.command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS;
+}
 
-    memset(mb_slave_state.special_data, 0, sizeof(mb_slave_state.special_data));
+bool _mb_sl_is_mask_write_command(modbus_slave_t* slave)
+{
+    return slave->data_req.command == MODBUS_MASK_WRITE_REGISTER;
+}
 
-    mb_slave_state.special_data[counter++] = (uint8_t)(reg_addr >> 8);
-    mb_slave_state.special_data[counter++] = (uint8_t)(reg_addr);
-    mb_slave_state.special_data[counter++] = (uint8_t)(written_count >> 8);
-    mb_slave_state.special_data[counter++] = (uint8_t)(written_count);
+bool _mb_sl_is_file_command(modbus_slave_t* slave)
+{
+    return slave->data_req.command == MODBUS_READ_FILE_RECORD || slave->data_req.command == MODBUS_WRITE_FILE_RECORD;
+}
 
-    mb_slave_state.data_resp.data_len = counter;
+bool _mb_sl_is_recieved_own_slave_id(modbus_slave_t* slave)
+{
+    return slave->slave_id == slave->data_req.id || _mb_sl_is_broadcast_request(slave);
 }
 
-void _mb_sl_fsm_request_slave_id(uint8_t byte)
+bool _mb_sl_is_broadcast_request(modbus_slave_t* slave)
 {
-    mb_slave_state.data_req.id = byte;
-    mb_slave_state.data_handler_counter = 0;
-    if (!_mb_sl_is_recieved_own_slave_id()) {
-    	mb_slave_state.req_data_bytes_idx = 0;
-        return;
+    return slave->data_req.id == MODBUS_BROADCAST_ID;
+}
+
+bool _mb_sl_check_available_request_command(modbus_slave_t* slave)
+{
+    if (slave->data_req.command == MODBUS_READ_FILE_RECORD) {
+        return slave->file_read_handler != NULL;
+    }
+    if (slave->data_req.command == MODBUS_WRITE_FILE_RECORD) {
+        return slave->file_write_handler != NULL;
     }
-    mb_slave_state.request_byte_handler = _mb_sl_fsm_request_command;
+    const modbus_slave_segment_t* segments = NULL;
+    return _mb_sl_get_segments(slave, _mb_sl_get_request_register_type(slave), &segments) > 0;
 }
 
-void _mb_sl_fsm_request_command(uint8_t byte)
+bool _mb_sl_check_request_register_addr(modbus_slave_t* slave)
 {
-    mb_slave_state.data_req.command = byte;
-    mb_slave_state.data_handler_counter = 0;
-    mb_slave_state.request_byte_handler = _mb_sl_fsm_request_register_addr;
+    if (_mb_sl_is_file_command(slave)) {
+        return true;
+    }
+    return _mb_sl_find_segment(slave, _mb_sl_get_request_register_type(slave), slave->data_req.register_addr) != NULL;
+}
 
-    if (!_mb_sl_is_recieved_own_slave_id()) {
-        return;
+bool _mb_sl_check_request_write_register_addr(modbus_slave_t* slave)
+{
+    /* The write address of a read/write request follows the read count */
+    if (!_mb_sl_is_read_write_command(slave)) {
+        return true;
     }
+    return _mb_sl_find_segment(slave, _mb_sl_get_request_register_type(slave), _mb_sl_get_write_register_addr(slave)) != NULL;
+}
 
-    if (!_mb_sl_check_available_request_command()) {
-        _mb_sl_request_proccess();
+bool _mb_sl_check_request_writable(modbus_slave_t* slave)
+{
+    if (!_mb_sl_is_write_single_reg_command(slave) && !_mb_sl_is_write_multiple_reg_command(slave)
+        && !_mb_sl_is_read_write_command(slave) && !_mb_sl_is_mask_write_command(slave)) {
+        return true;
     }
+    return _mb_sl_check_registers_writable(slave, _mb_sl_get_request_register_type(slave), _mb_sl_get_write_register_addr(slave), _mb_sl_get_write_registers_count(slave));
 }
 
-void _mb_sl_fsm_request_register_addr(uint8_t byte)
+bool _mb_sl_check_request_registers_count(modbus_slave_t* slave)
 {
-    mb_slave_state.data_req.register_addr <<= 8;
-    mb_slave_state.data_req.register_addr |= byte;
-    if (mb_slave_state.data_handler_counter == sizeof(mb_slave_state.data_req.register_addr)) {
-        mb_slave_state.data_handler_counter = 0;
-        mb_slave_state.request_byte_handler = _mb_sl_fsm_request_special_data;
+    if (_mb_sl_is_file_command(slave)) {
+        return _mb_sl_check_file_request(slave);
     }
 
-    if (!_mb_sl_is_recieved_own_slave_id()) {
-        return;
+    uint16_t reg_count = _mb_sl_get_needed_registers_count(slave);
+    uint16_t reg_addr  = slave->data_req.register_addr;
+
+    /* Caller storage may be larger than the response buffer */
+    uint32_t resp_count = MODBUS_COILS_BYTES((uint32_t)reg_count);
+    if (slave->data_req.command == MODBUS_READ_HOLDING_REGISTERS || slave->data_req.command == MODBUS_READ_INPUT_REGISTERS) {
+        resp_count = (uint32_t)reg_count * 2;
     }
 
-    if (mb_slave_state.request_byte_handler == _mb_sl_fsm_request_register_addr) {
-        return;
+    if (_mb_sl_is_read_write_command(slave)) {
+        uint16_t write_count = _mb_sl_get_write_registers_count(slave);
+        uint8_t  data_count  = slave->special_data[SPECIAL_DATA_READ_WRITE_META_COUNT - 1];
+        return reg_count > 0
+            && write_count > 0
+            && _mb_sl_check_registers_range(slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, reg_addr, reg_count)
+            && _mb_sl_check_registers_range(slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, _mb_sl_get_write_register_addr(slave), write_count)
+            && data_count == (uint32_t)write_count * 2
+            && (unsigned int)(SPECIAL_DATA_READ_WRITE_META_COUNT + data_count) <= (unsigned int)sizeof(slave->special_data)
+            && 1 + (uint32_t)reg_count * 2 <= sizeof(slave->special_data);
     }
 
-    if (!_mb_sl_check_request_register_addr()) {
-        _mb_sl_request_proccess();
+    uint8_t data_count = slave->special_data[SPECIAL_DATA_META_COUNT - 1];
+
+    /* The byte count of a write must match the registers count */
+    uint32_t write_count = reg_count;
+    if (slave->data_req.command == MODBUS_PRESET_MULTIPLE_REGISTERS) {
+        write_count *= 2;
     }
+    if (slave->data_req.command == MODBUS_FORCE_MULTIPLE_COILS) {
+        write_count = MODBUS_COILS_BYTES(write_count);
+    }
+
+    return reg_count > 0
+        && _mb_sl_check_registers_range(slave, _mb_sl_get_request_register_type(slave), reg_addr, reg_count)
+        && (!_mb_sl_is_write_multiple_reg_command(slave) || (data_count == write_count
+            && (unsigned int)(SPECIAL_DATA_META_COUNT + data_count) <= (unsigned int)sizeof(slave->special_data)))
+        && (!_mb_sl_is_read_command(slave) || 1 + resp_count <= sizeof(slave->special_data));
 }
 
-void _mb_sl_fsm_request_special_data(uint8_t byte)
+bool _mb_sl_check_file_byte_count(modbus_slave_t* slave)
 {
-    uint16_t needed_count_bytes = 0;
-    uint16_t needed_count       = 0;
-    uint16_t cur_count          = mb_slave_state.data_handler_counter;
-
-    if (mb_slave_state.data_req.register_addr + _mb_sl_get_needed_registers_count() > _mb_sl_get_registers_count(_mb_sl_get_request_register_type())) {
-        goto do_count_special_data;
+    uint8_t byte_count = slave->special_data[0];
+    if (slave->data_req.command == MODBUS_READ_FILE_RECORD) {
+        return byte_count >= SPECIAL_DATA_FILE_SUB_REQUEST_SIZE && byte_count <= MODBUS_FILE_READ_BYTES_MAX
+            && (unsigned int)(SPECIAL_DATA_FILE_META_COUNT + byte_count) <= (unsigned int)sizeof(slave->special_data);
     }
+    return byte_count >= SPECIAL_DATA_FILE_SUB_REQUEST_SIZE + 2 && byte_count <= MODBUS_FILE_WRITE_BYTES_MAX
+        && (unsigned int)(SPECIAL_DATA_FILE_META_COUNT + byte_count) <= (unsigned int)sizeof(slave->special_data);
+}
 
-    if (mb_slave_state.data_handler_counter > sizeof(mb_slave_state.special_data)) {
-        goto do_count_special_data;
+bool _mb_sl_check_file_request(modbus_slave_t* slave)
+{
+    if (!_mb_sl_check_file_byte_count(slave)) {
+        return false;
     }
 
-    mb_slave_state.special_data[mb_slave_state.data_handler_counter - 1] = byte;
-
+    bool     write = slave->data_req.command == MODBUS_WRITE_FILE_RECORD;
+    uint16_t idx   = SPECIAL_DATA_FILE_META_COUNT;
+    uint16_t end   = (uint16_t)(SPECIAL_DATA_FILE_META_COUNT + slave->special_data[0]);
+    while (idx < end) {
+        if (end - idx < SPECIAL_DATA_FILE_SUB_REQUEST_SIZE) {
+            return false;
+        }
+        uint32_t count = _mb_sl_get_special_data_value(slave, (uint8_t)(idx + SPECIAL_DATA_FILE_RECORD_LENGTH_IDX));
+        if (slave->special_data[idx] != MODBUS_FILE_REFERENCE_TYPE || count == 0) {
+            return false;
+        }
+        idx += SPECIAL_DATA_FILE_SUB_REQUEST_SIZE;
+        if (write && (uint32_t)(end - idx) < count * 2) {
+            return false;
+        }
+        idx = (uint16_t)(idx + (write ? count * 2 : 0));
+    }
 
-do_count_special_data:
-    needed_count_bytes = 0;
-    needed_count       = 0;
+    /* Every sub-response carries its length and reference type before the records */
+    uint16_t resp_count = _mb_sl_get_file_response_len(slave);
+    return write || (resp_count <= MODBUS_FILE_READ_BYTES_MAX && 1U + resp_count <= sizeof(slave->special_data));
+}
 
-    if (_mb_sl_is_read_command() || _mb_sl_is_write_single_reg_command()) {
-        needed_count_bytes = SPECIAL_DATA_VALUE_SIZE;
-        needed_count       = SPECIAL_DATA_VALUE_SIZE;
+uint16_t _mb_sl_get_file_response_len(modbus_slave_t* slave)
+{
+    if (slave->data_req.command == MODBUS_WRITE_FILE_RECORD) {
+        return slave->special_data[0];
     }
 
-    if (_mb_sl_is_write_multiple_reg_command()) {
-        needed_count_bytes = SPECIAL_DATA_META_COUNT + mb_slave_state.special_data[SPECIAL_DATA_META_COUNT - 1];
-        needed_count       = SPECIAL_DATA_VALUE_SIZE + 1;
+    uint32_t resp_count = 0;
+    uint16_t end = (uint16_t)(SPECIAL_DATA_FILE_META_COUNT + slave->special_data[0]);
+    for (uint16_t idx = SPECIAL_DATA_FILE_META_COUNT; idx + SPECIAL_DATA_FILE_SUB_REQUEST_SIZE <= end; idx += SPECIAL_DATA_FILE_SUB_REQUEST_SIZE) {
+        resp_count += 2 + (uint32_t)_mb_sl_get_special_data_value(slave, (uint8_t)(idx + SPECIAL_DATA_FILE_RECORD_LENGTH_IDX)) * 2;
     }
+    return (uint16_t)MB_MIN(resp_count, 0xFFFFUL);
+}
 
-    if (mb_slave_state.data_handler_counter == needed_count_bytes) {
-        mb_slave_state.data_handler_counter = 0;
-        mb_slave_state.request_byte_handler = _mb_sl_fsm_request_crc;
-    }
+uint16_t _mb_sl_get_special_data_first_value(modbus_slave_t* slave)
+{
+    return _mb_sl_get_special_data_value(slave, SPECIAL_DATA_REGISTERS_COUNT_IDX);
+}
 
-    if (!_mb_sl_is_recieved_own_slave_id()) {
-        return;
-    }
+uint16_t _mb_sl_get_special_data_value(modbus_slave_t* slave, uint8_t idx)
+{
+    uint8_t regh = slave->special_data[idx];
+    uint8_t regl = slave->special_data[idx + 1];
+    return (uint16_t)(((uint16_t)regh) << 8) + (uint16_t)regl;
+}
 
-    if (cur_count <= needed_count) {
-        return;
+uint8_t _mb_sl_get_special_data_meta_count(modbus_slave_t* slave)
+{
+    if (_mb_sl_is_file_command(slave)) {
+        return SPECIAL_DATA_FILE_META_COUNT;
     }
+    return _mb_sl_is_read_write_command(slave) ? SPECIAL_DATA_READ_WRITE_META_COUNT : SPECIAL_DATA_META_COUNT;
+}
 
-    if (!_mb_sl_check_request_registers_count()) {
-        _mb_sl_request_proccess();
+uint16_t _mb_sl_get_needed_registers_count(modbus_slave_t* slave)
+{
+    if (_mb_sl_is_write_single_reg_command(slave) || _mb_sl_is_mask_write_command(slave)) {
+        return 1;
     }
+    if (_mb_sl_is_read_command(slave) || _mb_sl_is_write_multiple_reg_command(slave) || _mb_sl_is_read_write_command(slave)) {
+        return _mb_sl_get_special_data_first_value(slave);
+    }
+    return 0;
 }
 
-void _mb_sl_fsm_request_crc(uint8_t byte)
+uint16_t _mb_sl_get_write_register_addr(modbus_slave_t* slave)
 {
-    mb_slave_state.data_req.crc >>= 8;
-    mb_slave_state.data_req.crc |= (byte << 8);
+    if (_mb_sl_is_read_write_command(slave)) {
+        return _mb_sl_get_special_data_value(slave, SPECIAL_DATA_WRITE_ADDR_IDX);
+    }
+    return slave->data_req.register_addr;
+}
 
-    if (mb_slave_state.data_handler_counter < sizeof(mb_slave_state.data_req.crc)) {
-        return;
+uint16_t _mb_sl_get_write_registers_count(modbus_slave_t* slave)
+{
+    if (_mb_sl_is_read_write_command(slave)) {
+        return _mb_sl_get_special_data_value(slave, SPECIAL_DATA_WRITE_COUNT_IDX);
     }
+    return _mb_sl_get_needed_registers_count(slave);
+}
 
-    if (!_mb_sl_is_recieved_own_slave_id()) {
-        mb_slave_state.data_handler_counter = 0;
-        mb_slave_state.request_byte_handler = _mb_sl_fsm_request_slave_id;
-        goto do_reset_data;
+uint16_t _mb_sl_get_segments(modbus_slave_t* slave, register_type_t register_type, const modbus_slave_segment_t** segments)
+{
+    if (register_type < MODBUS_REGISTER_DISCRETE_OUTPUT_COILS || register_type > MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS) {
+        return 0;
     }
 
-    uint16_t crc = modbus_crc16(
-		mb_slave_state.req_data_bytes,
-		mb_slave_state.req_data_bytes_idx - (uint16_t)sizeof(mb_slave_state.data_req.crc)
-	);
-    if (mb_slave_state.data_req.crc != crc) {
-        mb_slave_state.is_error_response = true;
+    uint8_t idx = (uint8_t)(register_type - MODBUS_REGISTER_DISCRETE_OUTPUT_COILS);
+    if (slave->segments[idx] != NULL) {
+        *segments = slave->segments[idx];
+        return slave->segments_count[idx];
     }
 
-    _mb_sl_request_proccess();
+    /* Without a segment table the dense array is one segment from address 0 */
+    *segments = &slave->dense_segments[idx];
+    return (slave->dense_segments[idx].storage != NULL && slave->dense_segments[idx].count > 0) ? 1 : 0;
+}
 
-    goto do_reset_data;
+const modbus_slave_segment_t* _mb_sl_find_segment(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id)
+{
+    const modbus_slave_segment_t* segments = NULL;
+    uint16_t high = _mb_sl_get_segments(slave, register_type, &segments);
+    uint16_t low  = 0;
+
+    /* First segment with a base above register_id */
+    while (low < high) {
+        uint16_t mid = (uint16_t)(low + (high - low) / 2);
+        if (segments[mid].base <= register_id) {
+            low = (uint16_t)(mid + 1);
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
 
-do_reset_data:
-    modbus_slave_clear_data();
+    const modbus_slave_segment_t* segment = &segments[low - 1];
+    return (uint32_t)register_id < (uint32_t)segment->base + segment->count ? segment : NULL;
 }
 
-bool _mb_sl_is_read_command(void)
+bool _mb_sl_check_registers_range(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count)
 {
-    return mb_slave_state.data_req.command == MODBUS_READ_COILS || mb_slave_state.data_req.command == MODBUS_READ_HOLDING_REGISTERS || mb_slave_state.data_req.command == MODBUS_READ_INPUT_REGISTERS || mb_slave_state.data_req.command == MODBUS_READ_INPUT_STATUS;
+    uint32_t cur = register_id;
+    uint32_t end = (uint32_t)register_id + count;
+    if (end > 0x10000UL) {
+        return false;
+    }
+    /* One lookup per segment, the next one has to start where the previous ends */
+    while (cur < end) {
+        const modbus_slave_segment_t* segment = _mb_sl_find_segment(slave, register_type, (uint16_t)cur);
+        if (segment == NULL) {
+            return false;
+        }
+        cur = (uint32_t)segment->base + segment->count;
+    }
+    return true;
 }
 
-bool _mb_sl_is_write_single_reg_command(void)
+bool _mb_sl_check_registers_writable(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count)
 {
-    return mb_slave_state.data_req.command == MODBUS_FORCE_SINGLE_COIL || mb_slave_state.data_req.command == MODBUS_PRESET_SINGLE_REGISTER;
+    uint32_t cur = register_id;
+    uint32_t end = (uint32_t)register_id + count;
+    if (end > 0x10000UL) {
+        return false;
+    }
+    /* Snapshot segments are read-only, the application's next publication would copy over a write */
+    while (cur < end) {
+        const modbus_slave_segment_t* segment = _mb_sl_find_segment(slave, register_type, (uint16_t)cur);
+        if (segment == NULL || segment->snapshot != NULL) {
+            return false;
+        }
+        cur = (uint32_t)segment->base + segment->count;
+    }
+    return true;
 }
 
-bool _mb_sl_is_write_multiple_reg_command(void)
+void _mb_sl_copy_registers(modbus_slave_t* slave, register_type_t register_type, uint16_t register_id, uint16_t count, uint8_t* data, bool to_storage, bool from_request)
 {
-    return mb_slave_state.data_req.command == MODBUS_FORCE_MULTIPLE_COILS || mb_slave_state.data_req.command == MODBUS_PRESET_MULTIPLE_REGISTERS;
+    bool coils = _mb_sl_is_coils(register_type);
+
+    uint16_t done = 0;
+    while (done < count) {
+        const modbus_slave_segment_t* segment = _mb_sl_find_segment(slave, register_type, (uint16_t)(register_id + done));
+        if (segment == NULL) {
+            return;
+        }
+        uint16_t offset = (uint16_t)(register_id + done - segment->base);
+        uint16_t chunk  = (uint16_t)MB_MIN((uint16_t)(count - done), (uint16_t)(segment->count - offset));
+
+        /* Lazily computed values are refreshed only for the polled part of the segment */
+        if (from_request && !to_storage && segment->read_handler != NULL) {
+            segment->read_handler(slave->user_context, register_type, (uint16_t)(register_id + done), chunk);
+        }
+
+        /* A publication during the copy may have reused the buffer, the copy is repeated from the new one */
+        modbus_slave_sequence_t sequence = 0;
+        bool retry = false;
+        do {
+            _mb_sl_copy_chunk(slave, coils, _mb_sl_get_segment_storage(segment, &sequence), offset, data, done, chunk, to_storage);
+            if (segment->snapshot != NULL && !to_storage) {
+                MB_SL_SEQUENCE_FENCE();
+                retry = MB_SL_SEQUENCE_LOAD(&segment->snapshot->sequence) != sequence;
+            }
+        } while (retry);
+
+        done = (uint16_t)(done + chunk);
+    }
 }
 
-bool _mb_sl_is_recieved_own_slave_id(void)
+void _mb_sl_copy_chunk(modbus_slave_t* slave, bool coils, void* storage, uint16_t offset, uint8_t* data, uint16_t done, uint16_t chunk, bool to_storage)
 {
-    return mb_slave_state.slave_id == mb_slave_state.data_req.id;
+    if (coils && to_storage) {
+        modbus_bits_copy((uint8_t*)storage, offset, data, done, chunk);
+    } else if (coils) {
+        modbus_bits_copy(data, done, (const uint8_t*)storage, offset, chunk);
+    } else if (slave->registers.registers_wire_order && to_storage) {
+        memcpy((uint16_t*)storage + offset, data + done * 2, chunk * 2);
+    } else if (slave->registers.registers_wire_order) {
+        memcpy(data + done * 2, (const uint16_t*)storage + offset, chunk * 2);
+    } else if (to_storage) {
+        uint16_t* registers = (uint16_t*)storage + offset;
+        const uint8_t* bytes = data + done * 2;
+        for (uint16_t i = 0; i < chunk; i++) {
+            registers[i] = (uint16_t)(((uint16_t)bytes[i * 2] << 8) | bytes[i * 2 + 1]);
+        }
+    } else {
+        const uint16_t* registers = (const uint16_t*)storage + offset;
+        uint8_t* bytes = data + done * 2;
+        for (uint16_t i = 0; i < chunk; i++) {
+            bytes[i * 2]     = (uint8_t)(registers[i] >> 8);
+            bytes[i * 2 + 1] = (uint8_t)(registers[i]);
+        }
+    }
 }
 
-bool _mb_sl_check_available_request_command(void)
+void* _mb_sl_get_segment_storage(const modbus_slave_segment_t* segment, modbus_slave_sequence_t* sequence)
 {
-    return false
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-        || mb_slave_state.data_req.command == MODBUS_READ_COILS
-        || mb_slave_state.data_req.command == MODBUS_FORCE_SINGLE_COIL
-        || mb_slave_state.data_req.command == MODBUS_FORCE_MULTIPLE_COILS
-#endif
-#if MODBUS_SLAVE_INPUT_COILS_COUNT
-        || mb_slave_state.data_req.command == MODBUS_READ_INPUT_STATUS
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-        || mb_slave_state.data_req.command == MODBUS_READ_HOLDING_REGISTERS
-        || mb_slave_state.data_req.command == MODBUS_PRESET_SINGLE_REGISTER
-        || mb_slave_state.data_req.command == MODBUS_PRESET_MULTIPLE_REGISTERS
-#endif
-#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
-        || mb_slave_state.data_req.command == MODBUS_READ_INPUT_REGISTERS
-#endif
-        ;
+    if (segment->snapshot == NULL) {
+        return segment->storage;
+    }
+    *sequence = MB_SL_SEQUENCE_LOAD(&segment->snapshot->sequence);
+    return segment->snapshot->buffers[*sequence & 1];
 }
 
-bool _mb_sl_check_request_register_addr(void)
+bool _mb_sl_is_coils(register_type_t register_type)
 {
-    return mb_slave_state.data_req.register_addr < (uint16_t)_mb_sl_get_registers_count(_mb_sl_get_request_register_type());
+    return register_type == MODBUS_REGISTER_DISCRETE_OUTPUT_COILS || register_type == MODBUS_REGISTER_DISCRETE_INPUT_COILS;
 }
 
-bool _mb_sl_check_request_registers_count(void)
+bool _mb_sl_get_coil(const uint8_t* coils, uint16_t coil_id)
 {
-    uint16_t reg_count = _mb_sl_get_needed_registers_count();
-    uint8_t data_count = mb_slave_state.special_data[SPECIAL_DATA_META_COUNT - 1];
-    uint16_t reg_addr  = mb_slave_state.data_req.register_addr;
-
-    return reg_count > 0
-        && reg_addr + reg_count <= _mb_sl_get_registers_count(_mb_sl_get_request_register_type())
-        && (unsigned int)(SPECIAL_DATA_META_COUNT + data_count) <= (unsigned int)sizeof(mb_slave_state.special_data);
+    return (coils[coil_id / 8] >> (coil_id % 8)) & 0x01;
 }
 
-uint16_t _mb_sl_get_special_data_first_value(void)
+void _mb_sl_set_coil(uint8_t* coils, uint16_t coil_id, bool value)
 {
-    uint8_t regh = mb_slave_state.special_data[SPECIAL_DATA_REGISTERS_COUNT_IDX];
-    uint8_t regl = mb_slave_state.special_data[SPECIAL_DATA_REGISTERS_COUNT_IDX + 1];
-    return (uint16_t)(((uint16_t)regh) << 8) + (uint16_t)regl;
+    uint8_t mask = (uint8_t)(1 << (coil_id % 8));
+    if (value) {
+        coils[coil_id / 8] |= mask;
+    } else {
+        coils[coil_id / 8] &= (uint8_t)~mask;
+    }
 }
 
-uint16_t _mb_sl_get_needed_registers_count(void)
+uint16_t _mb_sl_get_register(modbus_slave_t* slave, const uint16_t* registers, uint16_t register_id)
 {
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT || MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (_mb_sl_is_write_single_reg_command()) {
-        return 1;
-    }
-#endif
-#if MODBUS_SLAVE_INPUT_COILS_COUNT || MODBUS_SLAVE_OUTPUT_COILS_COUNT || MODBUS_SLAVE_INPUT_REGISTERS_COUNT || MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (_mb_sl_is_read_command() || _mb_sl_is_write_multiple_reg_command()) {
-        return _mb_sl_get_special_data_first_value();
+    if (!slave->registers.registers_wire_order) {
+        return registers[register_id];
     }
-#endif
-    return 0;
+    const uint8_t* bytes = (const uint8_t*)(registers + register_id);
+    return (uint16_t)(((uint16_t)bytes[0] << 8) | bytes[1]);
 }
 
-uint16_t _mb_sl_get_registers_count(register_type_t register_type)
+void _mb_sl_set_register(modbus_slave_t* slave, uint16_t* registers, uint16_t register_id, uint16_t value)
 {
-	(void)register_type;
-#if MODBUS_SLAVE_INPUT_COILS_COUNT
-    if (register_type == MODBUS_REGISTER_DISCRETE_INPUT_COILS) {
-        return MODBUS_SLAVE_INPUT_COILS_COUNT;
-    }
-#endif
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
-    if (register_type == MODBUS_REGISTER_DISCRETE_OUTPUT_COILS) {
-        return MODBUS_SLAVE_OUTPUT_COILS_COUNT;
-    }
-#endif
-#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
-    if (register_type == MODBUS_REGISTER_ANALOG_INPUT_REGISTERS) {
-        return MODBUS_SLAVE_INPUT_REGISTERS_COUNT;
-    }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (register_type == MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS) {
-        return MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT;
+    if (!slave->registers.registers_wire_order) {
+        registers[register_id] = value;
+        return;
     }
-#endif
-    return 0;
+    uint8_t* bytes = (uint8_t*)(registers + register_id);
+    bytes[0] = (uint8_t)(value >> 8);
+    bytes[1] = (uint8_t)(value);
 }
 
-register_type_t _mb_sl_get_request_register_type()
+register_type_t _mb_sl_get_request_register_type(modbus_slave_t* slave)
 {
     register_type_t  register_type = 0;
-    modbus_command_t command = mb_slave_state.data_req.command;
-    (void)command;
-#if MODBUS_SLAVE_INPUT_COILS_COUNT
+    modbus_command_t command = slave->data_req.command;
     if (command == MODBUS_READ_INPUT_STATUS) {
         register_type = MODBUS_REGISTER_DISCRETE_INPUT_COILS;
     }
-#endif
-#if MODBUS_SLAVE_OUTPUT_COILS_COUNT
     if (command == MODBUS_FORCE_MULTIPLE_COILS || command == MODBUS_FORCE_SINGLE_COIL || command == MODBUS_READ_COILS) {
         register_type = MODBUS_REGISTER_DISCRETE_OUTPUT_COILS;
     }
-#endif
-#if MODBUS_SLAVE_OUTPUT_HOLDING_REGISTERS_COUNT
-    if (command == MODBUS_PRESET_MULTIPLE_REGISTERS || command == MODBUS_PRESET_SINGLE_REGISTER || command == MODBUS_READ_HOLDING_REGISTERS) {
+    if (command == MODBUS_PRESET_MULTIPLE_REGISTERS || command == MODBUS_PRESET_SINGLE_REGISTER || command == MODBUS_READ_HOLDING_REGISTERS || command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS || command == MODBUS_MASK_WRITE_REGISTER) {
         register_type = MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS;
     }
-#endif
-#if MODBUS_SLAVE_INPUT_REGISTERS_COUNT
     if (command == MODBUS_READ_INPUT_REGISTERS) {
         register_type = MODBUS_REGISTER_ANALOG_INPUT_REGISTERS;
     }
-#endif
     return register_type;
 }
+
+void _mb_sl_legacy_response_data_handler(void* user_context, uint8_t* data, uint32_t len)
+{
+    (void)user_context;
+    if (mb_slave_legacy_response_data_handler != NULL) {
+        mb_slave_legacy_response_data_handler(data, len);
+    }
+}
+
+void _mb_sl_legacy_internal_error_handler(void* user_context)
+{
+    (void)user_context;
+    if (mb_slave_legacy_internal_error_handler != NULL) {
+        mb_slave_legacy_internal_error_handler();
+    }
+}
+
+uint8_t* _mb_sl_legacy_tx_buffer_provider(void* user_context, uint32_t len)
+{
+    (void)user_context;
+    if (mb_slave_legacy_tx_buffer_provider != NULL) {
+        return mb_slave_legacy_tx_buffer_provider(len);
+    }
+    return NULL;
+}
+
+void _mb_sl_legacy_tx_buffer_commit(void* user_context, uint8_t* data, uint32_t len)
+{
+    (void)user_context;
+    if (mb_slave_legacy_tx_buffer_commit != NULL) {
+        mb_slave_legacy_tx_buffer_commit(data, len);
+    }
+}
+
+void _mb_sl_legacy_write_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count)
+{
+    (void)user_context;
+    if (mb_slave_legacy_write_handler != NULL) {
+        mb_slave_legacy_write_handler(register_type, register_id, count);
+    }
+}
+
+bool _mb_sl_legacy_file_read_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, uint8_t* data)
+{
+    (void)user_context;
+    if (mb_slave_legacy_file_read_handler != NULL) {
+        return mb_slave_legacy_file_read_handler(file_number, record_number, count, data);
+    }
+    return false;
+}
+
+bool _mb_sl_legacy_file_write_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, const uint8_t* data)
+{
+    (void)user_context;
+    if (mb_slave_legacy_file_write_handler != NULL) {
+        return mb_slave_legacy_file_write_handler(file_number, record_number, count, data);
+    }
+    return false;
+}
@@ -20,4 +20,7 @@
 
 /**************************** MODBUS REGISTER SETTINGS END ****************************/
 
+/* The queue tests wait with more requests than the SDCC default holds */
+#define MODBUS_MASTER_QUEUE_SIZE                        (8)
+
 #endif
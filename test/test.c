@@ -15,11 +15,30 @@
 #include <Windows.h>
 #endif
 
+#if !SDCC && !_WIN32
+#include <pthread.h>
+#define SNAPSHOT_STRESS          (true)
+#define SNAPSHOT_PUBLICATIONS    (200000)
+#endif
+
 
 #define SLAVE_ID (0x01)
 #define DETAILS  (false)
 
 
+typedef struct _instance_link_t {
+    modbus_master_t   master;
+    modbus_slave_t    slave;
+    uint16_t          holding[4];
+    modbus_response_t response;
+    uint32_t          packets;
+    bool              buffered;
+    bool              deferred;
+    uint8_t           pending[64];
+    uint32_t          pending_len;
+} instance_link_t;
+
+
 // Master
 void request_data_sender(uint8_t* data, uint32_t len);
 void response_packet_handler(modbus_response_t* packet);
@@ -28,10 +47,57 @@ void master_internal_error_handler(void);
 // Slave
 void response_data_handler(uint8_t* data, uint32_t len);
 void slave_internal_error_handler(void);
+void instance_response_data_handler(void* user_context, uint8_t* data, uint32_t len);
+
+// Instances
+void link_request_data_sender(void* user_context, uint8_t* data, uint32_t len);
+uint8_t* tx_buffer_provider(void* user_context, uint32_t len);
+void tx_buffer_commit(void* user_context, uint8_t* data, uint32_t len);
+void link_response_data_handler(void* user_context, uint8_t* data, uint32_t len);
+void link_response_packet_handler(void* user_context, modbus_response_t* packet);
+void sensor_read_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count);
+void write_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count);
+bool file_read_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, uint8_t* data);
+bool file_write_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, const uint8_t* data);
+void file_complete_handler(void* user_context, modbus_error_response_t status, uint16_t records_done);
+uint32_t link_pump(instance_link_t* link);
+void counting_error_handler(void* user_context);
+uint32_t queue_clock(void* user_context);
+void requeue_packet_handler(void* user_context, modbus_response_t* packet);
+uint8_t link_step(instance_link_t* link);
+void poll_response_packet_handler(void* user_context, modbus_response_t* packet);
+void coalesced_packet_handler(void* user_context, modbus_response_t* packet);
+#if SNAPSHOT_STRESS
+void* snapshot_writer(void* snapshot);
+#endif
 
 // Tests
 void print_test_name(const char* format, uint16_t counter);
 void base_read_tests(void (*read_func) (uint8_t, uint16_t, uint16_t), uint16_t conunter, uint32_t registers_count);
+void crc_tests(void);
+void slave_instance_tests(void);
+void master_instance_tests(void);
+void receive_buffer_tests(void);
+void tx_buffer_tests(void);
+void frame_reset_tests(void);
+void packed_coils_tests(void);
+void wire_order_tests(void);
+void segments_tests(void);
+void read_handler_tests(void);
+void dirty_ranges_tests(void);
+void snapshot_tests(void);
+void read_write_tests(void);
+void mask_write_tests(void);
+void file_record_tests(void);
+void broadcast_tests(void);
+void units_tests(void);
+void foreign_frames_tests(void);
+void framing_tests(void);
+void queue_tests(void);
+void poll_list_tests(void);
+void coalescing_tests(void);
+void write_combining_tests(void);
+void set_frame_crc(uint8_t* frame, uint16_t len);
 void print_error(char* text);
 void print_success(char* text);
 
@@ -41,6 +107,27 @@ uint16_t  expected_master_result_len = 0;
 bool wait_error     = false;
 bool test_error     = false;
 bool response_ready = false;
+bool slave_response_sent = false;
+uint8_t  tx_buffer[32] = { 0 };
+uint8_t* tx_committed = NULL;
+uint32_t tx_requested_len = 0;
+uint32_t tx_committed_len = 0;
+uint16_t sensor_registers[8] = { 0 };
+uint32_t sensor_reads = 0;
+uint16_t sensor_read_id = 0;
+uint16_t sensor_read_count = 0;
+modbus_slave_range_t written_range = { 0 };
+uint32_t written_frames = 0;
+uint16_t file_records[40] = { 0 };
+uint32_t file_completions = 0;
+modbus_error_response_t file_status = MODBUS_NO_ERROR;
+uint16_t file_records_done = 0;
+uint32_t internal_errors = 0;
+uint32_t queue_clock_us = 0;
+const modbus_master_poll_t* active_poll = NULL;
+const modbus_master_poll_t* coalesced_polls[4] = { NULL };
+modbus_response_t coalesced_packets[4];
+uint8_t coalesced_count = 0;
 
 
 int main(void)
@@ -53,6 +140,8 @@ int main(void)
     modbus_slave_set_response_data_handler(&response_data_handler);
     modbus_slave_set_internal_error_handler(&slave_internal_error_handler);
 
+    crc_tests();
+
     uint16_t counter = 1;
     /* READ OUTPUT COILS BEGIN */
 #if !SDCC
@@ -209,6 +298,62 @@ int main(void)
 
 
 
+    /* REQUEST CRC BEGIN */
+    counter = 1;
+#if !SDCC
+    printf("\nREQUEST CRC TEST:\n");
+#endif
+    print_test_name("%u: Test wrong request crc", counter++);
+    uint8_t wrong_crc_01[] = { SLAVE_ID, 0x03, 0x00, 0x00, 0x00, 0x01, 0x84, 0x0B };
+    slave_response_sent = false;
+    request_data_sender(wrong_crc_01, sizeof(wrong_crc_01));
+    if (slave_response_sent) {
+        print_error("ERROR");
+        test_error = true;
+    } else {
+        print_success("SUCCESS");
+    }
+
+    print_test_name("%u: Test right request crc", counter++);
+    uint8_t right_crc_01[] = { SLAVE_ID, 0x03, 0x00, 0x00, 0x00, 0x01, 0x84, 0x0A };
+    slave_response_sent = false;
+    request_data_sender(right_crc_01, sizeof(right_crc_01));
+    if (slave_response_sent) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+    modbus_slave_clear_data();
+    /* REQUEST CRC END */
+
+
+
+    slave_instance_tests();
+    master_instance_tests();
+    receive_buffer_tests();
+    tx_buffer_tests();
+    frame_reset_tests();
+    packed_coils_tests();
+    wire_order_tests();
+    segments_tests();
+    read_handler_tests();
+    dirty_ranges_tests();
+    snapshot_tests();
+    read_write_tests();
+    mask_write_tests();
+    file_record_tests();
+    broadcast_tests();
+    units_tests();
+    foreign_frames_tests();
+    framing_tests();
+    queue_tests();
+    poll_list_tests();
+    coalescing_tests();
+    write_combining_tests();
+
+
+
     /* ERROR REQUEST BEGIN */
     counter = 1;
     memset(expected_master_result, 0xFF, sizeof(expected_master_result));
@@ -227,6 +372,7 @@ int main(void)
 
     print_test_name("%u: Slave unexceptable input coil", counter++);
     modbus_master_read_input_status(SLAVE_ID, 0xFFFF, 1);
+    modbus_slave_clear_data();
 
     print_test_name("%u: Slave input coils out of range", counter++);
     modbus_master_read_input_status(SLAVE_ID, 0, 0xFFFF);
@@ -340,6 +486,2134 @@ void base_read_tests(void (*read_func) (uint8_t, uint16_t, uint16_t), uint16_t c
     modbus_slave_clear_data();
 }
 
+void crc_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nCRC16 TESTS:\n");
+#endif
+    print_test_name("%u: Test check value", counter++);
+    const uint8_t check_data[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    if (modbus_crc16(check_data, sizeof(check_data)) == 0x4B37) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test engines", counter++);
+    static uint8_t crc_data[67] = { 0 };
+    for (uint16_t i = 0; i < sizeof(crc_data); i++) {
+        crc_data[i] = (uint8_t)(i * 37 + 11);
+    }
+    bool crc_error = false;
+    for (uint16_t len = 0; len <= sizeof(crc_data); len++) {
+        uint16_t expected = modbus_crc16_bitwise(MODBUS_CRC16_INIT, crc_data, len);
+        crc_error |= modbus_crc16(crc_data, len) != expected;
+        crc_error |= modbus_crc16_update(modbus_crc16_update(MODBUS_CRC16_INIT, crc_data, len / 3), crc_data + len / 3, len - len / 3) != expected;
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_TABLE
+        crc_error |= modbus_crc16_table(MODBUS_CRC16_INIT, crc_data, len) != expected;
+#endif
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_SLICING_4
+        crc_error |= modbus_crc16_slicing_4(MODBUS_CRC16_INIT, crc_data, len) != expected;
+#endif
+#if MODBUS_CRC16_ENGINE >= MODBUS_CRC16_ENGINE_SLICING_8
+        crc_error |= modbus_crc16_slicing_8(MODBUS_CRC16_INIT, crc_data, len) != expected;
+#endif
+    }
+    if (crc_error) {
+        print_error("ERROR");
+        test_error = true;
+    } else {
+        print_success("SUCCESS");
+    }
+
+#if MODBUS_CRC16_HW
+    print_test_name("%u: Test hardware kernel on random buffers", counter++);
+    if (!modbus_crc16_hw_available()) {
+#if DETAILS
+        printf("carry-less multiply is not supported, skipped\n");
+#endif
+        return;
+    }
+    static uint8_t random_data[4099] = { 0 };
+    uint32_t seed = 0xC0FFEE;
+    for (uint16_t i = 0; i < 1000 && !crc_error; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint16_t len = (uint16_t)((seed >> 8) % sizeof(random_data));
+        uint16_t offset = (uint16_t)(seed % 16);
+        if (offset + len > sizeof(random_data)) {
+            len = sizeof(random_data) - offset;
+        }
+        for (uint16_t j = 0; j < len; j++) {
+            seed = seed * 1103515245 + 12345;
+            random_data[offset + j] = (uint8_t)(seed >> 16);
+        }
+        uint16_t init = (uint16_t)(seed >> 3);
+        crc_error = modbus_crc16_clmul(init, random_data + offset, len) != modbus_crc16_bitwise(init, random_data + offset, len);
+    }
+    if (crc_error) {
+        print_error("ERROR");
+        test_error = true;
+    } else {
+        print_success("SUCCESS");
+    }
+#endif
+}
+
+void slave_instance_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nSLAVE INSTANCES TEST:\n");
+#endif
+    static uint8_t coils[2][MODBUS_COILS_BYTES(8)] = { 0 };
+    static uint16_t holding[2][4] = { 0 };
+    static modbus_slave_t slaves[2];
+    uint32_t responses[2] = { 0 };
+
+    for (uint8_t i = 0; i < 2; i++) {
+        modbus_slave_registers_t registers = { 0 };
+        registers.discrete_output_coils = coils[i];
+        registers.discrete_output_coils_count = sizeof(coils[i]) * 8;
+        registers.analog_output_holding_registers = holding[i];
+        registers.analog_output_holding_registers_count = sizeof(holding[i]) / sizeof(*holding[i]);
+        modbus_slave_init(&slaves[i], &registers, &responses[i]);
+        modbus_slave_set_slave_id_r(&slaves[i], SLAVE_ID + i);
+        modbus_slave_set_response_data_handler_r(&slaves[i], &instance_response_data_handler);
+    }
+
+    print_test_name("%u: Test write to one instance", counter++);
+    uint8_t preset_single[] = { SLAVE_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x03, 0x12, 0x34, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(preset_single, sizeof(preset_single) - 2);
+    preset_single[sizeof(preset_single) - 2] = (uint8_t)crc;
+    preset_single[sizeof(preset_single) - 1] = (uint8_t)(crc >> 8);
+    for (uint8_t i = 0; i < 2; i++) {
+        for (uint16_t j = 0; j < sizeof(preset_single); j++) {
+            modbus_slave_recieve_data_byte_r(&slaves[i], preset_single[j]);
+        }
+    }
+    if (responses[0] == 1 && responses[1] == 0 && holding[0][3] == 0x1234 && holding[1][3] == 0
+        && modbus_slave_get_register_value_r(&slaves[0], MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 3) == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test missing register type", counter++);
+    uint8_t read_input[] = { SLAVE_ID + 1, MODBUS_READ_INPUT_REGISTERS, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00 };
+    crc = modbus_crc16(read_input, sizeof(read_input) - 2);
+    read_input[sizeof(read_input) - 2] = (uint8_t)crc;
+    read_input[sizeof(read_input) - 1] = (uint8_t)(crc >> 8);
+    for (uint16_t j = 0; j < sizeof(read_input); j++) {
+        modbus_slave_recieve_data_byte_r(&slaves[1], read_input[j]);
+    }
+    if (responses[0] == 1 && responses[1] == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test default instance untouched", counter++);
+    if (modbus_slave_get_register_value(MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 3) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void master_instance_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nMASTER INSTANCES TEST:\n");
+#endif
+    static instance_link_t links[2];
+
+    for (uint8_t i = 0; i < 2; i++) {
+        modbus_slave_registers_t registers = { 0 };
+        registers.analog_output_holding_registers = links[i].holding;
+        registers.analog_output_holding_registers_count = sizeof(links[i].holding) / sizeof(*links[i].holding);
+        modbus_slave_init(&links[i].slave, &registers, &links[i]);
+        modbus_slave_set_slave_id_r(&links[i].slave, SLAVE_ID);
+        modbus_slave_set_response_data_handler_r(&links[i].slave, &link_response_data_handler);
+
+        modbus_master_init(&links[i].master, &links[i]);
+        modbus_master_set_request_data_sender_r(&links[i].master, &link_request_data_sender);
+        modbus_master_set_response_packet_handler_r(&links[i].master, &link_response_packet_handler);
+
+        links[i].holding[2] = 0x1000 + i;
+    }
+
+    print_test_name("%u: Test read through separate instances", counter++);
+    modbus_master_read_holding_registers_r(&links[0].master, SLAVE_ID, 2, 1);
+    modbus_master_read_holding_registers_r(&links[1].master, SLAVE_ID, 2, 1);
+    if (links[0].packets == 1 && links[0].response.status == MODBUS_NO_ERROR && links[0].response.response[0] == 0x1000
+        && links[1].packets == 1 && links[1].response.status == MODBUS_NO_ERROR && links[1].response.response[0] == 0x1001) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test write through one instance", counter++);
+    modbus_master_preset_single_register_r(&links[1].master, SLAVE_ID, 3, 0xBEEF);
+    if (links[0].packets == 1 && links[1].packets == 2 && links[0].holding[3] == 0 && links[1].holding[3] == 0xBEEF) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void receive_buffer_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nRECEIVE BUFFER TEST:\n");
+#endif
+    static instance_link_t link;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = link.holding;
+    registers.analog_output_holding_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+    link.buffered = true;
+
+    print_test_name("%u: Test write and read back", counter++);
+    const uint16_t values[] = { 0x0102, 0x0304, 0x0506, 0x0708 };
+    modbus_master_preset_multiple_registers_r(&link.master, SLAVE_ID, 0, values, 4);
+    bool written = link.packets == 1 && link.response.status == MODBUS_NO_ERROR && memcmp(link.holding, values, sizeof(values)) == 0;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 1, 3);
+    if (written && link.packets == 2 && link.response.status == MODBUS_NO_ERROR
+        && link.response.response[0] == 0x0304 && link.response.response[1] == 0x0506 && link.response.response[2] == 0x0708) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test split frames", counter++);
+    uint8_t frames[] = {
+        SLAVE_ID, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x00, 0x02, 0x00, 0x02, 0x04, 0xAA, 0xBB, 0xCC, 0xDD, 0x00, 0x00,
+        SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00
+    };
+    uint16_t crc = modbus_crc16(frames, 11);
+    frames[11] = (uint8_t)crc;
+    frames[12] = (uint8_t)(crc >> 8);
+    crc = modbus_crc16(frames + 13, 6);
+    frames[19] = (uint8_t)crc;
+    frames[20] = (uint8_t)(crc >> 8);
+    link.packets = 0;
+    size_t first = modbus_slave_receive_buffer_r(&link.slave, frames, sizeof(frames));
+    size_t second = modbus_slave_receive_buffer_r(&link.slave, frames + first, sizeof(frames) - first);
+    if (first == 13 && second == 8 && link.holding[2] == 0xAABB && link.holding[3] == 0xCCDD) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void tx_buffer_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nTX BUFFER TEST:\n");
+#endif
+    static uint16_t holding[4] = { 0x1111, 0x2222, 0x3333, 0x4444 };
+    static modbus_slave_t slave;
+    uint32_t responses = 0;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = holding;
+    registers.analog_output_holding_registers_count = sizeof(holding) / sizeof(*holding);
+    modbus_slave_init(&slave, &registers, &responses);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, &instance_response_data_handler);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+
+    print_test_name("%u: Test response serialized into provided buffer", counter++);
+    uint8_t read_holding[] = { SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(read_holding, sizeof(read_holding) - 2);
+    read_holding[sizeof(read_holding) - 2] = (uint8_t)crc;
+    read_holding[sizeof(read_holding) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_holding, sizeof(read_holding));
+    const uint8_t expected[] = { SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x04, 0x22, 0x22, 0x33, 0x33 };
+    if (responses == 0 && tx_committed == tx_buffer && tx_requested_len == 9 && tx_committed_len == 9
+        && memcmp(tx_buffer, expected, sizeof(expected)) == 0 && modbus_crc16(tx_buffer, 9) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test error response serialized into provided buffer", counter++);
+    read_holding[3] = 0x04;
+    crc = modbus_crc16(read_holding, sizeof(read_holding) - 2);
+    read_holding[sizeof(read_holding) - 2] = (uint8_t)crc;
+    read_holding[sizeof(read_holding) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_holding, sizeof(read_holding));
+    if (responses == 0 && tx_committed_len == 5 && tx_buffer[1] == (MODBUS_READ_HOLDING_REGISTERS | MODBUS_ERROR_COMMAND_CODE)
+        && tx_buffer[2] == MODBUS_ERROR_ILLEGAL_DATA_ADDRESS && modbus_crc16(tx_buffer, 5) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void frame_reset_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nFRAME RESET TEST:\n");
+#endif
+    static uint16_t holding[4] = { 0 };
+    static modbus_slave_t slave;
+    uint32_t responses = 0;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = holding;
+    registers.analog_output_holding_registers_count = sizeof(holding) / sizeof(*holding);
+    modbus_slave_init(&slave, &registers, &responses);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, &instance_response_data_handler);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+
+    print_test_name("%u: Test short write after long write", counter++);
+    uint8_t write_long[] = {
+        SLAVE_ID, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x00, 0x00, 0x00, 0x04, 0x08,
+        0x11, 0x11, 0x22, 0x22, 0x33, 0x33, 0x44, 0x44, 0x00, 0x00
+    };
+    uint16_t crc = modbus_crc16(write_long, sizeof(write_long) - 2);
+    write_long[sizeof(write_long) - 2] = (uint8_t)crc;
+    write_long[sizeof(write_long) - 1] = (uint8_t)(crc >> 8);
+    uint8_t write_short[] = { SLAVE_ID, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x00, 0x00, 0x00, 0x01, 0x02, 0x55, 0x55, 0x00, 0x00 };
+    crc = modbus_crc16(write_short, sizeof(write_short) - 2);
+    write_short[sizeof(write_short) - 2] = (uint8_t)crc;
+    write_short[sizeof(write_short) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, write_long, sizeof(write_long));
+    modbus_slave_receive_buffer_r(&slave, write_short, sizeof(write_short));
+    if (holding[0] == 0x5555 && holding[1] == 0x2222 && holding[2] == 0x3333 && holding[3] == 0x4444
+        && tx_committed_len == 8 && tx_buffer[1] == MODBUS_PRESET_MULTIPLE_REGISTERS && tx_buffer[5] == 0x01) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test write with wrong byte count", counter++);
+    write_short[6] = 0x04;
+    crc = modbus_crc16(write_short, sizeof(write_short) - 2);
+    write_short[sizeof(write_short) - 2] = (uint8_t)crc;
+    write_short[sizeof(write_short) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, write_short, sizeof(write_short));
+    modbus_slave_clear_data_r(&slave);
+    if (responses == 0 && tx_buffer[1] == (MODBUS_PRESET_MULTIPLE_REGISTERS | MODBUS_ERROR_COMMAND_CODE)
+        && tx_buffer[2] == MODBUS_ERROR_ILLEGAL_DATA_VALUE && holding[0] == 0x5555) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void packed_coils_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nPACKED COILS TEST:\n");
+#endif
+    static uint8_t coils[MODBUS_COILS_BYTES(32)] = { 0 };
+    static modbus_slave_t slave;
+    uint32_t responses = 0;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.discrete_output_coils = coils;
+    registers.discrete_output_coils_count = 32;
+    modbus_slave_init(&slave, &registers, &responses);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, &instance_response_data_handler);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+
+    print_test_name("%u: Test unaligned bit copy", counter++);
+    uint8_t src[6] = { 0xA5, 0x3C, 0xF0, 0x0F, 0x96, 0x69 };
+    bool copied = true;
+    for (uint8_t src_bit = 0; src_bit < 9 && copied; src_bit++) {
+        for (uint8_t dst_bit = 0; dst_bit < 9 && copied; dst_bit++) {
+            for (uint8_t count = 0; count <= 30 && copied; count++) {
+                uint8_t dst[6];
+                memset(dst, 0x5A, sizeof(dst));
+                modbus_bits_copy(dst, dst_bit, src, src_bit, count);
+                for (uint8_t i = 0; i < sizeof(dst) * 8; i++) {
+                    bool in_range = i >= dst_bit && i < dst_bit + count;
+                    uint8_t from  = in_range ? (uint8_t)(i - dst_bit + src_bit) : i;
+                    uint8_t value = in_range ? (uint8_t)(src[from / 8] >> (from % 8)) : (uint8_t)(0x5A >> (i % 8));
+                    if (((dst[i / 8] >> (i % 8)) & 0x01) != (value & 0x01)) {
+                        copied = false;
+                    }
+                }
+            }
+        }
+    }
+    if (copied) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test bulk coils set and get", counter++);
+    const uint8_t bits[] = { 0xFF, 0x81, 0x03 };
+    uint8_t read_bits[3] = { 0 };
+    bool bulk = modbus_slave_set_coils_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 5, 18, bits)
+        && modbus_slave_get_coils_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 5, 18, read_bits)
+        && !modbus_slave_set_coils_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 20, 13, bits)
+        && !modbus_slave_get_coils_r(&slave, MODBUS_REGISTER_DISCRETE_INPUT_COILS, 0, 1, read_bits);
+    if (bulk && memcmp(read_bits, bits, sizeof(bits)) == 0 && coils[0] == 0xE0 && coils[1] == 0x3F && coils[2] == 0x70
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 4) == 0
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 5) == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test read unaligned coils", counter++);
+    uint8_t read_coils[] = { SLAVE_ID, MODBUS_READ_COILS, 0x00, 0x0C, 0x00, 0x0A, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(read_coils, sizeof(read_coils) - 2);
+    read_coils[sizeof(read_coils) - 2] = (uint8_t)crc;
+    read_coils[sizeof(read_coils) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_coils, sizeof(read_coils));
+    const uint8_t expected_read[] = { SLAVE_ID, MODBUS_READ_COILS, 0x02, 0x03, 0x03 };
+    if (tx_committed_len == 7 && memcmp(tx_buffer, expected_read, sizeof(expected_read)) == 0 && modbus_crc16(tx_buffer, 7) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test force multiple unaligned coils", counter++);
+    uint8_t force_coils[] = { SLAVE_ID, MODBUS_FORCE_MULTIPLE_COILS, 0x00, 0x03, 0x00, 0x0B, 0x02, 0x55, 0x05, 0x00, 0x00 };
+    crc = modbus_crc16(force_coils, sizeof(force_coils) - 2);
+    force_coils[sizeof(force_coils) - 2] = (uint8_t)crc;
+    force_coils[sizeof(force_coils) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, force_coils, sizeof(force_coils));
+    if (responses == 0 && tx_committed_len == 8 && tx_buffer[1] == MODBUS_FORCE_MULTIPLE_COILS && tx_buffer[5] == 0x0B
+        && coils[0] == 0xA8 && coils[1] == 0x2A && coils[2] == 0x70) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void wire_order_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nWIRE ORDER REGISTERS TEST:\n");
+#endif
+    static uint16_t holding[4] = { 0 };
+    static modbus_slave_t slave;
+    uint32_t responses = 0;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = holding;
+    registers.analog_output_holding_registers_count = sizeof(holding) / sizeof(*holding);
+    registers.registers_wire_order = true;
+    modbus_slave_init(&slave, &registers, &responses);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, &instance_response_data_handler);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+
+    print_test_name("%u: Test accessors store wire order", counter++);
+    modbus_slave_set_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 1, 0x1234);
+    const uint8_t* bytes = (const uint8_t*)holding;
+    if (bytes[2] == 0x12 && bytes[3] == 0x34
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 1) == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test write and read back", counter++);
+    uint8_t preset_multiple[] = { SLAVE_ID, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x00, 0x02, 0x00, 0x02, 0x04, 0xAB, 0xCD, 0x00, 0x01, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(preset_multiple, sizeof(preset_multiple) - 2);
+    preset_multiple[sizeof(preset_multiple) - 2] = (uint8_t)crc;
+    preset_multiple[sizeof(preset_multiple) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, preset_multiple, sizeof(preset_multiple));
+    uint8_t read_holding[] = { SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x01, 0x00, 0x03, 0x00, 0x00 };
+    crc = modbus_crc16(read_holding, sizeof(read_holding) - 2);
+    read_holding[sizeof(read_holding) - 2] = (uint8_t)crc;
+    read_holding[sizeof(read_holding) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_holding, sizeof(read_holding));
+    const uint8_t expected[] = { SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x06, 0x12, 0x34, 0xAB, 0xCD, 0x00, 0x01 };
+    if (responses == 0 && tx_committed_len == 11 && memcmp(tx_buffer, expected, sizeof(expected)) == 0
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 2) == 0xABCD
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 3) == 0x0001) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void segments_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nSEGMENTS TEST:\n");
+#endif
+    static uint16_t low[21] = { 0 };
+    static uint16_t middle[40] = { 0 };
+    static uint16_t middle_tail[10] = { 0 };
+    static uint16_t high[100] = { 0 };
+    static uint8_t  coils[2][MODBUS_COILS_BYTES(12)] = { 0 };
+    static modbus_slave_t slave;
+    uint32_t responses = 0;
+
+    const modbus_slave_segment_t holding_segments[] = {
+        { .base = 0,     .count = 21,  .storage = low },
+        { .base = 1000,  .count = 40,  .storage = middle },
+        { .base = 1040,  .count = 10,  .storage = middle_tail },
+        { .base = 40001, .count = 100, .storage = high },
+    };
+    const modbus_slave_segment_t coils_segments[] = {
+        { .base = 100, .count = 12, .storage = coils[0] },
+        { .base = 112, .count = 12, .storage = coils[1] },
+    };
+    const modbus_slave_segment_t overlapping_segments[] = {
+        { .base = 0,  .count = 21, .storage = low },
+        { .base = 20, .count = 40, .storage = middle },
+    };
+
+    modbus_slave_init(&slave, NULL, &responses);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, &instance_response_data_handler);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+
+    print_test_name("%u: Test segment tables", counter++);
+    bool tables = modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, holding_segments, 4)
+        && modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, coils_segments, 2)
+        && !modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, overlapping_segments, 2);
+    modbus_slave_set_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 20, 0x2020);
+    modbus_slave_set_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 40100, 0x4100);
+    if (tables && low[20] == 0x2020 && high[99] == 0x4100
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 40100) == 0x4100) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test write and read across contiguous segments", counter++);
+    uint8_t preset_multiple[] = { SLAVE_ID, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x04, 0x0F, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(preset_multiple, sizeof(preset_multiple) - 2);
+    preset_multiple[sizeof(preset_multiple) - 2] = (uint8_t)crc;
+    preset_multiple[sizeof(preset_multiple) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, preset_multiple, sizeof(preset_multiple));
+    bool written = middle[39] == 0x1234 && middle_tail[0] == 0x5678;
+    uint8_t read_holding[] = { SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x04, 0x0F, 0x00, 0x02, 0x00, 0x00 };
+    crc = modbus_crc16(read_holding, sizeof(read_holding) - 2);
+    read_holding[sizeof(read_holding) - 2] = (uint8_t)crc;
+    read_holding[sizeof(read_holding) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_holding, sizeof(read_holding));
+    const uint8_t expected[] = { SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x04, 0x12, 0x34, 0x56, 0x78 };
+    if (written && responses == 0 && tx_committed_len == 9 && memcmp(tx_buffer, expected, sizeof(expected)) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test read in a gap", counter++);
+    read_holding[2] = 0x00;
+    read_holding[3] = 0x15;
+    read_holding[5] = 0x01;
+    crc = modbus_crc16(read_holding, sizeof(read_holding) - 2);
+    read_holding[sizeof(read_holding) - 2] = (uint8_t)crc;
+    read_holding[sizeof(read_holding) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_holding, sizeof(read_holding));
+    bool gap_addr = tx_committed_len == 5 && tx_buffer[2] == MODBUS_ERROR_ILLEGAL_DATA_ADDRESS;
+    read_holding[3] = 0x14;
+    read_holding[5] = 0x02;
+    crc = modbus_crc16(read_holding, sizeof(read_holding) - 2);
+    read_holding[sizeof(read_holding) - 2] = (uint8_t)crc;
+    read_holding[sizeof(read_holding) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_holding, sizeof(read_holding));
+    modbus_slave_clear_data_r(&slave);
+    if (gap_addr && tx_committed_len == 5 && tx_buffer[1] == (MODBUS_READ_HOLDING_REGISTERS | MODBUS_ERROR_COMMAND_CODE)
+        && tx_buffer[2] == MODBUS_ERROR_ILLEGAL_DATA_VALUE) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test coils across segments", counter++);
+    const uint8_t bits[] = { 0xA5, 0x0F };
+    uint8_t read_bits[2] = { 0 };
+    bool coils_set = modbus_slave_set_coils_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 106, 12, bits)
+        && modbus_slave_get_coils_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 106, 12, read_bits)
+        && !modbus_slave_get_coils_r(&slave, MODBUS_REGISTER_DISCRETE_OUTPUT_COILS, 120, 8, read_bits);
+    if (coils_set && read_bits[0] == 0xA5 && (read_bits[1] & 0x0F) == 0x0F && coils[0][0] == 0x40 && coils[0][1] == 0x09 && coils[1][0] == 0x3E) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void read_handler_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nREAD HANDLER TEST:\n");
+#endif
+    static uint16_t plain[4] = { 0x0A0A, 0x0B0B, 0x0C0C, 0x0D0D };
+    static modbus_slave_t slave;
+
+    const modbus_slave_segment_t input_segments[] = {
+        { .base = 0, .count = 4, .storage = plain },
+        { .base = 4, .count = 8, .storage = sensor_registers, .read_handler = &sensor_read_handler },
+    };
+
+    modbus_slave_init(&slave, NULL, NULL);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+    modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, input_segments, 2);
+
+    print_test_name("%u: Test read handler fills the requested range once", counter++);
+    uint8_t read_input[] = { SLAVE_ID, MODBUS_READ_INPUT_REGISTERS, 0x00, 0x02, 0x00, 0x05, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(read_input, sizeof(read_input) - 2);
+    read_input[sizeof(read_input) - 2] = (uint8_t)crc;
+    read_input[sizeof(read_input) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_input, sizeof(read_input));
+    const uint8_t expected[] = { SLAVE_ID, MODBUS_READ_INPUT_REGISTERS, 0x0A, 0x0C, 0x0C, 0x0D, 0x0D, 0x01, 0x04, 0x01, 0x05, 0x01, 0x06 };
+    if (sensor_reads == 1 && sensor_read_id == 4 && sensor_read_count == 3
+        && tx_committed_len == 15 && memcmp(tx_buffer, expected, sizeof(expected)) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test read handler is not called outside its segment", counter++);
+    read_input[3] = 0x00;
+    read_input[5] = 0x04;
+    crc = modbus_crc16(read_input, sizeof(read_input) - 2);
+    read_input[sizeof(read_input) - 2] = (uint8_t)crc;
+    read_input[sizeof(read_input) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, read_input, sizeof(read_input));
+    uint16_t value = modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, 11);
+    if (sensor_reads == 1 && value == 0x0000 && tx_committed_len == 13 && tx_buffer[3] == 0x0A) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void dirty_ranges_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nDIRTY RANGES TEST:\n");
+#endif
+    static uint8_t  coils[MODBUS_COILS_BYTES(16)] = { 0 };
+    static uint16_t holding[100] = { 0 };
+    static modbus_slave_t slave;
+    modbus_slave_range_t ranges[MODBUS_SLAVE_DIRTY_RANGES] = { 0 };
+    modbus_slave_registers_t registers = {
+        .discrete_output_coils                 = coils,
+        .discrete_output_coils_count           = 16,
+        .analog_output_holding_registers       = holding,
+        .analog_output_holding_registers_count = 100,
+    };
+
+    modbus_slave_init(&slave, &registers, NULL);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+    modbus_slave_set_write_handler_r(&slave, &write_handler);
+
+    print_test_name("%u: Test write handler is called once per frame", counter++);
+    uint8_t preset_multiple[] = { SLAVE_ID, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x00, 0x02, 0x00, 0x03, 0x06, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(preset_multiple, sizeof(preset_multiple) - 2);
+    preset_multiple[sizeof(preset_multiple) - 2] = (uint8_t)crc;
+    preset_multiple[sizeof(preset_multiple) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, preset_multiple, sizeof(preset_multiple));
+    if (written_frames == 1 && written_range.register_type == MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS
+        && written_range.register_id == 2 && written_range.count == 3 && holding[4] == 0x0003) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test adjacent writes are coalesced", counter++);
+    uint8_t preset_single[] = { SLAVE_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x05, 0x12, 0x34, 0x00, 0x00 };
+    crc = modbus_crc16(preset_single, sizeof(preset_single) - 2);
+    preset_single[sizeof(preset_single) - 2] = (uint8_t)crc;
+    preset_single[sizeof(preset_single) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, preset_single, sizeof(preset_single));
+    uint8_t force_single[] = { SLAVE_ID, MODBUS_FORCE_SINGLE_COIL, 0x00, 0x06, 0xFF, 0x00, 0x00, 0x00 };
+    crc = modbus_crc16(force_single, sizeof(force_single) - 2);
+    force_single[sizeof(force_single) - 2] = (uint8_t)crc;
+    force_single[sizeof(force_single) - 1] = (uint8_t)(crc >> 8);
+    modbus_slave_receive_buffer_r(&slave, force_single, sizeof(force_single));
+    uint8_t consumed = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES);
+    if (written_frames == 3 && consumed == 2
+        && ranges[0].register_type == MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS && ranges[0].register_id == 2 && ranges[0].count == 4
+        && ranges[1].register_type == MODBUS_REGISTER_DISCRETE_OUTPUT_COILS && ranges[1].register_id == 6 && ranges[1].count == 1
+        && modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test full list merges the closest ranges", counter++);
+    for (uint8_t i = 0; i <= MODBUS_SLAVE_DIRTY_RANGES; i++) {
+        preset_single[3] = (uint8_t)(i * 10);
+        crc = modbus_crc16(preset_single, sizeof(preset_single) - 2);
+        preset_single[sizeof(preset_single) - 2] = (uint8_t)crc;
+        preset_single[sizeof(preset_single) - 1] = (uint8_t)(crc >> 8);
+        modbus_slave_receive_buffer_r(&slave, preset_single, sizeof(preset_single));
+    }
+    consumed = modbus_slave_consume_dirty_ranges_r(&slave, ranges, 1);
+    bool first = consumed == 1 && ranges[0].register_id == 0 && ranges[0].count == 11;
+    consumed = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES);
+    if (first && consumed == MODBUS_SLAVE_DIRTY_RANGES - 1 && ranges[0].register_id == 20 && ranges[0].count == 1
+        && ranges[consumed - 1].register_id == MODBUS_SLAVE_DIRTY_RANGES * 10) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test write inside a merged gap joins the merged range", counter++);
+    for (uint8_t i = 0; i <= MODBUS_SLAVE_DIRTY_RANGES; i++) {
+        /* The last write lands between the two ranges the full list merges */
+        preset_single[3] = (uint8_t)(i < MODBUS_SLAVE_DIRTY_RANGES ? i * 10 : 5);
+        set_frame_crc(preset_single, sizeof(preset_single));
+        modbus_slave_receive_buffer_r(&slave, preset_single, sizeof(preset_single));
+    }
+    consumed = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES);
+    bool apart = true;
+    for (uint8_t i = 0; i < consumed; i++) {
+        for (uint8_t j = (uint8_t)(i + 1); j < consumed; j++) {
+            apart = apart && (ranges[i].register_id + ranges[i].count < ranges[j].register_id
+                || ranges[j].register_id + ranges[j].count < ranges[i].register_id);
+        }
+    }
+    if (apart && consumed == MODBUS_SLAVE_DIRTY_RANGES - 1 && ranges[consumed - 1].register_id == 0 && ranges[consumed - 1].count == 11) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test list switch waits for a write in progress", counter++);
+    preset_single[3] = 40;
+    set_frame_crc(preset_single, sizeof(preset_single));
+    modbus_slave_receive_buffer_r(&slave, preset_single, sizeof(preset_single));
+    /* The receive side was interrupted while updating the list, as an odd sequence shows */
+    slave.dirty_sequence++;
+    bool waited = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES) == 0
+        && modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES) == 0;
+    slave.dirty_sequence++;
+    consumed = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES);
+    if (waited && consumed == 1 && ranges[0].register_id == 40 && ranges[0].count == 1
+        && modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES) == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test writes during a drain are handed out after it", counter++);
+    for (uint8_t i = 0; i < 3; i++) {
+        preset_single[3] = (uint8_t)(i * 10);
+        set_frame_crc(preset_single, sizeof(preset_single));
+        modbus_slave_receive_buffer_r(&slave, preset_single, sizeof(preset_single));
+    }
+    first = modbus_slave_consume_dirty_ranges_r(&slave, ranges, 1) == 1 && ranges[0].register_id == 0;
+    /* Touches the range still waiting in the drained list, it goes to the other one */
+    preset_single[3] = 11;
+    set_frame_crc(preset_single, sizeof(preset_single));
+    modbus_slave_receive_buffer_r(&slave, preset_single, sizeof(preset_single));
+    consumed = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES);
+    bool drained = consumed == 2 && ranges[0].register_id == 10 && ranges[1].register_id == 20;
+    consumed = modbus_slave_consume_dirty_ranges_r(&slave, ranges, MODBUS_SLAVE_DIRTY_RANGES);
+    if (first && drained && consumed == 1 && ranges[0].register_id == 11 && ranges[0].count == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void snapshot_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nSNAPSHOT TEST:\n");
+#endif
+    static uint16_t front[8] = { 0 };
+    static uint16_t back[8] = { 0 };
+    static modbus_slave_snapshot_t snapshot;
+    static uint16_t holding_front[4] = { 0 };
+    static uint16_t holding_back[4] = { 0 };
+    static modbus_slave_snapshot_t holding_snapshot;
+    static modbus_slave_t slave;
+
+    modbus_slave_snapshot_init(&snapshot, front, back, sizeof(front));
+    modbus_slave_snapshot_init(&holding_snapshot, holding_front, holding_back, sizeof(holding_front));
+    const modbus_slave_segment_t input_segments[] = {
+        { .base = 0, .count = 8, .snapshot = &snapshot },
+    };
+    const modbus_slave_segment_t holding_segments[] = {
+        { .base = 0, .count = 4, .snapshot = &holding_snapshot },
+    };
+
+    modbus_slave_init(&slave, NULL, NULL);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+    bool table = modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, input_segments, 1)
+        && modbus_slave_set_segments_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, holding_segments, 1);
+
+    print_test_name("%u: Test values are visible only after publish", counter++);
+    uint16_t* values = (uint16_t*)modbus_slave_snapshot_begin(&snapshot);
+    values[0] = 0x1234;
+    values[7] = 0x5678;
+    bool hidden = modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, 0) == 0x0000;
+    modbus_slave_snapshot_publish(&snapshot);
+    values = (uint16_t*)modbus_slave_snapshot_begin(&snapshot);
+    values[1] = 0x4321;
+    modbus_slave_snapshot_publish(&snapshot);
+    if (table && hidden && values == front
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, 0) == 0x1234
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, 1) == 0x4321
+        && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_INPUT_REGISTERS, 7) == 0x5678) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test snapshot segment is read-only", counter++);
+    values = (uint16_t*)modbus_slave_snapshot_begin(&holding_snapshot);
+    values[1] = 0x0A01;
+    modbus_slave_snapshot_publish(&holding_snapshot);
+    uint8_t preset[] = { SLAVE_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x01, 0x0B, 0x01, 0x00, 0x00 };
+    set_frame_crc(preset, sizeof(preset));
+    modbus_slave_receive_buffer_r(&slave, preset, sizeof(preset));
+    bool refused = tx_committed_len == 5 && tx_buffer[1] == (MODBUS_PRESET_SINGLE_REGISTER | 0x80) && tx_buffer[2] == MODBUS_ERROR_ILLEGAL_DATA_ADDRESS;
+    modbus_slave_set_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 1, 0x0C01);
+    if (refused && modbus_slave_get_register_value_r(&slave, MODBUS_REGISTER_ANALOG_OUTPUT_HOLDING_REGISTERS, 1) == 0x0A01) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+#if SNAPSHOT_STRESS
+    print_test_name("%u: Test reads from another thread never see torn values", counter++);
+    uint8_t read_input[] = { SLAVE_ID, MODBUS_READ_INPUT_REGISTERS, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(read_input, sizeof(read_input) - 2);
+    read_input[sizeof(read_input) - 2] = (uint8_t)crc;
+    read_input[sizeof(read_input) - 1] = (uint8_t)(crc >> 8);
+
+    memset(modbus_slave_snapshot_begin(&snapshot), 0, sizeof(front));
+    modbus_slave_snapshot_publish(&snapshot);
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, snapshot_writer, &snapshot);
+
+    /* Every publication holds one 32-bit generation four times, a torn read mixes two of them */
+    uint32_t reads = 0;
+    uint32_t torn  = 0;
+    uint32_t last  = 0;
+    while (last < SNAPSHOT_PUBLICATIONS) {
+        modbus_slave_receive_buffer_r(&slave, read_input, sizeof(read_input));
+        uint32_t generation = 0;
+        for (uint8_t i = 0; i < 4; i++) {
+            const uint8_t* bytes = tx_buffer + 3 + i * 4;
+            uint32_t value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+            if (i > 0 && value != generation) {
+                torn++;
+            }
+            generation = value;
+        }
+        if (generation < last) {
+            torn++;
+        }
+        last = generation;
+        reads++;
+    }
+    pthread_join(writer, NULL);
+
+    if (torn == 0 && reads > 0 && tx_committed_len == 21) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+#endif
+}
+
+void read_write_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nREAD WRITE TEST:\n");
+#endif
+    static instance_link_t link;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = link.holding;
+    registers.analog_output_holding_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+    modbus_slave_set_write_handler_r(&link.slave, &write_handler);
+
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+
+    link.holding[0] = 0x1111;
+    link.holding[1] = 0x2222;
+
+    print_test_name("%u: Test registers are read after they are written", counter++);
+    const uint16_t values[] = { 0xA1A2, 0xB1B2 };
+    written_frames = 0;
+    modbus_master_read_write_multiple_registers_r(&link.master, SLAVE_ID, 0, 4, 2, values, 2);
+    if (link.packets == 1 && link.response.status == MODBUS_NO_ERROR && link.response.command == MODBUS_READ_WRITE_MULTIPLE_REGISTERS
+        && link.response.response[0] == 0x1111 && link.response.response[1] == 0x2222
+        && link.response.response[2] == 0xA1A2 && link.response.response[3] == 0xB1B2
+        && written_frames == 1 && written_range.register_id == 2 && written_range.count == 2) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test buffered receive of overlapping ranges", counter++);
+    link.buffered = true;
+    modbus_master_read_write_multiple_registers_r(&link.master, SLAVE_ID, 1, 2, 0, values, 2);
+    if (link.packets == 2 && link.response.status == MODBUS_NO_ERROR
+        && link.response.response[0] == 0xB1B2 && link.response.response[1] == 0xA1A2
+        && link.holding[0] == 0xA1A2 && link.holding[1] == 0xB1B2) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test write outside the registers is rejected", counter++);
+    static modbus_slave_t slave;
+    modbus_slave_init(&slave, &registers, NULL);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_tx_buffer_handlers_r(&slave, &tx_buffer_provider, &tx_buffer_commit);
+    uint8_t read_write[] = { SLAVE_ID, MODBUS_READ_WRITE_MULTIPLE_REGISTERS, 0x00, 0x00, 0x00, 0x01, 0x00, 0x04, 0x00, 0x01, 0x02, 0xCC, 0xDD, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(read_write, sizeof(read_write) - 2);
+    read_write[sizeof(read_write) - 2] = (uint8_t)crc;
+    read_write[sizeof(read_write) - 1] = (uint8_t)(crc >> 8);
+    tx_committed_len = 0;
+    modbus_slave_receive_buffer_r(&slave, read_write, sizeof(read_write));
+    if (tx_committed_len == 5 && tx_buffer[1] == (MODBUS_READ_WRITE_MULTIPLE_REGISTERS | MODBUS_ERROR_COMMAND_CODE)
+        && tx_buffer[2] == MODBUS_ERROR_ILLEGAL_DATA_ADDRESS && link.holding[3] == 0xB1B2) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void mask_write_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nMASK WRITE TEST:\n");
+#endif
+    static instance_link_t link;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = link.holding;
+    registers.analog_output_holding_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+    modbus_slave_set_write_handler_r(&link.slave, &write_handler);
+
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+
+    print_test_name("%u: Test AND and OR masks are applied", counter++);
+    link.holding[1] = 0x0012;
+    written_frames = 0;
+    modbus_master_mask_write_register_r(&link.master, SLAVE_ID, 1, 0x00F2, 0x0025);
+    if (link.packets == 1 && link.response.status == MODBUS_NO_ERROR && link.response.command == MODBUS_MASK_WRITE_REGISTER
+        && link.response.response[0] == 0x00F2 && link.response.response[1] == 0x0025 && link.holding[1] == 0x0017
+        && written_frames == 1 && written_range.register_id == 1 && written_range.count == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test mask write outside the registers", counter++);
+    link.buffered = true;
+    modbus_master_mask_write_register_r(&link.master, SLAVE_ID, 4, 0x0000, 0xFFFF);
+    if (link.packets == 2 && link.response.status == MODBUS_ERROR_DATA && written_frames == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void file_record_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nFILE RECORD TEST:\n");
+#endif
+    static instance_link_t link;
+    static uint16_t source[40];
+    static uint16_t destination[40];
+
+    modbus_slave_init(&link.slave, NULL, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+    modbus_slave_set_file_record_handlers_r(&link.slave, &file_read_handler, &file_write_handler);
+
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+    link.deferred = true;
+
+    for (uint16_t i = 0; i < 40; i++) {
+        source[i] = (uint16_t)(0xF000 + i);
+    }
+
+    print_test_name("%u: Test file is streamed in maximum-size requests", counter++);
+    modbus_master_write_file_r(&link.master, SLAVE_ID, 1, 0, source, 40, &file_complete_handler);
+    uint32_t writes = link_pump(&link);
+    bool written = file_completions == 1 && file_status == MODBUS_NO_ERROR && file_records_done == 40 && memcmp(file_records, source, sizeof(source)) == 0;
+    modbus_master_read_file_r(&link.master, SLAVE_ID, 1, 0, destination, 40, &file_complete_handler);
+    uint32_t reads = link_pump(&link);
+    if (written && file_completions == 2 && file_status == MODBUS_NO_ERROR && file_records_done == 40
+        && memcmp(destination, source, sizeof(source)) == 0
+        && writes == (40 + 11) / 12 && reads == (40 + 14) / 15 && link.packets == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test single record request", counter++);
+    modbus_master_read_file_record_r(&link.master, SLAVE_ID, 1, 38, 2);
+    link_pump(&link);
+    if (link.packets == 1 && link.response.status == MODBUS_NO_ERROR && link.response.command == MODBUS_READ_FILE_RECORD
+        && link.response.response[0] == 0xF026 && link.response.response[1] == 0xF027) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test missing records stop the transfer", counter++);
+    modbus_master_read_file_r(&link.master, SLAVE_ID, 1, 30, destination, 20, &file_complete_handler);
+    link_pump(&link);
+    if (file_completions == 3 && file_status == MODBUS_ERROR_DATA && file_records_done == 0 && link.packets == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test timeout stops the transfer", counter++);
+    modbus_master_write_file_r(&link.master, SLAVE_ID, 1, 0, source, 40, &file_complete_handler);
+    link.pending_len = 0;
+    modbus_master_timeout_r(&link.master);
+    if (file_completions == 4 && file_status == MODBUS_ERROR_TIMEOUT && file_records_done == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test request made during a transfer goes after it", counter++);
+    memset(destination, 0, sizeof(destination));
+    modbus_master_read_file_r(&link.master, SLAVE_ID, 1, 0, destination, 40, &file_complete_handler);
+    modbus_master_read_file_record_r(&link.master, SLAVE_ID, 1, 38, 2);
+    bool first = link.pending[1] == MODBUS_READ_FILE_RECORD && link.pending[7] == 0;
+    reads = link_pump(&link);
+    if (first && reads == (40 + 14) / 15 + 1 && file_completions == 5 && file_status == MODBUS_NO_ERROR && file_records_done == 40
+        && memcmp(destination, source, sizeof(source)) == 0 && link.packets == 2 && link.response.status == MODBUS_NO_ERROR && link.response.response[0] == 0xF026) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void broadcast_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nBROADCAST TEST:\n");
+#endif
+    static instance_link_t link;
+    static modbus_slave_t other;
+    uint16_t other_holding[4] = { 0 };
+    uint32_t other_responses = 0;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = link.holding;
+    registers.analog_output_holding_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+
+    registers.analog_output_holding_registers = other_holding;
+    modbus_slave_init(&other, &registers, &other_responses);
+    modbus_slave_set_slave_id_r(&other, SLAVE_ID + 1);
+    modbus_slave_set_response_data_handler_r(&other, &instance_response_data_handler);
+
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+    modbus_master_set_turnaround_delay_r(&link.master, 100);
+    link.deferred = true;
+
+    print_test_name("%u: Test broadcast write is applied by every slave without a response", counter++);
+    const uint16_t values[] = { 0x1234, 0x5678 };
+    modbus_master_preset_multiple_registers_r(&link.master, MODBUS_BROADCAST_ID, 1, values, 2);
+    uint16_t wait_time = modbus_master_get_wait_time_r(&link.master, 1000);
+    for (uint32_t i = 0; i < link.pending_len; i++) {
+        modbus_slave_recieve_data_byte_r(&other, link.pending[i]);
+    }
+    link_pump(&link);
+    if (wait_time == 100 && link.packets == 0 && other_responses == 0
+        && link.holding[1] == 0x1234 && link.holding[2] == 0x5678 && other_holding[1] == 0x1234 && other_holding[2] == 0x5678) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test turnaround delay completes the broadcast", counter++);
+    modbus_master_timeout_r(&link.master);
+    if (link.packets == 1 && link.response.status == MODBUS_NO_ERROR && link.response.slave_id == MODBUS_BROADCAST_ID
+        && link.response.command == MODBUS_PRESET_MULTIPLE_REGISTERS && modbus_master_get_wait_time_r(&link.master, 1000) == 1000) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test broadcast read is not sent", counter++);
+    modbus_master_read_holding_registers_r(&link.master, MODBUS_BROADCAST_ID, 0, 1);
+    modbus_master_mask_write_register_r(&link.master, SLAVE_ID, 0, 0x0000, 0x0001);
+    link_pump(&link);
+    if (link.packets == 2 && link.response.slave_id == SLAVE_ID && link.response.command == MODBUS_MASK_WRITE_REGISTER) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test slave ignores broadcast read and errors", counter++);
+    uint8_t read_holding[] = { MODBUS_BROADCAST_ID, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00 };
+    uint16_t crc = modbus_crc16(read_holding, sizeof(read_holding) - 2);
+    read_holding[sizeof(read_holding) - 2] = (uint8_t)crc;
+    read_holding[sizeof(read_holding) - 1] = (uint8_t)(crc >> 8);
+    uint8_t preset_single[] = { MODBUS_BROADCAST_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x08, 0x12, 0x34, 0x00, 0x00 };
+    crc = modbus_crc16(preset_single, sizeof(preset_single) - 2);
+    preset_single[sizeof(preset_single) - 2] = (uint8_t)crc;
+    preset_single[sizeof(preset_single) - 1] = (uint8_t)(crc >> 8);
+    for (uint16_t j = 0; j < sizeof(read_holding); j++) {
+        modbus_slave_recieve_data_byte_r(&other, read_holding[j]);
+    }
+    for (uint16_t j = 0; j < sizeof(preset_single); j++) {
+        modbus_slave_recieve_data_byte_r(&other, preset_single[j]);
+    }
+    if (other_responses == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test broadcast write needs no response handler", counter++);
+    static modbus_slave_t listener;
+    uint16_t listener_holding[4] = { 0 };
+    registers.analog_output_holding_registers = listener_holding;
+    modbus_slave_init(&listener, &registers, NULL);
+    modbus_slave_set_slave_id_r(&listener, SLAVE_ID + 2);
+    modbus_slave_set_internal_error_handler_r(&listener, &counting_error_handler);
+    internal_errors = 0;
+    preset_single[3] = 0x02;
+    set_frame_crc(preset_single, sizeof(preset_single));
+    modbus_slave_receive_buffer_r(&listener, preset_single, sizeof(preset_single));
+    if (internal_errors == 0 && listener_holding[2] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test rest of a request answered early is skipped", counter++);
+    /* The count is refused before the payload, which holds a broadcast write */
+    uint8_t decoy[] = { MODBUS_BROADCAST_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x03, 0xBE, 0xEF, 0x00, 0x00 };
+    set_frame_crc(decoy, sizeof(decoy));
+    uint8_t preset_multiple[] = { SLAVE_ID + 1, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x00, 0x00, 0x00, 0x40, 0x08,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    memcpy(preset_multiple + 7, decoy, sizeof(decoy));
+    set_frame_crc(preset_multiple, sizeof(preset_multiple));
+    uint8_t own_single[] = { SLAVE_ID + 1, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x00, 0x43, 0x21, 0x00, 0x00 };
+    set_frame_crc(own_single, sizeof(own_single));
+    size_t consumed = modbus_slave_receive_buffer_r(&other, preset_multiple, sizeof(preset_multiple));
+    bool refused = consumed == sizeof(preset_multiple) && other_responses == 1;
+    for (uint16_t j = 0; j < sizeof(own_single); j++) {
+        modbus_slave_recieve_data_byte_r(&other, own_single[j]);
+    }
+    if (refused && other_holding[3] == 0x0000 && other_responses == 2 && other_holding[0] == 0x4321) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void units_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nUNITS TEST:\n");
+#endif
+    static instance_link_t link;
+    static modbus_slave_t units[2];
+    static modbus_slave_t* table[MODBUS_SLAVE_UNITS_COUNT];
+    uint16_t holding[2][4] = { { 0x1001, 0x1002, 0x1003, 0x1004 }, { 0x2001, 0x2002, 0x2003, 0x2004 } };
+
+    for (uint8_t i = 0; i < 2; i++) {
+        modbus_slave_registers_t registers = { 0 };
+        registers.analog_output_holding_registers = holding[i];
+        registers.analog_output_holding_registers_count = sizeof(holding[i]) / sizeof(*holding[i]);
+        modbus_slave_init(&units[i], &registers, &link);
+        modbus_slave_set_slave_id_r(&units[i], (uint8_t)(0x10 + i));
+        modbus_slave_set_response_data_handler_r(&units[i], &link_response_data_handler);
+        table[0x10 + i] = &units[i];
+    }
+    modbus_slave_init(&link.slave, NULL, &link);
+    modbus_slave_set_units_r(&link.slave, table);
+
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+
+    print_test_name("%u: Test every unit answers with its own registers", counter++);
+    modbus_master_read_holding_registers_r(&link.master, 0x10, 1, 2);
+    bool first = link.packets == 1 && link.response.slave_id == 0x10 && link.response.response[0] == 0x1002 && link.response.response[1] == 0x1003;
+    link.buffered = true;
+    modbus_master_read_holding_registers_r(&link.master, 0x11, 1, 2);
+    if (first && link.packets == 2 && link.response.status == MODBUS_NO_ERROR && link.response.slave_id == 0x11
+        && link.response.response[0] == 0x2002 && link.response.response[1] == 0x2003) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test frame for an unknown id is skipped", counter++);
+    link.buffered = false;
+    modbus_master_read_holding_registers_r(&link.master, 0x12, 0, 1);
+    modbus_master_timeout_r(&link.master);
+    modbus_master_preset_single_register_r(&link.master, 0x11, 0, 0x2100);
+    if (link.packets == 3 && link.response.slave_id == 0x11 && link.response.status == MODBUS_NO_ERROR && holding[1][0] == 0x2100 && holding[0][0] == 0x1001) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test broadcast reaches every unit", counter++);
+    const uint16_t values[] = { 0xB001, 0xB002 };
+    modbus_master_preset_multiple_registers_r(&link.master, MODBUS_BROADCAST_ID, 2, values, 2);
+    modbus_master_timeout_r(&link.master);
+    modbus_master_read_holding_registers_r(&link.master, 0x10, 2, 1);
+    if (link.packets == 5 && link.response.slave_id == 0x10 && link.response.response[0] == 0xB001
+        && holding[0][2] == 0xB001 && holding[0][3] == 0xB002 && holding[1][2] == 0xB001 && holding[1][3] == 0xB002) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test timeout drops a partial frame", counter++);
+    const uint8_t partial[] = { 0x10, MODBUS_READ_HOLDING_REGISTERS, 0x00 };
+    for (uint16_t j = 0; j < sizeof(partial); j++) {
+        modbus_slave_recieve_data_byte_r(&link.slave, partial[j]);
+    }
+    modbus_slave_timeout_r(&link.slave);
+    modbus_master_read_holding_registers_r(&link.master, 0x11, 3, 1);
+    if (link.packets == 6 && link.response.slave_id == 0x11 && link.response.response[0] == 0xB002
+        && units[0].request_byte_handler == units[1].request_byte_handler) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void foreign_frames_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nFOREIGN FRAMES TEST:\n");
+#endif
+    static modbus_slave_t slave;
+    uint16_t holding[4] = { 0 };
+    uint32_t responses = 0;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = holding;
+    registers.analog_output_holding_registers_count = sizeof(holding) / sizeof(*holding);
+    modbus_slave_init(&slave, &registers, &responses);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, &instance_response_data_handler);
+
+    /* The payload is a complete request for this slave */
+    uint8_t decoy[] = { SLAVE_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x01, 0xAB, 0xCD, 0x00, 0x00 };
+    set_frame_crc(decoy, sizeof(decoy));
+    uint8_t foreign_write[] = { 0x20, MODBUS_PRESET_MULTIPLE_REGISTERS, 0x00, 0x00, 0x00, 0x04, 0x08,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    memcpy(foreign_write + 7, decoy, sizeof(decoy));
+    uint8_t foreign_read[] = { 0x21, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00 };
+    uint8_t foreign_answer[] = { 0x21, MODBUS_READ_HOLDING_REGISTERS, 0x04, SLAVE_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x02, 0x00, 0x00 };
+    uint8_t foreign_error[] = { 0x21, MODBUS_READ_HOLDING_REGISTERS | MODBUS_ERROR_COMMAND_CODE, 0x02, 0x00, 0x00 };
+    uint8_t own_write[] = { SLAVE_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x03, 0x12, 0x34, 0x00, 0x00 };
+    set_frame_crc(foreign_write, sizeof(foreign_write));
+    set_frame_crc(foreign_read, sizeof(foreign_read));
+    set_frame_crc(foreign_answer, sizeof(foreign_answer));
+    set_frame_crc(foreign_error, sizeof(foreign_error));
+    set_frame_crc(own_write, sizeof(own_write));
+
+    print_test_name("%u: Test foreign request and response are skipped", counter++);
+    uint8_t stream[sizeof(foreign_write) + sizeof(foreign_read) + sizeof(foreign_answer) + sizeof(foreign_read) + sizeof(foreign_error) + sizeof(own_write)];
+    uint16_t stream_len = 0;
+    memcpy(stream + stream_len, foreign_write, sizeof(foreign_write));
+    stream_len += sizeof(foreign_write);
+    memcpy(stream + stream_len, foreign_read, sizeof(foreign_read));
+    stream_len += sizeof(foreign_read);
+    memcpy(stream + stream_len, foreign_answer, sizeof(foreign_answer));
+    stream_len += sizeof(foreign_answer);
+    memcpy(stream + stream_len, foreign_read, sizeof(foreign_read));
+    stream_len += sizeof(foreign_read);
+    memcpy(stream + stream_len, foreign_error, sizeof(foreign_error));
+    stream_len += sizeof(foreign_error);
+    memcpy(stream + stream_len, own_write, sizeof(own_write));
+    stream_len += sizeof(own_write);
+    for (uint16_t j = 0; j < stream_len; j++) {
+        modbus_slave_recieve_data_byte_r(&slave, stream[j]);
+    }
+    if (responses == 1 && holding[1] == 0 && holding[2] == 0 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test foreign frames are skipped in one buffer", counter++);
+    holding[3] = 0;
+    size_t consumed = modbus_slave_receive_buffer_r(&slave, stream, stream_len);
+    if (consumed == stream_len && responses == 2 && holding[1] == 0 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test timeout ends a skipped frame", counter++);
+    for (uint16_t j = 0; j < 4; j++) {
+        modbus_slave_recieve_data_byte_r(&slave, foreign_write[j]);
+    }
+    modbus_slave_timeout_r(&slave);
+    holding[3] = 0;
+    for (uint16_t j = 0; j < sizeof(own_write); j++) {
+        modbus_slave_recieve_data_byte_r(&slave, own_write[j]);
+    }
+    if (responses == 3 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test unknown function resynchronizes", counter++);
+    uint8_t foreign_diagnostic[] = { 0x20, 0x08, 0x00, 0x00, 0xA5, 0x37, 0x00, 0x00 };
+    set_frame_crc(foreign_diagnostic, sizeof(foreign_diagnostic));
+    for (uint16_t j = 0; j < sizeof(foreign_diagnostic); j++) {
+        modbus_slave_recieve_data_byte_r(&slave, foreign_diagnostic[j]);
+    }
+    modbus_slave_timeout_r(&slave);
+    holding[3] = 0;
+    for (uint16_t j = 0; j < sizeof(own_write); j++) {
+        modbus_slave_recieve_data_byte_r(&slave, own_write[j]);
+    }
+    if (responses == 4 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test foreign retry isn't taken for a response", counter++);
+    /* Sized as a response the retry would run 69 bytes, over the own request */
+    uint8_t foreign_retry[] = { 0x21, MODBUS_READ_HOLDING_REGISTERS, 0x40, 0x00, 0x00, 0x01, 0x00, 0x00 };
+    set_frame_crc(foreign_retry, sizeof(foreign_retry));
+    uint8_t retries[2 * sizeof(foreign_retry) + sizeof(own_write)];
+    memcpy(retries, foreign_retry, sizeof(foreign_retry));
+    memcpy(retries + sizeof(foreign_retry), foreign_retry, sizeof(foreign_retry));
+    memcpy(retries + 2 * sizeof(foreign_retry), own_write, sizeof(own_write));
+    holding[3] = 0;
+    for (uint16_t j = 0; j < sizeof(retries); j++) {
+        modbus_slave_recieve_data_byte_r(&slave, retries[j]);
+    }
+    bool answered = responses == 5 && holding[3] == 0x1234;
+    holding[3] = 0;
+    consumed = modbus_slave_receive_buffer_r(&slave, retries, sizeof(retries));
+    if (answered && consumed == sizeof(retries) && responses == 6 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test silence ends a skipped frame cut short", counter++);
+    modbus_slave_set_framing_r(&slave, 9600, 11);
+    holding[3] = 0;
+    modbus_slave_receive_buffer_at_r(&slave, foreign_write, 10, 1000);
+    modbus_slave_receive_buffer_at_r(&slave, own_write, sizeof(own_write), 20000);
+    if (responses == 7 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void framing_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nFRAMING TEST:\n");
+#endif
+    static modbus_slave_t slave;
+    static instance_link_t link;
+    uint16_t holding[4] = { 0 };
+    uint32_t responses = 0;
+
+    print_test_name("%u: Test silent intervals from the baud rate", counter++);
+    modbus_rtu_framer_t framer_9600, framer_19200, framer_115200;
+    modbus_rtu_framer_init(&framer_9600, 9600, 11);
+    modbus_rtu_framer_init(&framer_19200, 19200, 10);
+    modbus_rtu_framer_init(&framer_115200, 115200, 11);
+    if (framer_9600.t15_us == 1719 && framer_9600.t35_us == 4011 && framer_9600.char_us == 1146
+        && framer_19200.t15_us == 782 && framer_19200.t35_us == 1823
+        && framer_115200.t15_us == MODBUS_RTU_FIXED_T15_US && framer_115200.t35_us == MODBUS_RTU_FIXED_T35_US) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = holding;
+    registers.analog_output_holding_registers_count = sizeof(holding) / sizeof(*holding);
+    modbus_slave_init(&slave, &registers, &responses);
+    modbus_slave_set_slave_id_r(&slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&slave, &instance_response_data_handler);
+    modbus_slave_set_framing_r(&slave, 9600, 11);
+    const uint32_t char_us = slave.framer.char_us;
+    const uint32_t t15_us  = slave.framer.t15_us;
+    const uint32_t t35_us  = slave.framer.t35_us;
+
+    uint8_t own_write[] = { SLAVE_ID, MODBUS_PRESET_SINGLE_REGISTER, 0x00, 0x03, 0x12, 0x34, 0x00, 0x00 };
+    set_frame_crc(own_write, sizeof(own_write));
+    /* The simulated clock wraps around during the test */
+    uint32_t now_us = 0xFFFFF000;
+
+    print_test_name("%u: Test t3.5 silence ends a partial frame", counter++);
+    for (uint16_t j = 0; j < 4; j++) {
+        modbus_slave_recieve_data_byte_at_r(&slave, own_write[j], now_us += char_us);
+    }
+    now_us += t35_us;
+    for (uint16_t j = 0; j < sizeof(own_write); j++) {
+        modbus_slave_recieve_data_byte_at_r(&slave, own_write[j], now_us += char_us);
+    }
+    if (responses == 1 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test t1.5 silence discards the frame", counter++);
+    holding[3] = 0;
+    now_us += t35_us;
+    for (uint16_t j = 0; j < sizeof(own_write); j++) {
+        now_us += char_us + (j == 4 ? t15_us + 1 : t15_us);
+        modbus_slave_recieve_data_byte_at_r(&slave, own_write[j], now_us);
+    }
+    if (responses == 1 && holding[3] == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test poll closes the frame at the t3.5 deadline", counter++);
+    uint32_t deadline_us = modbus_rtu_framer_get_deadline(&slave.framer);
+    modbus_slave_poll_r(&slave, deadline_us - 1);
+    bool open_before = slave.framer.open;
+    modbus_slave_poll_r(&slave, deadline_us);
+    now_us = deadline_us;
+    for (uint16_t j = 0; j < sizeof(own_write); j++) {
+        modbus_slave_recieve_data_byte_at_r(&slave, own_write[j], now_us += char_us);
+    }
+    if (open_before && responses == 2 && holding[3] == 0x1234) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test buffers stamped with their last byte", counter++);
+    holding[3] = 0;
+    now_us += t35_us + 4 * char_us;
+    modbus_slave_receive_buffer_at_r(&slave, own_write, 4, now_us);
+    now_us += 4 * char_us + t15_us;
+    modbus_slave_receive_buffer_at_r(&slave, own_write + 4, sizeof(own_write) - 4, now_us);
+    bool joined = responses == 3 && holding[3] == 0x1234;
+    holding[3] = 0;
+    now_us += t35_us + 4 * char_us;
+    modbus_slave_receive_buffer_at_r(&slave, own_write, 4, now_us);
+    now_us += 4 * char_us + t15_us + 1;
+    modbus_slave_receive_buffer_at_r(&slave, own_write + 4, sizeof(own_write) - 4, now_us);
+    if (joined && responses == 3 && holding[3] == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test master ends a response cut short", counter++);
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_internal_error_handler_r(&link.master, &counting_error_handler);
+    modbus_master_set_framing_r(&link.master, 115200, 11);
+    link.deferred = true;
+    link.packets  = 0;
+    internal_errors = 0;
+    uint8_t answer[] = { SLAVE_ID, MODBUS_READ_HOLDING_REGISTERS, 0x04, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00 };
+    set_frame_crc(answer, sizeof(answer));
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 2);
+    for (uint16_t j = 0; j < 5; j++) {
+        modbus_master_recieve_data_byte_at_r(&link.master, answer[j], now_us += link.master.framer.char_us);
+    }
+    modbus_master_poll_r(&link.master, now_us + MODBUS_RTU_FIXED_T35_US - 1);
+    bool waiting = internal_errors == 0;
+    modbus_master_poll_r(&link.master, now_us + MODBUS_RTU_FIXED_T35_US);
+    bool cut = waiting && internal_errors == 1 && link.packets == 0;
+    now_us += MODBUS_RTU_FIXED_T35_US;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 2);
+    modbus_master_receive_buffer_at_r(&link.master, answer, sizeof(answer), now_us += 20000);
+    modbus_master_poll_r(&link.master, now_us + MODBUS_RTU_FIXED_T35_US);
+    if (cut && internal_errors == 1 && link.packets == 1 && link.response.status == MODBUS_NO_ERROR && link.response.response[1] == 0x0002) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void queue_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nQUEUE TEST:\n");
+#endif
+    static instance_link_t link;
+    modbus_master_queue_stats_t stats;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = link.holding;
+    registers.analog_output_holding_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &link_response_packet_handler);
+    modbus_master_set_internal_error_handler_r(&link.master, &counting_error_handler);
+    /* Requests are delivered one at a time, the master sees the bus busy until the response */
+    link.deferred = true;
+    internal_errors = 0;
+
+    print_test_name("%u: Test request in flight is not overwritten", counter++);
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 1, 0x0055);
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    bool waiting = stats.depth == 1 && link.pending[1] == MODBUS_READ_HOLDING_REGISTERS;
+    uint32_t requests = link_pump(&link);
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    if (waiting && requests == 2 && link.packets == 2 && link.holding[1] == 0x0055 && stats.depth == 0 && stats.queued == 1
+        && link.response.command == MODBUS_PRESET_SINGLE_REGISTER && internal_errors == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test urgent write goes before routine polls", counter++);
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    for (uint8_t i = 0; i < 3; i++) {
+        modbus_master_set_priority_r(&link.master, MODBUS_PRIORITY_ROUTINE);
+        modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, i, 1);
+    }
+    modbus_master_set_priority_r(&link.master, MODBUS_PRIORITY_URGENT);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 2, 0x0077);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 3, 0x0088);
+    uint8_t order[6] = { 0 };
+    for (uint8_t i = 0; i < sizeof(order); i++) {
+        order[i] = link_step(&link);
+    }
+    const uint8_t expected_order[] = { MODBUS_READ_HOLDING_REGISTERS, MODBUS_PRESET_SINGLE_REGISTER, MODBUS_PRESET_SINGLE_REGISTER,
+        MODBUS_READ_HOLDING_REGISTERS, MODBUS_READ_HOLDING_REGISTERS, MODBUS_READ_HOLDING_REGISTERS };
+    if (memcmp(order, expected_order, sizeof(order)) == 0 && link.holding[2] == 0x0077 && link.holding[3] == 0x0088 && link.pending_len == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test timeout sends the next request", counter++);
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 1, 0x0066);
+    link.pending_len = 0;
+    modbus_master_timeout_r(&link.master);
+    bool sent = link.pending_len > 0 && link.pending[1] == MODBUS_PRESET_SINGLE_REGISTER && internal_errors == 1;
+    link_pump(&link);
+    if (sent && link.holding[1] == 0x0066) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test full queue drops the least urgent request", counter++);
+    modbus_master_reset_queue_stats_r(&link.master);
+    internal_errors = 0;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    for (uint8_t i = 0; i <= MODBUS_MASTER_QUEUE_SIZE; i++) {
+        modbus_master_set_priority_r(&link.master, MODBUS_PRIORITY_ROUTINE);
+        modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    }
+    bool refused = internal_errors == 1;
+    modbus_master_set_priority_r(&link.master, MODBUS_PRIORITY_URGENT);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 0, 0x0099);
+    uint16_t values[3] = { 0x0091, 0x0092, 0x0093 };
+    modbus_master_preset_multiple_registers_r(&link.master, SLAVE_ID, 1, values, 3);
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    bool full = stats.depth == MODBUS_MASTER_QUEUE_SIZE && stats.depth_max == MODBUS_MASTER_QUEUE_SIZE && stats.dropped == 3;
+    requests = link_pump(&link);
+    if (refused && full && internal_errors == 3 && requests == 1 + MODBUS_MASTER_QUEUE_SIZE && link.holding[0] == 0x0099
+        && link.holding[3] == 0x0093) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test wait time statistics", counter++);
+    modbus_master_reset_queue_stats_r(&link.master);
+    modbus_master_set_clock_r(&link.master, &queue_clock);
+    queue_clock_us = 1000;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    queue_clock_us = 1100;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 1, 1);
+    queue_clock_us = 1500;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 2, 1);
+    queue_clock_us = 3100;
+    link_pump(&link);
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    if (stats.queued == 2 && stats.dispatched == 2 && stats.wait_us_max == 2000 && stats.wait_us_total == 3600 && stats.depth == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test request queued while a full queue sends synchronously", counter++);
+    modbus_master_set_clock_r(&link.master, NULL);
+    modbus_master_reset_queue_stats_r(&link.master);
+    modbus_master_set_response_packet_handler_r(&link.master, &requeue_packet_handler);
+    internal_errors = 0;
+    link.packets = 0;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    for (uint8_t i = 0; i < MODBUS_MASTER_QUEUE_SIZE; i++) {
+        modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 1);
+    }
+    /* Every response comes back from inside the sender, the slot being sent is still taken */
+    link.deferred = false;
+    link_step(&link);
+    link.deferred = true;
+    bool answered = link.packets == 1 + MODBUS_MASTER_QUEUE_SIZE;
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 1, 1);
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    if (answered && stats.dropped == 1 && internal_errors == 1 && stats.depth == 0 && link.pending_len > 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void poll_list_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nPOLL LIST TEST:\n");
+#endif
+    static instance_link_t link;
+    modbus_master_poll_t polls[2] = {
+        { .slave_id = SLAVE_ID, .command = MODBUS_READ_HOLDING_REGISTERS, .reg_addr = 0, .reg_count = 2, .period_us = 100000 },
+        { .slave_id = SLAVE_ID, .command = MODBUS_READ_INPUT_REGISTERS,   .reg_addr = 0, .reg_count = 1, .period_us = 30000 }
+    };
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = link.holding;
+    registers.analog_output_holding_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    registers.analog_input_registers = link.holding;
+    registers.analog_input_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &poll_response_packet_handler);
+    modbus_master_set_internal_error_handler_r(&link.master, &counting_error_handler);
+    link.deferred = true;
+    internal_errors = 0;
+    queue_clock_us = 0;
+
+    print_test_name("%u: Test poll list needs a clock and periodic reads", counter++);
+    bool no_clock = !modbus_master_set_poll_list_r(&link.master, polls, 2);
+    modbus_master_set_clock_r(&link.master, &queue_clock);
+    polls[1].command = MODBUS_PRESET_SINGLE_REGISTER;
+    bool no_write = !modbus_master_set_poll_list_r(&link.master, polls, 2);
+    polls[1].command = MODBUS_READ_INPUT_REGISTERS;
+    if (no_clock && no_write && modbus_master_set_poll_list_r(&link.master, polls, 2) && link.pending_len == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test earliest deadline goes first and the next due poll follows its response", counter++);
+    uint32_t release_us = modbus_master_run_poll_list_r(&link.master);
+    bool first = link.pending[1] == MODBUS_READ_INPUT_REGISTERS && release_us == 0;
+    queue_clock_us = 5000;
+    bool stepped = link_step(&link) == MODBUS_READ_INPUT_REGISTERS && active_poll == &polls[1];
+    bool second = link.pending_len > 0 && link.pending[1] == MODBUS_READ_HOLDING_REGISTERS;
+    queue_clock_us = 8000;
+    link_step(&link);
+    if (first && stepped && second && active_poll == &polls[0] && link.response.command == MODBUS_READ_HOLDING_REGISTERS
+        && link.pending_len == 0 && polls[0].polls == 1 && polls[1].polls == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test jitter is the delay from release to send", counter++);
+    if (polls[0].jitter_us_max == 5000 && polls[0].jitter_us_total == 5000 && polls[1].jitter_us_max == 0
+        && polls[0].release_us == 100000 && polls[1].release_us == 30000) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test nothing is sent before its release", counter++);
+    queue_clock_us = 10000;
+    release_us = modbus_master_run_poll_list_r(&link.master);
+    if (release_us == 30000 && link.pending_len == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test late poll counts the periods it missed", counter++);
+    queue_clock_us = 95000;
+    modbus_master_run_poll_list_r(&link.master);
+    if (link.pending[1] == MODBUS_READ_INPUT_REGISTERS && polls[1].missed == 2 && polls[1].release_us == 120000
+        && polls[1].jitter_us_max == 65000 && polls[0].missed == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test timeout counts an error and sends the next due poll", counter++);
+    queue_clock_us = 100000;
+    link.pending_len = 0;
+    modbus_master_timeout_r(&link.master);
+    bool sent = link.pending_len > 0 && link.pending[1] == MODBUS_READ_HOLDING_REGISTERS;
+    link_step(&link);
+    if (sent && polls[1].errors == 1 && polls[0].errors == 0 && internal_errors == 1 && active_poll == &polls[0]) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test queued requests go before due polls", counter++);
+    queue_clock_us = 130000;
+    modbus_master_run_poll_list_r(&link.master);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 3, 0x0042);
+    queue_clock_us = 240000;
+    uint8_t order[4] = { 0 };
+    for (uint8_t i = 0; i < sizeof(order); i++) {
+        order[i] = link_step(&link);
+    }
+    const uint8_t expected_order[] = { MODBUS_READ_INPUT_REGISTERS, MODBUS_PRESET_SINGLE_REGISTER,
+        MODBUS_READ_INPUT_REGISTERS, MODBUS_READ_HOLDING_REGISTERS };
+    if (memcmp(order, expected_order, sizeof(order)) == 0 && link.holding[3] == 0x0042 && active_poll == &polls[0] && link.pending_len == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test poll list is cleared", counter++);
+    queue_clock_us = 500000;
+    bool cleared = modbus_master_set_poll_list_r(&link.master, NULL, 0);
+    release_us = modbus_master_run_poll_list_r(&link.master);
+    if (cleared && release_us == 500000 && link.pending_len == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void coalescing_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nREAD COALESCING TEST:\n");
+#endif
+    static instance_link_t link;
+    static uint8_t coils[MODBUS_COILS_BYTES(16)] = { 0 };
+    modbus_master_poll_t polls[3] = {
+        { .slave_id = SLAVE_ID, .command = MODBUS_READ_HOLDING_REGISTERS, .reg_addr = 2, .reg_count = 2, .period_us = 100000 },
+        { .slave_id = SLAVE_ID, .command = MODBUS_READ_HOLDING_REGISTERS, .reg_addr = 0, .reg_count = 2, .period_us = 100000 },
+        { .slave_id = SLAVE_ID, .command = MODBUS_READ_INPUT_REGISTERS,   .reg_addr = 0, .reg_count = 2, .period_us = 100000 }
+    };
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = link.holding;
+    registers.analog_output_holding_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    registers.analog_input_registers = link.holding;
+    registers.analog_input_registers_count = sizeof(link.holding) / sizeof(*link.holding);
+    registers.discrete_output_coils = coils;
+    registers.discrete_output_coils_count = 16;
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &coalesced_packet_handler);
+    modbus_master_set_internal_error_handler_r(&link.master, &counting_error_handler);
+    modbus_master_set_clock_r(&link.master, &queue_clock);
+    modbus_master_set_read_coalescing_r(&link.master, true, 0);
+    link.deferred = true;
+    queue_clock_us = 0;
+    for (uint16_t i = 0; i < 4; i++) {
+        link.holding[i] = (uint16_t)(0x1100 * (i + 1));
+    }
+
+    print_test_name("%u: Test adjacent reads go out as one request and each entry gets its values", counter++);
+    modbus_master_set_poll_list_r(&link.master, polls, 2);
+    coalesced_count = 0;
+    modbus_master_run_poll_list_r(&link.master);
+    bool merged = link.pending[1] == MODBUS_READ_HOLDING_REGISTERS && link.pending[3] == 0 && link.pending[5] == 4;
+    link_step(&link);
+    if (merged && coalesced_count == 2 && link.pending_len == 0 && polls[0].polls == 1 && polls[1].polls == 1
+        && coalesced_polls[0] == &polls[0] && coalesced_packets[0].response[0] == 0x3300 && coalesced_packets[0].response[1] == 0x4400
+        && coalesced_polls[1] == &polls[1] && coalesced_packets[1].response[0] == 0x1100 && coalesced_packets[1].response[1] == 0x2200) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test other functions are not merged", counter++);
+    modbus_master_set_poll_list_r(&link.master, polls, 3);
+    coalesced_count = 0;
+    modbus_master_run_poll_list_r(&link.master);
+    uint32_t requests = link_pump(&link);
+    if (requests == 2 && coalesced_count == 3 && polls[2].polls == 1 && coalesced_packets[2].command == MODBUS_READ_INPUT_REGISTERS) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test gap tolerance", counter++);
+    polls[0].reg_addr  = 3;
+    polls[0].reg_count = 1;
+    polls[1].reg_count = 1;
+    modbus_master_set_read_coalescing_r(&link.master, true, 1);
+    modbus_master_set_poll_list_r(&link.master, polls, 2);
+    modbus_master_run_poll_list_r(&link.master);
+    bool apart = link.pending[5] == 1;
+    link_pump(&link);
+    modbus_master_set_read_coalescing_r(&link.master, true, 2);
+    modbus_master_set_poll_list_r(&link.master, polls, 2);
+    coalesced_count = 0;
+    modbus_master_run_poll_list_r(&link.master);
+    bool bridged = link.pending[3] == 0 && link.pending[5] == 4;
+    link_step(&link);
+    if (apart && bridged && coalesced_count == 2 && coalesced_packets[0].response[0] == 0x4400 && coalesced_packets[1].response[0] == 0x1100) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test merged read stays within the master's register count", counter++);
+    polls[0].reg_addr  = 10;
+    polls[0].reg_count = MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT - 9;
+    polls[1].reg_addr  = 0;
+    polls[1].reg_count = 11;
+    modbus_master_set_read_coalescing_r(&link.master, true, 0);
+    modbus_master_set_poll_list_r(&link.master, polls, 2);
+    modbus_master_run_poll_list_r(&link.master);
+    uint8_t first_count = link.pending[5];
+    requests = link_pump(&link);
+    if (first_count == polls[0].reg_count && requests == 2 && polls[0].polls == 1 && polls[1].polls == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test error reaches every merged entry", counter++);
+    polls[0].reg_addr  = 2;
+    polls[0].reg_count = 2;
+    polls[1].reg_addr  = 4;
+    polls[1].reg_count = 1;
+    modbus_master_set_poll_list_r(&link.master, polls, 2);
+    coalesced_count = 0;
+    modbus_master_run_poll_list_r(&link.master);
+    link_step(&link);
+    if (coalesced_count == 2 && coalesced_packets[0].status != MODBUS_NO_ERROR && coalesced_packets[1].status != MODBUS_NO_ERROR
+        && polls[0].errors == 1 && polls[1].errors == 1) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test coils are split bit by bit", counter++);
+    coils[0] = 0xB5;
+    coils[1] = 0x03;
+    polls[0].command   = MODBUS_READ_COILS;
+    polls[0].reg_addr  = 5;
+    polls[0].reg_count = 6;
+    polls[1].command   = MODBUS_READ_COILS;
+    polls[1].reg_addr  = 1;
+    polls[1].reg_count = 3;
+    modbus_master_set_read_coalescing_r(&link.master, true, 1);
+    modbus_master_set_poll_list_r(&link.master, polls, 2);
+    coalesced_count = 0;
+    modbus_master_run_poll_list_r(&link.master);
+    merged = link.pending[1] == MODBUS_READ_COILS && link.pending[3] == 1 && link.pending[5] == 10;
+    link_step(&link);
+    /* Coils 5..10 of 0x03B5 are 0b011101, coils 1..3 are 0b010 */
+    if (merged && coalesced_count == 2 && coalesced_packets[0].status == MODBUS_NO_ERROR
+        && coalesced_packets[0].response[0] == 0x1D && coalesced_packets[1].response[0] == 0x02) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void write_combining_tests(void)
+{
+    uint16_t counter = 1;
+#if !SDCC
+    printf("\nWRITE COMBINING TEST:\n");
+#endif
+    static instance_link_t link;
+    static uint8_t coils[MODBUS_COILS_BYTES(16)] = { 0 };
+    static uint16_t holding[16] = { 0 };
+    modbus_master_queue_stats_t stats;
+
+    modbus_slave_registers_t registers = { 0 };
+    registers.analog_output_holding_registers = holding;
+    registers.analog_output_holding_registers_count = sizeof(holding) / sizeof(*holding);
+    registers.discrete_output_coils = coils;
+    registers.discrete_output_coils_count = 16;
+    modbus_slave_init(&link.slave, &registers, &link);
+    modbus_slave_set_slave_id_r(&link.slave, SLAVE_ID);
+    modbus_slave_set_response_data_handler_r(&link.slave, &link_response_data_handler);
+    modbus_master_init(&link.master, &link);
+    modbus_master_set_request_data_sender_r(&link.master, &link_request_data_sender);
+    modbus_master_set_response_packet_handler_r(&link.master, &coalesced_packet_handler);
+    modbus_master_set_internal_error_handler_r(&link.master, &counting_error_handler);
+    modbus_master_set_write_combining_r(&link.master, true);
+    link.deferred = true;
+    internal_errors = 0;
+
+    print_test_name("%u: Test single writes are held and flushed as one frame", counter++);
+    for (uint16_t i = 0; i < 4; i++) {
+        modbus_master_preset_single_register_r(&link.master, SLAVE_ID, i, (uint16_t)(0x0A00 + i));
+    }
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    bool held = link.pending_len == 0 && stats.depth == 1 && stats.combined == 3;
+    modbus_master_flush_writes_r(&link.master);
+    bool combined = link.pending[1] == MODBUS_PRESET_MULTIPLE_REGISTERS && link.pending[3] == 0 && link.pending[5] == 4;
+    coalesced_count = 0;
+    link_step(&link);
+    bool responses = coalesced_count == 4;
+    for (uint8_t i = 0; i < 4 && responses; i++) {
+        responses = coalesced_packets[i].status == MODBUS_NO_ERROR && coalesced_packets[i].command == MODBUS_PRESET_SINGLE_REGISTER
+            && coalesced_packets[i].response[0] == 0x0A00 + i && holding[i] == 0x0A00 + i;
+    }
+    if (held && combined && responses && link.pending_len == 0) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test other request goes after the held writes", counter++);
+    coalesced_count = 0;
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 1, 0x0B01);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 2, 0x0B02);
+    modbus_master_read_holding_registers_r(&link.master, SLAVE_ID, 0, 4);
+    uint8_t order[3] = { 0 };
+    for (uint8_t i = 0; i < sizeof(order); i++) {
+        order[i] = link_step(&link);
+    }
+    if (order[0] == MODBUS_PRESET_MULTIPLE_REGISTERS && order[1] == MODBUS_READ_HOLDING_REGISTERS && order[2] == 0
+        && coalesced_count == 3 && coalesced_packets[2].command == MODBUS_READ_HOLDING_REGISTERS && coalesced_packets[2].response[2] == 0x0B02) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test writes apart or to another slave stay single and in order", counter++);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 0, 0x0C00);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 2, 0x0C02);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID + 1, 3, 0x0C03);
+    modbus_master_preset_single_register_r(&link.master, SLAVE_ID, 1, 0x0C01);
+    modbus_master_flush_writes_r(&link.master);
+    uint32_t requests = link_pump(&link);
+    /* The other slave isn't on the line */
+    modbus_master_timeout_r(&link.master);
+    requests += link_pump(&link);
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    if (requests == 4 && holding[0] == 0x0C00 && holding[1] == 0x0C01 && holding[2] == 0x0C02 && stats.combined == 4) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test coils are combined into force multiple coils", counter++);
+    modbus_master_force_single_coil_r(&link.master, SLAVE_ID, 3, 0xFF00);
+    modbus_master_force_single_coil_r(&link.master, SLAVE_ID, 4, 0x0000);
+    modbus_master_force_single_coil_r(&link.master, SLAVE_ID, 5, 0xFF00);
+    modbus_master_force_single_coil_r(&link.master, SLAVE_ID, 2, 0xFF00);
+    modbus_master_flush_writes_r(&link.master);
+    combined = link.pending[1] == MODBUS_FORCE_MULTIPLE_COILS && link.pending[3] == 2 && link.pending[5] == 4 && link.pending[7] == 0x0B;
+    coalesced_count = 0;
+    link_step(&link);
+    if (combined && coils[0] == 0x2C && coalesced_count == 4 && coalesced_packets[0].command == MODBUS_FORCE_SINGLE_COIL
+        && coalesced_packets[0].response[0] == 0xFF00 && coalesced_packets[2].response[0] == 0x0000) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test combined frame takes the largest request", counter++);
+    uint16_t request_registers = (uint16_t)MB_MIN((MODBUS_MASTER_QUEUE_FRAME_SIZE - 9) / 2, MODBUS_MASTER_MESSAGE_DATA_SIZE / 2);
+    for (uint16_t i = 0; i < request_registers; i++) {
+        modbus_master_preset_single_register_r(&link.master, SLAVE_ID, i, i);
+    }
+    modbus_master_flush_writes_r(&link.master);
+    modbus_master_get_queue_stats_r(&link.master, &stats);
+    bool one = link.pending[1] == MODBUS_PRESET_MULTIPLE_REGISTERS && link.pending[5] == request_registers && stats.depth == 0;
+    /* A slave with the same buffers takes a little less, the frame is only looked at */
+    link.pending_len = 0;
+    modbus_master_timeout_r(&link.master);
+    if (one && request_registers == MODBUS_MASTER_OUTPUT_HOLDING_REGISTERS_COUNT) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+
+    print_test_name("%u: Test error reaches every combined write", counter++);
+    for (uint16_t i = 14; i < 18; i++) {
+        modbus_master_preset_single_register_r(&link.master, SLAVE_ID, i, i);
+    }
+    modbus_master_flush_writes_r(&link.master);
+    coalesced_count = 0;
+    link_step(&link);
+    if (coalesced_count == 4 && coalesced_packets[0].status != MODBUS_NO_ERROR && coalesced_packets[3].status != MODBUS_NO_ERROR
+        && coalesced_packets[3].command == MODBUS_PRESET_SINGLE_REGISTER) {
+        print_success("SUCCESS");
+    } else {
+        print_error("ERROR");
+        test_error = true;
+    }
+}
+
+void set_frame_crc(uint8_t* frame, uint16_t len)
+{
+    uint16_t crc = modbus_crc16(frame, (uint16_t)(len - 2));
+    frame[len - 2] = (uint8_t)crc;
+    frame[len - 1] = (uint8_t)(crc >> 8);
+}
+
 void print_test_name(const char* format, uint16_t counter)
 {
 #if !SDCC && DETAILS
@@ -404,11 +2678,113 @@ void response_packet_handler(modbus_response_t* packet)
 
 void response_data_handler(uint8_t* data, uint32_t len)
 {
+    slave_response_sent = true;
     for (int i = 0; i < len; i++) {
         modbus_master_recieve_data_byte(data[i]);
     }
 }
 
+void instance_response_data_handler(void* user_context, uint8_t* data, uint32_t len)
+{
+    (void)data;
+    (void)len;
+    (*(uint32_t*)user_context)++;
+}
+
+void link_request_data_sender(void* user_context, uint8_t* data, uint32_t len)
+{
+    instance_link_t* link = (instance_link_t*)user_context;
+    if (link->deferred) {
+        memcpy(link->pending, data, len);
+        link->pending_len = len;
+        return;
+    }
+    if (link->buffered) {
+        while (len > 0) {
+            size_t consumed = modbus_slave_receive_buffer_r(&link->slave, data, len);
+            data += consumed;
+            len  -= (uint32_t)consumed;
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        modbus_slave_recieve_data_byte_r(&link->slave, data[i]);
+    }
+}
+
+void link_response_data_handler(void* user_context, uint8_t* data, uint32_t len)
+{
+    instance_link_t* link = (instance_link_t*)user_context;
+    if (link->buffered) {
+        while (len > 0) {
+            size_t consumed = modbus_master_receive_buffer_r(&link->master, data, len);
+            data += consumed;
+            len  -= (uint32_t)consumed;
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        modbus_master_recieve_data_byte_r(&link->master, data[i]);
+    }
+}
+
+void link_response_packet_handler(void* user_context, modbus_response_t* packet)
+{
+    instance_link_t* link = (instance_link_t*)user_context;
+    link->response = *packet;
+    link->packets++;
+}
+
+void sensor_read_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count)
+{
+    (void)user_context;
+    (void)register_type;
+    sensor_reads++;
+    sensor_read_id    = register_id;
+    sensor_read_count = count;
+    for (uint16_t i = 0; i < count; i++) {
+        sensor_registers[register_id - 4 + i] = (uint16_t)(0x0100 + register_id + i);
+    }
+}
+
+void write_handler(void* user_context, register_type_t register_type, uint16_t register_id, uint16_t count)
+{
+    (void)user_context;
+    written_frames++;
+    written_range.register_type = register_type;
+    written_range.register_id   = register_id;
+    written_range.count         = count;
+}
+
+#if SNAPSHOT_STRESS
+void* snapshot_writer(void* snapshot)
+{
+    for (uint32_t generation = 1; generation <= SNAPSHOT_PUBLICATIONS; generation++) {
+        uint16_t* values = (uint16_t*)modbus_slave_snapshot_begin((modbus_slave_snapshot_t*)snapshot);
+        for (uint8_t i = 0; i < 4; i++) {
+            values[i * 2]     = (uint16_t)(generation >> 16);
+            values[i * 2 + 1] = (uint16_t)generation;
+        }
+        modbus_slave_snapshot_publish((modbus_slave_snapshot_t*)snapshot);
+    }
+    return NULL;
+}
+#endif
+
+uint8_t* tx_buffer_provider(void* user_context, uint32_t len)
+{
+    (void)user_context;
+    tx_requested_len = len;
+    return len <= sizeof(tx_buffer) ? tx_buffer : NULL;
+}
+
+void tx_buffer_commit(void* user_context, uint8_t* data, uint32_t len)
+{
+    (void)user_context;
+    tx_committed     = data;
+    tx_committed_len = len;
+}
+
 void master_internal_error_handler(void)
 {
     print_error("MASTER ERROR");
@@ -455,3 +2831,107 @@ void print_success(char* text)
 #endif
 #endif
 }
+
+bool file_read_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, uint8_t* data)
+{
+    (void)user_context;
+    if (file_number != 1 || (uint32_t)record_number + count > sizeof(file_records) / sizeof(*file_records)) {
+        return false;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        data[i * 2]     = (uint8_t)(file_records[record_number + i] >> 8);
+        data[i * 2 + 1] = (uint8_t)(file_records[record_number + i]);
+    }
+    return true;
+}
+
+bool file_write_handler(void* user_context, uint16_t file_number, uint16_t record_number, uint16_t count, const uint8_t* data)
+{
+    (void)user_context;
+    if (file_number != 1 || (uint32_t)record_number + count > sizeof(file_records) / sizeof(*file_records)) {
+        return false;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        file_records[record_number + i] = (uint16_t)((data[i * 2] << 8) | data[i * 2 + 1]);
+    }
+    return true;
+}
+
+void file_complete_handler(void* user_context, modbus_error_response_t status, uint16_t records_done)
+{
+    (void)user_context;
+    file_completions++;
+    file_status       = status;
+    file_records_done = records_done;
+}
+
+void counting_error_handler(void* user_context)
+{
+    (void)user_context;
+    internal_errors++;
+}
+
+uint32_t queue_clock(void* user_context)
+{
+    (void)user_context;
+    return queue_clock_us;
+}
+
+void requeue_packet_handler(void* user_context, modbus_response_t* packet)
+{
+    instance_link_t* link = (instance_link_t*)user_context;
+    link_response_packet_handler(user_context, packet);
+    if (link->packets == 2) {
+        modbus_master_read_holding_registers_r(&link->master, SLAVE_ID, 0, 1);
+    }
+}
+
+void poll_response_packet_handler(void* user_context, modbus_response_t* packet)
+{
+    instance_link_t* link = (instance_link_t*)user_context;
+    active_poll = modbus_master_get_active_poll_r(&link->master);
+    link_response_packet_handler(user_context, packet);
+}
+
+void coalesced_packet_handler(void* user_context, modbus_response_t* packet)
+{
+    instance_link_t* link = (instance_link_t*)user_context;
+    if (coalesced_count < sizeof(coalesced_packets) / sizeof(*coalesced_packets)) {
+        coalesced_polls[coalesced_count]   = modbus_master_get_active_poll_r(&link->master);
+        coalesced_packets[coalesced_count] = *packet;
+        coalesced_count++;
+    }
+}
+
+uint8_t link_step(instance_link_t* link)
+{
+    /* Delivers the pending request only, returns its function code */
+    uint8_t  request[sizeof(link->pending)];
+    uint32_t len = link->pending_len;
+    if (len == 0) {
+        return 0;
+    }
+    memcpy(request, link->pending, len);
+    link->pending_len = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        modbus_slave_recieve_data_byte_r(&link->slave, request[i]);
+    }
+    return request[1];
+}
+
+uint32_t link_pump(instance_link_t* link)
+{
+    /* Requests sent from a response handler are delivered after the slave has finished the previous one */
+    uint8_t  request[sizeof(link->pending)];
+    uint32_t requests = 0;
+    while (link->pending_len > 0) {
+        uint32_t len = link->pending_len;
+        memcpy(request, link->pending, len);
+        link->pending_len = 0;
+        for (uint32_t i = 0; i < len; i++) {
+            modbus_slave_recieve_data_byte_r(&link->slave, request[i]);
+        }
+        requests++;
+    }
+    return requests;
+}